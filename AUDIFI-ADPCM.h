@@ -0,0 +1,287 @@
+//==============================================================================//
+//
+//  AUDIFI ADPCM
+//  Version : v0.1
+//
+//  IMA ADPCM codec for the audio frames. Every 16-bit sample is coded as a 4-bit
+//  step from the previous one, which is a quarter of the bytes of 16-bit PCM and
+//  half of the 8-bit samples sent otherwise. Decoding is a table lookup and a few
+//  adds per sample, so the receiver can easily keep up.
+//
+//  The samples are coded in blocks of 505, laid out as in IMA ADPCM WAV files.
+//  Each block starts with the first sample and the step index, followed by the
+//  rest of the samples as nibbles, low nibble first. A block can be decoded on its
+//  own, so a lost frame does not affect the ones after it.
+//
+//  This file is shared by the server application, the transmitter and the
+//  receiver. Copy it to the sketch folders along with the sketches.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_ADPCM_H
+#define AUDIFI_ADPCM_H
+
+#include <stdint.h>
+
+//the third byte of a frame header tells how the samples are coded.
+//the length bytes always hold the no. of samples, not the no. of bytes.
+#define FRAME_CODEC_PCM_U8 0      //one unsigned 8-bit sample per byte
+#define FRAME_CODEC_IMA_ADPCM 1   //IMA ADPCM blocks
+
+//the fourth byte of a frame header holds flags. the frames of the next track
+//follow the last frame of a track at once, so the receiver can only tell where
+//a track ends from these.
+#define FRAME_FLAG_TRACK_END 0x01   //the last frame of a track
+#define FRAME_FLAG_STREAM_END 0x02  //the last frame of the last track, nothing follows
+
+//a stereo frame holds left and right samples in turn, left first, and its
+//no. of samples counts both, so it's always even. stereo is only sent as PCM,
+//an ADPCM frame is always mono.
+#define FRAME_FLAG_STEREO 0x04
+
+#define ADPCM_BLOCK_SAMPLES 505   //samples per block, a 256-byte block
+#define ADPCM_BLOCK_HEADER_SIZE 4 //first sample and step index
+
+//==============================================================================//
+
+const int16_t adpcmStepTable[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+  253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+  1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+  3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+  12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+const int8_t adpcmIndexTable[16] = {
+  -1, -1, -1, -1, 2, 4, 6, 8,
+  -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+//==============================================================================//
+//The state shared by the encoder and the decoder. Both update it the same way,
+//so the decoder's output is exactly what the encoder predicted.
+
+struct AdpcmState {
+  int32_t predictor;  //the last decoded sample
+  int32_t stepIndex;  //index into the step table
+};
+
+//==============================================================================//
+//Moves the state by one coded sample and returns the new sample.
+
+inline int16_t adpcmDecodeSample(AdpcmState* state, uint8_t nibble) {
+  int32_t step = adpcmStepTable[state->stepIndex];
+  int32_t difference = step >> 3;
+
+  if (nibble & 4) {
+    difference += step;
+  }
+  if (nibble & 2) {
+    difference += step >> 1;
+  }
+  if (nibble & 1) {
+    difference += step >> 2;
+  }
+
+  int32_t predictor = state->predictor + ((nibble & 8) ? -difference : difference);
+  predictor = (predictor > 32767) ? 32767 : ((predictor < -32768) ? -32768 : predictor);
+  state->predictor = predictor;
+
+  int32_t stepIndex = state->stepIndex + adpcmIndexTable[nibble];
+  state->stepIndex = (stepIndex > 88) ? 88 : ((stepIndex < 0) ? 0 : stepIndex);
+  return int16_t(predictor);
+}
+
+//==============================================================================//
+//Finds the nibble closest to the sample and moves the state with it.
+
+inline uint8_t adpcmEncodeSample(AdpcmState* state, int16_t sample) {
+  int32_t difference = int32_t(sample) - state->predictor;
+  int32_t step = adpcmStepTable[state->stepIndex];
+  uint8_t nibble = 0;
+
+  if (difference < 0) {
+    nibble = 8;
+    difference = -difference;
+  }
+  if (difference >= step) {
+    nibble |= 4;
+    difference -= step;
+  }
+  step >>= 1;
+
+  if (difference >= step) {
+    nibble |= 2;
+    difference -= step;
+  }
+  step >>= 1;
+
+  if (difference >= step) {
+    nibble |= 1;
+  }
+
+  adpcmDecodeSample(state, nibble);
+  return nibble;
+}
+
+//==============================================================================//
+//Returns the no. of bytes sampleCount samples take when coded.
+
+inline uint32_t adpcmEncodedLength(uint32_t sampleCount) {
+  uint32_t fullBlocks = sampleCount / ADPCM_BLOCK_SAMPLES;
+  uint32_t lastBlockSamples = sampleCount % ADPCM_BLOCK_SAMPLES;
+  uint32_t length = fullBlocks * (ADPCM_BLOCK_HEADER_SIZE + ((ADPCM_BLOCK_SAMPLES - 1) / 2));
+
+  //the first sample of a block is in its header, two samples per byte after that
+  if (lastBlockSamples > 0) {
+    length += ADPCM_BLOCK_HEADER_SIZE + (lastBlockSamples / 2);
+  }
+  return length;
+}
+
+//==============================================================================//
+//Returns the no. of data bytes of a frame with sampleCount samples, or 0 if the
+//codec is not known.
+
+inline uint32_t getFramePayloadLength(uint8_t codec, uint32_t sampleCount) {
+  if (codec == FRAME_CODEC_PCM_U8) {
+    return sampleCount;
+  }
+  if (codec == FRAME_CODEC_IMA_ADPCM) {
+    return adpcmEncodedLength(sampleCount);
+  }
+  return 0;
+}
+
+//==============================================================================//
+//Folds a stereo frame to mono in place, each pair to the average of the two,
+//for a receiver that can only play mono. Returns the new length of the frame
+//including the header, or length as it is if the frame is not stereo.
+
+inline uint16_t downmixStereoFrame(uint8_t* frame, uint16_t length) {
+  if ((length < 4) || ((frame[3] & FRAME_FLAG_STEREO) == 0)) {
+    return length;
+  }
+
+  uint32_t sampleCount = (uint32_t(frame[0]) << 8) | frame[1];
+  sampleCount = (sampleCount < uint32_t(length - 4)) ? sampleCount : uint32_t(length - 4);
+  uint32_t pairCount = sampleCount / 2;
+  uint8_t* samples = &frame[4];
+
+  for (uint32_t i=0; i < pairCount; i++) {
+    samples[i] = uint8_t((uint32_t(samples[i * 2]) + samples[(i * 2) + 1] + 1) / 2);
+  }
+
+  frame[0] = uint8_t(pairCount >> 8);
+  frame[1] = uint8_t(pairCount);
+  frame[3] &= uint8_t(~FRAME_FLAG_STEREO);
+  return uint16_t(4 + pairCount);
+}
+
+//==============================================================================//
+//Codes sampleCount samples to output, which must have room for
+//adpcmEncodedLength(sampleCount) bytes. The step index is carried from one call
+//to the next, so the encoder doesn't have to adapt again at every frame.
+//Returns the no. of bytes written.
+
+inline uint32_t adpcmEncode(const int16_t* input, uint32_t sampleCount, uint8_t* output, int32_t* stepIndex) {
+  uint8_t* start = output;
+
+  while (sampleCount > 0) {
+    uint32_t blockSamples = (sampleCount < ADPCM_BLOCK_SAMPLES) ? sampleCount : ADPCM_BLOCK_SAMPLES;
+    AdpcmState state = {input[0], *stepIndex};
+
+    output[0] = uint8_t(input[0] & 0xFF);
+    output[1] = uint8_t((input[0] >> 8) & 0xFF);
+    output[2] = uint8_t(state.stepIndex);
+    output[3] = 0;
+    output += ADPCM_BLOCK_HEADER_SIZE;
+
+    for (uint32_t i=1; i < blockSamples; i += 2) {
+      uint8_t nibbles = adpcmEncodeSample(&state, input[i]);
+
+      if ((i + 1) < blockSamples) {
+        nibbles |= uint8_t(adpcmEncodeSample(&state, input[i + 1]) << 4);
+      }
+      *output++ = nibbles;
+    }
+
+    *stepIndex = state.stepIndex;
+    input += blockSamples;
+    sampleCount -= blockSamples;
+  }
+  return uint32_t(output - start);
+}
+
+//==============================================================================//
+//Reads the header of a block. Returns false if the step index is out of range,
+//which means the data is not ADPCM.
+
+inline bool adpcmReadBlockHeader(const uint8_t* input, AdpcmState* state) {
+  state->predictor = int16_t(uint16_t(input[0] | (input[1] << 8)));
+  state->stepIndex = input[2];
+  return (state->stepIndex <= 88);
+}
+
+//==============================================================================//
+//Decodes sampleCount samples to 16 bits. Returns the no. of bytes read, or 0 if
+//the data is invalid.
+
+inline uint32_t adpcmDecode(const uint8_t* input, uint32_t sampleCount, int16_t* output) {
+  const uint8_t* start = input;
+
+  while (sampleCount > 0) {
+    uint32_t blockSamples = (sampleCount < ADPCM_BLOCK_SAMPLES) ? sampleCount : ADPCM_BLOCK_SAMPLES;
+    AdpcmState state;
+
+    if (!adpcmReadBlockHeader(input, &state)) {
+      return 0;
+    }
+    input += ADPCM_BLOCK_HEADER_SIZE;
+    *output++ = int16_t(state.predictor);
+
+    for (uint32_t i=1; i < blockSamples; i += 2) {
+      uint8_t nibbles = *input++;
+      *output++ = adpcmDecodeSample(&state, nibbles & 0x0F);
+
+      if ((i + 1) < blockSamples) {
+        *output++ = adpcmDecodeSample(&state, nibbles >> 4);
+      }
+    }
+    sampleCount -= blockSamples;
+  }
+  return uint32_t(input - start);
+}
+
+//==============================================================================//
+//Same as adpcmDecode(), but the samples are written as unsigned 8-bit samples,
+//the format the receiver plays.
+
+inline uint32_t adpcmDecodeU8(const uint8_t* input, uint32_t sampleCount, uint8_t* output) {
+  const uint8_t* start = input;
+
+  while (sampleCount > 0) {
+    uint32_t blockSamples = (sampleCount < ADPCM_BLOCK_SAMPLES) ? sampleCount : ADPCM_BLOCK_SAMPLES;
+    AdpcmState state;
+
+    if (!adpcmReadBlockHeader(input, &state)) {
+      return 0;
+    }
+    input += ADPCM_BLOCK_HEADER_SIZE;
+    *output++ = uint8_t((state.predictor + 32768) >> 8);
+
+    for (uint32_t i=1; i < blockSamples; i += 2) {
+      uint8_t nibbles = *input++;
+      *output++ = uint8_t((adpcmDecodeSample(&state, nibbles & 0x0F) + 32768) >> 8);
+
+      if ((i + 1) < blockSamples) {
+        *output++ = uint8_t((adpcmDecodeSample(&state, nibbles >> 4) + 32768) >> 8);
+      }
+    }
+    sampleCount -= blockSamples;
+  }
+  return uint32_t(input - start);
+}
+
+#endif
@@ -0,0 +1,551 @@
+//==============================================================================//
+//
+//  AUDIFI Audio Source
+//  Version : v0.1
+//
+//  Sequential access to audio files for the server application. A track is never
+//  loaded as a whole. The memory-mapped backend maps a small window of the file
+//  at a time, and the read-ahead backend reads fixed size chunks in a background
+//  thread. Either way, the memory used stays the same no matter how long the
+//  track is, and the first frame can be sent as soon as its bytes are available.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_AUDIO_SOURCE_H
+#define AUDIFI_AUDIO_SOURCE_H
+
+#ifdef _WIN32
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#define AUDIO_SOURCE_MAP_WINDOW (4UL * 1024 * 1024)  //size of a mapped view of the file
+#define AUDIO_SOURCE_MAP_ALIGNMENT (64UL * 1024)     //views start at multiples of this
+#define AUDIO_SOURCE_CHUNK_SIZE (64UL * 1024)        //size of a read-ahead chunk
+#define AUDIO_SOURCE_CHUNK_COUNT 8                   //no. of chunks read ahead
+
+//==============================================================================//
+//fseek() and ftell() with 64-bit offsets, as a long is only 32 bits on Windows
+//and the WAV files can be larger than 2 GB. A 32-bit POSIX build needs
+//_FILE_OFFSET_BITS=64 for a 64-bit off_t.
+
+inline int seekFile(FILE* file, uint64_t offset, int origin) {
+#ifdef _WIN32
+  return _fseeki64(file, int64_t(offset), origin);
+#else
+  return fseeko(file, off_t(offset), origin);
+#endif
+}
+
+inline int64_t tellFile(FILE* file) {
+#ifdef _WIN32
+  return _ftelli64(file);
+#else
+  return int64_t(ftello(file));
+#endif
+}
+
+//==============================================================================//
+//A sequentially read audio file. acquire() gives direct access to the bytes at
+//the current position without copying them, and release() moves past them.
+
+class AudioSource {
+  public:
+    virtual ~AudioSource() {}
+
+    virtual bool open(const char* path) = 0;
+    virtual void close() = 0;
+    virtual uint64_t getSize() const = 0;
+    virtual uint64_t getPosition() const = 0;
+    virtual bool seek(uint64_t position) = 0;
+
+    //points data to up to length contiguous bytes at the current position.
+    //returns the no. of bytes available, which can be less than length.
+    //0 is returned at the end of the file. may wait for the bytes to be read.
+    virtual uint32_t acquire(const uint8_t** data, uint32_t length) = 0;
+
+    //moves the current position by length bytes. the pointer from acquire()
+    //is no longer valid after this.
+    virtual void release(uint32_t length) = 0;
+
+    //------------------------------------------------------------------------------//
+    //Copies up to length bytes to the buffer. Returns the no. of bytes copied.
+
+    uint32_t read(uint8_t* buffer, uint32_t length) {
+      uint32_t bytesRead = 0;
+
+      while (bytesRead < length) {
+        const uint8_t* data = NULL;
+        uint32_t available = acquire(&data, length - bytesRead);
+
+        if (available == 0) {
+          break;
+        }
+        memcpy(buffer + bytesRead, data, available);
+        release(available);
+        bytesRead += available;
+      }
+      return bytesRead;
+    }
+};
+
+//==============================================================================//
+//Maps a window of the file into memory. The window slides along as the file is
+//read, so only AUDIO_SOURCE_MAP_WINDOW bytes are ever mapped.
+
+class MappedAudioSource : public AudioSource {
+  public:
+    MappedAudioSource() : fileSize(0), position(0), windowStart(0), windowLength(0), window(NULL) {
+    #ifdef _WIN32
+      fileHandle = INVALID_HANDLE_VALUE;
+      mappingHandle = NULL;
+    #else
+      fd = -1;
+    #endif
+    }
+
+    ~MappedAudioSource() {
+      close();
+    }
+
+    //------------------------------------------------------------------------------//
+
+    bool open(const char* path) {
+      close();
+
+    #ifdef _WIN32
+      fileHandle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                               FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+      if (fileHandle == INVALID_HANDLE_VALUE) {
+        return false;
+      }
+
+      LARGE_INTEGER size;
+
+      if (!GetFileSizeEx(fileHandle, &size)) {
+        close();
+        return false;
+      }
+      fileSize = uint64_t(size.QuadPart);
+
+      if (fileSize > 0) {
+        mappingHandle = CreateFileMapping(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+
+        if (mappingHandle == NULL) {
+          close();
+          return false;
+        }
+      }
+    #else
+      fd = ::open(path, O_RDONLY);
+
+      if (fd < 0) {
+        return false;
+      }
+
+      struct stat status;
+
+      if ((fstat(fd, &status) != 0) || (!S_ISREG(status.st_mode))) {  //only regular files can be mapped
+        close();
+        return false;
+      }
+      fileSize = uint64_t(status.st_size);
+    #endif
+
+      position = 0;
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void close() {
+      unmapWindow();
+
+    #ifdef _WIN32
+      if (mappingHandle != NULL) {
+        CloseHandle(mappingHandle);
+        mappingHandle = NULL;
+      }
+      if (fileHandle != INVALID_HANDLE_VALUE) {
+        CloseHandle(fileHandle);
+        fileHandle = INVALID_HANDLE_VALUE;
+      }
+    #else
+      if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+      }
+    #endif
+
+      fileSize = 0;
+      position = 0;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    uint64_t getSize() const {
+      return fileSize;
+    }
+
+    uint64_t getPosition() const {
+      return position;
+    }
+
+    bool seek(uint64_t newPosition) {
+      if (newPosition > fileSize) {
+        return false;
+      }
+      position = newPosition;
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    uint32_t acquire(const uint8_t** data, uint32_t length) {
+      if (position >= fileSize) {
+        return 0;
+      }
+
+      //slide the window if the position is outside of it
+      if ((window == NULL) || (position < windowStart) || (position >= (windowStart + windowLength))) {
+        if (!mapWindow(position - (position % AUDIO_SOURCE_MAP_ALIGNMENT))) {
+          return 0;
+        }
+      }
+
+      uint64_t available = (windowStart + windowLength) - position;
+
+      if (available > length) {
+        available = length;
+      }
+      *data = window + (position - windowStart);
+      return uint32_t(available);
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void release(uint32_t length) {
+      position += length;
+
+      if (position > fileSize) {
+        position = fileSize;
+      }
+    }
+
+  private:
+  #ifdef _WIN32
+    HANDLE fileHandle;
+    HANDLE mappingHandle;
+  #else
+    int fd;
+  #endif
+    uint64_t fileSize;
+    uint64_t position;  //current read position in the file
+    uint64_t windowStart; //file offset of the mapped window
+    uint64_t windowLength;
+    uint8_t* window;  //the mapped window
+
+    //------------------------------------------------------------------------------//
+
+    bool mapWindow(uint64_t start) {
+      unmapWindow();
+
+      uint64_t length = fileSize - start;
+
+      if (length > AUDIO_SOURCE_MAP_WINDOW) {
+        length = AUDIO_SOURCE_MAP_WINDOW;
+      }
+
+    #ifdef _WIN32
+      window = (uint8_t*) MapViewOfFile(mappingHandle, FILE_MAP_READ, DWORD(start >> 32),
+                                        DWORD(start & 0xFFFFFFFF), size_t(length));
+    #else
+      void* view = mmap(NULL, size_t(length), PROT_READ, MAP_SHARED, fd, off_t(start));
+      window = (view == MAP_FAILED) ? NULL : (uint8_t*) view;
+
+      if (window != NULL) {
+        madvise(view, size_t(length), MADV_SEQUENTIAL);
+      }
+    #endif
+
+      if (window == NULL) {
+        return false;
+      }
+      windowStart = start;
+      windowLength = length;
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void unmapWindow() {
+      if (window != NULL) {
+      #ifdef _WIN32
+        UnmapViewOfFile(window);
+      #else
+        munmap(window, size_t(windowLength));
+      #endif
+        window = NULL;
+      }
+      windowStart = 0;
+      windowLength = 0;
+    }
+};
+
+//==============================================================================//
+//Reads the file in fixed size chunks in a background thread, staying up to
+//AUDIO_SOURCE_CHUNK_COUNT chunks ahead of the current position. This also works
+//for files that can not be mapped.
+
+class ChunkedAudioSource : public AudioSource {
+  public:
+    ChunkedAudioSource() : file(NULL), fileSize(0), position(0), readPosition(0),
+                           chunksRead(0), chunksReleased(0), stopping(false), readFailed(false) {}
+
+    ~ChunkedAudioSource() {
+      close();
+    }
+
+    //------------------------------------------------------------------------------//
+
+    bool open(const char* path) {
+      close();
+      file = fopen(path, "rb"); //binary mode, otherwise the bytes can be altered
+
+      if (file == NULL) {
+        return false;
+      }
+
+      //find the size of the file
+      if (seekFile(file, 0, SEEK_END) != 0) {
+        close();
+        return false;
+      }
+      int64_t size = tellFile(file);
+
+      if (size < 0) {
+        close();
+        return false;
+      }
+      fileSize = uint64_t(size);
+      startReading(0);
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void close() {
+      stopReading();
+
+      if (file != NULL) {
+        fclose(file);
+        file = NULL;
+      }
+      fileSize = 0;
+      position = 0;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    uint64_t getSize() const {
+      return fileSize;
+    }
+
+    uint64_t getPosition() const {
+      return position;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Restarts the read-ahead at the chunk holding the new position.
+
+    bool seek(uint64_t newPosition) {
+      if ((file == NULL) || (newPosition > fileSize)) {
+        return false;
+      }
+      stopReading();
+      startReading(newPosition);
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    uint32_t acquire(const uint8_t** data, uint32_t length) {
+      if (position >= fileSize) {
+        return 0;
+      }
+
+      uint64_t chunkIndex = (position - readPosition) / AUDIO_SOURCE_CHUNK_SIZE;
+      std::unique_lock<std::mutex> lock(chunkMutex);
+
+      //wait until the chunk holding the position has been read
+      while ((chunksRead <= chunkIndex) && (!readFailed)) {
+        chunkReady.wait(lock);
+      }
+
+      if (chunksRead <= chunkIndex) {
+        return 0;
+      }
+
+      uint64_t chunkStart = readPosition + (chunkIndex * AUDIO_SOURCE_CHUNK_SIZE);
+      uint64_t chunkEnd = chunkStart + AUDIO_SOURCE_CHUNK_SIZE;
+
+      if (chunkEnd > fileSize) {
+        chunkEnd = fileSize;
+      }
+
+      uint64_t available = chunkEnd - position;
+
+      if (available > length) {
+        available = length;
+      }
+      *data = chunks[chunkIndex % AUDIO_SOURCE_CHUNK_COUNT] + (position - chunkStart);
+      return uint32_t(available);
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void release(uint32_t length) {
+      position += length;
+
+      if (position > fileSize) {
+        position = fileSize;
+      }
+
+      //hand the chunks we are done with back to the reader
+      uint64_t done = (position - readPosition) / AUDIO_SOURCE_CHUNK_SIZE;
+      std::lock_guard<std::mutex> lock(chunkMutex);
+
+      if (done > chunksReleased) {
+        chunksReleased = done;
+        chunkFree.notify_one();
+      }
+    }
+
+  private:
+    FILE* file;
+    uint64_t fileSize;
+    uint64_t position;  //current read position in the file
+    uint64_t readPosition;  //file offset of the first chunk read
+    uint8_t chunks[AUDIO_SOURCE_CHUNK_COUNT][AUDIO_SOURCE_CHUNK_SIZE];
+
+    std::thread reader;
+    std::mutex chunkMutex;
+    std::condition_variable chunkReady; //signalled when a chunk has been read
+    std::condition_variable chunkFree;  //signalled when a chunk has been released
+    uint64_t chunksRead;  //no. of chunks read from readPosition
+    uint64_t chunksReleased;  //no. of chunks we are done with
+    bool stopping;
+    bool readFailed;
+
+    //------------------------------------------------------------------------------//
+
+    void startReading(uint64_t startPosition) {
+      //chunks start at a multiple of the chunk size
+      readPosition = startPosition - (startPosition % AUDIO_SOURCE_CHUNK_SIZE);
+      position = startPosition;
+      chunksRead = 0;
+      chunksReleased = 0;
+      stopping = false;
+      readFailed = false;
+      reader = std::thread(&ChunkedAudioSource::readChunks, this);
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void stopReading() {
+      if (reader.joinable()) {
+        {
+          std::lock_guard<std::mutex> lock(chunkMutex);
+          stopping = true;
+        }
+        chunkFree.notify_one();
+        reader.join();
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Runs in the background. Reads chunks while there's a free one.
+
+    void readChunks() {
+      uint64_t offset = readPosition;
+      uint64_t chunkIndex = 0;
+
+      if (seekFile(file, offset, SEEK_SET) != 0) {
+        std::lock_guard<std::mutex> lock(chunkMutex);
+        readFailed = true;
+        chunkReady.notify_one();
+        return;
+      }
+
+      while (offset < fileSize) {
+        {
+          std::unique_lock<std::mutex> lock(chunkMutex);
+
+          while ((!stopping) && ((chunkIndex - chunksReleased) >= AUDIO_SOURCE_CHUNK_COUNT)) {
+            chunkFree.wait(lock);
+          }
+          if (stopping) {
+            return;
+          }
+        }
+
+        //the chunk is not in use, so it can be filled without the lock
+        uint64_t length = fileSize - offset;
+
+        if (length > AUDIO_SOURCE_CHUNK_SIZE) {
+          length = AUDIO_SOURCE_CHUNK_SIZE;
+        }
+
+        size_t bytesRead = fread(chunks[chunkIndex % AUDIO_SOURCE_CHUNK_COUNT], 1, size_t(length), file);
+
+        std::lock_guard<std::mutex> lock(chunkMutex);
+
+        if (bytesRead != length) {
+          readFailed = true;
+          chunkReady.notify_one();
+          return;
+        }
+        offset += length;
+        chunkIndex++;
+        chunksRead = chunkIndex;
+        chunkReady.notify_one();
+      }
+    }
+};
+
+//==============================================================================//
+//Opens an audio file with the memory-mapped backend if possible, or with the
+//read-ahead backend otherwise. Returns NULL if the file can not be opened.
+
+inline AudioSource* openAudioSource(const char* path, bool preferMapped = true) {
+  if (preferMapped) {
+    MappedAudioSource* mappedSource = new MappedAudioSource();
+
+    if (mappedSource->open(path)) {
+      return mappedSource;
+    }
+    delete mappedSource;
+  }
+
+  ChunkedAudioSource* chunkedSource = new ChunkedAudioSource();
+
+  if (chunkedSource->open(path)) {
+    return chunkedSource;
+  }
+  delete chunkedSource;
+  return NULL;
+}
+
+#endif
@@ -0,0 +1,3158 @@
+
+//==============================================================================//
+//
+//  AUDIFI Benchmark
+//  Version : v0.1
+//
+//  Measures the speed of the server's DSP stages on the host, checks every
+//  sample converter kernel against the exact values, and simulates the
+//  transmitter's fan-out to several receivers and the recovery of lost fragments,
+//  compares the receiver's audio buffers, simulates its jitter buffer and the
+//  whole link from the server to the receiver, compares frame sizes on the link,
+//  measures the cost of the metrics, checks the playlist loader and the track
+//  cache, runs the server's frame pipeline on temporary WAV files, and
+//  negotiates and discovers the link with the loopback device, streams a live
+//  input through a pipe (POSIX only), and checks and measures the CRC of checked
+//  frames and sends damaged ones again through the loopback device, checks
+//  the control messages and times them through the loopback device, and
+//  measures what stereo frames cost in CPU time and link bandwidth. Each
+//  benchmark can be run on its own by giving its name, or all of them with no
+//  arguments.
+//  Some also check their results, and the program fails if a check fails.
+//
+//  Build : g++ -std=c++11 -O2 -pthread AUDIFI-Benchmark.cpp -o AUDIFI-Benchmark
+//          cl /O2 /EHsc AUDIFI-Benchmark.cpp
+//
+//==============================================================================//
+
+//includes
+#include "AUDIFI-Protocol.h"
+
+//room for the largest frame the frame size benchmark sends
+#define FRAGMENT_FRAME_SIZE PROTOCOL_ALIGNED_FRAME_SIZE
+
+#include "AUDIFI-Resampler.h"
+#include "AUDIFI-ADPCM.h"
+#include "AUDIFI-Fan-Out.h"
+#include "AUDIFI-Fragment.h"
+#include "AUDIFI-Ring-Buffer.h"
+#include "AUDIFI-Jitter-Buffer.h"
+#include "AUDIFI-Link-Simulator.h"
+#include "AUDIFI-Metrics.h"
+#include "AUDIFI-Pipeline.h"
+#include "AUDIFI-Frame-Check.h"
+#include "AUDIFI-Control.h"
+#include "AUDIFI-Link-Negotiation.h"
+#include "AUDIFI-Loopback-Device.h"
+#include "AUDIFI-Live-Input.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#ifdef _WIN32
+  #include <sys/utime.h>
+#else
+  #include <utime.h>
+#endif
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#define BENCHMARK_AUDIO_SECONDS 60      //length of the audio processed by each run
+#define BENCHMARK_BLOCK_LENGTH 1024     //samples given to a stage at a time
+#define BENCHMARK_FRAME_SAMPLES 11025   //samples per frame, as sent by the server
+#define BENCHMARK_SAMPLE_RATE 11025     //the receiver's playback rate
+
+//==============================================================================//
+//Function declarations
+
+double secondsNow();
+void fillTestSignal(float* buffer, uint32_t length, uint32_t sampleRate);
+double measureSnr(const int16_t* reference, const int16_t* signal, uint32_t length);
+bool benchmarkResampler();
+bool testConverter();
+bool benchmarkConverter();
+bool benchmarkAdpcm();
+bool simulateFanOut(int mode);
+bool benchmarkFanOut();
+bool simulateFragments(double lossRate, bool fec);
+bool benchmarkFragments();
+bool testRingBuffer();
+bool benchmarkRingBuffer();
+bool simulateJitter(const char* name, bool adaptive, double hiccupRate, double sourcePpm, struct JitterResult* result);
+bool benchmarkJitter();
+void printLinkResult(const char* name, const LinkResult& result);
+bool benchmarkLink();
+bool benchmarkFrameSize();
+bool testMetrics();
+bool benchmarkMetrics();
+bool writeTestWav(const char* path, uint32_t sampleRate, uint16_t channelCount, uint32_t seconds);
+bool testPlaylist();
+bool runPipeline(const Playlist& playlist, uint8_t codec, uint8_t channelCount, uint32_t frameInterval,
+                 struct PipelineResult* result);
+bool benchmarkPipeline();
+bool benchmarkNegotiation();
+bool benchmarkDiscovery();
+bool runLiveInput(uint32_t stallTime, struct LiveResult* result);
+bool benchmarkLiveInput();
+bool testFrameCrc();
+bool runFrameCheck(uint32_t errorInterval, struct FrameCheckResult* result);
+bool benchmarkFrameCheck();
+bool testControlMessages();
+bool runControl(struct ControlResult* result);
+bool benchmarkControl();
+bool testStereoConverter();
+bool testStereoFallback();
+bool benchmarkStereo();
+
+//==============================================================================//
+//The benchmarks that can be run by name.
+
+struct Benchmark {
+  const char* name;
+  bool (*run)();  //returns false if a check failed
+};
+
+Benchmark benchmarks[] = {
+  {"resampler", benchmarkResampler},
+  {"converter", benchmarkConverter},
+  {"adpcm", benchmarkAdpcm},
+  {"fanout", benchmarkFanOut},
+  {"fragments", benchmarkFragments},
+  {"ringbuffer", benchmarkRingBuffer},
+  {"jitter", benchmarkJitter},
+  {"link", benchmarkLink},
+  {"framesize", benchmarkFrameSize},
+  {"metrics", benchmarkMetrics},
+  {"pipeline", benchmarkPipeline},
+  {"negotiation", benchmarkNegotiation},
+  {"discovery", benchmarkDiscovery},
+  {"live", benchmarkLiveInput},
+  {"framecheck", benchmarkFrameCheck},
+  {"control", benchmarkControl},
+  {"stereo", benchmarkStereo},
+};
+
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+//==============================================================================//
+
+int main(int argc, char** argv) {
+  printf("\nAUDIFI - Benchmark\n");
+  printf("------------------\n");
+
+  bool passed = true;
+
+  if (argc < 2) {
+    for (size_t i=0; i < BENCHMARK_COUNT; i++) {
+      passed &= benchmarks[i].run();
+    }
+    return passed ? 0 : 1;
+  }
+
+  for (int i=1; i < argc; i++) {
+    size_t j = 0;
+
+    while ((j < BENCHMARK_COUNT) && (strcmp(argv[i], benchmarks[j].name) != 0)) {
+      j++;
+    }
+
+    if (j == BENCHMARK_COUNT) {
+      printf("\nUnknown benchmark: %s\n", argv[i]);
+      printf("Available:");
+
+      for (j=0; j < BENCHMARK_COUNT; j++) {
+        printf(" %s", benchmarks[j].name);
+      }
+      printf("\n");
+      return 1;
+    }
+    passed &= benchmarks[j].run();
+  }
+  return passed ? 0 : 1;
+}
+
+//==============================================================================//
+
+double secondsNow() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//==============================================================================//
+//A mix of tones and noise, so that the filters can't take any shortcuts.
+
+void fillTestSignal(float* buffer, uint32_t length, uint32_t sampleRate) {
+  uint32_t noise = 0x12345678;
+
+  for (uint32_t i=0; i < length; i++) {
+    noise ^= noise << 13;
+    noise ^= noise >> 17;
+    noise ^= noise << 5;
+    double t = double(i) / double(sampleRate);
+    buffer[i] = float((0.3 * sin(2.0 * 3.14159265358979 * 440.0 * t)) + (0.2 * sin(2.0 * 3.14159265358979 * 3000.0 * t)) +
+                      (0.1 * ((double(noise) / 4294967296.0) - 0.5)));
+  }
+}
+
+//==============================================================================//
+//Signal to noise ratio of signal against reference, in dB.
+
+double measureSnr(const int16_t* reference, const int16_t* signal, uint32_t length) {
+  double signalPower = 0.0;
+  double noisePower = 0.0;
+
+  for (uint32_t i=0; i < length; i++) {
+    double error = double(signal[i]) - double(reference[i]);
+    signalPower += double(reference[i]) * double(reference[i]);
+    noisePower += error * error;
+  }
+
+  if (noisePower == 0.0) {
+    return 999.0;
+  }
+  return 10.0 * log10(signalPower / noisePower);
+}
+
+//==============================================================================//
+//Resamples a minute of audio from the common file rates to the receiver's rate,
+//in blocks as the server does. The real-time factor is the processing time over
+//the length of the audio. Below 1 the stage keeps up with playback.
+
+bool benchmarkResampler() {
+  const uint32_t inputRates[] = {8000, 22050, 44100, 48000, 96000};
+  const uint32_t outputRate = 11025;
+
+  printf("\nResampler, %d s of audio to %u Hz\n", BENCHMARK_AUDIO_SECONDS, outputRate);
+  printf("%-8s %8s %6s %8s %12s %12s\n", "quality", "input Hz", "taps", "kernel", "RTF", "x real time");
+
+  for (int quality=RESAMPLER_QUALITY_LOW; quality <= RESAMPLER_QUALITY_HIGH; quality++) {
+    for (size_t r=0; r < (sizeof(inputRates) / sizeof(inputRates[0])); r++) {
+      uint32_t inputLength = inputRates[r] * BENCHMARK_AUDIO_SECONDS;
+      std::vector<float> input(inputLength);
+      std::vector<float> output(BENCHMARK_BLOCK_LENGTH);
+      fillTestSignal(&input[0], inputLength, inputRates[r]);
+
+      for (int level=KERNEL_SCALAR; level <= detectKernelLevel(); level++) {
+        Resampler resampler;
+        resampler.setKernelLevel(level);
+        resampler.configure(inputRates[r], outputRate, quality);
+
+        double startTime = secondsNow();
+        uint32_t position = 0;
+
+        while (position < inputLength) {
+          uint32_t blockLength = inputLength - position;
+          uint32_t inputUsed = 0;
+
+          if (blockLength > BENCHMARK_BLOCK_LENGTH) {
+            blockLength = BENCHMARK_BLOCK_LENGTH;
+          }
+          resampler.process(&input[position], blockLength, &inputUsed, &output[0], BENCHMARK_BLOCK_LENGTH);
+          position += inputUsed;
+        }
+
+        double rtf = (secondsNow() - startTime) / BENCHMARK_AUDIO_SECONDS;
+        printf("%-8s %8u %6u %8s %12.6f %12.0f\n", Resampler::getQualityName(quality), inputRates[r],
+          resampler.getTapCount(), resampler.getKernelName(), rtf, (rtf > 0.0) ? (1.0 / rtf) : 0.0);
+      }
+    }
+  }
+  return true;
+}
+
+//==============================================================================//
+//Sample converter, from the WAV formats to the receiver's 8 bits.
+
+#define CONVERTER_TEST_FRAMES 2051      //longest run checked, two blocks and an odd tail
+#define CONVERTER_TEST_GUARD 64         //bytes after the output that must stay untouched
+#define CONVERTER_MIN_SPEED 50.0        //times real time each kernel must at least reach
+
+struct ConverterCase {
+  const char* name;
+  WavFormat format;
+  bool stereoOutput;
+};
+
+static const ConverterCase converterCases[] = {
+  {"16-bit stereo to mono", {WAV_FORMAT_PCM, 2, 44100, 16, 4, 0, 0}, false},
+  {"16-bit stereo", {WAV_FORMAT_PCM, 2, 44100, 16, 4, 0, 0}, true},
+  {"16-bit mono", {WAV_FORMAT_PCM, 1, 44100, 16, 2, 0, 0}, false},
+  {"24-bit stereo to mono", {WAV_FORMAT_PCM, 2, 96000, 24, 6, 0, 0}, false},
+  {"32-bit stereo to mono", {WAV_FORMAT_PCM, 2, 48000, 32, 8, 0, 0}, false},
+  {"Float stereo to mono", {WAV_FORMAT_FLOAT, 2, 48000, 32, 8, 0, 0}, false},
+};
+
+//------------------------------------------------------------------------------//
+//Fills frameCount frames of the format with a sweep over the whole range, and
+//the value of each sample to reference, +/-1 at full scale. Float samples go a
+//little past full scale, to check the clamping.
+
+void fillConverterInput(const WavFormat& format, uint32_t frameCount, uint8_t* input, double* reference) {
+  uint32_t sampleCount = frameCount * format.channelCount;
+  uint32_t sampleSize = format.bitsPerSample / 8;
+
+  for (uint32_t i=0; i < sampleCount; i++) {
+    double value = sin(double(i) * 0.0137) * ((i % 3) ? 1.0 : 0.999) * ((format.formatTag == WAV_FORMAT_FLOAT) ? 1.2 : 1.0);
+    uint8_t* sample = &input[i * sampleSize];
+
+    if (format.formatTag == WAV_FORMAT_FLOAT) {
+      float floatValue = float(value);
+      memcpy(sample, &floatValue, sizeof(floatValue));
+      reference[i] = floatValue;
+      continue;
+    }
+
+    int64_t fullScale = int64_t(1) << (format.bitsPerSample - 1);
+    int64_t integer = int64_t(floor(value * double(fullScale)));
+    integer = (integer >= fullScale) ? (fullScale - 1) : integer;
+    reference[i] = double(integer) / double(fullScale);
+
+    for (uint32_t j=0; j < sampleSize; j++) {
+      sample[j] = uint8_t(uint64_t(integer) >> (j * 8));
+    }
+  }
+}
+
+//------------------------------------------------------------------------------//
+//The 8-bit sample nearest to a value, +/-1 at full scale.
+
+uint8_t getNearestU8(double value) {
+  value = (value > 1.0) ? 1.0 : ((value < -1.0) ? -1.0 : value);
+  long rounded = lround((value + 1.0) * 128.0);
+  return uint8_t((rounded > 255) ? 255 : rounded);
+}
+
+//------------------------------------------------------------------------------//
+//Runs every kernel on every format, for odd lengths around the SIMD widths, with
+//the input and output one frame and one byte off their alignment, so that every
+//tail goes through the scalar code. Each output sample has to be within the
+//dither's one step of the exact value, and of what the scalar kernel gives with
+//its own dither, and the bytes after the output must not be touched.
+
+bool testConverter() {
+  const uint32_t lengths[] = {1, 7, 15, 16, 17, 31, 32, 33, 63, 65, 1023, 1025, CONVERTER_TEST_FRAMES};
+  bool passed = true;
+
+  printf("%-24s %8s %8s %8s %10s\n", "Converter", "kernel", "runs", "errors", "vs scalar");
+
+  for (size_t c=0; c < (sizeof(converterCases) / sizeof(converterCases[0])); c++) {
+    const ConverterCase& test = converterCases[c];
+    uint32_t outputChannels = test.stereoOutput ? 2 : 1;
+    std::vector<uint8_t> input((CONVERTER_TEST_FRAMES + 1) * test.format.blockAlign);
+    std::vector<double> reference((CONVERTER_TEST_FRAMES + 1) * test.format.channelCount);
+    std::vector<uint8_t> output((CONVERTER_TEST_FRAMES * 2) + 1 + CONVERTER_TEST_GUARD);
+    std::vector<uint8_t> scalarOutput(CONVERTER_TEST_FRAMES * 2);
+    fillConverterInput(test.format, CONVERTER_TEST_FRAMES + 1, &input[0], &reference[0]);
+
+    //one frame in, so the input is not aligned
+    const uint8_t* frames = &input[test.format.blockAlign];
+    const double* values = &reference[test.format.channelCount];
+
+    for (int level=KERNEL_SCALAR; level <= detectKernelLevel(); level++) {
+      uint32_t runs = 0;
+      uint32_t errors = 0;
+      int maxDifference = 0;
+
+      for (size_t l=0; l < (sizeof(lengths) / sizeof(lengths[0])); l++) {
+        uint32_t frameCount = lengths[l];
+        uint32_t outputCount = frameCount * outputChannels;
+        SampleConverter converter;
+        converter.setKernelLevel(level);
+        converter.configure(test.format);
+        memset(&output[0], 0xA5, output.size());
+
+        if (test.stereoOutput) {
+          converter.convertStereo(frames, frameCount, &output[1]);
+        }
+        else {
+          converter.convert(frames, frameCount, &output[1]);
+        }
+
+        if (level == KERNEL_SCALAR) {
+          memcpy(&scalarOutput[0], &output[1], outputCount);
+        }
+
+        for (uint32_t i=0; i < outputCount; i++) {
+          double exact = 0.0;
+
+          if (test.stereoOutput) {
+            exact = values[i];
+          }
+          else {
+            for (uint32_t j=0; j < test.format.channelCount; j++) {
+              exact += values[(i * test.format.channelCount) + j];
+            }
+            exact /= test.format.channelCount;
+          }
+
+          int difference = abs(int(output[1 + i]) - int(scalarOutput[i]));
+          maxDifference = (difference > maxDifference) ? difference : maxDifference;
+          errors += ((abs(int(output[1 + i]) - int(getNearestU8(exact))) > 1) || (difference > 2)) ? 1 : 0;
+        }
+
+        errors += (output[0] != 0xA5) ? 1 : 0;
+
+        for (uint32_t i=0; i < CONVERTER_TEST_GUARD; i++) {
+          errors += (output[1 + outputCount + i] != 0xA5) ? 1 : 0;
+        }
+        runs++;
+      }
+
+      SampleConverter converter;
+      converter.setKernelLevel(level);
+      printf("%-24s %8s %8u %8u %10d%s\n", test.name, converter.getKernelName(), runs, errors, maxDifference,
+        (errors == 0) ? "" : "  FAILED");
+      passed &= (errors == 0);
+    }
+  }
+  return passed;
+}
+
+//------------------------------------------------------------------------------//
+//Checks the kernels, then converts a minute of audio in each format with each
+//kernel, in blocks as the server does. The real-time factor is the processing
+//time over the length of the audio, and every kernel has to be at least
+//CONVERTER_MIN_SPEED times faster than real time on this one thread.
+
+bool benchmarkConverter() {
+  printf("\nSample converter, %d s of audio\n", BENCHMARK_AUDIO_SECONDS);
+  bool passed = testConverter();
+
+  printf("\n%-24s %8s %12s %12s\n", "Format", "kernel", "RTF", "x real time");
+
+  for (size_t c=0; c < (sizeof(converterCases) / sizeof(converterCases[0])); c++) {
+    const ConverterCase& test = converterCases[c];
+    uint32_t frameCount = test.format.sampleRate * BENCHMARK_AUDIO_SECONDS;
+    std::vector<uint8_t> input(frameCount * test.format.blockAlign);
+    std::vector<double> reference(frameCount * test.format.channelCount);
+    std::vector<uint8_t> output(BENCHMARK_BLOCK_LENGTH * 2);
+    fillConverterInput(test.format, frameCount, &input[0], &reference[0]);
+
+    for (int level=KERNEL_SCALAR; level <= detectKernelLevel(); level++) {
+      SampleConverter converter;
+      converter.setKernelLevel(level);
+      converter.configure(test.format);
+      double startTime = secondsNow();
+
+      for (uint32_t position=0; position < frameCount; position += BENCHMARK_BLOCK_LENGTH) {
+        uint32_t blockFrames = ((frameCount - position) < BENCHMARK_BLOCK_LENGTH) ? (frameCount - position) : BENCHMARK_BLOCK_LENGTH;
+
+        if (test.stereoOutput) {
+          converter.convertStereo(&input[position * test.format.blockAlign], blockFrames, &output[0]);
+        }
+        else {
+          converter.convert(&input[position * test.format.blockAlign], blockFrames, &output[0]);
+        }
+      }
+
+      double rtf = (secondsNow() - startTime) / BENCHMARK_AUDIO_SECONDS;
+      double speed = (rtf > 0.0) ? (1.0 / rtf) : 1e9;
+      bool ok = (speed >= CONVERTER_MIN_SPEED);
+      printf("%-24s %8s %12.6f %12.0f%s\n", test.name, converter.getKernelName(), rtf, speed, ok ? "" : "  FAILED");
+      passed &= ok;
+    }
+  }
+
+  printf("Sample converter: %s\n", passed ? "ok" : "FAILED");
+  return passed;
+}
+
+//==============================================================================//
+//Codes a minute of audio at the playback rate frame by frame, as the server does,
+//and decodes it to 16 and 8 bits, as the receiver does. The round trip is checked
+//for the lengths of odd sized frames and for the quality of the decoded audio.
+
+bool benchmarkAdpcm() {
+  const uint32_t sampleCount = BENCHMARK_SAMPLE_RATE * BENCHMARK_AUDIO_SECONDS;
+  const double minimumSnr = 18.0; //about 21 dB on the test signal, the white noise in it is the hardest part
+  bool passed = true;
+
+  std::vector<float> signal(sampleCount);
+  std::vector<int16_t> input(sampleCount);
+  std::vector<int16_t> decoded(sampleCount);
+  std::vector<uint8_t> decodedU8(sampleCount);
+  std::vector<uint8_t> encoded(adpcmEncodedLength(BENCHMARK_FRAME_SAMPLES) * ((sampleCount / BENCHMARK_FRAME_SAMPLES) + 1));
+  std::vector<uint32_t> frameOffsets;
+
+  fillTestSignal(&signal[0], sampleCount, BENCHMARK_SAMPLE_RATE);
+
+  for (uint32_t i=0; i < sampleCount; i++) {
+    input[i] = int16_t(lrintf(signal[i] * 32767.0f));
+  }
+
+  printf("\nADPCM, %d s of audio at %u Hz in frames of %u samples\n", BENCHMARK_AUDIO_SECONDS, BENCHMARK_SAMPLE_RATE, BENCHMARK_FRAME_SAMPLES);
+
+  //encode
+  double startTime = secondsNow();
+  uint32_t encodedLength = 0;
+  int32_t stepIndex = 0;
+
+  for (uint32_t i=0; i < sampleCount; i += BENCHMARK_FRAME_SAMPLES) {
+    uint32_t frameSamples = ((sampleCount - i) < BENCHMARK_FRAME_SAMPLES) ? (sampleCount - i) : BENCHMARK_FRAME_SAMPLES;
+    frameOffsets.push_back(encodedLength);
+    encodedLength += adpcmEncode(&input[i], frameSamples, &encoded[encodedLength], &stepIndex);
+  }
+  double encodeTime = secondsNow() - startTime;
+
+  //decode to 16 bits, and to 8 bits as the receiver does
+  startTime = secondsNow();
+
+  for (uint32_t i=0, frame=0; i < sampleCount; i += BENCHMARK_FRAME_SAMPLES, frame++) {
+    uint32_t frameSamples = ((sampleCount - i) < BENCHMARK_FRAME_SAMPLES) ? (sampleCount - i) : BENCHMARK_FRAME_SAMPLES;
+    adpcmDecode(&encoded[frameOffsets[frame]], frameSamples, &decoded[i]);
+  }
+  double decodeTime = secondsNow() - startTime;
+  startTime = secondsNow();
+
+  for (uint32_t i=0, frame=0; i < sampleCount; i += BENCHMARK_FRAME_SAMPLES, frame++) {
+    uint32_t frameSamples = ((sampleCount - i) < BENCHMARK_FRAME_SAMPLES) ? (sampleCount - i) : BENCHMARK_FRAME_SAMPLES;
+    adpcmDecodeU8(&encoded[frameOffsets[frame]], frameSamples, &decodedU8[i]);
+  }
+  double decodeU8Time = secondsNow() - startTime;
+
+  double audioSeconds = double(BENCHMARK_AUDIO_SECONDS);
+  printf("%-12s %12s %12s %12s\n", "stage", "Msamples/s", "RTF", "x real time");
+  printf("%-12s %12.1f %12.6f %12.0f\n", "encode", sampleCount / encodeTime / 1e6, encodeTime / audioSeconds, audioSeconds / encodeTime);
+  printf("%-12s %12.1f %12.6f %12.0f\n", "decode", sampleCount / decodeTime / 1e6, decodeTime / audioSeconds, audioSeconds / decodeTime);
+  printf("%-12s %12.1f %12.6f %12.0f\n", "decode u8", sampleCount / decodeU8Time / 1e6, decodeU8Time / audioSeconds, audioSeconds / decodeU8Time);
+  printf("%u samples in %u bytes, %.2f bits per sample, %.2fx smaller than 8-bit PCM\n",
+    sampleCount, encodedLength, (encodedLength * 8.0) / sampleCount, double(sampleCount) / encodedLength);
+
+  //the round trip has to be close to the input, and the 8-bit output has to be
+  //the 16-bit output cut to 8 bits
+  double snr = measureSnr(&input[0], &decoded[0], sampleCount);
+  bool u8Matches = true;
+
+  for (uint32_t i=0; i < sampleCount; i++) {
+    u8Matches &= (decodedU8[i] == uint8_t((decoded[i] + 32768) >> 8));
+  }
+
+  printf("Round trip SNR %.1f dB: %s\n", snr, (snr >= minimumSnr) ? "ok" : "FAILED");
+  printf("8-bit output matches 16-bit output: %s\n", u8Matches ? "ok" : "FAILED");
+  passed &= (snr >= minimumSnr) && u8Matches;
+
+  //frames of any length, including those cut at the end of a track, have to code
+  //to the expected no. of bytes and decode back from the same no. of bytes
+  const uint32_t frameLengths[] = {1, 2, 3, ADPCM_BLOCK_SAMPLES - 1, ADPCM_BLOCK_SAMPLES, ADPCM_BLOCK_SAMPLES + 1,
+                                   (2 * ADPCM_BLOCK_SAMPLES) + 2, BENCHMARK_FRAME_SAMPLES};
+  bool lengthsMatch = true;
+
+  for (size_t i=0; i < (sizeof(frameLengths) / sizeof(frameLengths[0])); i++) {
+    int32_t index = 0;
+    uint32_t length = adpcmEncode(&input[0], frameLengths[i], &encoded[0], &index);
+    uint32_t readLength = adpcmDecode(&encoded[0], frameLengths[i], &decoded[0]);
+
+    if ((length != adpcmEncodedLength(frameLengths[i])) || (readLength != length) || (decoded[0] != input[0])) {
+      printf("Frame of %u samples: coded to %u bytes, decoded from %u bytes\n", frameLengths[i], length, readLength);
+      lengthsMatch = false;
+    }
+  }
+  printf("Frame lengths: %s\n", lengthsMatch ? "ok" : "FAILED");
+  passed &= lengthsMatch;
+
+  //a full scale square wave must not wrap around. the decoder needs a few samples
+  //to follow each edge, but it has to settle at the right end.
+  bool clipsCleanly = true;
+
+  for (uint32_t i=0; i < BENCHMARK_FRAME_SAMPLES; i++) {
+    input[i] = ((i / 25) & 1) ? 32767 : -32768;
+  }
+
+  stepIndex = 0;
+  adpcmEncode(&input[0], BENCHMARK_FRAME_SAMPLES, &encoded[0], &stepIndex);
+  adpcmDecode(&encoded[0], BENCHMARK_FRAME_SAMPLES, &decoded[0]);
+
+  for (uint32_t i=20; i < BENCHMARK_FRAME_SAMPLES; i += 25) {
+    clipsCleanly &= ((decoded[i] > 0) == (input[i] > 0)) && (abs(decoded[i] - input[i]) < 4096);
+  }
+  printf("Full scale square wave: %s\n", clipsCleanly ? "ok" : "FAILED");
+  passed &= clipsCleanly;
+
+  return passed;
+}
+
+//==============================================================================//
+//A receiver in the fan-out simulation. It grants credit the way the real one does,
+//and plays a frame every playbackPeriod ms.
+
+struct SimulatedReceiver {
+  uint32_t address;
+  uint32_t joinTime;      //when it joins the network
+  uint32_t leaveTime;     //when it goes silent
+  uint32_t playbackPeriod;
+  uint32_t bufferedFrames;
+  uint32_t creditOutstanding;
+  uint32_t playTime;
+  bool registered;
+  bool started;
+  uint32_t expectedSequence;  //sequence no. of the next frame, once started
+  uint32_t framesReceived;
+  uint32_t errors;        //gaps, repeats and overflows
+};
+
+#define SIM_BUFFER_FRAMES 10      //receiver buffer, CB_SIZE / frame size
+#define SIM_CREDIT_WINDOW 4       //same as CREDIT_WINDOW_FRAMES
+#define SIM_SERIAL_PERIOD 25      //ms per frame on the serial link
+#define SIM_DURATION 120000       //simulated time, ms
+#define SIM_RECEIVER_COUNT 4
+
+//==============================================================================//
+//Runs the transmitter's fan-out against simulated receivers, a millisecond at a
+//time. One receiver joins late and another goes silent halfway through. Every
+//receiver must get a gapless run of frames, the silent one must not hold up the
+//others, and every frame must cross the serial link only once.
+
+bool simulateFanOut(int mode) {
+  FanOut* fanOut = new FanOut(mode);
+  SimulatedReceiver receivers[SIM_RECEIVER_COUNT] = {
+    {0x0204A8C0, 0, 0xFFFFFFFF, 100, 0, 0, 0, false, false, 0, 0, 0},
+    {0x0304A8C0, 0, 0xFFFFFFFF, 100, 0, 0, 0, false, false, 0, 0, 0},
+    {0x0404A8C0, 10000, 0xFFFFFFFF, 101, 0, 0, 0, false, false, 0, 0, 0},
+    {0x0504A8C0, 0, 60000, 99, 0, 0, 0, false, false, 0, 0, 0},
+  };
+  uint32_t applicationSequence = 0; //frames the application has sent over serial
+  uint32_t framesRequested = 0;
+  uint32_t framesLost = 0;  //sent to a receiver that has gone silent
+  uint32_t serialTime = 0;
+  uint32_t framesAtLeave = 0;
+  uint32_t framesAtEnd = 0;
+  bool passed = true;
+
+  for (uint32_t now=0; now < SIM_DURATION; now++) {
+    //the receivers
+    for (int i=0; i < SIM_RECEIVER_COUNT; i++) {
+      SimulatedReceiver& receiver = receivers[i];
+
+      if ((now < receiver.joinTime) || (now >= receiver.leaveTime)) {
+        continue;
+      }
+      if (!receiver.registered) {
+        receiver.registered = (fanOut->registerClient(receiver.address, now) >= 0);
+        continue;
+      }
+
+      if (receiver.bufferedFrames > 0) {
+        if ((now - receiver.playTime) >= receiver.playbackPeriod) {
+          receiver.bufferedFrames--;
+          receiver.playTime = now;
+        }
+      }
+      else {
+        receiver.playTime = now;
+      }
+
+      uint32_t framesVacant = SIM_BUFFER_FRAMES - receiver.bufferedFrames;
+
+      if ((framesVacant > receiver.creditOutstanding) && (receiver.creditOutstanding < SIM_CREDIT_WINDOW)) {
+        uint32_t creditGrant = framesVacant - receiver.creditOutstanding;
+        creditGrant = (creditGrant > (SIM_CREDIT_WINDOW - receiver.creditOutstanding)) ? (SIM_CREDIT_WINDOW - receiver.creditOutstanding) : creditGrant;
+        fanOut->grantCredit(receiver.address, uint16_t(creditGrant), now);
+        receiver.creditOutstanding += creditGrant;
+      }
+    }
+
+    fanOut->expireClients(now);
+
+    //the application answers requests one frame at a time, at the speed of the link
+    if ((framesRequested > 0) && ((now - serialTime) >= SIM_SERIAL_PERIOD)) {
+      uint8_t* slot = fanOut->beginWrite();
+
+      if (slot != NULL) {
+        memset(slot, 0, 4);
+        memcpy(slot + 4, &applicationSequence, sizeof(applicationSequence));
+        fanOut->commitWrite(uint16_t(4 + sizeof(applicationSequence)));
+        applicationSequence++;
+        framesRequested--;
+        serialTime = now;
+      }
+    }
+
+    uint32_t framesFree = fanOut->getFreeFrames();
+
+    if (framesFree > framesRequested) {
+      framesRequested = framesFree;
+    }
+
+    //the transmitter sends one frame per round
+    FanOutSend send;
+
+    if (fanOut->nextSend(&send)) {
+      uint32_t sequence = 0;
+      memcpy(&sequence, send.frame + 4, sizeof(sequence));
+
+      for (int i=0; i < SIM_RECEIVER_COUNT; i++) {
+        SimulatedReceiver& receiver = receivers[i];
+        bool addressed = (send.client < 0) || (send.address == receiver.address);
+
+        if ((!receiver.registered) || (!addressed)) {
+          continue;
+        }
+        if (now >= receiver.leaveTime) {
+          framesLost += (send.client >= 0) ? 1 : 0;
+          continue;
+        }
+
+        //a receiver can't tell a broadcast frame it didn't ask for from one it did,
+        //so it must never get one without credit
+        if ((receiver.creditOutstanding == 0) || (receiver.bufferedFrames == SIM_BUFFER_FRAMES) ||
+            (receiver.started && (sequence != receiver.expectedSequence))) {
+          receiver.errors++;
+        }
+
+        receiver.started = true;
+        receiver.expectedSequence = sequence + 1;
+        receiver.creditOutstanding -= (receiver.creditOutstanding > 0) ? 1 : 0;
+        receiver.bufferedFrames += (receiver.bufferedFrames < SIM_BUFFER_FRAMES) ? 1 : 0;
+        receiver.framesReceived++;
+      }
+      fanOut->completeSend(send);
+    }
+
+    if (now == (receivers[3].leaveTime + FAN_OUT_CLIENT_TIMEOUT + 1000)) {
+      framesAtLeave = receivers[0].framesReceived;
+    }
+  }
+  framesAtEnd = receivers[0].framesReceived;
+
+  printf("%s: %u frames over serial, %u frames sent\n", (mode == FAN_OUT_BROADCAST) ? "Broadcast" : "Unicast",
+    applicationSequence, fanOut->getFramesSent());
+
+  for (int i=0; i < SIM_RECEIVER_COUNT; i++) {
+    printf("  receiver %d: %u frames, %u errors\n", i, receivers[i].framesReceived, receivers[i].errors);
+    passed &= (receivers[i].errors == 0) && (receivers[i].framesReceived > 0);
+  }
+
+  //the others have to keep playing after the silent one is dropped. in broadcast
+  //mode they all play at the pace of the slowest one.
+  uint32_t playbackPeriod = (mode == FAN_OUT_BROADCAST) ? receivers[2].playbackPeriod : receivers[0].playbackPeriod;
+  uint32_t expectedAfterLeave = (SIM_DURATION - (receivers[3].leaveTime + FAN_OUT_CLIENT_TIMEOUT + 1000)) / playbackPeriod;
+  bool keptPlaying = ((framesAtEnd - framesAtLeave) + 2) >= expectedAfterLeave;
+  printf("  playback after a receiver went silent: %s\n", keptPlaying ? "ok" : "FAILED");
+  passed &= keptPlaying;
+
+  //every frame has to cross the serial link once. in broadcast mode it's also sent
+  //once, and in unicast mode once per receiver.
+  uint32_t framesReceived = 0;
+
+  for (int i=0; i < SIM_RECEIVER_COUNT; i++) {
+    framesReceived += receivers[i].framesReceived;
+  }
+
+  bool sentOnce = (mode == FAN_OUT_BROADCAST) ? (fanOut->getFramesSent() <= applicationSequence) :
+                                                (fanOut->getFramesSent() == (framesReceived + framesLost));
+  printf("  frames sent once per %s: %s\n", (mode == FAN_OUT_BROADCAST) ? "network" : "receiver", sentOnce ? "ok" : "FAILED");
+  passed &= sentOnce && (fanOut->getFramesWritten() == applicationSequence);
+
+  delete fanOut;
+  return passed;
+}
+
+//==============================================================================//
+//Runs the fan-out simulation in both modes.
+
+bool benchmarkFanOut() {
+  printf("\nFan-out, %d receivers, %d s simulated\n", SIM_RECEIVER_COUNT, SIM_DURATION / 1000);
+  bool passed = simulateFanOut(FAN_OUT_UNICAST);
+  passed &= simulateFanOut(FAN_OUT_BROADCAST);
+  printf("Fan-out simulation: %s\n", passed ? "ok" : "FAILED");
+  return passed;
+}
+
+//==============================================================================//
+//A packet on its way over the simulated Wi-Fi link.
+
+struct SimulatedPacket {
+  uint32_t arrivalTime;
+  std::vector<uint8_t> data;
+};
+
+#define FRAGMENT_SIM_FRAMES 1000      //frames sent in a run
+#define FRAGMENT_SIM_FRAME_PERIOD 40  //ms between frames, as when filling the buffer
+#define FRAGMENT_SIM_LATENCY 2        //min. delay of a packet, ms
+#define FRAGMENT_SIM_JITTER 4         //max. extra delay, which reorders the packets
+
+//------------------------------------------------------------------------------//
+//xorshift, so that every run sees the same losses.
+
+uint32_t nextRandom(uint32_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+//------------------------------------------------------------------------------//
+//Queues a packet on a link, unless it's lost.
+
+void sendSimulatedPacket(std::vector<SimulatedPacket>& link, const uint8_t* data, uint32_t length,
+                         uint32_t now, double lossRate, uint32_t* random) {
+  if ((nextRandom(random) % 100000) < uint32_t(lossRate * 100000)) {
+    return;
+  }
+
+  SimulatedPacket packet;
+  packet.arrivalTime = now + FRAGMENT_SIM_LATENCY + (nextRandom(random) % (FRAGMENT_SIM_JITTER + 1));
+  packet.data.assign(data, data + length);
+  link.push_back(packet);
+}
+
+//------------------------------------------------------------------------------//
+//Takes the packets that have arrived off a link.
+
+std::vector<SimulatedPacket> receiveSimulatedPackets(std::vector<SimulatedPacket>& link, uint32_t now) {
+  std::vector<SimulatedPacket> arrived;
+
+  for (size_t i=0; i < link.size(); ) {
+    if (link[i].arrivalTime <= now) {
+      arrived.push_back(link[i]);
+      link[i] = link.back();
+      link.pop_back();
+    }
+    else {
+      i++;
+    }
+  }
+  return arrived;
+}
+
+//==============================================================================//
+//Sends frames from a simulated transmitter to a simulated receiver over links
+//that lose and reorder packets, both ways. The receiver asks for missing
+//fragments as the real one does. Every frame handed out must be exactly the one
+//sent, and every frame must be handed out or counted as skipped.
+
+bool simulateFragments(double lossRate, bool fec) {
+  RetransmitCache* cache = new RetransmitCache();
+  FrameAssembler* assembler = new FrameAssembler();
+  std::vector<SimulatedPacket> toReceiver;
+  std::vector<SimulatedPacket> toTransmitter;
+  std::vector<std::vector<uint8_t> > frames(FRAGMENT_SIM_FRAMES);
+  std::vector<uint32_t> sendTimes(FRAGMENT_SIM_FRAMES);
+  std::vector<uint8_t> received(FRAGMENT_FRAME_SIZE);
+  uint8_t packet[FRAGMENT_PACKET_SIZE];
+  uint32_t random = 0x2545F491;
+  uint32_t framesSent = 0;
+  uint32_t framesReceived = 0;
+  uint32_t framesSkipped = 0;
+  uint32_t framesCorrupt = 0;
+  uint32_t nackCount = 0;
+  uint32_t fragmentsSent = 0;
+  uint32_t fragmentsRetransmitted = 0;
+  uint32_t maxDelay = 0;
+  uint32_t endTime = (FRAGMENT_SIM_FRAMES * FRAGMENT_SIM_FRAME_PERIOD) + 1000;
+
+  //mostly full frames, and a short one now and then as at the end of a track
+  for (uint32_t i=0; i < FRAGMENT_SIM_FRAMES; i++) {
+    uint32_t length = ((i % 50) == 49) ? (4 + (nextRandom(&random) % 3000) + 1) : REQUEST_SIZE;
+    frames[i].resize(length);
+
+    for (uint32_t j=0; j < length; j++) {
+      frames[i][j] = uint8_t(nextRandom(&random));
+    }
+  }
+
+  for (uint32_t now=0; now < endTime; now++) {
+    //the transmitter
+    if (((now % FRAGMENT_SIM_FRAME_PERIOD) == 0) && (framesSent < FRAGMENT_SIM_FRAMES)) {
+      const uint8_t* frame = frames[framesSent].data();
+      uint16_t length = uint16_t(frames[framesSent].size());
+      uint16_t sequence = uint16_t(framesSent + 60000); //wraps around during the run
+
+      cache->store(sequence, frame, length);
+
+      for (uint8_t i=0; i < getFragmentCount(length); i++) {
+        sendSimulatedPacket(toReceiver, packet, writeFragment(frame, length, sequence, i, 0, packet), now, lossRate, &random);
+        fragmentsSent++;
+      }
+      if (fec) {
+        sendSimulatedPacket(toReceiver, packet, writeParityFragment(frame, length, sequence, packet), now, lossRate, &random);
+        fragmentsSent++;
+      }
+      sendTimes[framesSent++] = now;
+    }
+
+    std::vector<SimulatedPacket> requests = receiveSimulatedPackets(toTransmitter, now);
+
+    for (size_t i=0; i < requests.size(); i++) {
+      char request[32] = {0};
+      memcpy(request, requests[i].data.data(), (requests[i].data.size() < 31) ? requests[i].data.size() : 31);
+      char* end = NULL;
+      uint16_t sequence = uint16_t(strtoul(&request[3], &end, 10));
+      uint32_t mask = strtoul(end + 1, NULL, 10);
+      uint16_t length = 0;
+      const uint8_t* frame = cache->find(sequence, &length);
+
+      for (uint8_t j=0; (frame != NULL) && (j < getFragmentCount(length)); j++) {
+        if (mask & (uint32_t(1) << j)) {
+          sendSimulatedPacket(toReceiver, packet, writeFragment(frame, length, sequence, j, FRAGMENT_FLAG_RETRANSMIT, packet), now, lossRate, &random);
+          fragmentsRetransmitted++;
+        }
+      }
+    }
+
+    //the receiver
+    std::vector<SimulatedPacket> fragments = receiveSimulatedPackets(toReceiver, now);
+
+    for (size_t i=0; i < fragments.size(); i++) {
+      assembler->addFragment(fragments[i].data.data(), uint32_t(fragments[i].data.size()), now);
+    }
+
+    uint16_t sequence = 0;
+    uint32_t missingMask = 0;
+
+    if (assembler->getMissingFragments(now, &sequence, &missingMask)) {
+      char request[24] = {0};
+      snprintf(request, sizeof(request), "NK#%u#%lu", sequence, (unsigned long) missingMask);
+      sendSimulatedPacket(toTransmitter, (const uint8_t*) request, uint32_t(strlen(request)), now, lossRate, &random);
+      nackCount++;
+    }
+
+    uint16_t length = 0;
+    uint16_t skipped = 0;
+
+    while (assembler->popFrame(received.data(), &length, &sequence, &skipped, now)) {
+      uint32_t index = uint16_t(sequence - 60000);
+
+      if ((index >= framesSent) || (length != frames[index].size()) || (memcmp(received.data(), frames[index].data(), length) != 0)) {
+        framesCorrupt++;
+      }
+      else {
+        maxDelay = ((now - sendTimes[index]) > maxDelay) ? (now - sendTimes[index]) : maxDelay;
+      }
+      framesReceived++;
+      framesSkipped += skipped;
+    }
+  }
+
+  //the frames lost at the very end are never skipped over
+  uint32_t lostAtEnd = FRAGMENT_SIM_FRAMES - (framesReceived + framesSkipped);
+
+  printf("%5.1f%% %-4s %7.2f%% %8u %8u %9.1f%% %8u ms %8u\n", lossRate * 100, fec ? "on" : "off",
+    (100.0 * framesReceived) / FRAGMENT_SIM_FRAMES, assembler->getFramesRecovered(), nackCount,
+    (100.0 * fragmentsRetransmitted) / fragmentsSent, maxDelay, framesCorrupt);
+
+  bool passed = (framesCorrupt == 0) && (lostAtEnd <= FRAGMENT_ASSEMBLY_SLOTS);
+
+  //without losses nothing is asked for, and with a few everything still arrives
+  if (lossRate == 0) {
+    passed &= (framesReceived == FRAGMENT_SIM_FRAMES) && (nackCount == 0);
+  }
+  else if (lossRate <= 0.05) {
+    passed &= (framesReceived >= (FRAGMENT_SIM_FRAMES * 99 / 100));
+  }
+
+  delete cache;
+  delete assembler;
+  return passed;
+}
+
+//==============================================================================//
+//Runs the fragment simulation at a few loss rates, with and without FEC.
+
+bool benchmarkFragments() {
+  const double lossRates[] = {0, 0.01, 0.05, 0.10, 0.20};
+  bool passed = true;
+
+  printf("\nFragment recovery, %d frames, losses both ways\n", FRAGMENT_SIM_FRAMES);
+  printf("%6s %-4s %8s %8s %8s %10s %11s %8s\n", "Loss", "FEC", "Frames", "Rebuilt", "NACKs", "Resent", "Max delay", "Corrupt");
+
+  for (size_t i=0; i < (sizeof(lossRates) / sizeof(lossRates[0])); i++) {
+    passed &= simulateFragments(lossRates[i], false);
+    passed &= simulateFragments(lossRates[i], true);
+  }
+
+  printf("Fragment simulation: %s\n", passed ? "ok" : "FAILED");
+  return passed;
+}
+
+//==============================================================================//
+//The receiver's audio buffer before the ring buffer, kept here for comparison.
+
+#define LEGACY_CB_SIZE 110250
+
+typedef struct {
+    uint8_t* buffer;
+    int head;
+    int tail;
+    int maxlen;
+} circ_buf_t;
+
+int cbPush (circ_buf_t* c, uint8_t data) {
+  int next;
+
+  next = c->head + 1;  // next is where head will point to after this write.
+  
+  if (next >= c->maxlen) {
+    next = 0;
+  }
+
+  if (next == c->tail) {  // if the head + 1 == tail, circular buffer is full
+    return -1;
+  }
+
+  c->buffer[c->head] = data;  // Load data and then move
+  c->head = next;             // head to next data offset.
+  return 0;  // return success to indicate successful push.
+}
+
+int cbPop (circ_buf_t* c, uint8_t* data) {
+  int next;
+
+  if (c->head == c->tail) {  // if the head == tail, we don't have any data
+    return -1;
+  }
+
+  next = c->tail + 1;  // next is where tail will point to after this read.
+  if(next >= c->maxlen) {
+    next = 0;
+  }
+
+  *data = c->buffer[c->tail];  // Read data and then move
+  c->tail = next;              // tail to next offset.
+  return 0;  // return success to indicate successful pop.
+}
+
+//==============================================================================//
+//Checks the ring buffer on its own and with a producer and a consumer thread
+//moving spans of odd lengths, so that they wrap around at every position. Then
+//checks the receiver's audio buffer across mono and stereo runs.
+
+#define RING_TEST_CAPACITY 1000
+#define RING_TEST_ELEMENTS 1000000
+
+bool testRingBuffer() {
+  RingBuffer<uint32_t> ring;
+  bool passed = ring.begin(RING_TEST_CAPACITY) && ring.isEmpty() && (ring.getCapacity() == RING_TEST_CAPACITY);
+  std::vector<uint32_t> span(RING_TEST_CAPACITY + 1);
+  uint32_t pushed = 0;
+  uint32_t popped = 0;
+
+  //one thread. a push never takes more than there is room for.
+  for (uint32_t round=0; round < 10000; round++) {
+    uint32_t length = (round * 37) % (RING_TEST_CAPACITY + 1);
+
+    for (uint32_t i=0; i < length; i++) {
+      span[i] = pushed + i;
+    }
+
+    uint32_t vacant = ring.getVacant();
+    uint32_t count = ring.push(span.data(), length);
+    passed &= (count == ((length < vacant) ? length : vacant));
+    pushed += count;
+    passed &= (ring.getOccupied() == (pushed - popped)) && (ring.isFull() == ((pushed - popped) == RING_TEST_CAPACITY));
+
+    count = ring.pop(span.data(), (round * 53) % (RING_TEST_CAPACITY + 1));
+
+    for (uint32_t i=0; i < count; i++) {
+      passed &= (span[i] == (popped + i));
+    }
+    popped += count;
+  }
+
+  //a discard skips the oldest, the same as a pop
+  uint32_t value = 0;
+  uint32_t occupied = ring.getOccupied();
+  uint32_t discarded = ring.discard(3);
+  passed &= (discarded == ((occupied < 3) ? occupied : 3));
+  popped += discarded;
+
+  while (ring.pop(&value)) {
+    passed &= (value == popped++);
+  }
+  passed &= ring.isEmpty() && (popped == pushed) && (!ring.pop(&value)) && (ring.discard(1) == 0);
+
+  //two threads. every element must arrive once, in order.
+  bool ordered = true;
+
+  std::thread producer([&ring]() {
+    std::vector<uint32_t> data(257);
+    uint32_t next = 0;
+    uint32_t length = 1;
+
+    while (next < RING_TEST_ELEMENTS) {
+      length = (length * 7 + 3) % 257;
+      uint32_t count = ((RING_TEST_ELEMENTS - next) < length) ? (RING_TEST_ELEMENTS - next) : length;
+
+      for (uint32_t i=0; i < count; i++) {
+        data[i] = next + i;
+      }
+      next += ring.push(data.data(), count);
+    }
+  });
+
+  std::thread consumer([&ring, &ordered]() {
+    std::vector<uint32_t> data(263);
+    uint32_t next = 0;
+    uint32_t length = 1;
+
+    while (next < RING_TEST_ELEMENTS) {
+      length = (length * 11 + 5) % 263;
+      uint32_t count = ring.pop(data.data(), length);
+
+      for (uint32_t i=0; i < count; i++) {
+        ordered &= (data[i] == (next + i));
+      }
+      next += count;
+    }
+  });
+
+  producer.join();
+  consumer.join();
+  passed &= ordered && ring.isEmpty();
+
+  //the audio buffer counts a byte per tick in mono and a pair per tick in
+  //stereo, and pops each run the way it was pushed
+  AudioRingBuffer audio;
+  uint8_t mono[100];
+  uint8_t stereo[100];
+  uint8_t left[AUDIO_RING_BLOCK_TICKS];
+  uint8_t right[AUDIO_RING_BLOCK_TICKS];
+  passed &= audio.begin(250) && audio.isEmpty();
+
+  for (int i=0; i < 100; i++) {
+    mono[i] = uint8_t(i);
+    stereo[i] = uint8_t(((i % 2) == 0) ? (100 + (i / 2)) : (200 + (i / 2)));
+  }
+  passed &= audio.push(mono, 100, false) && audio.push(stereo, 100, true) && audio.push(mono, 30, false);
+  passed &= (audio.getOccupiedTicks() == 180) && (audio.getVacantBytes() == 20);
+  passed &= (!audio.push(mono, 21, false)) && (audio.getOccupiedTicks() == 180);
+
+  uint32_t ticks = 0;
+  uint32_t count = 0;
+
+  while ((count = audio.pop(left, right, AUDIO_RING_BLOCK_TICKS)) > 0) {
+    for (uint32_t i=0; i < count; i++) {
+      uint32_t tick = ticks + i;
+
+      if ((tick < 100) || (tick >= 150)) {
+        uint8_t expected = uint8_t((tick < 100) ? tick : (tick - 150));
+        passed &= (left[i] == expected) && (right[i] == expected);
+      }
+      else {
+        passed &= (left[i] == (100 + (tick - 100))) && (right[i] == (200 + (tick - 100)));
+      }
+    }
+    ticks += count;
+  }
+  passed &= (ticks == 180) && audio.isEmpty() && (audio.getOccupiedTicks() == 0);
+
+  //a flush drops every run, and the next push starts where the producer left off
+  passed &= audio.push(stereo, 99, true) && audio.push(mono, 10, false) && (audio.getOccupiedTicks() == 59);
+  audio.discardAll();
+  passed &= audio.isEmpty() && (audio.getOccupiedTicks() == 0);
+  passed &= audio.push(stereo, 4, true) && (audio.pop(left, right, 4) == 2);
+  passed &= (left[0] == 100) && (right[0] == 200) && (left[1] == 101) && (right[1] == 201);
+
+  printf("Ring buffer checks: %s\n", passed ? "ok" : "FAILED");
+  return passed;
+}
+
+//==============================================================================//
+//Measures how many samples a second go through the legacy buffer and the ring
+//buffer, a sample at a time and in spans. A frame is pushed, then popped.
+
+bool benchmarkRingBuffer() {
+  printf("\nRing buffer, frames of %d samples\n", BENCHMARK_FRAME_SAMPLES);
+  bool passed = testRingBuffer();
+
+  const uint32_t rounds = 2000;
+  std::vector<uint8_t> frame(BENCHMARK_FRAME_SAMPLES);
+  uint32_t checksum = 0;
+
+  for (uint32_t i=0; i < BENCHMARK_FRAME_SAMPLES; i++) {
+    frame[i] = uint8_t(i * 31);
+  }
+
+  //cbPush and cbPop, a sample per call
+  circ_buf_t legacy;
+  legacy.buffer = (uint8_t*) malloc(LEGACY_CB_SIZE + 1);
+  legacy.head = 0;
+  legacy.tail = 0;
+  legacy.maxlen = LEGACY_CB_SIZE + 1;
+
+  double startTime = secondsNow();
+
+  for (uint32_t round=0; round < rounds; round++) {
+    uint8_t sample = 0;
+
+    for (uint32_t i=0; i < BENCHMARK_FRAME_SAMPLES; i++) {
+      cbPush(&legacy, frame[i]);
+    }
+    while (cbPop(&legacy, &sample) == 0) {
+      checksum += sample;
+    }
+  }
+
+  double legacyTime = secondsNow() - startTime;
+  free(legacy.buffer);
+
+  //the ring buffer, a sample per call and in spans
+  const uint32_t spanLengths[] = {1, 64, BENCHMARK_FRAME_SAMPLES};
+  RingBuffer<uint8_t> ring;
+  ring.begin(LEGACY_CB_SIZE);
+
+  printf("%-22s %12s %8s\n", "Buffer", "Msamples/s", "Speedup");
+  printf("%-22s %12.1f %8s\n", "cbPush/cbPop", (double(rounds) * BENCHMARK_FRAME_SAMPLES) / legacyTime / 1e6, "1.0x");
+
+  for (size_t k=0; k < (sizeof(spanLengths) / sizeof(spanLengths[0])); k++) {
+    std::vector<uint8_t> span(spanLengths[k]);
+    startTime = secondsNow();
+
+    for (uint32_t round=0; round < rounds; round++) {
+      //the network side pushes whole frames, the output side pops spans
+      if (spanLengths[k] == 1) {
+        for (uint32_t i=0; i < BENCHMARK_FRAME_SAMPLES; i++) {
+          ring.push(frame[i]);
+        }
+      }
+      else {
+        ring.push(frame.data(), BENCHMARK_FRAME_SAMPLES);
+      }
+
+      uint32_t count = 0;
+
+      if (spanLengths[k] == 1) {
+        while (ring.pop(span.data())) {
+          checksum += span[0];
+        }
+      }
+      else {
+        while ((count = ring.pop(span.data(), spanLengths[k])) > 0) {
+          checksum += span[count - 1];
+        }
+      }
+    }
+
+    double ringTime = secondsNow() - startTime;
+    char name[32];
+    snprintf(name, sizeof(name), "RingBuffer, span %u", spanLengths[k]);
+    printf("%-22s %12.1f %7.1fx\n", name, (double(rounds) * BENCHMARK_FRAME_SAMPLES) / ringTime / 1e6, legacyTime / ringTime);
+  }
+
+  printf("(checksum %u)\n", checksum);
+  return passed;
+}
+
+//==============================================================================//
+//The receiver's playback in the jitter buffer simulation.
+
+struct JitterResult {
+  uint32_t firstSoundTime;  //ms from the first request
+  uint32_t underruns;
+  uint32_t lateUnderruns;   //in the second half of the run
+  double meanDepth;         //ms of audio buffered while playing, the latency
+  int32_t driftPpm;         //correction at the end
+};
+
+#define JITTER_SIM_DURATION 3600000   //ms
+#define JITTER_SIM_SAMPLE_RATE 11025
+#define JITTER_SIM_FRAME_SAMPLES 11025
+#define JITTER_SIM_CAPACITY 110250
+#define JITTER_SIM_SERIAL_TIME 225    //ms to move a frame over serial
+#define JITTER_SIM_CREDIT_WINDOW 4
+
+//------------------------------------------------------------------------------//
+//A receiver asking for frames over a link with jitter and stalls, from a source
+//that is as fast as needed, or that makes the samples at its own clock. The
+//legacy receiver fills the whole buffer before playing, and keeps it full.
+//The adaptive one uses the jitter buffer.
+
+bool simulateJitter(const char* name, bool adaptive, double hiccupRate, double sourcePpm, JitterResult* result) {
+  JitterBuffer* jitter = new JitterBuffer();
+  std::vector<uint32_t> arrivalTimes;   //frames on the way, in order
+  uint32_t random = 0x9E3779B9;
+  uint32_t serialFreeTime = 0;
+  uint32_t framesRequested = 0;
+  uint32_t creditOutstanding = 0;
+  uint32_t depth = 0;
+  bool playing = false;
+  bool started = false;
+  double playbackPosition = 0;  //fraction of a sample played
+  double depthSum = 0;
+  uint32_t depthCount = 0;
+
+  jitter->configure(JITTER_SIM_SAMPLE_RATE, JITTER_SIM_FRAME_SAMPLES, JITTER_SIM_CAPACITY);
+  memset(result, 0, sizeof(JitterResult));
+
+  for (uint32_t now=0; now < JITTER_SIM_DURATION; now++) {
+    //ask for frames
+    uint32_t creditGrant = 0;
+    uint32_t framesVacant = (JITTER_SIM_CAPACITY - depth) / JITTER_SIM_FRAME_SAMPLES;
+    framesVacant = (framesVacant > creditOutstanding) ? (framesVacant - creditOutstanding) : 0;
+
+    if (adaptive) {
+      creditGrant = jitter->getFramesWanted(depth, creditOutstanding);
+      creditGrant = (creditGrant < framesVacant) ? creditGrant : framesVacant;
+    }
+    else {
+      creditGrant = framesVacant;
+    }
+    creditGrant = ((creditOutstanding + creditGrant) > JITTER_SIM_CREDIT_WINDOW) ? (JITTER_SIM_CREDIT_WINDOW - creditOutstanding) : creditGrant;
+
+    //the frames go over serial one after the other, and over Wi-Fi with jitter
+    //and the odd stall. a source with its own clock has the frame ready only
+    //once it has made all of its samples.
+    for (uint32_t i=0; i < creditGrant; i++) {
+      uint32_t startTime = (serialFreeTime > now) ? serialFreeTime : now;
+
+      if (sourcePpm != 0) {
+        uint32_t readyTime = uint32_t(((framesRequested + 1) * 1000.0 * JITTER_SIM_FRAME_SAMPLES / JITTER_SIM_SAMPLE_RATE) * (1 + sourcePpm * 1e-6));
+        startTime = (readyTime > startTime) ? readyTime : startTime;
+      }
+
+      serialFreeTime = startTime + JITTER_SIM_SERIAL_TIME;
+      uint32_t wifiDelay = 5 + (nextRandom(&random) % 30);
+
+      if ((nextRandom(&random) % 100000) < uint32_t(hiccupRate * 100000)) {
+        wifiDelay += 300 + (nextRandom(&random) % 1200);
+      }
+
+      uint32_t arrivalTime = serialFreeTime + wifiDelay;
+      arrivalTime = (!arrivalTimes.empty() && (arrivalTimes.back() > arrivalTime)) ? arrivalTimes.back() : arrivalTime;
+      arrivalTimes.push_back(arrivalTime);
+      framesRequested++;
+    }
+
+    if (creditGrant > 0) {
+      creditOutstanding += creditGrant;
+      jitter->addRequests(now, creditGrant);
+    }
+
+    //frames arrive
+    while (!arrivalTimes.empty() && (arrivalTimes.front() <= now)) {
+      arrivalTimes.erase(arrivalTimes.begin());
+      depth += JITTER_SIM_FRAME_SAMPLES;
+      depth = (depth > JITTER_SIM_CAPACITY) ? JITTER_SIM_CAPACITY : depth;
+      creditOutstanding--;
+      jitter->addFrame(now);
+    }
+
+    //start playing
+    if (!playing) {
+      bool ready = adaptive ? jitter->isReady(depth) : ((JITTER_SIM_CAPACITY - depth) < JITTER_SIM_FRAME_SAMPLES);
+
+      if (ready) {
+        playing = true;
+
+        if (!started) {
+          result->firstSoundTime = now;
+          started = true;
+        }
+      }
+    }
+
+    jitter->update(now, depth, playing);
+
+    //play, faster or slower by the drift correction
+    if (playing) {
+      double rate = JITTER_SIM_SAMPLE_RATE * (1 + (adaptive ? (jitter->getDriftPpm() * 1e-6) : 0)) / 1000.0;
+      playbackPosition += rate;
+      uint32_t played = uint32_t(playbackPosition);
+      playbackPosition -= played;
+
+      if (played >= depth) {
+        depth = 0;
+        playing = false;
+        result->underruns++;
+        result->lateUnderruns += (now >= (JITTER_SIM_DURATION / 2)) ? 1 : 0;
+
+        if (adaptive) {
+          jitter->addUnderrun();
+        }
+      }
+      else {
+        depth -= played;
+      }
+
+      depthSum += depth * 1000.0 / JITTER_SIM_SAMPLE_RATE;
+      depthCount++;
+    }
+  }
+
+  result->meanDepth = (depthCount > 0) ? (depthSum / depthCount) : 0;
+  result->driftPpm = adaptive ? jitter->getDriftPpm() : 0;
+
+  printf("%-28s %-8s %8u ms %5u/%-5u %9.0f ms %8d\n", name, adaptive ? "adaptive" : "legacy", result->firstSoundTime,
+    result->underruns, result->lateUnderruns, result->meanDepth, result->driftPpm);
+
+  delete jitter;
+  return true;
+}
+
+//------------------------------------------------------------------------------//
+//Compares the receivers on a link with stalls, and with a source whose clock is
+//slower than the receiver's. The adaptive receiver must start sooner and play
+//with less latency, and must not drop out once it has adapted. Then checks that
+//the drift correction slows down and speeds up playback.
+
+bool benchmarkJitter() {
+  JitterResult legacy;
+  JitterResult adaptive;
+  bool passed = true;
+
+  printf("\nJitter buffer, %d s simulated\n", JITTER_SIM_DURATION / 1000);
+  printf("%-28s %-8s %11s %9s %12s %8s\n", "Link", "Buffer", "First sound", "Underruns", "Latency", "Drift");
+
+  simulateJitter("Stalls on 5% of frames", false, 0.05, 0, &legacy);
+  simulateJitter("Stalls on 5% of frames", true, 0.05, 0, &adaptive);
+  passed &= (adaptive.firstSoundTime < legacy.firstSoundTime) && (adaptive.meanDepth < legacy.meanDepth) &&
+            (adaptive.lateUnderruns == 0);
+
+  simulateJitter("Source clock 300 ppm slower", false, 0.01, 300, &legacy);
+  simulateJitter("Source clock 300 ppm slower", true, 0.01, 300, &adaptive);
+  passed &= (adaptive.firstSoundTime < legacy.firstSoundTime) && (adaptive.meanDepth < legacy.meanDepth) &&
+            (adaptive.lateUnderruns == 0) && (adaptive.driftPpm <= 0);
+
+  //the drift correction on its own, with the depth held below and then above
+  //the range it should be in
+  JitterBuffer* jitter = new JitterBuffer();
+  int32_t slowPpm;
+  int32_t fastPpm;
+
+  jitter->configure(JITTER_SIM_SAMPLE_RATE, JITTER_SIM_FRAME_SAMPLES, JITTER_SIM_CAPACITY);
+
+  for (uint32_t i=0; i < 16; i++) {
+    jitter->addRequests(i * 1000, 1);
+    jitter->addFrame((i * 1000) + 250);
+  }
+
+  for (uint32_t now=0; now <= 120000; now += 10) {
+    jitter->update(now, jitter->getLowWatermark() / 4, true);
+  }
+  slowPpm = jitter->getDriftPpm();
+
+  for (uint32_t now=120000; now <= 240000; now += 10) {
+    jitter->update(now, jitter->getHighWatermark() + JITTER_SIM_FRAME_SAMPLES, true);
+  }
+  fastPpm = jitter->getDriftPpm();
+  delete jitter;
+
+  printf("Drift correction, buffer low %d ppm, high %d ppm\n", slowPpm, fastPpm);
+  passed &= (slowPpm < 0) && (fastPpm > 0);
+
+  printf("Jitter buffer simulation: %s\n", passed ? "ok" : "FAILED");
+  return passed;
+}
+
+//==============================================================================//
+//The whole link, from the server to the receiver's output.
+
+#define LINK_BENCHMARK_DURATION 120000  //ms simulated for each link
+
+//------------------------------------------------------------------------------//
+
+void printLinkResult(const char* name, const LinkResult& result) {
+  printf("%-30s %8u ms %8.0f/s %5.0f%% %6.0f ms %6u ms %9u %6u %7u\n", name, result.firstSampleTime, result.throughput,
+    result.serialLoad * 100, result.roundTripMean, result.roundTripMax, result.underruns, result.framesLost, result.framesCorrupt);
+}
+
+//------------------------------------------------------------------------------//
+//Runs the chain over a few links and both request modes. The samples must always
+//arrive in order. On a clean link at the default baud rate, playback must keep
+//up and never stop in either mode. With a few losses, no frame may be lost. A
+//serial link too slow for PCM must be enough with ADPCM.
+
+bool benchmarkLink() {
+  LinkConfig clean;
+  clean.baudRate = 500000;
+  clean.creditWindow = 4;
+  clean.codec = FRAME_CODEC_PCM_U8;
+  clean.channelCount = 1;
+  clean.fec = true;
+  clean.udpLoss = 0;
+  clean.udpReorder = 0;
+  clean.udpLatency = 2000;
+  clean.udpJitter = 3000;
+  clean.udpBandwidth = 1000000;
+  clean.udpPacketOverhead = 200;
+  clean.frameSize = REQUEST_SIZE;
+  clean.duration = LINK_BENCHMARK_DURATION;
+  clean.seed = 0x1B873593;
+
+  LinkConfig handshake = clean;
+  handshake.creditWindow = 0;
+
+  LinkConfig lossy = clean;
+  lossy.udpLoss = 0.01;
+  lossy.udpReorder = 0.02;
+
+  LinkConfig handshakeLossy = lossy;
+  handshakeLossy.creditWindow = 0;
+
+  LinkConfig veryLossy = lossy;
+  veryLossy.udpLoss = 0.05;
+
+  LinkConfig slowSerial = clean;
+  slowSerial.baudRate = 57600;
+
+  LinkConfig slowSerialAdpcm = slowSerial;
+  slowSerialAdpcm.codec = FRAME_CODEC_IMA_ADPCM;
+
+  LinkResult handshakeResult, creditResult, handshakeLossyResult, lossyResult, veryLossyResult, slowResult, slowAdpcmResult;
+  bool passed = true;
+
+  printf("\nLink simulation, %d s each, %d sample/s playback\n", LINK_BENCHMARK_DURATION / 1000, LINK_SIM_SAMPLE_RATE);
+  printf("%-30s %11s %10s %6s %9s %9s %9s %6s %7s\n", "Link", "First sound", "Received", "Serial", "RTT", "Max RTT",
+    "Underruns", "Lost", "Corrupt");
+
+  simulateLink(handshake, &handshakeResult);
+  printLinkResult("RD?, 500 kbaud", handshakeResult);
+  simulateLink(clean, &creditResult);
+  printLinkResult("Credit, 500 kbaud", creditResult);
+  simulateLink(handshakeLossy, &handshakeLossyResult);
+  printLinkResult("RD?, 1% loss, reordering", handshakeLossyResult);
+  simulateLink(lossy, &lossyResult);
+  printLinkResult("Credit, 1% loss, reordering", lossyResult);
+  simulateLink(veryLossy, &veryLossyResult);
+  printLinkResult("Credit, 5% loss, reordering", veryLossyResult);
+  simulateLink(slowSerial, &slowResult);
+  printLinkResult("Credit, 57600 baud", slowResult);
+  simulateLink(slowSerialAdpcm, &slowAdpcmResult);
+  printLinkResult("Credit, 57600 baud, ADPCM", slowAdpcmResult);
+
+  passed &= (handshakeResult.framesCorrupt == 0) && (creditResult.framesCorrupt == 0) && (handshakeLossyResult.framesCorrupt == 0) &&
+            (lossyResult.framesCorrupt == 0) && (veryLossyResult.framesCorrupt == 0) && (slowResult.framesCorrupt == 0);
+  passed &= (handshakeResult.underruns == 0) && (handshakeResult.throughput >= (LINK_SIM_SAMPLE_RATE * 0.98)) &&
+            (creditResult.underruns == 0) && (creditResult.throughput >= (LINK_SIM_SAMPLE_RATE * 0.98));
+  passed &= (handshakeLossyResult.framesLost == 0) && (lossyResult.framesLost == 0);
+  passed &= (slowResult.underruns > 0) && (slowAdpcmResult.underruns == 0);
+
+  printf("Link simulation: %s\n", passed ? "ok" : "FAILED");
+  return passed;
+}
+
+//==============================================================================//
+//Compares frame sizes on a slow, lossy radio link, where the airtime of a packet
+//is mostly overhead. The fragment layout of each size is worked out at compile
+//time by FrameLayout. The capacity is the no. of samples/s the air could carry
+//with PCM frames and the parity fragment, and the load is the share of the
+//airtime the simulated link used at the playback rate.
+
+#define FRAME_SIZE_DURATION 60000     //ms simulated for each frame size
+#define FRAME_SIZE_BANDWIDTH 250000   //bytes/s of airtime
+#define FRAME_SIZE_PACKET_OVERHEAD 400  //us of airtime per packet
+
+struct FrameSizeCase {
+  const char* name;
+  uint32_t frameSize;
+  uint32_t fragmentCount;
+  uint32_t lastFragmentDataSize;
+  uint32_t wireSize;
+};
+
+#define FRAME_SIZE_CASE(name, size) {name, FrameLayout<size>::getFrameSize(), FrameLayout<size>::getFragmentCount(), \
+                                     FrameLayout<size>::getLastFragmentDataSize(), FrameLayout<size>::getWireSize()}
+
+bool benchmarkFrameSize() {
+  const FrameSizeCase cases[] = {
+    FRAME_SIZE_CASE("Classic", PROTOCOL_CLASSIC_FRAME_SIZE),
+    FRAME_SIZE_CASE("Aligned, 8 fragments", PROTOCOL_ALIGNED_FRAME_SIZE),
+    FRAME_SIZE_CASE("Aligned, 7 fragments", 7 * PROTOCOL_FRAGMENT_DATA_SIZE),
+    FRAME_SIZE_CASE("Aligned, 4 fragments", 4 * PROTOCOL_FRAGMENT_DATA_SIZE),
+    FRAME_SIZE_CASE("A byte over 2 fragments", (2 * PROTOCOL_FRAGMENT_DATA_SIZE) + 1),
+  };
+
+  LinkConfig config;
+  config.baudRate = 500000;
+  config.creditWindow = 4;
+  config.codec = FRAME_CODEC_PCM_U8;
+  config.channelCount = 1;
+  config.fec = true;
+  config.udpLoss = 0.01;
+  config.udpReorder = 0;
+  config.udpLatency = 2000;
+  config.udpJitter = 3000;
+  config.udpBandwidth = FRAME_SIZE_BANDWIDTH;
+  config.udpPacketOverhead = FRAME_SIZE_PACKET_OVERHEAD;
+  config.duration = FRAME_SIZE_DURATION;
+  config.seed = 0x1B873593;
+
+  bool passed = true;
+  double classicCapacity = 0.0;
+  double classicLoad = 0.0;
+
+  printf("\nFrame sizes, %d s each, %d bytes/s and %d us per packet of airtime, 1%% loss\n", FRAME_SIZE_DURATION / 1000,
+    FRAME_SIZE_BANDWIDTH, FRAME_SIZE_PACKET_OVERHEAD);
+  printf("%-24s %6s %9s %9s %8s %11s %6s %9s %9s %6s\n", "Frame", "Bytes", "Fragments", "Last", "Samples", "Capacity",
+    "Load", "Packets", "Underruns", "Lost");
+
+  for (size_t i=0; i < (sizeof(cases) / sizeof(cases[0])); i++) {
+    const FrameSizeCase& frameCase = cases[i];
+    uint32_t packets = frameCase.fragmentCount + 1; //and the parity fragment
+    uint32_t samples = frameCase.frameSize - PROTOCOL_FRAME_HEADER_SIZE;
+    uint32_t parityLength = PROTOCOL_FRAGMENT_HEADER_SIZE + ((frameCase.fragmentCount > 1) ? PROTOCOL_FRAGMENT_DATA_SIZE : frameCase.frameSize);
+    double airTime = ((double(packets) * FRAME_SIZE_PACKET_OVERHEAD) / 1000000.0) +
+                     (double(frameCase.wireSize + parityLength) / FRAME_SIZE_BANDWIDTH);
+    double capacity = samples / airTime;
+    LinkResult result;
+
+    config.frameSize = frameCase.frameSize;
+    simulateLink(config, &result);
+
+    printf("%-24s %6u %9u %9u %8.0f %9.0f/s %5.2f%% %7.1f/s %9u %6u\n", frameCase.name, frameCase.frameSize,
+      frameCase.fragmentCount, frameCase.lastFragmentDataSize, double(samples) / packets, capacity, result.udpLoad * 100,
+      result.packetsSent / (FRAME_SIZE_DURATION / 1000.0), result.underruns, result.framesLost);
+
+    if (i == 0) {
+      classicCapacity = capacity;
+      classicLoad = result.udpLoad;
+    }
+    else if (i == 1) {
+      //the aligned frame carries more in the same packets
+      passed &= (capacity > classicCapacity) && (result.udpLoad < classicLoad);
+    }
+    passed &= (result.framesCorrupt == 0) && (result.framesLost == 0);
+  }
+
+  printf("Frame sizes: %s\n", passed ? "ok" : "FAILED");
+  return passed;
+}
+
+//==============================================================================//
+//Checks the histogram buckets and percentiles against known values, and that
+//counters and histograms updated from several threads lose nothing.
+
+#define METRICS_TEST_THREADS 4
+#define METRICS_TEST_UPDATES 1000000
+
+bool testMetrics() {
+  MetricHistogram histogram;
+  bool passed = (histogram.getPercentile(50) == 0);
+
+  //0 goes below 1, 1 below 2, 2 and 3 below 4, and so on
+  const uint32_t values[] = {0, 1, 2, 3, 4, 7, 8, 100000};
+  const int bucketOf[] = {0, 1, 2, 2, 3, 3, 4, METRICS_HISTOGRAM_BUCKETS - 1};
+
+  for (size_t i=0; i < (sizeof(values) / sizeof(values[0])); i++) {
+    uint32_t before = histogram.getBucket(bucketOf[i]);
+    histogram.record(values[i]);
+    passed &= (histogram.getBucket(bucketOf[i]) == (before + 1));
+  }
+  passed &= (histogram.getCount() == 8) && (histogram.getSum() == 100025) && (histogram.getMax() == 100000);
+  passed &= (histogram.getPercentile(50) == 4) && (histogram.getPercentile(75) == 8) && (histogram.getPercentile(100) == 100000);
+
+  MetricsLine line("histogram");
+  line.add("test_ms", histogram);
+  passed &= (strstr(line.getText(), "histogram name=test_ms count=8 sum=100025 max=100000 p50=4") == line.getText());
+  passed &= (strstr(line.getText(), " lt4=2 lt8=2 ") != NULL) && (strstr(line.getText(), " inf=1") != NULL);
+
+  MetricCounter counter;
+  MetricHistogram shared;
+  std::vector<std::thread> threads;
+
+  for (int t=0; t < METRICS_TEST_THREADS; t++) {
+    threads.push_back(std::thread([&counter, &shared, t]() {
+      for (uint32_t i=0; i < METRICS_TEST_UPDATES; i++) {
+        counter.increment();
+        shared.record(((i * 7) + t) & 1023);
+      }
+    }));
+  }
+  for (size_t t=0; t < threads.size(); t++) {
+    threads[t].join();
+  }
+
+  uint32_t bucketTotal = 0;
+
+  for (int i=0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+    bucketTotal += shared.getBucket(i);
+  }
+  passed &= (counter.get() == (METRICS_TEST_THREADS * METRICS_TEST_UPDATES)) &&
+            (shared.getCount() == (METRICS_TEST_THREADS * METRICS_TEST_UPDATES)) &&
+            (bucketTotal == shared.getCount()) && (shared.getMax() == 1023);
+
+  printf("Metrics checks: %s\n", passed ? "ok" : "FAILED");
+  return passed;
+}
+
+//==============================================================================//
+//Measures the cost of an update, from one thread, which is how the firmware uses
+//them, and from several threads on the same metric, which is the worst case.
+
+bool benchmarkMetrics() {
+  printf("\nMetrics\n");
+  bool passed = testMetrics();
+
+  const uint32_t updates = 10000000;
+  MetricCounter counter;
+  MetricHistogram histogram;
+
+  double startTime = secondsNow();
+
+  for (uint32_t i=0; i < updates; i++) {
+    counter.add(i & 15);
+  }
+
+  double counterTime = secondsNow() - startTime;
+  startTime = secondsNow();
+
+  for (uint32_t i=0; i < updates; i++) {
+    histogram.record(i & 4095);
+  }
+
+  double histogramTime = secondsNow() - startTime;
+  MetricHistogram sharedHistogram;
+  std::vector<std::thread> threads;
+  startTime = secondsNow();
+
+  for (int t=0; t < METRICS_TEST_THREADS; t++) {
+    threads.push_back(std::thread([&sharedHistogram, updates]() {
+      for (uint32_t i=0; i < (updates / METRICS_TEST_THREADS); i++) {
+        sharedHistogram.record(i & 4095);
+      }
+    }));
+  }
+  for (size_t t=0; t < threads.size(); t++) {
+    threads[t].join();
+  }
+
+  double sharedTime = secondsNow() - startTime;
+
+  printf("%-32s %10s\n", "Update", "ns");
+  printf("%-32s %10.1f\n", "Counter", counterTime * 1e9 / updates);
+  printf("%-32s %10.1f\n", "Histogram", histogramTime * 1e9 / updates);
+  printf("%-32s %10.1f\n", "Histogram, 4 threads", sharedTime * 1e9 / updates);
+  printf("(checksum %u %u)\n", counter.get(), histogram.getSum() + sharedHistogram.getSum());
+  return passed;
+}
+
+//==============================================================================//
+//Writes a 16-bit WAV file with the test signal on every channel.
+
+bool writeTestWav(const char* path, uint32_t sampleRate, uint16_t channelCount, uint32_t seconds) {
+  uint32_t frameCount = sampleRate * seconds;
+  uint32_t dataLength = frameCount * channelCount * 2;
+  uint8_t header[44];
+  std::vector<float> signal(frameCount);
+  std::vector<int16_t> samples(size_t(frameCount) * channelCount);
+
+  fillTestSignal(signal.data(), frameCount, sampleRate);
+
+  for (uint32_t i=0; i < frameCount; i++) {
+    for (uint16_t c=0; c < channelCount; c++) {
+      samples[(size_t(i) * channelCount) + c] = int16_t(lrintf(signal[i] * 32767.0f));
+    }
+  }
+
+  const uint32_t fields[] = {36 + dataLength, 16, uint32_t(WAV_FORMAT_PCM | (channelCount << 16)), sampleRate,
+                             sampleRate * channelCount * 2, uint32_t((channelCount * 2) | (16 << 16)), dataLength};
+  memcpy(&header[0], "RIFF", 4);
+  memcpy(&header[8], "WAVEfmt ", 8);
+  memcpy(&header[36], "data", 4);
+
+  for (int i=0; i < 7; i++) {
+    int offset = (i == 0) ? 4 : ((i == 6) ? 40 : (12 + (i * 4)));
+
+    for (int b=0; b < 4; b++) {
+      header[offset + b] = uint8_t(fields[i] >> (b * 8));
+    }
+  }
+
+  FILE* file = fopen(path, "wb");
+
+  if (file == NULL) {
+    return false;
+  }
+
+  bool written = (fwrite(header, 1, sizeof(header), file) == sizeof(header)) &&
+                 (fwrite(samples.data(), 2, samples.size(), file) == samples.size());
+  written &= (fclose(file) == 0);
+  return written;
+}
+
+//==============================================================================//
+//Takes all the frames of the playlist from the pipeline, like the server's
+//serial stage does. With a frame interval the frames are taken no faster than
+//that, as if written to a serial port.
+
+struct PipelineResult {
+  uint32_t frameCount;
+  uint64_t sampleCount;
+  uint32_t trackEnds;
+  uint32_t streamEnds;
+  uint32_t stereoFrames;
+  bool streamEndLast; //the only stream end is on the last frame
+  bool tracksInOrder; //the track ends are in playlist order
+  uint32_t framesNotReady;  //after the first frame
+  double seconds;
+  double readerUtilization;
+  double dspUtilization;
+  double writerWaitShare; //of the writer's time
+};
+
+bool runPipeline(const Playlist& playlist, uint8_t codec, uint8_t channelCount, uint32_t frameInterval,
+                 PipelineResult* result) {
+  FramePipeline pipeline;
+  PipelineConfig config;
+  config.frameSamples = BENCHMARK_FRAME_SAMPLES;
+  config.sampleRate = BENCHMARK_SAMPLE_RATE;
+  config.resamplerQuality = RESAMPLER_QUALITY_MEDIUM;
+  config.codec = codec;
+  config.channelCount = channelCount;
+  config.preferMapped = true;
+  config.printTracks = false;
+  config.firstTrack = 0;
+  config.firstTrackOffset = 0;
+
+  memset(result, 0, sizeof(PipelineResult));
+  result->tracksInOrder = true;
+
+  double startTime = secondsNow();
+  double waitTime = 0.0;
+  int lastTrackIndex = -1;
+  bool streamEnded = false;
+
+  if (!pipeline.start(&playlist, NULL, config)) {
+    return false;
+  }
+
+  while (true) {
+    if ((result->frameCount > 0) && (!streamEnded) && (pipeline.getFramesReady() == 0)) {
+      result->framesNotReady++;
+    }
+
+    double waitStartTime = secondsNow();
+    PipelineFrame* frame = pipeline.getFrame(1000);
+    waitTime += secondsNow() - waitStartTime;
+
+    if (frame == NULL) {
+      break;
+    }
+
+    result->frameCount++;
+    result->sampleCount += (uint32_t(frame->data[0]) << 8) | frame->data[1];
+    result->streamEndLast = false;
+    result->stereoFrames += (frame->data[3] & FRAME_FLAG_STEREO) ? 1 : 0;
+
+    if (frame->data[3] & FRAME_FLAG_TRACK_END) {
+      result->trackEnds++;
+      result->tracksInOrder &= (frame->trackIndex > lastTrackIndex);
+      lastTrackIndex = frame->trackIndex;
+    }
+    if (frame->data[3] & FRAME_FLAG_STREAM_END) {
+      result->streamEnds++;
+      result->streamEndLast = true;
+      streamEnded = true;
+    }
+    pipeline.releaseFrame(frame);
+
+    if (frameInterval > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(frameInterval));
+    }
+  }
+
+  result->seconds = secondsNow() - startTime;
+  result->readerUtilization = pipeline.getReaderStage().getUtilization();
+  result->dspUtilization = pipeline.getDspStage().getUtilization();
+  result->writerWaitShare = waitTime / result->seconds;
+  result->streamEndLast &= (result->streamEnds == 1);
+  pipeline.stop();
+  return true;
+}
+
+//==============================================================================//
+//Loads a playlist with a byte order mark, CRLF line ends, comments and empty
+//lines. A path is longer than a read block, the CR of a line is the last byte
+//of a block and its NL the first of the next, and a comment crosses the end of
+//a block. Then the track cache has to find an unchanged file after a save and a
+//load, and miss it once the size or the modification time has changed.
+
+bool testPlaylist() {
+  const char* playlistPath = "AUDIFI-Benchmark-playlist.m3u";
+  const char* cachePath = "AUDIFI-Benchmark-cache.txt";
+  const char* trackPath = "AUDIFI-Benchmark-track.wav";
+  const size_t blockSize = PLAYLIST_READ_BLOCK_SIZE;
+
+  std::vector<std::string> expected;
+  expected.push_back("first.wav");
+  expected.push_back("second.wav");
+  expected.push_back("long-" + std::string(blockSize, 'a') + ".wav");
+
+  std::string text = "\xEF\xBB\xBF#EXTM3U\r\nfirst.wav\r\n\r\n# a comment\r\nsecond.wav\n" + expected[2] + "\r\n";
+
+  //the CR ends the second block
+  expected.push_back("crlf-" + std::string((2 * blockSize) - 1 - text.size() - 9, 'b') + ".wav");
+  text += expected[3] + "\r\n";
+
+  //the comment starts 50 bytes before the end of the third block
+  expected.push_back("fill-" + std::string((3 * blockSize) - 50 - text.size() - 10, 'c') + ".wav");
+  text += expected[4] + "\n# " + std::string(100, 'd') + "\n";
+
+  expected.push_back("last.wav"); //no NL after the last line
+  text += expected[5];
+
+  FILE* file = fopen(playlistPath, "wb");
+  bool passed = (file != NULL) && (fwrite(text.data(), 1, text.size(), file) == text.size());
+  passed &= (file != NULL) && (fclose(file) == 0);
+
+  Playlist playlist;
+  passed &= playlist.load(playlistPath) && (playlist.getCount() == expected.size());
+
+  for (size_t i=0; passed && (i < expected.size()); i++) {
+    passed &= (expected[i] == playlist.getPath(i));
+  }
+  passed &= (text[(2 * blockSize) - 1] == '\r') && (text[2 * blockSize] == '\n');
+
+  //the format is cached, saved and loaded again
+  WavFormat format;
+  AudioSource* source = writeTestWav(trackPath, BENCHMARK_SAMPLE_RATE, 1, 1) ? openAudioSource(trackPath) : NULL;
+  passed &= (source != NULL) && parseWav(source, &format);
+  delete source;
+  remove(cachePath);
+
+  TrackCache cache;
+  TrackInfo info;
+  passed &= (!cache.load(cachePath)) && (!cache.lookup(trackPath, &info));
+  passed &= cache.store(trackPath, format) && cache.save();
+
+  TrackCache loaded;
+  passed &= loaded.load(cachePath) && (loaded.getCount() == 1) && loaded.lookup(trackPath, &info);
+  passed &= (info.format.dataOffset == format.dataOffset) && (info.format.dataLength == format.dataLength) &&
+            (info.format.sampleRate == format.sampleRate) && (info.duration == 1000);
+
+  //the same size, but an hour older
+  uint64_t size = 0;
+  int64_t modifiedTime = 0;
+  struct utimbuf times;
+  passed &= getFileStatus(trackPath, &size, &modifiedTime);
+  times.actime = time_t(modifiedTime - 3600);
+  times.modtime = time_t(modifiedTime - 3600);
+  passed &= (utime(trackPath, &times) == 0) && (!loaded.lookup(trackPath, &info)) && (loaded.find(trackPath) != NULL);
+
+  //a stored entry is found again, until the file grows
+  passed &= loaded.store(trackPath, format) && loaded.lookup(trackPath, &info);
+  file = fopen(trackPath, "ab");
+  passed &= (file != NULL) && (fputc(0, file) == 0);
+  passed &= (file != NULL) && (fclose(file) == 0);
+  passed &= (utime(trackPath, &times) == 0) && (!loaded.lookup(trackPath, &info));
+
+  remove(playlistPath);
+  remove(cachePath);
+  remove(trackPath);
+
+  printf("Playlist checks: %s\n", passed ? "ok" : "FAILED");
+  return passed;
+}
+
+//==============================================================================//
+//Runs the frame pipeline on a playlist that has to be resampled and on one that
+//doesn't, with both codecs, and checks that every sample comes out and that the
+//track and stream ends are flagged on the right frames. Then the frames are
+//taken at a steady pace, and each one should be ready by the time it's taken.
+
+#define PIPELINE_TEST_SECONDS 20    //length of the file played at the output rate
+#define PIPELINE_FRAME_INTERVAL 5   //ms between frames for the paced run
+
+bool benchmarkPipeline() {
+  printf("\nFrame pipeline\n");
+  bool passed = testPlaylist();
+
+  const char* resampledPath = "AUDIFI-Benchmark-44100.wav";
+  const char* directPath = "AUDIFI-Benchmark-11025.wav";
+
+  if ((!writeTestWav(resampledPath, 44100, 2, BENCHMARK_AUDIO_SECONDS)) ||
+      (!writeTestWav(directPath, BENCHMARK_SAMPLE_RATE, 1, PIPELINE_TEST_SECONDS))) {
+    printf("Could not write the test files\n");
+    remove(resampledPath);
+    remove(directPath);
+    return false;
+  }
+
+  //a file that can't be opened is skipped without a gap
+  Playlist resampled;
+  resampled.add(resampledPath);
+  resampled.add("AUDIFI-Benchmark-missing.wav");
+  resampled.add(resampledPath);
+  resampled.add(resampledPath);
+
+  Playlist direct;
+  direct.add(directPath);
+  direct.add(directPath);
+
+  const uint32_t trackCount = 3;
+  const uint64_t resampledSamples = uint64_t(trackCount) * BENCHMARK_AUDIO_SECONDS * BENCHMARK_SAMPLE_RATE;
+  const uint64_t directSamples = uint64_t(2) * PIPELINE_TEST_SECONDS * BENCHMARK_SAMPLE_RATE;
+
+  struct Run {
+    const char* name;
+    const Playlist* playlist;
+    uint8_t codec;
+    uint32_t frameInterval;
+  };
+
+  const Run runs[] = {
+    {"44.1 kHz stereo, PCM", &resampled, FRAME_CODEC_PCM_U8, 0},
+    {"44.1 kHz stereo, ADPCM", &resampled, FRAME_CODEC_IMA_ADPCM, 0},
+    {"11025 Hz mono, PCM", &direct, FRAME_CODEC_PCM_U8, 0},
+    {"11025 Hz mono, ADPCM", &direct, FRAME_CODEC_IMA_ADPCM, 0},
+    {"44.1 kHz stereo, PCM, paced", &resampled, FRAME_CODEC_PCM_U8, PIPELINE_FRAME_INTERVAL},
+  };
+
+  printf("%-32s %10s %8s %8s %8s %10s\n", "Run", "frames/s", "reader", "DSP", "writer", "not ready");
+
+  for (size_t i=0; i < (sizeof(runs) / sizeof(runs[0])); i++) {
+    PipelineResult result;
+    bool resampling = (runs[i].playlist == &resampled);
+    uint32_t tracks = resampling ? trackCount : 2;
+    uint64_t expected = resampling ? resampledSamples : directSamples;
+
+    if (!runPipeline(*runs[i].playlist, runs[i].codec, 1, runs[i].frameInterval, &result)) {
+      printf("%-32s could not start\n", runs[i].name);
+      passed = false;
+      continue;
+    }
+
+    //the filter's delay is flushed at the end of each track, so the resampled
+    //output is a little longer
+    bool samplesOk = resampling ? ((result.sampleCount >= expected) && (result.sampleCount <= (expected + (expected / 100)))) :
+                                  (result.sampleCount == expected);
+    bool flagsOk = (result.trackEnds == tracks) && result.streamEndLast && result.tracksInOrder;
+    bool readyOk = (runs[i].frameInterval == 0) || (result.framesNotReady == 0);
+
+    printf("%-32s %10.0f %7.0f%% %7.0f%% %7.0f%% %10u%s\n", runs[i].name, result.frameCount / result.seconds,
+      result.readerUtilization * 100.0, result.dspUtilization * 100.0, (1.0 - result.writerWaitShare) * 100.0,
+      result.framesNotReady, (samplesOk && flagsOk && readyOk) ? "" : "  FAILED");
+
+    if (!samplesOk) {
+      printf("  %llu samples, expected %llu\n", (unsigned long long) result.sampleCount, (unsigned long long) expected);
+    }
+    passed &= samplesOk && flagsOk && readyOk;
+  }
+
+  remove(resampledPath);
+  remove(directPath);
+
+  printf("Frame pipeline: %s\n", passed ? "ok" : "FAILED");
+  return passed;
+}
+
+//==============================================================================//
+//Negotiates the link with the loopback device the way the server does, against
+//devices with different capabilities, and checks that both sides agree on the
+//expected settings and options. A device that corrupts the test pattern above a rate has to
+//end up at the fastest rate below it, and one that only says YES! has to get PCM.
+
+#ifndef _WIN32
+
+bool benchmarkNegotiation() {
+  printf("\nLink negotiation\n");
+
+  const uint8_t allCodecs = PROTOCOL_CODEC_PCM_U8 | PROTOCOL_CODEC_IMA_ADPCM;
+  const uint8_t allOptions = PROTOCOL_OPTION_CHECKED_FRAMES | PROTOCOL_OPTION_CONTROL | PROTOCOL_OPTION_STEREO;
+
+  struct Run {
+    const char* name;
+    LinkCapabilities device;
+    uint32_t workingBaudRate;   //0 if the device holds every rate
+    uint32_t maxBaudRate;       //fastest rate the server tries
+    uint8_t preferredCodec;
+    LinkSettings expected;
+  };
+
+  const Run runs[] = {
+    {"All rates", {PROTOCOL_VERSION, PROTOCOL_ALL_BAUDRATES, REQUEST_SIZE, allCodecs}, 0, 2000000,
+      FRAME_CODEC_IMA_ADPCM, {2000000, REQUEST_SIZE, FRAME_CODEC_IMA_ADPCM, allOptions}},
+    {"Fails above 1M", {PROTOCOL_VERSION, PROTOCOL_ALL_BAUDRATES, REQUEST_SIZE, allCodecs}, 1000000, 2000000,
+      FRAME_CODEC_PCM_U8, {1000000, REQUEST_SIZE, FRAME_CODEC_PCM_U8, allOptions}},
+    {"Fails above base", {PROTOCOL_VERSION, PROTOCOL_ALL_BAUDRATES, REQUEST_SIZE, allCodecs}, PROTOCOL_BASE_BAUDRATE, 2000000,
+      FRAME_CODEC_PCM_U8, {PROTOCOL_BASE_BAUDRATE, REQUEST_SIZE, FRAME_CODEC_PCM_U8, allOptions}},
+    {"921600, small frames, PCM", {PROTOCOL_VERSION, 0x03, 4000, PROTOCOL_CODEC_PCM_U8}, 0, 2000000,
+      FRAME_CODEC_IMA_ADPCM, {921600, 4000, FRAME_CODEC_PCM_U8, allOptions}},
+    {"Server limited to base", {PROTOCOL_VERSION, PROTOCOL_ALL_BAUDRATES, REQUEST_SIZE, allCodecs}, 0, PROTOCOL_BASE_BAUDRATE,
+      FRAME_CODEC_PCM_U8, {PROTOCOL_BASE_BAUDRATE, REQUEST_SIZE, FRAME_CODEC_PCM_U8, allOptions}},
+    {"Version 2 device", {2, PROTOCOL_ALL_BAUDRATES, REQUEST_SIZE, allCodecs}, 0, 2000000,
+      FRAME_CODEC_PCM_U8, {2000000, REQUEST_SIZE, FRAME_CODEC_PCM_U8, PROTOCOL_OPTION_CHECKED_FRAMES}},
+    {"Version 0 device, ADPCM asked", {0, 0, 0, 0}, 0, 2000000,
+      FRAME_CODEC_IMA_ADPCM, {PROTOCOL_BASE_BAUDRATE, PROTOCOL_CLASSIC_FRAME_SIZE, FRAME_CODEC_PCM_U8, 0}},
+  };
+
+  //a plain YES! is firmware from before the codecs, which only plays PCM
+  LinkCapabilities plain;
+  bool passed = parseCapabilities("YES!", &plain) && (plain.version == 0) && (plain.codecs == PROTOCOL_CODEC_PCM_U8) &&
+                (plain.frameSize == PROTOCOL_CLASSIC_FRAME_SIZE);
+  printf("%-32s %10s %8s %6s %8s\n", "Device", "baud", "frame", "codec", "ms");
+
+  for (size_t i=0; i < (sizeof(runs) / sizeof(runs[0])); i++) {
+    const Run& run = runs[i];
+    LoopbackDevice device(REQUEST_HEADER_SIZE, REQUEST_DATA_SIZE, PROTOCOL_BASE_BAUDRATE, false);
+    device.setCapabilities(run.device, run.workingBaudRate);
+
+    if (!device.start()) {
+      printf("%-32s could not start the loopback device\n", run.name);
+      passed = false;
+      continue;
+    }
+
+    SerialTransport* port = createSerialTransport();
+    LinkCapabilities local = {PROTOCOL_VERSION, 0, REQUEST_SIZE, allCodecs};
+    LinkCapabilities remote;
+    LinkSettings settings = {0, 0, 0, 0};
+
+    for (int j=0; j < PROTOCOL_BAUDRATE_COUNT; j++) {
+      local.baudRates |= (protocolBaudRates[j] <= run.maxBaudRate) ? uint8_t(1 << j) : 0;
+    }
+
+    double startTime = secondsNow();
+    bool negotiated = port->open(device.getPortName(), PROTOCOL_BASE_BAUDRATE) &&
+                      queryLinkCapabilities(port, 1000, &remote) &&
+                      negotiateLink(port, local, remote, run.preferredCodec, PROTOCOL_BASE_BAUDRATE, &settings);
+    double handshakeTime = secondsNow() - startTime;
+
+    //a version 0 device has no LINK#, so it's only ready once it's answered
+    uint32_t waitTime = 0;
+
+    while ((!device.isLinkReady()) && (waitTime < 2000)) {
+      sleepMillis(10);
+      waitTime += 10;
+    }
+
+    const LinkSettings& deviceSettings = device.getLinkSettings();
+    bool settingsOk = negotiated && (settings.baudRate == run.expected.baudRate) &&
+                      (settings.frameSize == run.expected.frameSize) && (settings.codec == run.expected.codec) &&
+                      (settings.options == run.expected.options);
+    bool agreed = (run.device.version == 0) ||
+                  ((deviceSettings.baudRate == settings.baudRate) && (deviceSettings.frameSize == settings.frameSize) &&
+                   (deviceSettings.codec == settings.codec) && (deviceSettings.options == settings.options));
+
+    printf("%-32s %10lu %8u %6u %8.0f%s\n", run.name, (unsigned long) settings.baudRate, unsigned(settings.frameSize),
+      unsigned(settings.codec), handshakeTime * 1000.0, (settingsOk && agreed) ? "" : "  FAILED");
+    passed &= settingsOk && agreed;
+
+    port->close();
+    delete port;
+    device.stop();
+  }
+
+  printf("Link negotiation: %s\n", passed ? "ok" : "FAILED");
+  return passed;
+}
+
+//==============================================================================//
+//Looks for the loopback device among ports that are missing or never answer,
+//the way the server does without --port. The device has to be found, and well
+//within a second, since the ports are probed at the same time.
+
+#define DISCOVERY_SILENT_PORTS 4  //pseudo terminals nobody answers on
+#define DISCOVERY_MAX_TIME 500    //ms the discovery may take
+
+bool benchmarkDiscovery() {
+  printf("\nLink discovery\n");
+
+  LoopbackDevice device(REQUEST_HEADER_SIZE, REQUEST_DATA_SIZE, PROTOCOL_BASE_BAUDRATE, false);
+
+  if (!device.start()) {
+    printf("Could not start the loopback device\n");
+    return false;
+  }
+
+  std::vector<std::string> portNames;
+  std::vector<int> silentFds;
+  portNames.push_back("/dev/audifi-missing");
+
+  for (int i=0; i < DISCOVERY_SILENT_PORTS; i++) {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if ((fd >= 0) && (grantpt(fd) == 0) && (unlockpt(fd) == 0) && (ptsname(fd) != NULL)) {
+      portNames.push_back(ptsname(fd));
+      silentFds.push_back(fd);
+    }
+    else if (fd >= 0) {
+      close(fd);
+    }
+    if (i == (DISCOVERY_SILENT_PORTS / 2)) {
+      portNames.push_back(device.getPortName());
+    }
+  }
+
+  LinkDiscovery discovery;
+  discovery.port = NULL;
+  double startTime = secondsNow();
+  bool found = discoverLink(portNames, PROTOCOL_ALL_BAUDRATES, 1000, &discovery);
+  double discoveryTime = secondsNow() - startTime;
+
+  //the device is waiting for the LINK# now
+  LinkSettings settings;
+  bool linked = found && negotiateLink(discovery.port, discovery.capabilities, discovery.capabilities,
+                                       FRAME_CODEC_PCM_U8, discovery.baudRate, &settings);
+
+  bool passed = found && (discovery.portName == device.getPortName()) && linked &&
+                ((discoveryTime * 1000.0) < DISCOVERY_MAX_TIME);
+
+  printf("%-32s %10s %8s\n", "Ports", "found", "ms");
+  printf("%-32d %10s %8.0f%s\n", int(portNames.size()), found ? discovery.portName.c_str() : "none",
+    discoveryTime * 1000.0, passed ? "" : "  FAILED");
+
+  if (discovery.port != NULL) {
+    discovery.port->close();
+    delete discovery.port;
+  }
+  for (size_t i=0; i < silentFds.size(); i++) {
+    close(silentFds[i]);
+  }
+  device.stop();
+
+  printf("Link discovery: %s\n", passed ? "ok" : "FAILED");
+  return passed;
+}
+
+#else
+
+bool benchmarkNegotiation() {
+  printf("\nLink negotiation needs the loopback device, which is only available on POSIX systems.\n");
+  return true;
+}
+
+bool benchmarkDiscovery() {
+  printf("\nLink discovery needs the loopback device, which is only available on POSIX systems.\n");
+  return true;
+}
+
+#endif
+
+//==============================================================================//
+//Pipes raw PCM into the live input at the rate of a capture, and builds frames
+//as the server does, with all the credit it wants. One run stalls the writer
+//halfway, as a receiver that falls behind would, and the samples that piled up
+//have to be dropped so the latency stays within the backlog.
+
+#define LIVE_BENCHMARK_MILLIS 1000    //length of the input
+#define LIVE_BENCHMARK_CHUNK 5        //ms of samples written at a time
+#define LIVE_BENCHMARK_BACKLOG 100    //ms of samples kept
+
+struct LiveResult {
+  uint32_t frameCount;
+  uint32_t sampleCount;   //samples sent
+  uint32_t samplesDropped;
+  double meanLatency;     //ms from the samples being written to the frame being built
+  double maxLatency;
+  bool streamEnded;       //the last frame was flagged
+};
+
+#ifndef _WIN32
+
+bool runLiveInput(uint32_t stallTime, LiveResult* result) {
+  memset(result, 0, sizeof(LiveResult));
+
+  int fds[2];
+
+  if (pipe(fds) != 0) {
+    return false;
+  }
+
+  const uint32_t inputRate = 48000; //whole frames in a chunk
+  const uint32_t chunkFrames = (inputRate * LIVE_BENCHMARK_CHUNK) / 1000;
+  WavFormat rawFormat = {WAV_FORMAT_PCM, 2, inputRate, 16, 4, 0, 0};
+
+  //the writer sends a sine at the rate of a capture and closes the pipe at the end
+  std::thread writer([&]() {
+    std::vector<int16_t> chunk(chunkFrames * 2);
+    uint64_t startTime = pipelineMicros();
+    uint32_t frameIndex = 0;
+
+    for (uint32_t i=0; i < (LIVE_BENCHMARK_MILLIS / LIVE_BENCHMARK_CHUNK); i++) {
+      for (uint32_t j=0; j < chunkFrames; j++, frameIndex++) {
+        int16_t sample = int16_t(8000.0 * sin(2.0 * M_PI * 440.0 * frameIndex / inputRate));
+        chunk[2 * j] = sample;
+        chunk[(2 * j) + 1] = sample;
+      }
+      if (write(fds[1], &chunk[0], chunk.size() * sizeof(int16_t)) < 0) {
+        break;
+      }
+
+      uint64_t dueTime = startTime + ((uint64_t(i) + 1) * LIVE_BENCHMARK_CHUNK * 1000);
+      uint64_t now = pipelineMicros();
+
+      if (dueTime > now) {
+        std::this_thread::sleep_for(std::chrono::microseconds(dueTime - now));
+      }
+    }
+    close(fds[1]);
+  });
+
+  LiveConfig config = {BENCHMARK_SAMPLE_RATE, RESAMPLER_QUALITY_MEDIUM, FRAME_CODEC_PCM_U8, 128, LIVE_BENCHMARK_BACKLOG};
+  LiveInput input;
+  bool started = input.begin(fds[0], rawFormat, config);
+  double latencySum = 0.0;
+  PipelineFrame frame;
+  uint64_t startTime = pipelineMicros();
+  bool stalled = false;
+
+  while (started && (!input.isFinished())) {
+    uint64_t captureTime = 0;
+
+    if ((!stalled) && (stallTime > 0) && ((pipelineMicros() - startTime) >= (LIVE_BENCHMARK_MILLIS * 1000 / 4))) {
+      sleepMillis(stallTime);
+      stalled = true;
+    }
+    if (input.buildFrame(&frame, REQUEST_DATA_SIZE, 100, &captureTime) == 0) {
+      continue;
+    }
+
+    double latency = double(pipelineMicros() - captureTime) / 1000.0;
+    latencySum += latency;
+    result->maxLatency = (latency > result->maxLatency) ? latency : result->maxLatency;
+    result->frameCount++;
+    result->sampleCount += (uint32_t(frame.data[0]) << 8) | frame.data[1];
+    result->streamEnded = ((frame.data[3] & FRAME_FLAG_STREAM_END) != 0);
+  }
+
+  if (!started) {
+    close(fds[0]);
+  }
+  writer.join();
+
+  result->samplesDropped = input.getSamplesDropped();
+  result->meanLatency = (result->frameCount > 0) ? (latencySum / result->frameCount) : 0.0;
+  input.close();
+  return started;
+}
+
+//==============================================================================//
+//Every sample has to be sent or counted as dropped. A receiver that keeps up
+//loses none and gets them within a few chunks on average, and one that stalls for longer
+//than the backlog still never has a frame older than the backlog and a little.
+
+bool benchmarkLiveInput() {
+  printf("\nLive input\n");
+  printf("%-24s %8s %8s %8s %8s %8s\n", "Receiver", "frames", "samples", "dropped", "mean ms", "max ms");
+
+  struct Run {
+    const char* name;
+    uint32_t stallTime;  //ms the writer stops for
+  };
+
+  const Run runs[] = {
+    {"Keeping up", 0},
+    {"Stalls for 300 ms", 300},
+  };
+
+  bool passed = true;
+
+  for (size_t i=0; i < (sizeof(runs) / sizeof(runs[0])); i++) {
+    LiveResult result;
+    bool ran = runLiveInput(runs[i].stallTime, &result);
+    uint32_t inputSamples = (BENCHMARK_SAMPLE_RATE * LIVE_BENCHMARK_MILLIS) / 1000;
+    uint32_t accounted = result.sampleCount + result.samplesDropped;
+
+    //the filter adds a few samples at the end, and its rounding can lose one
+    bool ok = ran && result.streamEnded && (accounted >= (inputSamples - 1)) && (accounted <= (inputSamples + 64));
+
+    if (runs[i].stallTime == 0) {
+      ok &= (result.samplesDropped == 0) && (result.meanLatency < ((4 * LIVE_BENCHMARK_CHUNK) + 5)) &&
+            (result.maxLatency < LIVE_BENCHMARK_BACKLOG);
+    }
+    else {
+      ok &= (result.samplesDropped > 0) && (result.maxLatency < (LIVE_BENCHMARK_BACKLOG + 20));
+    }
+
+    printf("%-24s %8u %8u %8u %8.1f %8.1f%s\n", runs[i].name, result.frameCount, result.sampleCount,
+      result.samplesDropped, result.meanLatency, result.maxLatency, ok ? "" : "  FAILED");
+    passed &= ok;
+  }
+
+  printf("Live input: %s\n", passed ? "ok" : "FAILED");
+  return passed;
+}
+
+#else
+
+bool benchmarkLiveInput() {
+  printf("\nThe live input benchmark pipes its input, which is only done on POSIX systems.\n");
+  return true;
+}
+
+#endif
+
+//==============================================================================//
+//Checks the CRC of checked frames against its known value and the bytewise
+//reference, and measures both. Then streams checked frames to the loopback
+//device, which damages some of them. Every frame has to end up in the emulated
+//buffer whole and in order, and the frames asked for again must not hold up
+//the ones after them for long.
+
+#define FRAME_CHECK_CRC_BYTES (1 << 20)     //bytes the CRC is measured on
+#define FRAME_CHECK_CRC_PASSES 64
+#define FRAME_CHECK_FRAMES 100              //frames streamed in a run
+#define FRAME_CHECK_FRAME_SAMPLES 500       //small, so the emulated buffer doesn't fill
+#define FRAME_CHECK_BAUDRATE 2000000
+
+struct FrameCheckResult {
+  double sendTime;        //s to send all the frames once
+  uint32_t framesResent;  //RS# answered
+  LoopbackCheckStats device;
+  uint32_t digest;        //what the device's digest should be
+};
+
+bool testFrameCrc() {
+  const uint8_t checkInput[] = "123456789";
+  bool passed = (crc32Update(0, checkInput, 9) == 0xCBF43926) && (crc32UpdateBytewise(0, checkInput, 9) == 0xCBF43926) &&
+                (crc32Update(crc32Update(0, checkInput, 4), checkInput + 4, 5) == 0xCBF43926);
+
+  //every length around the 8-byte steps, at every alignment
+  uint8_t buffer[80];
+  uint32_t state = 1;
+
+  for (uint32_t i=0; i < sizeof(buffer); i++) {
+    buffer[i] = uint8_t(nextRandom(&state));
+  }
+  for (uint32_t offset=0; offset < 8; offset++) {
+    for (uint32_t length=0; length <= (sizeof(buffer) - offset); length++) {
+      passed &= (crc32Update(0, buffer + offset, length) == crc32UpdateBytewise(0, buffer + offset, length));
+    }
+  }
+  return passed;
+}
+
+#ifndef _WIN32
+
+bool runFrameCheck(uint32_t errorInterval, FrameCheckResult* result) {
+  memset(result, 0, sizeof(FrameCheckResult));
+
+  LoopbackDevice device(REQUEST_HEADER_SIZE, FRAME_CHECK_FRAME_SAMPLES, PROTOCOL_BASE_BAUDRATE, false);
+  device.setErrorInterval(errorInterval);
+
+  if (!device.start()) {
+    return false;
+  }
+
+  SerialTransport* port = createSerialTransport();
+  LinkCapabilities local = {PROTOCOL_VERSION, PROTOCOL_ALL_BAUDRATES, REQUEST_SIZE, PROTOCOL_CODEC_PCM_U8};
+  LinkCapabilities remote;
+  LinkSettings settings;
+
+  bool linked = port->open(device.getPortName(), PROTOCOL_BASE_BAUDRATE) &&
+                queryLinkCapabilities(port, 1000, &remote) &&
+                negotiateLink(port, local, remote, FRAME_CODEC_PCM_U8, PROTOCOL_BASE_BAUDRATE, &settings) &&
+                (settings.options & PROTOCOL_OPTION_CHECKED_FRAMES);
+
+  //the frames are sent as the server sends them, and RS# is answered from the
+  //history. once all are sent, the requests are answered until none comes.
+  FrameHistory history;
+  uint8_t frame[REQUEST_HEADER_SIZE + FRAME_CHECK_FRAME_SAMPLES];
+  char line[PROTOCOL_LINE_MAX_LENGTH];
+  uint32_t credit = 0;
+  uint32_t framesSent = 0;
+  uint32_t noiseState = 7;
+  double startTime = secondsNow();
+
+  while (linked) {
+    bool allSent = (framesSent == FRAME_CHECK_FRAMES);
+    int length = port->readLine(line, sizeof(line), ((credit > 0) && (!allSent)) ? 0 : (allSent ? 2500 : 100));
+
+    if (length < 0) {
+      linked = false;
+    }
+    else if (length > 0) {
+      uint32_t envelopeLength = 0;
+      const uint8_t* envelope = NULL;
+
+      if (strncmp(line, "RD#", 3) == 0) {
+        credit += uint32_t(atoi(&line[3]));
+      }
+      else if ((strncmp(line, "RS#", 3) == 0) &&
+               ((envelope = history.find(uint8_t(atoi(&line[3])), &envelopeLength)) != NULL)) {
+        port->write(envelope, envelopeLength);
+        result->framesResent++;
+      }
+      continue;
+    }
+    else if (allSent) {
+      break;
+    }
+
+    if ((credit > 0) && (!allSent)) {
+      frame[0] = uint8_t(FRAME_CHECK_FRAME_SAMPLES >> 8);
+      frame[1] = uint8_t(FRAME_CHECK_FRAME_SAMPLES);
+      frame[2] = FRAME_CODEC_PCM_U8;
+      frame[3] = (framesSent == (FRAME_CHECK_FRAMES - 1)) ? (FRAME_FLAG_TRACK_END | FRAME_FLAG_STREAM_END) : 0;
+
+      for (uint32_t i=0; i < FRAME_CHECK_FRAME_SAMPLES; i++) {
+        frame[REQUEST_HEADER_SIZE + i] = uint8_t(nextRandom(&noiseState));
+      }
+
+      //the device's digest is the CRC of the frame CRCs, in order
+      uint8_t sequence = history.getNextSequence();
+      uint32_t crc = getFrameCrc(sequence, frame, sizeof(frame));
+      uint8_t crcBytes[4] = {uint8_t(crc), uint8_t(crc >> 8), uint8_t(crc >> 16), uint8_t(crc >> 24)};
+      result->digest = crc32Update(result->digest, crcBytes, 4);
+
+      uint32_t envelopeLength = 0;
+      const uint8_t* envelope = history.add(frame, sizeof(frame), &envelopeLength);
+      linked = port->write(envelope, envelopeLength);
+      credit--;
+      framesSent++;
+
+      if (framesSent == FRAME_CHECK_FRAMES) {
+        result->sendTime = secondsNow() - startTime;
+      }
+    }
+  }
+
+  port->close();
+  delete port;
+  device.stop();
+  result->device = device.getCheckStats();
+  return framesSent == FRAME_CHECK_FRAMES;
+}
+
+#endif
+
+//==============================================================================//
+
+bool benchmarkFrameCheck() {
+  printf("\nFrame check\n");
+
+  bool passed = testFrameCrc();
+  std::vector<uint8_t> buffer(FRAME_CHECK_CRC_BYTES);
+  uint32_t state = 3;
+
+  for (size_t i=0; i < buffer.size(); i++) {
+    buffer[i] = uint8_t(nextRandom(&state));
+  }
+
+  uint32_t crc = 0;
+  double startTime = secondsNow();
+
+  for (int i=0; i < FRAME_CHECK_CRC_PASSES; i++) {
+    crc = crc32UpdateBytewise(crc, &buffer[0], FRAME_CHECK_CRC_BYTES);
+  }
+  double bytewiseTime = secondsNow() - startTime;
+  uint32_t bytewiseCrc = crc;
+
+  crc = 0;
+  startTime = secondsNow();
+
+  for (int i=0; i < FRAME_CHECK_CRC_PASSES; i++) {
+    crc = crc32Update(crc, &buffer[0], FRAME_CHECK_CRC_BYTES);
+  }
+  double sliceTime = secondsNow() - startTime;
+  passed &= (crc == bytewiseCrc);
+
+  double megabytes = double(FRAME_CHECK_CRC_BYTES) * FRAME_CHECK_CRC_PASSES / 1e6;
+  printf("%-24s %10s %12s\n", "CRC-32", "MB/s", "us/frame");
+  printf("%-24s %10.0f %12.1f\n", "Bytewise", megabytes / bytewiseTime, (bytewiseTime * 1e6 * REQUEST_SIZE) / (megabytes * 1e6));
+  printf("%-24s %10.0f %12.1f%s\n", "Slice-by-8", megabytes / sliceTime, (sliceTime * 1e6 * REQUEST_SIZE) / (megabytes * 1e6),
+    passed ? "" : "  FAILED");
+
+#ifndef _WIN32
+  struct Run {
+    const char* name;
+    uint32_t errorInterval;
+  };
+
+  const Run runs[] = {
+    {"Clean link", 0},
+    {"Every 10th frame", 10},
+    {"Every 5th frame", 5},
+  };
+
+  printf("%-24s %8s %8s %8s %8s %8s %8s\n", "Damaged", "frames", "CRC err", "resends", "lost", "skipped", "send ms");
+  double cleanTime = 0.0;
+
+  for (size_t i=0; i < (sizeof(runs) / sizeof(runs[0])); i++) {
+    FrameCheckResult result;
+    bool ran = runFrameCheck(runs[i].errorInterval, &result);
+    const LoopbackCheckStats& device = result.device;
+
+    //whole frames in order, and a damaged one only costs its own resend
+    bool ok = ran && (device.framesDelivered == FRAME_CHECK_FRAMES) && (device.digest == result.digest) &&
+              (device.framesLost == 0);
+
+    if (runs[i].errorInterval == 0) {
+      cleanTime = result.sendTime;
+      ok &= (device.framesDamaged == 0) && (result.framesResent == 0);
+    }
+    else {
+      ok &= (device.crcErrors > 0) && (result.framesResent > 0) && (result.sendTime < ((2.0 * cleanTime) + 0.2));
+    }
+
+    printf("%-24s %8u %8u %8u %8u %8u %8.0f%s\n", runs[i].name, device.framesDelivered, device.crcErrors,
+      result.framesResent, device.framesLost, device.bytesSkipped, result.sendTime * 1000.0, ok ? "" : "  FAILED");
+    passed &= ok;
+  }
+#else
+  printf("The resend runs need the loopback device, which is only available on POSIX systems.\n");
+#endif
+
+  printf("Frame check: %s\n", passed ? "ok" : "FAILED");
+  return passed;
+}
+
+//==============================================================================//
+//Checks the control messages, how they're typed in, coded, found among the
+//frames, sent again and told apart from the ones sent again. Then streams frames
+//to the loopback device with a few control messages in between, and times each
+//one from its write to its CA#. As it's written right after the frame on the
+//wire, it only waits for the frames already granted, not for all those the
+//pipeline has ready.
+
+#define CONTROL_BENCHMARK_FRAMES 60
+
+struct ControlResult {
+  double frameTime;       //s a frame takes on the wire at the rate agreed on
+  double maxLatency;      //s from a message's first write to its CA#, the longest
+  double totalLatency;
+  uint32_t acknowledged;
+  uint32_t resent;
+  uint32_t givenUp;
+  uint32_t applied;       //as the device counted them
+  bool paused;
+  int32_t gainPercent;
+  uint32_t bufferFlushes;
+};
+
+bool testControlMessages() {
+  struct Command {
+    const char* text;
+    bool valid;
+    uint8_t type;
+    int32_t value;
+  };
+
+  const Command commands[] = {
+    {"pause", true, CONTROL_PAUSE, 0},
+    {"  play \n", true, CONTROL_RESUME, 0},
+    {"next", true, CONTROL_SKIP, 1},
+    {"prev", true, CONTROL_SKIP, -1},
+    {"skip -3", true, CONTROL_SKIP, -3},
+    {"seek 1:30", true, CONTROL_SEEK, 90000},
+    {"seek 45", true, CONTROL_SEEK, 45000},
+    {"gain 50", true, CONTROL_GAIN, 50},
+    {"gain 500", false, 0, 0},
+    {"seek 1:75", false, 0, 0},
+    {"seek -5", false, 0, 0},
+    {"pauses", false, 0, 0},
+    {"next 2", false, 0, 0},
+    {"", false, 0, 0},
+  };
+
+  bool passed = true;
+
+  for (size_t i=0; i < (sizeof(commands) / sizeof(commands[0])); i++) {
+    ControlMessage message;
+    bool valid = parseControlCommand(commands[i].text, &message);
+    passed &= (valid == commands[i].valid);
+
+    if (valid && commands[i].valid) {
+      passed &= (message.type == commands[i].type) && (message.value == commands[i].value);
+    }
+  }
+
+  //both ways on the serial link and on the air, and a damaged one is refused
+  ControlMessage message = {CONTROL_SEEK, 200, 123456, 65000};
+  ControlMessage copy;
+  uint8_t envelope[CONTROL_ENVELOPE_SIZE];
+  uint8_t packet[CONTROL_PACKET_SIZE];
+
+  writeControlEnvelope(envelope, message);
+  passed &= readControlEnvelope(envelope + FRAME_CHECK_SYNC_SIZE, &copy) && (copy.type == message.type) &&
+            (copy.id == message.id) && (copy.value == message.value) && (copy.frameSequence == message.frameSequence);
+  envelope[FRAME_CHECK_SYNC_SIZE + 3] ^= 0x10;
+  passed &= !readControlEnvelope(envelope + FRAME_CHECK_SYNC_SIZE, &copy);
+
+  writeControlPacket(packet, message);
+  passed &= readControlPacket(packet, sizeof(packet), &copy) && (copy.value == message.value) &&
+            (copy.frameSequence == message.frameSequence);
+  passed &= !readControlPacket(packet, sizeof(packet) - 1, &copy);
+
+  //one search finds both sync words in the noise, and counts the noise
+  const uint8_t stream[] = {0x00, 0xA5, 0xA5, 0x5A, 0xC3, 0x5C, 0x11, 0xA5, 0x5A, 0xA5, 0x5A, 0xC3, 0x3C};
+  uint8_t matched = 0;
+  uint32_t skippedTotal = 0;
+  int found[2] = {SYNC_NONE, SYNC_NONE};
+  int foundCount = 0;
+
+  for (size_t i=0; i < sizeof(stream); i++) {
+    uint32_t skipped = 0;
+    int sync = scanSyncByte(stream[i], &matched, &skipped);
+    skippedTotal += skipped;
+
+    if ((sync != SYNC_NONE) && (foundCount < 2)) {
+      found[foundCount++] = sync;
+    }
+  }
+  passed &= (foundCount == 2) && (found[0] == SYNC_CONTROL) && (found[1] == SYNC_FRAME) && (skippedTotal == 5);
+
+  char line[PROTOCOL_LINE_MAX_LENGTH];
+  uint8_t id = 0;
+  formatControlAck(line, sizeof(line), 77);
+  passed &= parseControlAck(line, &id) && (id == 77) && (!parseControlAck("CA#300", &id));
+  formatControlLine(line, sizeof(line), message);
+  passed &= parseControlLine(line, &copy) && (copy.type == CONTROL_SEEK) && (copy.value == 123456);
+
+  //sent again until it's answered, and given up on after the last attempt
+  ControlQueue queue;
+  bool resent = false;
+  uint8_t first = queue.add(message);
+  uint8_t second = queue.add(message);
+  passed &= queue.getDue(0, &copy, &resent) && (copy.id == first) && (!resent);
+  passed &= queue.getDue(0, &copy, &resent) && (copy.id == second) && (!queue.getDue(1, &copy, &resent));
+  passed &= queue.acknowledge(second) && (!queue.acknowledge(second));
+
+  uint32_t now = 0;
+  uint32_t sends = 1;
+
+  while (queue.getCount() > 0) {
+    now += CONTROL_RESEND_INTERVAL;
+
+    if (queue.getDue(now, &copy, &resent)) {
+      passed &= resent && (copy.id == first);
+      sends++;
+    }
+  }
+  passed &= (sends == CONTROL_SEND_ATTEMPTS) && (queue.getGivenUp() == 1);
+
+  //a resend is only acted on once, and the first message is new whatever its id
+  ControlFilter filter;
+  passed &= filter.accept(200) && (!filter.accept(200)) && filter.accept(202) && (!filter.accept(201));
+  filter.reset();
+  passed &= filter.accept(0) && filter.accept(1) && (!filter.accept(0));
+  return passed;
+}
+
+#ifndef _WIN32
+
+bool runControl(ControlResult* result) {
+  memset(result, 0, sizeof(ControlResult));
+
+  LoopbackDevice device(REQUEST_HEADER_SIZE, FRAME_CHECK_FRAME_SAMPLES, PROTOCOL_BASE_BAUDRATE, false);
+
+  if (!device.start()) {
+    return false;
+  }
+
+  SerialTransport* port = createSerialTransport();
+  LinkCapabilities local = {PROTOCOL_VERSION, PROTOCOL_ALL_BAUDRATES, REQUEST_SIZE, PROTOCOL_CODEC_PCM_U8};
+  LinkCapabilities remote;
+  LinkSettings settings;
+
+  bool linked = port->open(device.getPortName(), PROTOCOL_BASE_BAUDRATE) &&
+                queryLinkCapabilities(port, 1000, &remote) &&
+                negotiateLink(port, local, remote, FRAME_CODEC_PCM_U8, PROTOCOL_BASE_BAUDRATE, &settings) &&
+                (settings.options & PROTOCOL_OPTION_CONTROL);
+
+  //the messages and the frame each one is written after
+  struct Control {
+    uint32_t afterFrame;
+    const char* command;
+  };
+
+  const Control controls[] = {
+    {10, "gain 50"},
+    {15, "pause"},
+    {18, "resume"},
+    {30, "seek 0:10"},
+  };
+  const uint32_t controlCount = sizeof(controls) / sizeof(controls[0]);
+
+  ControlQueue queue;
+  double sendTimes[256] = {0.0};
+  uint32_t controlsAdded = 0;
+  uint8_t frame[REQUEST_HEADER_SIZE + FRAME_CHECK_FRAME_SAMPLES];
+  uint8_t envelope[CONTROL_ENVELOPE_SIZE];
+  char line[PROTOCOL_LINE_MAX_LENGTH];
+  FrameHistory history;
+  uint32_t credit = 0;
+  uint32_t framesSent = 0;
+
+  while (linked) {
+    bool allSent = (framesSent == CONTROL_BENCHMARK_FRAMES);
+    bool controlsDone = (controlsAdded == controlCount) && (queue.getCount() == 0);
+    int length = port->readLine(line, sizeof(line), ((credit > 0) && (!allSent)) ? 0 : (allSent ? 500 : 20));
+
+    if (length < 0) {
+      linked = false;
+    }
+    else if (length > 0) {
+      uint8_t id = 0;
+      uint32_t envelopeLength = 0;
+      const uint8_t* resend = NULL;
+
+      if (strncmp(line, "RD#", 3) == 0) {
+        credit += uint32_t(atoi(&line[3]));
+      }
+      else if ((strncmp(line, "RS#", 3) == 0) && ((resend = history.find(uint8_t(atoi(&line[3])), &envelopeLength)) != NULL)) {
+        port->write(resend, envelopeLength);
+      }
+      else if (parseControlAck(line, &id) && queue.acknowledge(id)) {
+        double latency = secondsNow() - sendTimes[id];
+        result->maxLatency = (latency > result->maxLatency) ? latency : result->maxLatency;
+        result->totalLatency += latency;
+        result->acknowledged++;
+      }
+    }
+    else if (allSent && controlsDone) {
+      break;
+    }
+
+    //a message is added once its frame is written, and sent again until its CA#
+    if ((controlsAdded < controlCount) && (framesSent >= controls[controlsAdded].afterFrame)) {
+      ControlMessage message;
+      parseControlCommand(controls[controlsAdded].command, &message);
+      queue.add(message);
+      controlsAdded++;
+    }
+
+    ControlMessage message;
+    bool resent = false;
+
+    while (linked && queue.getDue(uint32_t(secondsNow() * 1000.0), &message, &resent)) {
+      if (!resent) {
+        sendTimes[message.id] = secondsNow();
+      }
+      result->resent += resent ? 1 : 0;
+      linked = port->write(envelope, writeControlEnvelope(envelope, message));
+    }
+
+    if ((credit > 0) && (!allSent)) {
+      frame[0] = uint8_t(FRAME_CHECK_FRAME_SAMPLES >> 8);
+      frame[1] = uint8_t(FRAME_CHECK_FRAME_SAMPLES);
+      frame[2] = FRAME_CODEC_PCM_U8;
+      frame[3] = 0;
+      memset(frame + REQUEST_HEADER_SIZE, 128, FRAME_CHECK_FRAME_SAMPLES);
+
+      uint32_t envelopeLength = 0;
+      const uint8_t* checked = history.add(frame, sizeof(frame), &envelopeLength);
+      linked = port->write(checked, envelopeLength);
+      result->frameTime = (envelopeLength * 10.0) / settings.baudRate;
+      credit--;
+      framesSent++;
+    }
+  }
+
+  port->close();
+  delete port;
+  device.stop();
+
+  result->givenUp = queue.getGivenUp();
+  result->applied = device.getControlsApplied();
+  result->paused = device.isPaused();
+  result->gainPercent = device.getGainPercent();
+  result->bufferFlushes = device.getCheckStats().bufferFlushes;
+  return (framesSent == CONTROL_BENCHMARK_FRAMES) && (controlsAdded == controlCount);
+}
+
+#endif
+
+//==============================================================================//
+
+bool benchmarkControl() {
+  printf("\nControl messages\n");
+
+  bool passed = testControlMessages();
+  printf("%-24s %s\n", "Parsing and coding", passed ? "ok" : "FAILED");
+
+#ifndef _WIN32
+  ControlResult result;
+  bool ran = runControl(&result);
+
+  //each one applied once, and it only waited behind the frames already granted
+  bool ok = ran && (result.acknowledged == 4) && (result.givenUp == 0) && (result.applied == 4) && (!result.paused) &&
+            (result.gainPercent == 50) && (result.bufferFlushes == 1) &&
+            (result.maxLatency < (((LOOPBACK_CREDIT_WINDOW + 1) * result.frameTime) + 0.05));
+
+  printf("%-24s %8s %8s %8s %8s %8s\n", "Loopback", "acked", "resent", "frame ms", "avg ms", "max ms");
+  printf("%-24s %8u %8u %8.2f %8.2f %8.2f%s\n", "4 messages", result.acknowledged, result.resent, result.frameTime * 1000.0,
+    (result.acknowledged > 0) ? (result.totalLatency * 1000.0 / result.acknowledged) : 0.0, result.maxLatency * 1000.0,
+    ok ? "" : "  FAILED");
+  passed &= ok;
+#else
+  printf("The loopback run needs the loopback device, which is only available on POSIX systems.\n");
+#endif
+
+  printf("Control messages: %s\n", passed ? "ok" : "FAILED");
+  return passed;
+}
+
+//==============================================================================//
+//Stereo frames, from the converter to the link.
+
+#define STEREO_TEST_FRAMES 1000       //frames given to the converter in each format
+#define STEREO_TEST_SECONDS 20        //length of the test files
+#define STEREO_MAX_DSP_SHARE 0.1      //of real time the DSP stage may take for stereo
+#define STEREO_MAX_SERIAL_LOAD 0.6    //share of the serial link stereo may take at the base rate
+
+//------------------------------------------------------------------------------//
+//Converts a signal whose right channel is the left one upside down, with every
+//kernel, and from 8-bit mono and 3-channel float. Each output sample must be
+//within an 8-bit step of its own channel, so no kernel mixes or swaps them.
+
+bool testStereoConverter() {
+  std::vector<int16_t> input(STEREO_TEST_FRAMES * 2);
+  std::vector<uint8_t> output(STEREO_TEST_FRAMES * 2);
+  std::vector<uint8_t> expected(STEREO_TEST_FRAMES * 2);
+  bool passed = true;
+
+  for (uint32_t i=0; i < STEREO_TEST_FRAMES; i++) {
+    input[i * 2] = int16_t(int32_t((i * 331) % 65536) - 32768);
+    input[(i * 2) + 1] = int16_t(-1 - input[i * 2]);
+  }
+
+  //rounded to the nearest step, the dither moves it by at most one
+  for (uint32_t i=0; i < (STEREO_TEST_FRAMES * 2); i++) {
+    int32_t rounded = (int32_t(input[i]) + 32768 + 128) >> 8;
+    expected[i] = uint8_t((rounded > 255) ? 255 : rounded);
+  }
+
+  printf("%-24s %8s %8s\n", "Converter", "kernel", "errors");
+
+  for (int level=KERNEL_SCALAR; level <= detectKernelLevel(); level++) {
+    WavFormat format = {WAV_FORMAT_PCM, 2, 44100, 16, 4, 0, 0};
+    SampleConverter converter;
+    converter.setKernelLevel(level);
+    converter.configure(format);
+    converter.convertStereo((const uint8_t*) &input[0], STEREO_TEST_FRAMES, &output[0]);
+
+    uint32_t errors = 0;
+
+    for (uint32_t i=0; i < (STEREO_TEST_FRAMES * 2); i++) {
+      errors += (abs(int(output[i]) - int(expected[i])) > 1) ? 1 : 0;
+    }
+    printf("%-24s %8s %8u%s\n", "16-bit stereo", converter.getKernelName(), errors, (errors == 0) ? "" : "  FAILED");
+    passed &= (errors == 0);
+  }
+
+  //a mono file is played on both channels
+  std::vector<uint8_t> monoInput(STEREO_TEST_FRAMES);
+  WavFormat monoFormat = {WAV_FORMAT_PCM, 1, 11025, 8, 1, 0, 0};
+  SampleConverter monoConverter;
+  monoConverter.configure(monoFormat);
+
+  for (uint32_t i=0; i < STEREO_TEST_FRAMES; i++) {
+    monoInput[i] = uint8_t(i * 7);
+  }
+  monoConverter.convertStereo(&monoInput[0], STEREO_TEST_FRAMES, &output[0]);
+
+  uint32_t monoErrors = 0;
+
+  for (uint32_t i=0; i < STEREO_TEST_FRAMES; i++) {
+    monoErrors += ((output[i * 2] != monoInput[i]) || (output[(i * 2) + 1] != monoInput[i])) ? 1 : 0;
+  }
+  printf("%-24s %8s %8u%s\n", "8-bit mono", "-", monoErrors, (monoErrors == 0) ? "" : "  FAILED");
+  passed &= (monoErrors == 0);
+
+  //only the front left and right of a file with more channels are played
+  std::vector<float> floatInput(STEREO_TEST_FRAMES * 3);
+  WavFormat floatFormat = {WAV_FORMAT_FLOAT, 3, 48000, 32, 12, 0, 0};
+  SampleConverter floatConverter;
+  floatConverter.configure(floatFormat);
+
+  for (uint32_t i=0; i < STEREO_TEST_FRAMES; i++) {
+    floatInput[i * 3] = input[i * 2] / 32768.0f;
+    floatInput[(i * 3) + 1] = input[(i * 2) + 1] / 32768.0f;
+    floatInput[(i * 3) + 2] = 1.0f;
+  }
+  floatConverter.convertStereo((const uint8_t*) &floatInput[0], STEREO_TEST_FRAMES, &output[0]);
+
+  uint32_t floatErrors = 0;
+
+  for (uint32_t i=0; i < (STEREO_TEST_FRAMES * 2); i++) {
+    floatErrors += (abs(int(output[i]) - int(expected[i])) > 1) ? 1 : 0;
+  }
+  printf("%-24s %8s %8u%s\n", "Float, 3 channels", floatConverter.getKernelName(), floatErrors,
+    (floatErrors == 0) ? "" : "  FAILED");
+  passed &= (floatErrors == 0);
+  return passed;
+}
+
+//------------------------------------------------------------------------------//
+//Checks that an older receiver is only sent mono. A receiver's VER# has to be
+//read back, a stereo frame folded to mono has half the samples, each the
+//average of its pair, and the fan-out ring has to know the oldest receiver,
+//counting one that hasn't sent a VER# yet as version 0.
+
+bool testStereoFallback() {
+  char line[PROTOCOL_LINE_MAX_LENGTH];
+  uint8_t version = 0;
+  formatReceiverVersion(line, sizeof(line), PROTOCOL_VERSION);
+  bool passed = parseReceiverVersion(line, &version) && (version == PROTOCOL_VERSION);
+  passed &= (!parseReceiverVersion("VER#", &version)) && (!parseReceiverVersion("VER#4x", &version)) &&
+            (!parseReceiverVersion("VER#256", &version)) && (!parseReceiverVersion("YES!", &version));
+
+  uint8_t frame[4 + 10] = {0, 10, FRAME_CODEC_PCM_U8, FRAME_FLAG_STEREO | FRAME_FLAG_TRACK_END};
+
+  for (int i=0; i < 10; i++) {
+    frame[4 + i] = uint8_t(((i % 2) == 0) ? (i * 20) : 255);
+  }
+
+  uint16_t length = downmixStereoFrame(frame, sizeof(frame));
+  passed &= (length == (4 + 5)) && (frame[0] == 0) && (frame[1] == 5) && (frame[3] == FRAME_FLAG_TRACK_END);
+
+  for (int i=0; i < 5; i++) {
+    passed &= (frame[4 + i] == uint8_t((i * 40 + 255 + 1) / 2));
+  }
+  passed &= (downmixStereoFrame(frame, length) == length) && (frame[1] == 5); //mono is left as it is
+
+  FanOut fanOut(FAN_OUT_UNICAST);
+  passed &= (fanOut.getMinClientVersion() == PROTOCOL_VERSION);
+  fanOut.registerClient(1, 0);
+  fanOut.setClientVersion(1, PROTOCOL_STEREO_VERSION, 0);
+  passed &= (fanOut.getMinClientVersion() == PROTOCOL_STEREO_VERSION);
+  fanOut.registerClient(2, 0);
+  passed &= (fanOut.getMinClientVersion() == 0);
+  fanOut.setClientVersion(2, PROTOCOL_CONTROL_VERSION, 0);
+  passed &= (fanOut.getMinClientVersion() == PROTOCOL_CONTROL_VERSION);
+  fanOut.expireClients(FAN_OUT_CLIENT_TIMEOUT);
+  passed &= (fanOut.getClientCount() == 0) && (fanOut.getMinClientVersion() == PROTOCOL_VERSION);
+
+  printf("%-24s %s\n", "Older receiver", passed ? "ok" : "FAILED");
+  return passed;
+}
+
+//------------------------------------------------------------------------------//
+//Checks the converter, then measures the CPU time and the link bandwidth of
+//stereo against mono. The pipeline has to give twice the samples, all in stereo
+//frames, with the DSP stage well within real time. On the simulated link at the
+//base rate, stereo has to play without a break and leave room on the serial link,
+//also with losses on the air. A serial link too slow for it must show up as
+//underruns.
+
+bool benchmarkStereo() {
+  printf("\nStereo frames\n");
+
+  bool passed = testStereoConverter();
+  passed &= testStereoFallback();
+
+  const char* resampledPath = "AUDIFI-Benchmark-Stereo-44100.wav";
+  const char* directPath = "AUDIFI-Benchmark-Stereo-11025.wav";
+
+  if ((!writeTestWav(resampledPath, 44100, 2, STEREO_TEST_SECONDS)) ||
+      (!writeTestWav(directPath, BENCHMARK_SAMPLE_RATE, 2, STEREO_TEST_SECONDS))) {
+    printf("Could not write the test files\n");
+    remove(resampledPath);
+    remove(directPath);
+    return false;
+  }
+
+  Playlist resampled;
+  resampled.add(resampledPath);
+
+  Playlist direct;
+  direct.add(directPath);
+
+  struct PipelineRun {
+    const char* name;
+    const Playlist* playlist;
+    uint8_t channelCount;
+  };
+
+  const PipelineRun pipelineRuns[] = {
+    {"44.1 kHz, mono", &resampled, 1},
+    {"44.1 kHz, stereo", &resampled, 2},
+    {"11025 Hz, mono", &direct, 1},
+    {"11025 Hz, stereo", &direct, 2},
+  };
+
+  PipelineResult monoResult;
+  memset(&monoResult, 0, sizeof(monoResult));
+
+  printf("\n%-24s %8s %10s %12s %10s\n", "Pipeline", "frames", "samples", "DSP ms/s", "real time");
+
+  for (size_t i=0; i < (sizeof(pipelineRuns) / sizeof(pipelineRuns[0])); i++) {
+    const PipelineRun& run = pipelineRuns[i];
+    PipelineResult result;
+
+    if (!runPipeline(*run.playlist, FRAME_CODEC_PCM_U8, run.channelCount, 0, &result)) {
+      printf("%-24s could not start\n", run.name);
+      passed = false;
+      continue;
+    }
+
+    //DSP time for each second of audio played
+    double audioSeconds = double(result.sampleCount) / (run.channelCount * BENCHMARK_SAMPLE_RATE);
+    double dspShare = (audioSeconds > 0) ? ((result.dspUtilization * result.seconds) / audioSeconds) : 1.0;
+    bool ok = (result.streamEndLast) && (result.stereoFrames == ((run.channelCount == 2) ? result.frameCount : 0));
+
+    if (run.channelCount == 1) {
+      monoResult = result;
+    }
+    else {
+      ok &= (result.sampleCount == (monoResult.sampleCount * 2)) && (dspShare < STEREO_MAX_DSP_SHARE);
+    }
+
+    printf("%-24s %8u %10llu %12.2f %9.2f%%%s\n", run.name, result.frameCount, (unsigned long long) result.sampleCount,
+      dspShare * 1000.0, dspShare * 100.0, ok ? "" : "  FAILED");
+    passed &= ok;
+  }
+
+  remove(resampledPath);
+  remove(directPath);
+
+  //the same link as the link benchmark
+  LinkConfig mono;
+  mono.baudRate = PROTOCOL_BASE_BAUDRATE;
+  mono.creditWindow = 4;
+  mono.codec = FRAME_CODEC_PCM_U8;
+  mono.channelCount = 1;
+  mono.fec = true;
+  mono.udpLoss = 0;
+  mono.udpReorder = 0;
+  mono.udpLatency = 2000;
+  mono.udpJitter = 3000;
+  mono.udpBandwidth = 1000000;
+  mono.udpPacketOverhead = 200;
+  mono.frameSize = REQUEST_SIZE;
+  mono.duration = LINK_BENCHMARK_DURATION;
+  mono.seed = 0x1B873593;
+
+  LinkConfig stereo = mono;
+  stereo.channelCount = 2;
+
+  LinkConfig stereoLossy = stereo;
+  stereoLossy.udpLoss = 0.01;
+  stereoLossy.udpReorder = 0.02;
+
+  LinkConfig stereoFast = stereo;
+  stereoFast.baudRate = 2000000;
+
+  LinkConfig stereoSlow = stereo;
+  stereoSlow.baudRate = 115200;
+
+  struct LinkRun {
+    const char* name;
+    const LinkConfig* config;
+    LinkResult result;
+  };
+
+  LinkRun linkRuns[] = {
+    {"Mono, 500 kbaud", &mono, LinkResult()},
+    {"Stereo, 500 kbaud", &stereo, LinkResult()},
+    {"Stereo, 500 kbaud, 1% loss", &stereoLossy, LinkResult()},
+    {"Stereo, 2 Mbaud", &stereoFast, LinkResult()},
+    {"Stereo, 115200 baud", &stereoSlow, LinkResult()},
+  };
+
+  //the bytes/s a stream needs on the serial link, with the frame headers, against
+  //what the link carries at 10 bits a byte
+  printf("\n%-28s %10s %10s %7s %7s %10s %9s %7s\n", "Link", "needs B/s", "has B/s", "Serial", "Air",
+    "Received", "Underruns", "Corrupt");
+
+  for (size_t i=0; i < (sizeof(linkRuns) / sizeof(linkRuns[0])); i++) {
+    LinkRun& run = linkRuns[i];
+    double needed = double(run.config->channelCount) * LINK_SIM_SAMPLE_RATE * run.config->frameSize /
+                    getLinkFrameSamples(*run.config);
+
+    simulateLink(*run.config, &run.result);
+    printf("%-28s %10.0f %10u %6.0f%% %6.0f%% %8.0f/s %9u %7u\n", run.name, needed, run.config->baudRate / 10,
+      run.result.serialLoad * 100.0, run.result.udpLoad * 100.0, run.result.throughput, run.result.underruns,
+      run.result.framesCorrupt);
+  }
+
+  const LinkResult& monoLink = linkRuns[0].result;
+  const LinkResult& stereoLink = linkRuns[1].result;
+  const LinkResult& stereoLossyLink = linkRuns[2].result;
+  const LinkResult& stereoFastLink = linkRuns[3].result;
+  const LinkResult& stereoSlowLink = linkRuns[4].result;
+  bool linkOk = (monoLink.underruns == 0) && (monoLink.framesCorrupt == 0);
+
+  linkOk &= (stereoLink.underruns == 0) && (stereoLink.framesCorrupt == 0) &&
+            (stereoLink.throughput >= (2 * LINK_SIM_SAMPLE_RATE * 0.98)) && (stereoLink.serialLoad < STEREO_MAX_SERIAL_LOAD);
+  linkOk &= (stereoLossyLink.framesCorrupt == 0) && (stereoLossyLink.framesLost == 0);
+  linkOk &= (stereoFastLink.underruns == 0) && (stereoFastLink.framesCorrupt == 0);
+  linkOk &= (stereoSlowLink.underruns > 0) && (stereoSlowLink.framesCorrupt == 0);
+  passed &= linkOk;
+
+  printf("Stereo frames: %s\n", passed ? "ok" : "FAILED");
+  return passed;
+}
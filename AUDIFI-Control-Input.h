@@ -0,0 +1,207 @@
+//==============================================================================//
+//
+//  AUDIFI Control Input
+//  Version : v0.1
+//
+//  Reads the typed commands for the control messages, see AUDIFI-Control.h, one
+//  on each line, from stdin or a named pipe. A thread of its own reads and parses
+//  them as they arrive, and the streaming thread takes the messages in between
+//  two frames, without waiting. A line longer than CONTROL_COMMAND_MAX_LENGTH is
+//  not a command.
+//
+//  A named pipe is opened for writing too, so it stays open while nothing else
+//  has it open, and commands can be sent with one "echo next > pipe" after the
+//  other.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_CONTROL_INPUT_H
+#define AUDIFI_CONTROL_INPUT_H
+
+#include "AUDIFI-Control.h"
+#include "AUDIFI-Ring-Buffer.h"
+#include <atomic>
+#include <thread>
+
+#ifdef _WIN32
+  #include <fcntl.h>
+  #include <io.h>
+#else
+  #include <errno.h>
+  #include <fcntl.h>
+  #include <poll.h>
+  #include <unistd.h>
+#endif
+
+#define CONTROL_INPUT_SLOTS 16      //messages parsed and not taken yet
+#define CONTROL_POLL_TIMEOUT 100    //ms a read waits for data before checking if it should stop
+
+//==============================================================================//
+
+class ControlInput {
+  public:
+    ControlInput() : fd(-1), running(false), lineLength(0), lineTooLong(false) {
+    }
+
+    ~ControlInput() {
+      close();
+    }
+
+    //------------------------------------------------------------------------------//
+    //Opens stdin if the path is "-", or else the named pipe or file at path, and
+    //starts reading it.
+
+    bool open(const char* path) {
+      close();
+
+    #ifdef _WIN32
+      fd = (strcmp(path, "-") == 0) ? _fileno(stdin) : _open(path, _O_RDONLY);
+    #else
+      fd = (strcmp(path, "-") == 0) ? STDIN_FILENO : ::open(path, O_RDWR);
+    #endif
+
+      if ((fd < 0) || (!messages.begin(CONTROL_INPUT_SLOTS))) {
+        closeInput();
+        return false;
+      }
+
+      lineLength = 0;
+      lineTooLong = false;
+      running = true;
+      inputThread = std::thread(&ControlInput::runInput, this);
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Stops reading. On Windows a read in progress has to return first.
+
+    void close() {
+      if (inputThread.joinable()) {
+        running = false;
+        inputThread.join();
+      }
+      closeInput();
+    }
+
+    //------------------------------------------------------------------------------//
+
+    bool isOpen() const {
+      return fd >= 0;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Takes the next message typed in. Returns false if there's none. Never waits.
+
+    bool take(ControlMessage* message) {
+      return messages.pop(message);
+    }
+
+  private:
+    int fd;
+    std::thread inputThread;
+    std::atomic<bool> running;
+    RingBuffer<ControlMessage> messages;
+    char line[CONTROL_COMMAND_MAX_LENGTH];
+    uint32_t lineLength;
+    bool lineTooLong;
+
+    ControlInput(const ControlInput&);
+    ControlInput& operator=(const ControlInput&);
+
+    //------------------------------------------------------------------------------//
+    //Reads up to length bytes. Returns the no. read, 0 if nothing arrived within
+    //CONTROL_POLL_TIMEOUT, or -1 at the end of the input.
+
+    int readInput(uint8_t* data, uint32_t length) {
+    #ifdef _WIN32
+      int count = _read(fd, data, length);
+      return (count > 0) ? count : -1;
+    #else
+      struct pollfd pollFd;
+      pollFd.fd = fd;
+      pollFd.events = POLLIN;
+      pollFd.revents = 0;
+
+      int ready = ::poll(&pollFd, 1, CONTROL_POLL_TIMEOUT);
+
+      if (ready == 0) {
+        return 0;
+      }
+      if (ready < 0) {
+        return (errno == EINTR) ? 0 : -1;
+      }
+
+      ssize_t count = ::read(fd, data, length);
+
+      if (count < 0) {
+        return ((errno == EINTR) || (errno == EAGAIN)) ? 0 : -1;
+      }
+      return (count > 0) ? int(count) : -1;
+    #endif
+    }
+
+    //------------------------------------------------------------------------------//
+    //The input thread. Reads until the input ends or the input is closed.
+
+    void runInput() {
+      uint8_t data[CONTROL_COMMAND_MAX_LENGTH];
+
+      while (running) {
+        int count = readInput(data, sizeof(data));
+
+        if (count < 0) {
+          break;
+        }
+        for (int i=0; i < count; i++) {
+          addInputByte(char(data[i]));
+        }
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Adds a byte to the line, and parses the line once it's whole.
+
+    void addInputByte(char value) {
+      if (value != '\n') {
+        if (lineLength < (CONTROL_COMMAND_MAX_LENGTH - 1)) {
+          line[lineLength] = value;
+          lineLength++;
+        }
+        else {
+          lineTooLong = true;
+        }
+        return;
+      }
+
+      line[lineLength] = 0;
+      ControlMessage message;
+
+      if ((!lineTooLong) && parseControlCommand(line, &message)) {
+        if (!messages.push(message)) {
+          printf("Too many commands, %s was dropped.\n", getControlName(message.type));
+        }
+      }
+      else if (lineTooLong || (*skipControlSpaces(line) != 0)) {
+        printf("Unknown command. The commands are pause, resume, next, prev, skip <tracks>, seek <m:ss> and gain <percent>.\n");
+      }
+      lineLength = 0;
+      lineTooLong = false;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void closeInput() {
+    #ifdef _WIN32
+      if ((fd >= 0) && (fd != _fileno(stdin))) {
+        _close(fd);
+      }
+    #else
+      if ((fd >= 0) && (fd != STDIN_FILENO)) {
+        ::close(fd);
+      }
+    #endif
+      fd = -1;
+    }
+};
+
+#endif
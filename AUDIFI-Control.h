@@ -0,0 +1,585 @@
+//==============================================================================//
+//
+//  AUDIFI Control
+//  Version : v0.1
+//
+//  Typed control messages that share the serial and UDP links with the frames,
+//  so that the stream can be paused, skipped, seeked and turned up or down while
+//  it plays. A message jumps ahead of the frames queued on the way. The server
+//  writes it as soon as the frame on the wire is done, the transmitter sends it
+//  over UDP before its next frame, and the receiver acts on it as it arrives,
+//  not once the frames in its buffer have been played.
+//
+//  The receiver stops and starts its output for a pause and a resume, and applies
+//  the gain to the samples as it plays them, so these take effect at once. A skip
+//  or a seek starts the stream somewhere else. The server starts its pipeline
+//  over there, and the receiver empties its buffer and throws away the frames
+//  that were already on the way.
+//
+//  A message is [type][id][value, 4 bytes MSB first][frame sequence no., 2 bytes].
+//  On the serial link it's sent between the frames with a sync word of its own
+//  and a CRC, the way a checked frame is, see AUDIFI-Frame-Check.h. So it's only
+//  used on a link with checked frames, when both sides agreed on
+//  PROTOCOL_OPTION_CONTROL as well:
+//
+//    [control sync word, 4 bytes][message, 8 bytes][CRC-32, 4 bytes]
+//
+//  On the air it's a UDP packet of its own, [CONTROL_MARKER][message]. Each side
+//  answers a message with "CA#<id>", and it's sent again every
+//  CONTROL_RESEND_INTERVAL ms until it is, at most CONTROL_SEND_ATTEMPTS times.
+//  The ids count the messages on each link, and a message that's sent again is
+//  only acted on once.
+//
+//  The frame sequence no. is only used on the air, by a skip or a seek. It's the
+//  first frame from the new place, the ones before it are thrown away.
+//
+//  The messages can be typed in as well, eg. "seek 1:30" or "gain 50", see
+//  parseControlCommand(). Nothing here allocates memory.
+//
+//  This file is shared by the server application, the transmitter and the
+//  receiver. Copy it to the sketch folders along with AUDIFI-Frame-Check.h.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_CONTROL_H
+#define AUDIFI_CONTROL_H
+
+#include "AUDIFI-Frame-Check.h"
+
+#define CONTROL_PAUSE 1
+#define CONTROL_RESUME 2
+#define CONTROL_SKIP 3                //value: tracks to move on by, back if negative
+#define CONTROL_SEEK 4                //value: ms from the start of the track
+#define CONTROL_GAIN 5                //value: volume in percent
+
+#define CONTROL_GAIN_UNITY 100
+#define CONTROL_GAIN_MAX 400
+#define CONTROL_MESSAGE_SIZE 8
+#define CONTROL_ENVELOPE_SIZE (FRAME_CHECK_SYNC_SIZE + CONTROL_MESSAGE_SIZE + FRAME_CHECK_CRC_SIZE)
+#define CONTROL_PACKET_SIZE (1 + CONTROL_MESSAGE_SIZE)
+#define CONTROL_MARKER 0xC5           //first byte of a control packet, not ASCII and not FRAGMENT_MARKER
+#define CONTROL_QUEUE_SIZE 4          //messages on a link waiting for their CA#
+#define CONTROL_RESEND_INTERVAL 100   //ms before a message without a CA# is sent again
+#define CONTROL_SEND_ATTEMPTS 5
+#define CONTROL_COMMAND_MAX_LENGTH 32 //max length of a typed command including NL
+
+//what a search for the sync words found
+#define SYNC_NONE 0
+#define SYNC_FRAME 1
+#define SYNC_CONTROL 2
+
+//the frame sync word but for its last byte, so one search finds both
+static const uint8_t controlSyncWord[FRAME_CHECK_SYNC_SIZE] = {0xA5, 0x5A, 0xC3, 0x5C};
+
+struct ControlMessage {
+  uint8_t type;           //CONTROL_*
+  uint8_t id;
+  int32_t value;
+  uint16_t frameSequence; //on the air, the first frame after a skip or a seek
+};
+
+//==============================================================================//
+//Moves a search for the sync words on by a byte. matched is the no. of bytes of
+//a sync word seen so far, and skipped is set to the no. of bytes that turned out
+//not to be one. Returns SYNC_FRAME or SYNC_CONTROL once a whole sync word has
+//gone by, and SYNC_NONE until then.
+
+inline int scanSyncByte(uint8_t value, uint8_t* matched, uint32_t* skipped) {
+  *skipped = 0;
+
+  if (value == frameSyncWord[*matched]) {
+    (*matched)++;
+
+    if (*matched < FRAME_CHECK_SYNC_SIZE) {
+      return SYNC_NONE;
+    }
+    *matched = 0;
+    return SYNC_FRAME;
+  }
+
+  if ((*matched == (FRAME_CHECK_SYNC_SIZE - 1)) && (value == controlSyncWord[*matched])) {
+    *matched = 0;
+    return SYNC_CONTROL;
+  }
+
+  *skipped = (value == frameSyncWord[0]) ? *matched : (*matched + 1);
+  *matched = (value == frameSyncWord[0]) ? 1 : 0;
+  return SYNC_NONE;
+}
+
+//==============================================================================//
+//True for the messages that start the stream somewhere else, so that what's
+//buffered on the way is of no use.
+
+inline bool isControlFlush(uint8_t type) {
+  return (type == CONTROL_SKIP) || (type == CONTROL_SEEK);
+}
+
+//------------------------------------------------------------------------------//
+
+inline const char* getControlName(uint8_t type) {
+  switch (type) {
+    case CONTROL_PAUSE:
+      return "pause";
+    case CONTROL_RESUME:
+      return "resume";
+    case CONTROL_SKIP:
+      return "skip";
+    case CONTROL_SEEK:
+      return "seek";
+    case CONTROL_GAIN:
+      return "gain";
+  }
+  return "unknown";
+}
+
+//------------------------------------------------------------------------------//
+//False if the type is unknown or the value makes no sense for it.
+
+inline bool isControlValid(const ControlMessage& message) {
+  switch (message.type) {
+    case CONTROL_PAUSE:
+    case CONTROL_RESUME:
+    case CONTROL_SKIP:
+      return true;
+    case CONTROL_SEEK:
+      return message.value >= 0;
+    case CONTROL_GAIN:
+      return (message.value >= 0) && (message.value <= CONTROL_GAIN_MAX);
+  }
+  return false;
+}
+
+//==============================================================================//
+//Writes the CONTROL_MESSAGE_SIZE bytes of the message to data.
+
+inline void writeControlMessage(uint8_t* data, const ControlMessage& message) {
+  uint32_t value = uint32_t(message.value);
+
+  data[0] = message.type;
+  data[1] = message.id;
+
+  for (int i=0; i < 4; i++) {
+    data[2 + i] = uint8_t(value >> (24 - (8 * i)));
+  }
+  data[6] = uint8_t(message.frameSequence >> 8);
+  data[7] = uint8_t(message.frameSequence);
+}
+
+//------------------------------------------------------------------------------//
+//Returns false if the message is not a valid one.
+
+inline bool readControlMessage(const uint8_t* data, ControlMessage* message) {
+  uint32_t value = 0;
+
+  for (int i=0; i < 4; i++) {
+    value = (value << 8) | data[2 + i];
+  }
+  message->type = data[0];
+  message->id = data[1];
+  message->value = int32_t(value);
+  message->frameSequence = uint16_t((uint16_t(data[6]) << 8) | data[7]);
+  return isControlValid(*message);
+}
+
+//------------------------------------------------------------------------------//
+//Writes the message as it's sent on the serial link, CONTROL_ENVELOPE_SIZE
+//bytes. Returns the no. of bytes written.
+
+inline uint32_t writeControlEnvelope(uint8_t* envelope, const ControlMessage& message) {
+  memcpy(envelope, controlSyncWord, FRAME_CHECK_SYNC_SIZE);
+  writeControlMessage(envelope + FRAME_CHECK_SYNC_SIZE, message);
+
+  uint32_t crc = crc32Update(0, envelope + FRAME_CHECK_SYNC_SIZE, CONTROL_MESSAGE_SIZE);
+  uint8_t* crcBytes = envelope + FRAME_CHECK_SYNC_SIZE + CONTROL_MESSAGE_SIZE;
+
+  for (int i=0; i < FRAME_CHECK_CRC_SIZE; i++) {
+    crcBytes[i] = uint8_t(crc >> (8 * i));
+  }
+  return CONTROL_ENVELOPE_SIZE;
+}
+
+//------------------------------------------------------------------------------//
+//Reads the message and the CRC that came after the control sync word. Returns
+//false if the CRC doesn't match or the message is not a valid one.
+
+inline bool readControlEnvelope(const uint8_t* data, ControlMessage* message) {
+  const uint8_t* crcBytes = data + CONTROL_MESSAGE_SIZE;
+  uint32_t crc = uint32_t(crcBytes[0]) | (uint32_t(crcBytes[1]) << 8) | (uint32_t(crcBytes[2]) << 16) |
+                 (uint32_t(crcBytes[3]) << 24);
+
+  return (crc == crc32Update(0, data, CONTROL_MESSAGE_SIZE)) && readControlMessage(data, message);
+}
+
+//------------------------------------------------------------------------------//
+//Writes the message as a UDP packet, CONTROL_PACKET_SIZE bytes. Returns the no.
+//of bytes written.
+
+inline uint32_t writeControlPacket(uint8_t* packet, const ControlMessage& message) {
+  packet[0] = CONTROL_MARKER;
+  writeControlMessage(packet + 1, message);
+  return CONTROL_PACKET_SIZE;
+}
+
+//------------------------------------------------------------------------------//
+//Returns false if the packet is not a valid control message.
+
+inline bool readControlPacket(const uint8_t* packet, uint32_t length, ControlMessage* message) {
+  return (length == CONTROL_PACKET_SIZE) && (packet[0] == CONTROL_MARKER) && readControlMessage(packet + 1, message);
+}
+
+//==============================================================================//
+//The answer to a message, "CA#<id>", without the NL. Returns the length of the
+//line.
+
+inline int formatControlAck(char* line, uint32_t maxLength, uint8_t id) {
+  return snprintf(line, maxLength, "CA#%u", unsigned(id));
+}
+
+//------------------------------------------------------------------------------//
+//Returns false if the line is not a CA# line.
+
+inline bool parseControlAck(const char* line, uint8_t* id) {
+  if (strncmp(line, "CA#", 3) != 0) {
+    return false;
+  }
+
+  char* end = NULL;
+  unsigned long value = strtoul(&line[3], &end, 10);
+
+  if ((end == &line[3]) || (*end != 0) || (value > 255)) {
+    return false;
+  }
+  *id = uint8_t(value);
+  return true;
+}
+
+//------------------------------------------------------------------------------//
+//A message typed in at the transmitter for the server, "CT#<type>#<value>",
+//without the NL. Returns the length of the line.
+
+inline int formatControlLine(char* line, uint32_t maxLength, const ControlMessage& message) {
+  return snprintf(line, maxLength, "CT#%u#%ld", unsigned(message.type), long(message.value));
+}
+
+//------------------------------------------------------------------------------//
+//Returns false if the line is not a CT# line with a valid message in it. The id
+//is left at 0.
+
+inline bool parseControlLine(const char* line, ControlMessage* message) {
+  if (strncmp(line, "CT#", 3) != 0) {
+    return false;
+  }
+
+  char* end = NULL;
+  unsigned long type = strtoul(&line[3], &end, 10);
+
+  if ((end == &line[3]) || (*end != '#') || (type > 255)) {
+    return false;
+  }
+
+  const char* valueText = end + 1;
+  long value = strtol(valueText, &end, 10);
+
+  if ((end == valueText) || (*end != 0)) {
+    return false;
+  }
+
+  message->type = uint8_t(type);
+  message->id = 0;
+  message->value = int32_t(value);
+  message->frameSequence = 0;
+  return isControlValid(*message);
+}
+
+//==============================================================================//
+//Typed commands
+
+inline bool isControlSpace(char value) {
+  return (value == ' ') || (value == '\t') || (value == '\r') || (value == '\n');
+}
+
+//------------------------------------------------------------------------------//
+
+inline const char* skipControlSpaces(const char* text) {
+  while (isControlSpace(*text)) {
+    text++;
+  }
+  return text;
+}
+
+//------------------------------------------------------------------------------//
+//True if text starts with the word as a whole word. end is set to just after it.
+
+inline bool matchControlWord(const char* text, const char* word, const char** end) {
+  size_t length = strlen(word);
+
+  if ((strncmp(text, word, length) != 0) || ((text[length] != 0) && (!isControlSpace(text[length])))) {
+    return false;
+  }
+  *end = text + length;
+  return true;
+}
+
+//------------------------------------------------------------------------------//
+//Reads a whole no. that ends the command. Returns false if there is none, or
+//there's more after it.
+
+inline bool readControlNumber(const char* text, long* value) {
+  char* end = NULL;
+  text = skipControlSpaces(text);
+  *value = strtol(text, &end, 10);
+  return (end != text) && (*skipControlSpaces(end) == 0);
+}
+
+//------------------------------------------------------------------------------//
+//Reads a typed command into message, with an id of 0. The commands are
+//
+//  pause, resume or play, next, prev, skip <tracks>, seek <s> or seek <m>:<ss>,
+//  gain <percent>
+//
+//in lower case, with spaces anywhere between the words. Returns false if it's
+//not one of them.
+
+inline bool parseControlCommand(const char* text, ControlMessage* message) {
+  const char* end = NULL;
+  long value = 0;
+
+  text = skipControlSpaces(text);
+  message->id = 0;
+  message->value = 0;
+  message->frameSequence = 0;
+
+  if (matchControlWord(text, "pause", &end)) {
+    message->type = CONTROL_PAUSE;
+  }
+  else if (matchControlWord(text, "resume", &end) || matchControlWord(text, "play", &end)) {
+    message->type = CONTROL_RESUME;
+  }
+  else if (matchControlWord(text, "next", &end) || matchControlWord(text, "prev", &end)) {
+    message->type = CONTROL_SKIP;
+    message->value = (text[0] == 'n') ? 1 : -1;
+  }
+  else if (matchControlWord(text, "skip", &end)) {
+    message->type = CONTROL_SKIP;
+
+    if (*skipControlSpaces(end) == 0) {
+      message->value = 1;
+      return true;
+    }
+    if ((!readControlNumber(end, &value)) || (value < -1000) || (value > 1000)) {
+      return false;
+    }
+    message->value = int32_t(value);
+    return true;
+  }
+  else if (matchControlWord(text, "seek", &end)) {
+    //seconds, or minutes and seconds
+    char* numberEnd = NULL;
+    text = skipControlSpaces(end);
+    long minutes = 0;
+    long seconds = strtol(text, &numberEnd, 10);
+
+    if ((numberEnd == text) || (seconds < 0)) {
+      return false;
+    }
+    if (*numberEnd == ':') {
+      minutes = seconds;
+      text = numberEnd + 1;
+      seconds = strtol(text, &numberEnd, 10);
+
+      if ((numberEnd == text) || (seconds < 0) || (seconds > 59)) {
+        return false;
+      }
+    }
+    if ((*skipControlSpaces(numberEnd) != 0) || (minutes > 10000) || (seconds > 600000)) {
+      return false;
+    }
+    message->type = CONTROL_SEEK;
+    message->value = int32_t(((minutes * 60) + seconds) * 1000);
+    return true;
+  }
+  else if (matchControlWord(text, "gain", &end)) {
+    if ((!readControlNumber(end, &value)) || (value < 0) || (value > CONTROL_GAIN_MAX)) {
+      return false;
+    }
+    message->type = CONTROL_GAIN;
+    message->value = int32_t(value);
+    return true;
+  }
+  else {
+    return false;
+  }
+
+  return *skipControlSpaces(end) == 0;
+}
+
+//==============================================================================//
+//The gain as a factor in 1/256ths.
+
+inline int32_t getControlGainScale(int32_t percent) {
+  return (percent * 256) / CONTROL_GAIN_UNITY;
+}
+
+//------------------------------------------------------------------------------//
+//Scales an 8-bit sample about the middle by gainScale, and clips it.
+
+inline uint8_t applyControlGain(uint8_t sample, int32_t gainScale) {
+  int32_t scaled = 128 + (((int32_t(sample) - 128) * gainScale) / 256);
+  return uint8_t((scaled < 0) ? 0 : ((scaled > 255) ? 255 : scaled));
+}
+
+//==============================================================================//
+//The messages sent on a link that are waiting for their CA#. A message is sent
+//again every CONTROL_RESEND_INTERVAL ms until it's answered, and given up on
+//after CONTROL_SEND_ATTEMPTS sends. The ids are given out here, in order.
+
+class ControlQueue {
+  public:
+    ControlQueue() {
+      reset();
+    }
+
+    //------------------------------------------------------------------------------//
+    //Forgets the messages and starts the ids over, as a new link does.
+
+    void reset() {
+      count = 0;
+      nextId = 0;
+      givenUp = 0;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Adds a message with the next id and returns the id. If the queue is full, the
+    //oldest message is given up on.
+
+    uint8_t add(const ControlMessage& message) {
+      if (count == CONTROL_QUEUE_SIZE) {
+        remove(0);
+        givenUp++;
+      }
+
+      Entry& entry = entries[count];
+      entry.message = message;
+      entry.message.id = nextId;
+      entry.sendTime = 0;
+      entry.sendCount = 0;
+      count++;
+      nextId++;
+      return entry.message.id;
+    }
+
+    //------------------------------------------------------------------------------//
+    //The next message that's due to be sent, the oldest first. Returns false if
+    //none is. resent is set if it was sent before. The messages sent
+    //CONTROL_SEND_ATTEMPTS times are given up on here.
+
+    bool getDue(uint32_t now, ControlMessage* message, bool* resent) {
+      uint32_t i = 0;
+
+      while (i < count) {
+        Entry& entry = entries[i];
+
+        if ((entry.sendCount > 0) && ((now - entry.sendTime) < CONTROL_RESEND_INTERVAL)) {
+          i++;
+          continue;
+        }
+        if (entry.sendCount >= CONTROL_SEND_ATTEMPTS) {
+          remove(i);
+          givenUp++;
+          continue;
+        }
+        *resent = (entry.sendCount > 0);
+        entry.sendTime = now;
+        entry.sendCount++;
+        *message = entry.message;
+        return true;
+      }
+      return false;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Drops the message once its CA# has arrived. Returns false if it wasn't waiting.
+
+    bool acknowledge(uint8_t id) {
+      for (uint32_t i=0; i < count; i++) {
+        if (entries[i].message.id == id) {
+          remove(i);
+          return true;
+        }
+      }
+      return false;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    uint32_t getCount() const {
+      return count;
+    }
+
+    //------------------------------------------------------------------------------//
+    //The no. of messages given up on since the reset.
+
+    uint32_t getGivenUp() const {
+      return givenUp;
+    }
+
+  private:
+    struct Entry {
+      ControlMessage message;
+      uint32_t sendTime;
+      uint32_t sendCount;
+    };
+
+    Entry entries[CONTROL_QUEUE_SIZE];
+    uint32_t count;
+    uint8_t nextId;
+    uint32_t givenUp;
+
+    //------------------------------------------------------------------------------//
+
+    void remove(uint32_t index) {
+      for (uint32_t i=index; (i + 1) < count; i++) {
+        entries[i] = entries[i + 1];
+      }
+      count--;
+    }
+};
+
+//==============================================================================//
+//Tells a new message from one sent again, on the side that receives them. The
+//ids up to FRAME_CHECK_WINDOW ahead are new, so messages given up on in between
+//don't matter. The first message after a reset is new whatever its id, as a
+//receiver may join a transmitter in fan-out mode that has sent many before.
+
+class ControlFilter {
+  public:
+    ControlFilter() {
+      reset();
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void reset() {
+      expectedId = 0;
+      started = false;
+    }
+
+    //------------------------------------------------------------------------------//
+    //True if the message with the id is a new one.
+
+    bool accept(uint8_t id) {
+      if (started && (getSequenceGap(expectedId, id) < 0)) {
+        return false;
+      }
+      expectedId = uint8_t(id + 1);
+      started = true;
+      return true;
+    }
+
+  private:
+    uint8_t expectedId;
+    bool started;
+};
+
+#endif
@@ -0,0 +1,321 @@
+//==============================================================================//
+//
+//  AUDIFI Fan-Out
+//  Version : v0.1
+//
+//  Lets the transmitter feed one stream to several receivers. Frames from the
+//  application are kept in a small ring, and every registered receiver has its own
+//  cursor into it. A frame crosses the serial link once, and is sent to each
+//  receiver as its credit allows. A slot of the ring is only reused after every
+//  receiver has been sent its frame, so the slowest receiver sets the pace.
+//
+//  In unicast mode each receiver gets its own copy of a frame, whenever it has
+//  credit. In broadcast mode a frame goes out once to the whole network, as soon
+//  as all receivers have credit for it.
+//
+//  Every receiver has the protocol version it reported with VER#, 0 until it
+//  has, so the caller can tell if all of them can play stereo frames.
+//
+//  This is only the bookkeeping. Sending and receiving is up to the caller, so
+//  the same code runs on the transmitter and in the host simulation.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_FAN_OUT_H
+#define AUDIFI_FAN_OUT_H
+
+#include "AUDIFI-Protocol.h"
+#include <stdint.h>
+#include <string.h>
+
+#ifndef FAN_OUT_RING_FRAMES
+  #define FAN_OUT_RING_FRAMES 4       //no. of frames held for the receivers
+#endif
+#ifndef FAN_OUT_FRAME_SIZE
+  #define FAN_OUT_FRAME_SIZE REQUEST_SIZE //max frame length including the header
+#endif
+#ifndef FAN_OUT_MAX_CLIENTS
+  #define FAN_OUT_MAX_CLIENTS 4       //max no. of receivers
+#endif
+
+#define FAN_OUT_CLIENT_TIMEOUT 5000   //a receiver that is silent for this long is dropped
+#define FAN_OUT_CREDIT_MAX_FRAMES 64  //upper limit of the credit of a receiver
+
+#define FAN_OUT_UNICAST 1
+#define FAN_OUT_BROADCAST 2
+
+//==============================================================================//
+
+struct FanOutClient {
+  uint32_t address;   //IP address of the receiver
+  bool active;
+  uint32_t cursor;    //sequence no. of the next frame to send to it
+  uint16_t credit;    //no. of frames it has granted
+  uint32_t lastSeen;  //when we last heard from it
+  uint32_t framesSent;
+  uint8_t version;    //protocol version it reported, 0 until it has
+};
+
+//------------------------------------------------------------------------------//
+//A frame to be sent. In broadcast mode client is -1.
+
+struct FanOutSend {
+  int client;
+  uint32_t address;
+  uint32_t sequence;
+  const uint8_t* frame;
+  uint16_t length;
+};
+
+//==============================================================================//
+
+class FanOut {
+  public:
+    FanOut(int mode) : mode(mode), head(0), broadcastCursor(0), nextClient(0), framesWritten(0), framesSent(0) {
+      memset(clients, 0, sizeof(clients));
+      memset(frameLengths, 0, sizeof(frameLengths));
+    }
+
+    //------------------------------------------------------------------------------//
+    //Adds a receiver, or refreshes it if it's known already. A new receiver starts
+    //with the next frame to arrive, or the next broadcast frame.
+    //Returns its index, or -1 if the table is full.
+
+    int registerClient(uint32_t address, uint32_t now) {
+      int vacant = -1;
+
+      for (int i=0; i < FAN_OUT_MAX_CLIENTS; i++) {
+        if (clients[i].active && (clients[i].address == address)) {
+          clients[i].lastSeen = now;
+          return i;
+        }
+        if ((!clients[i].active) && (vacant < 0)) {
+          vacant = i;
+        }
+      }
+
+      if (vacant >= 0) {
+        FanOutClient& client = clients[vacant];
+        client.address = address;
+        client.active = true;
+        client.cursor = (mode == FAN_OUT_BROADCAST) ? broadcastCursor : head;
+        client.credit = 0;
+        client.lastSeen = now;
+        client.framesSent = 0;
+        client.version = 0;
+      }
+      return vacant;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Keeps the protocol version a receiver reported, registering it if needed.
+
+    void setClientVersion(uint32_t address, uint8_t version, uint32_t now) {
+      int index = registerClient(address, now);
+
+      if (index >= 0) {
+        clients[index].version = version;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Adds to the credit of a receiver, registering it if needed.
+
+    void grantCredit(uint32_t address, uint16_t frames, uint32_t now) {
+      int index = registerClient(address, now);
+
+      if (index < 0) {
+        return;
+      }
+
+      uint32_t credit = uint32_t(clients[index].credit) + frames;
+      clients[index].credit = uint16_t((credit > FAN_OUT_CREDIT_MAX_FRAMES) ? FAN_OUT_CREDIT_MAX_FRAMES : credit);
+    }
+
+    //------------------------------------------------------------------------------//
+    //Drops the receivers we haven't heard from in a while, so that they don't hold
+    //up the others. Returns the no. of receivers dropped.
+
+    int expireClients(uint32_t now) {
+      int expired = 0;
+
+      for (int i=0; i < FAN_OUT_MAX_CLIENTS; i++) {
+        if (clients[i].active && ((now - clients[i].lastSeen) >= FAN_OUT_CLIENT_TIMEOUT)) {
+          clients[i].active = false;
+          expired++;
+        }
+      }
+      return expired;
+    }
+
+    //------------------------------------------------------------------------------//
+    //No. of frames the ring can take now. Nothing is wanted without receivers.
+
+    uint32_t getFreeFrames() const {
+      if (getClientCount() == 0) {
+        return 0;
+      }
+      return FAN_OUT_RING_FRAMES - (head - getOldestCursor());
+    }
+
+    //------------------------------------------------------------------------------//
+    //Returns the slot for the next frame, or NULL if the ring is full. The frame
+    //is only visible to the receivers after commitWrite().
+
+    uint8_t* beginWrite() {
+      if ((head - getOldestCursor()) >= FAN_OUT_RING_FRAMES) {
+        return NULL;
+      }
+      return frames[head % FAN_OUT_RING_FRAMES];
+    }
+
+    void commitWrite(uint16_t length) {
+      frameLengths[head % FAN_OUT_RING_FRAMES] = length;
+      head++;
+      framesWritten++;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Finds the next frame to send. The receivers take turns in unicast mode.
+    //The frame stays in the ring until completeSend() is called.
+    //Returns false if there's nothing to send.
+
+    bool nextSend(FanOutSend* send) {
+      if (mode == FAN_OUT_BROADCAST) {
+        if ((broadcastCursor == head) || (getClientCount() == 0)) {
+          return false;
+        }
+
+        //every receiver waiting for this frame must have room for it
+        for (int i=0; i < FAN_OUT_MAX_CLIENTS; i++) {
+          if (clients[i].active && (clients[i].cursor == broadcastCursor) && (clients[i].credit == 0)) {
+            return false;
+          }
+        }
+
+        send->client = -1;
+        send->address = 0;
+        send->sequence = broadcastCursor;
+      }
+      else {
+        int i = 0;
+
+        for (; i < FAN_OUT_MAX_CLIENTS; i++) {
+          const FanOutClient& client = clients[(nextClient + i) % FAN_OUT_MAX_CLIENTS];
+
+          if (client.active && (client.credit > 0) && (client.cursor != head)) {
+            break;
+          }
+        }
+
+        if (i == FAN_OUT_MAX_CLIENTS) {
+          return false;
+        }
+
+        send->client = (nextClient + i) % FAN_OUT_MAX_CLIENTS;
+        send->address = clients[send->client].address;
+        send->sequence = clients[send->client].cursor;
+        nextClient = (send->client + 1) % FAN_OUT_MAX_CLIENTS;
+      }
+
+      send->frame = frames[send->sequence % FAN_OUT_RING_FRAMES];
+      send->length = frameLengths[send->sequence % FAN_OUT_RING_FRAMES];
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Moves the cursors past a frame that has been sent, which frees its slot once
+    //every receiver has had it.
+
+    void completeSend(const FanOutSend& send) {
+      framesSent++;
+
+      if (send.client >= 0) {
+        FanOutClient& client = clients[send.client];
+
+        if (client.active && (client.cursor == send.sequence)) {
+          client.cursor++;
+          client.credit--;
+          client.framesSent++;
+        }
+        return;
+      }
+
+      for (int i=0; i < FAN_OUT_MAX_CLIENTS; i++) {
+        if (clients[i].active && (clients[i].cursor == send.sequence)) {
+          clients[i].cursor++;
+          clients[i].credit--;
+          clients[i].framesSent++;
+        }
+      }
+      broadcastCursor = send.sequence + 1;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    int getClientCount() const {
+      int count = 0;
+
+      for (int i=0; i < FAN_OUT_MAX_CLIENTS; i++) {
+        count += clients[i].active ? 1 : 0;
+      }
+      return count;
+    }
+
+    const FanOutClient& getClient(int index) const {
+      return clients[index];
+    }
+
+    //the lowest version of the receivers, PROTOCOL_VERSION if there are none
+    uint8_t getMinClientVersion() const {
+      uint8_t version = PROTOCOL_VERSION;
+
+      for (int i=0; i < FAN_OUT_MAX_CLIENTS; i++) {
+        if (clients[i].active && (clients[i].version < version)) {
+          version = clients[i].version;
+        }
+      }
+      return version;
+    }
+
+    uint32_t getFramesWritten() const {
+      return framesWritten;
+    }
+
+    uint32_t getFramesSent() const {
+      return framesSent;
+    }
+
+    //sequence no. of the next frame written to the ring
+    uint32_t getNextSequence() const {
+      return head;
+    }
+
+  private:
+    int mode;
+    uint8_t frames[FAN_OUT_RING_FRAMES][FAN_OUT_FRAME_SIZE];
+    uint16_t frameLengths[FAN_OUT_RING_FRAMES];
+    uint32_t head;  //sequence no. of the next frame written
+    uint32_t broadcastCursor; //sequence no. of the next frame broadcast
+    FanOutClient clients[FAN_OUT_MAX_CLIENTS];
+    int nextClient; //the receiver served first next time
+    uint32_t framesWritten;
+    uint32_t framesSent;
+
+    //------------------------------------------------------------------------------//
+    //The oldest frame still needed by a receiver. The sequence nos. wrap around,
+    //so they are compared by their distance from the head.
+
+    uint32_t getOldestCursor() const {
+      uint32_t oldest = (mode == FAN_OUT_BROADCAST) ? broadcastCursor : head;
+
+      for (int i=0; i < FAN_OUT_MAX_CLIENTS; i++) {
+        if (clients[i].active && ((head - clients[i].cursor) > (head - oldest))) {
+          oldest = clients[i].cursor;
+        }
+      }
+      return oldest;
+    }
+};
+
+#endif
@@ -0,0 +1,509 @@
+//==============================================================================//
+//
+//  AUDIFI Fragment
+//  Version : v0.1
+//
+//  Splits the audio frames into UDP packets and puts them back together. A frame
+//  is larger than a packet, so it's sent as several fragments. Each fragment has
+//  a header with the sequence no. of its frame and its own index, so fragments
+//  that arrive late or out of order still land in the right place.
+//
+//  The transmitter keeps the last few frames it has sent. The receiver asks for
+//  the fragments it's missing with "NK#<sequence>#<mask>", and only those are
+//  sent again. An optional parity fragment, the XOR of all the others, lets the
+//  receiver rebuild one lost fragment per frame without asking.
+//
+//  Fragment layout :
+//
+//    [marker][flags][sequence hi][sequence lo][index][count][length hi][length lo]
+//    [data..]
+//
+//  The length is the length of the whole frame. The parity fragment has the
+//  index count, and is as long as the longest fragment.
+//
+//  The frame and packet sizes come from AUDIFI-Protocol.h unless they are set
+//  before this file is included.
+//
+//  This file is shared by the transmitter and the receiver. Copy it to the sketch
+//  folders along with the sketches, and AUDIFI-Protocol.h with it.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_FRAGMENT_H
+#define AUDIFI_FRAGMENT_H
+
+#include "AUDIFI-Protocol.h"
+#include <stdint.h>
+#include <string.h>
+
+#ifndef FRAGMENT_PACKET_SIZE
+  #define FRAGMENT_PACKET_SIZE UDP_MTU_SIZE //max UDP packet, the MTU
+#endif
+#ifndef FRAGMENT_FRAME_SIZE
+  #define FRAGMENT_FRAME_SIZE REQUEST_SIZE  //max frame length including the frame header
+#endif
+#ifndef FRAGMENT_ASSEMBLY_SLOTS
+  #define FRAGMENT_ASSEMBLY_SLOTS 2     //frames the receiver can assemble at once
+#endif
+#ifndef FRAGMENT_CACHE_FRAMES
+  #define FRAGMENT_CACHE_FRAMES 2       //frames the transmitter keeps for retransmits
+#endif
+
+#define FRAGMENT_HEADER_SIZE PROTOCOL_FRAGMENT_HEADER_SIZE
+#define FRAGMENT_DATA_SIZE (FRAGMENT_PACKET_SIZE - FRAGMENT_HEADER_SIZE)
+#define FRAGMENT_MAX_COUNT ((FRAGMENT_FRAME_SIZE + FRAGMENT_DATA_SIZE - 1) / FRAGMENT_DATA_SIZE)
+
+#define FRAGMENT_MARKER 0xA5          //not ASCII, so fragments aren't taken for requests
+#define FRAGMENT_FLAG_PARITY 0x01
+#define FRAGMENT_FLAG_RETRANSMIT 0x02
+
+#define FRAGMENT_NACK_DELAY 10        //silence (ms) after which missing fragments are asked for
+#define FRAGMENT_NACK_INTERVAL 15     //time between two requests for the same frame
+#define FRAGMENT_NACK_RETRIES 4       //requests made before the frame is given up
+#define FRAGMENT_SEQUENCE_WINDOW 8    //older frames than this mean the transmitter restarted
+
+static_assert(FrameLayout<FRAGMENT_FRAME_SIZE, FRAGMENT_PACKET_SIZE>::getFragmentCount() <= PROTOCOL_FRAGMENT_MAX_COUNT,
+  "A frame can't have more than 32 fragments, the missing ones are sent as a 32-bit mask");
+
+//==============================================================================//
+
+struct FragmentHeader {
+  uint8_t flags;
+  uint16_t sequence;    //sequence no. of the frame
+  uint8_t index;        //index of the fragment, count for the parity fragment
+  uint8_t count;        //no. of data fragments in the frame
+  uint16_t frameLength;
+};
+
+//==============================================================================//
+//Returns the no. of data fragments a frame is split into.
+
+inline uint8_t getFragmentCount(uint16_t frameLength) {
+  return uint8_t((frameLength + FRAGMENT_DATA_SIZE - 1) / FRAGMENT_DATA_SIZE);
+}
+
+//------------------------------------------------------------------------------//
+//Returns the no. of data bytes in a fragment. The last one can be shorter.
+
+inline uint16_t getFragmentDataLength(uint16_t frameLength, uint8_t index) {
+  uint32_t offset = uint32_t(index) * FRAGMENT_DATA_SIZE;
+
+  if (offset >= frameLength) {
+    return 0;
+  }
+  return uint16_t(((frameLength - offset) < FRAGMENT_DATA_SIZE) ? (frameLength - offset) : FRAGMENT_DATA_SIZE);
+}
+
+//------------------------------------------------------------------------------//
+
+inline void writeFragmentHeader(const FragmentHeader& header, uint8_t* packet) {
+  packet[0] = FRAGMENT_MARKER;
+  packet[1] = header.flags;
+  packet[2] = uint8_t(header.sequence >> 8);
+  packet[3] = uint8_t(header.sequence & 0xFF);
+  packet[4] = header.index;
+  packet[5] = header.count;
+  packet[6] = uint8_t(header.frameLength >> 8);
+  packet[7] = uint8_t(header.frameLength & 0xFF);
+}
+
+//------------------------------------------------------------------------------//
+//Reads and checks the header of a packet. Returns false if the packet is not a
+//fragment, or doesn't agree with its own header.
+
+inline bool readFragmentHeader(const uint8_t* packet, uint32_t length, FragmentHeader* header) {
+  if ((length <= FRAGMENT_HEADER_SIZE) || (packet[0] != FRAGMENT_MARKER)) {
+    return false;
+  }
+
+  header->flags = packet[1];
+  header->sequence = uint16_t((packet[2] << 8) | packet[3]);
+  header->index = packet[4];
+  header->count = packet[5];
+  header->frameLength = uint16_t((packet[6] << 8) | packet[7]);
+
+  if ((header->frameLength == 0) || (header->frameLength > FRAGMENT_FRAME_SIZE) ||
+      (header->count != getFragmentCount(header->frameLength))) {
+    return false;
+  }
+
+  uint32_t dataLength = length - FRAGMENT_HEADER_SIZE;
+
+  if (header->flags & FRAGMENT_FLAG_PARITY) {
+    return (header->index == header->count) && (dataLength == getFragmentDataLength(header->frameLength, 0));
+  }
+  return (header->index < header->count) && (dataLength == getFragmentDataLength(header->frameLength, header->index));
+}
+
+//==============================================================================//
+//Writes a data fragment of a frame to packet, which must hold FRAGMENT_PACKET_SIZE
+//bytes. Returns the length of the packet.
+
+inline uint16_t writeFragment(const uint8_t* frame, uint16_t frameLength, uint16_t sequence, uint8_t index, uint8_t flags, uint8_t* packet) {
+  FragmentHeader header = {flags, sequence, index, getFragmentCount(frameLength), frameLength};
+  uint16_t dataLength = getFragmentDataLength(frameLength, index);
+
+  writeFragmentHeader(header, packet);
+  memcpy(packet + FRAGMENT_HEADER_SIZE, frame + (uint32_t(index) * FRAGMENT_DATA_SIZE), dataLength);
+  return uint16_t(FRAGMENT_HEADER_SIZE + dataLength);
+}
+
+//------------------------------------------------------------------------------//
+//Writes the parity fragment of a frame, the XOR of all its data fragments. The
+//short last fragment counts as padded with zeros.
+
+inline uint16_t writeParityFragment(const uint8_t* frame, uint16_t frameLength, uint16_t sequence, uint8_t* packet) {
+  uint8_t count = getFragmentCount(frameLength);
+  FragmentHeader header = {FRAGMENT_FLAG_PARITY, sequence, count, count, frameLength};
+  uint16_t parityLength = getFragmentDataLength(frameLength, 0);
+  uint8_t* parity = packet + FRAGMENT_HEADER_SIZE;
+
+  writeFragmentHeader(header, packet);
+  memcpy(parity, frame, parityLength);
+
+  for (uint8_t i=1; i < count; i++) {
+    const uint8_t* data = frame + (uint32_t(i) * FRAGMENT_DATA_SIZE);
+    uint16_t dataLength = getFragmentDataLength(frameLength, i);
+
+    for (uint16_t j=0; j < dataLength; j++) {
+      parity[j] ^= data[j];
+    }
+  }
+  return uint16_t(FRAGMENT_HEADER_SIZE + parityLength);
+}
+
+//==============================================================================//
+//The frames the transmitter has sent recently, by sequence no. The oldest one is
+//replaced by a new frame.
+
+class RetransmitCache {
+  public:
+    RetransmitCache() : next(0) {
+      memset(lengths, 0, sizeof(lengths));
+      memset(sequences, 0, sizeof(sequences));
+    }
+
+    //------------------------------------------------------------------------------//
+    //Keeps a copy of a frame. A frame sent to several receivers is only kept once.
+
+    void store(uint16_t sequence, const uint8_t* frame, uint16_t length) {
+      if ((length == 0) || (length > FRAGMENT_FRAME_SIZE) || (find(sequence, NULL) != NULL)) {
+        return;
+      }
+
+      memcpy(frames[next], frame, length);
+      lengths[next] = length;
+      sequences[next] = sequence;
+      next = (next + 1) % FRAGMENT_CACHE_FRAMES;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Returns the frame with the sequence no., or NULL if it's no longer kept.
+
+    const uint8_t* find(uint16_t sequence, uint16_t* length) const {
+      for (int i=0; i < FRAGMENT_CACHE_FRAMES; i++) {
+        if ((lengths[i] > 0) && (sequences[i] == sequence)) {
+          if (length != NULL) {
+            *length = lengths[i];
+          }
+          return frames[i];
+        }
+      }
+      return NULL;
+    }
+
+  private:
+    uint8_t frames[FRAGMENT_CACHE_FRAMES][FRAGMENT_FRAME_SIZE];
+    uint16_t lengths[FRAGMENT_CACHE_FRAMES];  //0 if the slot is empty
+    uint16_t sequences[FRAGMENT_CACHE_FRAMES];
+    int next; //slot replaced next
+};
+
+//==============================================================================//
+//Puts the frames back together on the receiver. Frames are handed out in the
+//order of their sequence nos. A frame that is still incomplete after its
+//fragments have been asked for FRAGMENT_NACK_RETRIES times is given up.
+
+class FrameAssembler {
+  public:
+    FrameAssembler() {
+      reset();
+    }
+
+    //------------------------------------------------------------------------------//
+    //Forgets all frames, as after the transmitter restarts.
+
+    void reset() {
+      for (int i=0; i < FRAGMENT_ASSEMBLY_SLOTS; i++) {
+        slots[i].used = false;
+      }
+      released = false;
+      lastReleased = 0;
+      newestSeen = false;
+      newestSequence = 0;
+      framesGivenUp = 0;
+      framesDropped = 0;
+      framesRecovered = 0;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Adds a received packet. Returns false if it's not a fragment, or belongs to a
+    //frame that has already been handed out or given up.
+
+    bool addFragment(const uint8_t* packet, uint32_t length, uint32_t now) {
+      FragmentHeader header;
+
+      if (!readFragmentHeader(packet, length, &header)) {
+        return false;
+      }
+
+      if (released && (int16_t(header.sequence - lastReleased) <= 0)) {
+        if (int16_t(header.sequence - lastReleased) > -FRAGMENT_SEQUENCE_WINDOW) {
+          return false; //a late or repeated fragment
+        }
+        reset();  //far behind, the transmitter started over
+      }
+
+      if ((!newestSeen) || (int16_t(header.sequence - newestSequence) > 0)) {
+        newestSequence = header.sequence;
+        newestSeen = true;
+      }
+
+      Slot* slot = getSlot(header);
+
+      if (slot == NULL) {
+        return false;
+      }
+
+      const uint8_t* data = packet + FRAGMENT_HEADER_SIZE;
+      uint32_t dataLength = length - FRAGMENT_HEADER_SIZE;
+
+      if (header.flags & FRAGMENT_FLAG_PARITY) {
+        memcpy(slot->parity, data, dataLength);
+        slot->parityReceived = true;
+      }
+      else {
+        memcpy(slot->data + (uint32_t(header.index) * FRAGMENT_DATA_SIZE), data, dataLength);
+        slot->receivedMask |= (uint32_t(1) << header.index);
+      }
+      slot->lastTime = now;
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Finds a frame whose missing fragments should be asked for now. That's when a
+    //newer frame has started to arrive, or nothing has arrived for a while.
+    //Returns false if there's nothing to ask for.
+
+    bool getMissingFragments(uint32_t now, uint16_t* sequence, uint32_t* mask) {
+      for (int i=0; i < FRAGMENT_ASSEMBLY_SLOTS; i++) {
+        Slot& slot = slots[i];
+
+        if ((!slot.used) || recover(slot) || (slot.nackCount >= FRAGMENT_NACK_RETRIES)) {
+          continue;
+        }
+
+        bool overtaken = (int16_t(newestSequence - slot.sequence) > 0);
+        bool silent = ((now - slot.lastTime) >= FRAGMENT_NACK_DELAY);
+        bool due = (slot.nackCount == 0) || ((now - slot.nackTime) >= FRAGMENT_NACK_INTERVAL);
+
+        if ((overtaken || silent) && due) {
+          slot.nackCount++;
+          slot.nackTime = now;
+          *sequence = slot.sequence;
+          *mask = getAllFragmentsMask(slot.count) & (~slot.receivedMask);
+          return true;
+        }
+      }
+      return false;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Copies the oldest frame to frame if it's complete. Frames given up are skipped.
+    //framesSkipped tells how many frames were missed since the last one handed out.
+    //Returns false if the oldest frame is not ready yet.
+
+    bool popFrame(uint8_t* frame, uint16_t* length, uint16_t* sequence, uint16_t* framesSkipped, uint32_t now) {
+      while (true) {
+        Slot* slot = getOldestSlot();
+
+        if (slot == NULL) {
+          return false;
+        }
+
+        if (recover(*slot)) {
+          uint16_t skipped = released ? uint16_t(slot->sequence - lastReleased - 1) : 0;
+
+          memcpy(frame, slot->data, slot->frameLength);
+          *length = slot->frameLength;
+          *sequence = slot->sequence;
+          *framesSkipped = uint16_t(skipped + framesGivenUp);
+          framesGivenUp = 0;
+          release(*slot);
+          return true;
+        }
+
+        //the last request has gone unanswered
+        if ((slot->nackCount >= FRAGMENT_NACK_RETRIES) && ((now - slot->nackTime) >= FRAGMENT_NACK_INTERVAL)) {
+          drop(*slot);
+          continue;
+        }
+        return false;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+
+    uint32_t getFramesDropped() const {
+      return framesDropped;
+    }
+
+    uint32_t getFramesRecovered() const {
+      return framesRecovered;
+    }
+
+  private:
+    struct Slot {
+      bool used;
+      uint16_t sequence;
+      uint8_t count;
+      uint16_t frameLength;
+      uint32_t receivedMask;  //a bit for each data fragment received
+      bool parityReceived;
+      uint32_t lastTime;      //when the last fragment arrived
+      uint32_t nackTime;      //when the missing fragments were last asked for
+      uint8_t nackCount;
+      uint8_t data[FRAGMENT_MAX_COUNT * FRAGMENT_DATA_SIZE];
+      uint8_t parity[FRAGMENT_DATA_SIZE];
+    };
+
+    Slot slots[FRAGMENT_ASSEMBLY_SLOTS];
+    bool released;          //true once a frame has been handed out or given up
+    uint16_t lastReleased;  //sequence no. of that frame
+    bool newestSeen;
+    uint16_t newestSequence;
+    uint16_t framesGivenUp; //frames given up since the last one handed out
+    uint32_t framesDropped;
+    uint32_t framesRecovered; //frames completed with the parity fragment
+
+    //------------------------------------------------------------------------------//
+
+    static uint32_t getAllFragmentsMask(uint8_t count) {
+      return (count >= 32) ? 0xFFFFFFFF : ((uint32_t(1) << count) - 1);
+    }
+
+    //------------------------------------------------------------------------------//
+    //Returns the slot of the frame, taking a new one for a new frame. When all the
+    //slots are taken, the oldest frame is given up for a newer one.
+
+    Slot* getSlot(const FragmentHeader& header) {
+      Slot* vacant = NULL;
+
+      for (int i=0; i < FRAGMENT_ASSEMBLY_SLOTS; i++) {
+        if (slots[i].used && (slots[i].sequence == header.sequence)) {
+          //the same sequence no. with another frame length is not the same frame
+          return (slots[i].frameLength == header.frameLength) ? &slots[i] : NULL;
+        }
+        if ((!slots[i].used) && (vacant == NULL)) {
+          vacant = &slots[i];
+        }
+      }
+
+      if (vacant == NULL) {
+        Slot* oldest = getOldestSlot();
+
+        if (int16_t(header.sequence - oldest->sequence) < 0) {
+          return NULL;
+        }
+        drop(*oldest);
+        vacant = oldest;
+      }
+
+      vacant->used = true;
+      vacant->sequence = header.sequence;
+      vacant->count = header.count;
+      vacant->frameLength = header.frameLength;
+      vacant->receivedMask = 0;
+      vacant->parityReceived = false;
+      vacant->nackTime = 0;
+      vacant->nackCount = 0;
+
+      //the parity counts the short last fragment as padded with zeros
+      memset(vacant->data, 0, sizeof(vacant->data));
+      return vacant;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    Slot* getOldestSlot() {
+      Slot* oldest = NULL;
+
+      for (int i=0; i < FRAGMENT_ASSEMBLY_SLOTS; i++) {
+        if (slots[i].used && ((oldest == NULL) || (int16_t(slots[i].sequence - oldest->sequence) < 0))) {
+          oldest = &slots[i];
+        }
+      }
+      return oldest;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Returns true if the frame is complete, rebuilding a single missing fragment
+    //from the parity fragment if needed.
+
+    bool recover(Slot& slot) {
+      uint32_t missingMask = getAllFragmentsMask(slot.count) & (~slot.receivedMask);
+
+      if (missingMask == 0) {
+        return true;
+      }
+
+      //only one fragment can be rebuilt
+      if ((!slot.parityReceived) || ((missingMask & (missingMask - 1)) != 0)) {
+        return false;
+      }
+
+      uint8_t missing = 0;
+
+      while (((missingMask >> missing) & 1) == 0) {
+        missing++;
+      }
+
+      uint8_t* rebuilt = slot.data + (uint32_t(missing) * FRAGMENT_DATA_SIZE);
+      uint16_t rebuiltLength = getFragmentDataLength(slot.frameLength, missing);
+      memcpy(rebuilt, slot.parity, rebuiltLength);
+
+      for (uint8_t i=0; i < slot.count; i++) {
+        const uint8_t* data = slot.data + (uint32_t(i) * FRAGMENT_DATA_SIZE);
+
+        if (i == missing) {
+          continue;
+        }
+        for (uint16_t j=0; j < rebuiltLength; j++) {
+          rebuilt[j] ^= data[j];
+        }
+      }
+
+      slot.receivedMask |= (uint32_t(1) << missing);
+      framesRecovered++;
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void release(Slot& slot) {
+      slot.used = false;
+
+      if ((!released) || (int16_t(slot.sequence - lastReleased) > 0)) {
+        lastReleased = slot.sequence;
+        released = true;
+      }
+    }
+
+    void drop(Slot& slot) {
+      framesGivenUp++;
+      framesDropped++;
+      release(slot);
+    }
+};
+
+#endif
@@ -0,0 +1,231 @@
+//==============================================================================//
+//
+//  AUDIFI Frame Check
+//  Version : v0.1
+//
+//  Checked frames on the serial link, used when both sides agreed on
+//  PROTOCOL_OPTION_CHECKED_FRAMES in the LINK# line. Each frame is sent as
+//
+//    [sync word, 4 bytes][sequence no.][frame header and payload][CRC-32, 4 bytes]
+//
+//  The CRC-32 is the IEEE 802.3 one (as zlib's), over the sequence no. and the
+//  frame, LSB first. The sequence no. starts at 0 once the link is agreed on and
+//  counts the frames, not the resends. A frame that fails its CRC is never passed
+//  on. The transmitter looks for the next sync word instead of throwing away
+//  everything it has, and asks for each frame it's missing with "RS#<sequence no.>".
+//  The server keeps the last FRAME_CHECK_HISTORY_FRAMES frames to send them again
+//  from, ahead of the frames due next, and without using up any credit.
+//
+//  The server works out the CRC 8 bytes at a time with the slice-by-8 tables,
+//  and the ESP32 uses its ROM routine. The CRC32 instruction of SSE4.2 is for the
+//  Castagnoli polynomial, which the ROM doesn't have, so it's not used.
+//
+//  This file is shared by the server application and the transmitter. Copy it to
+//  the sketch folder along with the sketch.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_FRAME_CHECK_H
+#define AUDIFI_FRAME_CHECK_H
+
+#include "AUDIFI-Protocol.h"
+
+#ifdef ARDUINO_ARCH_ESP32
+  #include <rom/crc.h>
+#endif
+
+#define FRAME_CHECK_SYNC_SIZE 4
+#define FRAME_CHECK_PREFIX_SIZE 5     //sync word and sequence no.
+#define FRAME_CHECK_CRC_SIZE 4
+#define FRAME_CHECK_OVERHEAD (FRAME_CHECK_PREFIX_SIZE + FRAME_CHECK_CRC_SIZE)
+#define FRAME_CHECK_WINDOW 128        //sequence nos. less than this far ahead are new, the others old
+#define FRAME_CHECK_HISTORY_FRAMES 16 //frames the server keeps for RS#, a divisor of 256
+
+//no proper prefix of it is also a suffix, so a search can start over at the
+//byte that broke a match
+static const uint8_t frameSyncWord[FRAME_CHECK_SYNC_SIZE] = {0xA5, 0x5A, 0xC3, 0x3C};
+
+//==============================================================================//
+//Adds length bytes to the CRC of the bytes before. The CRC of nothing is 0, so
+//a CRC is started with 0, as with zlib's crc32().
+
+#ifdef ARDUINO_ARCH_ESP32
+
+inline uint32_t crc32Update(uint32_t crc, const uint8_t* data, uint32_t length) {
+  return crc32_le(crc, data, length);
+}
+
+#else
+
+//the slice-by-8 tables. the first one is the classic bytewise table, and each of
+//the others moves a byte's effect one byte further along.
+struct Crc32Tables {
+  uint32_t table[8][256];
+
+  Crc32Tables() {
+    for (uint32_t i=0; i < 256; i++) {
+      uint32_t crc = i;
+
+      for (int j=0; j < 8; j++) {
+        crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+      }
+      table[0][i] = crc;
+    }
+    for (int k=1; k < 8; k++) {
+      for (uint32_t i=0; i < 256; i++) {
+        table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+      }
+    }
+  }
+};
+
+inline const Crc32Tables& getCrc32Tables() {
+  static const Crc32Tables tables;  //built on first use
+  return tables;
+}
+
+//------------------------------------------------------------------------------//
+//A byte at a time, the reference for the one below.
+
+inline uint32_t crc32UpdateBytewise(uint32_t crc, const uint8_t* data, uint32_t length) {
+  const uint32_t* table = getCrc32Tables().table[0];
+  crc = ~crc;
+
+  for (uint32_t i=0; i < length; i++) {
+    crc = (crc >> 8) ^ table[(crc ^ data[i]) & 0xFF];
+  }
+  return ~crc;
+}
+
+//------------------------------------------------------------------------------//
+
+inline uint32_t crc32Update(uint32_t crc, const uint8_t* data, uint32_t length) {
+  const Crc32Tables& tables = getCrc32Tables();
+  crc = ~crc;
+
+  while (length >= 8) {
+    uint32_t low = crc ^ (uint32_t(data[0]) | (uint32_t(data[1]) << 8) | (uint32_t(data[2]) << 16) | (uint32_t(data[3]) << 24));
+    uint32_t high = uint32_t(data[4]) | (uint32_t(data[5]) << 8) | (uint32_t(data[6]) << 16) | (uint32_t(data[7]) << 24);
+
+    crc = tables.table[7][low & 0xFF] ^ tables.table[6][(low >> 8) & 0xFF] ^
+          tables.table[5][(low >> 16) & 0xFF] ^ tables.table[4][low >> 24] ^
+          tables.table[3][high & 0xFF] ^ tables.table[2][(high >> 8) & 0xFF] ^
+          tables.table[1][(high >> 16) & 0xFF] ^ tables.table[0][high >> 24];
+    data += 8;
+    length -= 8;
+  }
+
+  for (uint32_t i=0; i < length; i++) {
+    crc = (crc >> 8) ^ tables.table[0][(crc ^ data[i]) & 0xFF];
+  }
+  return ~crc;
+}
+
+#endif
+
+//==============================================================================//
+//The CRC a checked frame is sent with.
+
+inline uint32_t getFrameCrc(uint8_t sequence, const uint8_t* frame, uint32_t length) {
+  return crc32Update(crc32Update(0, &sequence, 1), frame, length);
+}
+
+//------------------------------------------------------------------------------//
+//True if the 4 CRC bytes that came after the frame match it.
+
+inline bool checkFrameCrc(uint8_t sequence, const uint8_t* frame, uint32_t length, const uint8_t* crcBytes) {
+  uint32_t crc = uint32_t(crcBytes[0]) | (uint32_t(crcBytes[1]) << 8) | (uint32_t(crcBytes[2]) << 16) |
+                 (uint32_t(crcBytes[3]) << 24);
+  return crc == getFrameCrc(sequence, frame, length);
+}
+
+//------------------------------------------------------------------------------//
+//Writes the frame to envelope as a checked frame. The envelope has to have room
+//for length + FRAME_CHECK_OVERHEAD bytes. Returns the no. of bytes written.
+
+inline uint32_t writeCheckedFrame(uint8_t* envelope, uint8_t sequence, const uint8_t* frame, uint32_t length) {
+  memcpy(envelope, frameSyncWord, FRAME_CHECK_SYNC_SIZE);
+  envelope[FRAME_CHECK_SYNC_SIZE] = sequence;
+  memcpy(envelope + FRAME_CHECK_PREFIX_SIZE, frame, length);
+
+  uint32_t crc = getFrameCrc(sequence, frame, length);
+  uint8_t* crcBytes = envelope + FRAME_CHECK_PREFIX_SIZE + length;
+
+  for (int i=0; i < FRAME_CHECK_CRC_SIZE; i++) {
+    crcBytes[i] = uint8_t(crc >> (8 * i));
+  }
+  return length + FRAME_CHECK_OVERHEAD;
+}
+
+//------------------------------------------------------------------------------//
+//The no. of sequence nos. from expected to sequence, if sequence is a new frame,
+//or -1 if it's one that was seen before.
+
+inline int getSequenceGap(uint8_t expected, uint8_t sequence) {
+  uint8_t gap = uint8_t(sequence - expected);
+  return (gap < FRAME_CHECK_WINDOW) ? int(gap) : -1;
+}
+
+//==============================================================================//
+//The frames last sent by the server, ready to be sent again. A frame is wrapped
+//once, in its slot, and the same bytes are written each time it's sent. Its
+//slot is reused FRAME_CHECK_HISTORY_FRAMES frames later.
+
+class FrameHistory {
+  public:
+    FrameHistory() {
+      reset();
+    }
+
+    //------------------------------------------------------------------------------//
+    //Forgets the frames and starts over at sequence no. 0, as a new link does.
+
+    void reset() {
+      nextSequence = 0;
+
+      for (int i=0; i < FRAME_CHECK_HISTORY_FRAMES; i++) {
+        lengths[i] = 0;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Wraps the frame with the next sequence no. and keeps it. Returns the checked
+    //frame, and its length in envelopeLength.
+
+    const uint8_t* add(const uint8_t* frame, uint32_t length, uint32_t* envelopeLength) {
+      int slot = nextSequence % FRAME_CHECK_HISTORY_FRAMES;
+      lengths[slot] = writeCheckedFrame(envelopes[slot], nextSequence, frame, length);
+      sequences[slot] = nextSequence;
+      nextSequence++;
+
+      *envelopeLength = lengths[slot];
+      return envelopes[slot];
+    }
+
+    //------------------------------------------------------------------------------//
+    //The checked frame with the sequence no., or NULL if it's no longer kept.
+
+    const uint8_t* find(uint8_t sequence, uint32_t* envelopeLength) const {
+      int slot = sequence % FRAME_CHECK_HISTORY_FRAMES;
+
+      if ((lengths[slot] == 0) || (sequences[slot] != sequence)) {
+        return NULL;
+      }
+      *envelopeLength = lengths[slot];
+      return envelopes[slot];
+    }
+
+    //------------------------------------------------------------------------------//
+
+    uint8_t getNextSequence() const {
+      return nextSequence;
+    }
+
+  private:
+    uint8_t envelopes[FRAME_CHECK_HISTORY_FRAMES][REQUEST_SIZE + FRAME_CHECK_OVERHEAD];
+    uint32_t lengths[FRAME_CHECK_HISTORY_FRAMES];
+    uint8_t sequences[FRAME_CHECK_HISTORY_FRAMES];
+    uint8_t nextSequence;
+};
+
+#endif
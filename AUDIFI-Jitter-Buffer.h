@@ -0,0 +1,315 @@
+//==============================================================================//
+//
+//  AUDIFI Jitter Buffer
+//  Version : v0.1
+//
+//  Decides when the receiver starts playing, when it asks for more frames, and
+//  how fast it plays. It holds no samples itself, it only watches the depth of
+//  the audio buffer.
+//
+//  Playback starts as soon as a small prefill is buffered. From then on a frame
+//  is requested whenever the depth, counting the frames on the way, falls below
+//  the low watermark, and the depth never goes past the high watermark, one
+//  frame above it. The low watermark follows the measured time from a request
+//  to the arrival of its frame, so that the next frame comes in before the
+//  buffer runs dry. Stalls are rare but long, so the longest recent delay is
+//  remembered for a while too. An underrun raises the watermark for a while.
+//
+//  The receiver's timer and the source's clock never run at exactly the same
+//  rate. If the depth keeps drifting out of its usual range, playback is sped up
+//  or slowed down a little by dropping or repeating single samples.
+//
+//  This file is shared by the receiver and the benchmark. Copy it to the sketch
+//  folder along with the sketch.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_JITTER_BUFFER_H
+#define AUDIFI_JITTER_BUFFER_H
+
+#include <stdint.h>
+#include <math.h>
+
+#define JITTER_PREFILL_MS 200         //buffered audio needed to start playing
+#define JITTER_MIN_DEPTH_MS 250       //least low watermark
+#define JITTER_DELAY_DEVIATIONS 4     //deviations of the delay added to its mean for the low watermark
+#define JITTER_PEAK_DECAY_FRAMES 4096  //frames over which a stall is mostly forgotten
+#define JITTER_UNDERRUN_BOOST_MS 500  //raise of the low watermark after an underrun
+#define JITTER_MAX_BOOST_MS 3000
+#define JITTER_MAX_REQUESTS 16        //max no. of requests waiting for their frame
+#define JITTER_DRIFT_TIME_CONSTANT 20000  //smoothing of the depth for drift, ms
+#define JITTER_MAX_DRIFT_PPM 1000     //max. playback rate correction
+
+//==============================================================================//
+
+class JitterBuffer {
+  public:
+    JitterBuffer() {
+      configure(11025, 11025, 110250);
+    }
+
+    //------------------------------------------------------------------------------//
+    //Sets the playback rate, the no. of samples in a full frame, and the capacity of
+    //the audio buffer, all in samples. Forgets all measurements.
+
+    void configure(uint32_t sampleRate, uint32_t frameSamples, uint32_t capacity,
+                   uint32_t prefillMs = JITTER_PREFILL_MS, uint32_t minDepthMs = JITTER_MIN_DEPTH_MS) {
+      this->sampleRate = sampleRate;
+      this->frameSamples = frameSamples;
+      this->capacity = capacity;
+      prefillDepth = msToSamples(prefillMs);
+      minDepth = msToSamples(minDepthMs);
+      reset();
+    }
+
+    //------------------------------------------------------------------------------//
+    //Forgets the measurements, as when a new stream starts.
+
+    void reset() {
+      delayMeasured = false;
+      delayMean = 0;
+      delayDeviation = 0;
+      delayPeak = 0;
+      delayLeast = 0;
+      boost = 0;
+      startDepth = prefillDepth;
+      requestCount = 0;
+      requestFirst = 0;
+      playing = false;
+      smoothedDepth = 0;
+      lastUpdateTime = 0;
+      driftPpm = 0;
+      underrunCount = 0;
+      updateWatermarks();
+    }
+
+    //------------------------------------------------------------------------------//
+    //Changes the no. of samples in a full frame and the capacity, and keeps the
+    //measurements, as when the stream switches between mono and stereo frames.
+
+    void resize(uint32_t frameSamples, uint32_t capacity) {
+      this->frameSamples = frameSamples;
+      this->capacity = capacity;
+      updateWatermarks();
+    }
+
+    //------------------------------------------------------------------------------//
+    //The receiver asked for frames.
+
+    void addRequests(uint32_t now, uint32_t count) {
+      for (uint32_t i=0; (i < count) && (requestCount < JITTER_MAX_REQUESTS); i++) {
+        requestTimes[(requestFirst + requestCount) % JITTER_MAX_REQUESTS] = now;
+        requestCount++;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Requests that will never be answered, such as for frames lost on the way.
+    //The oldest ones go first.
+
+    void dropRequests(uint32_t count) {
+      count = (count < requestCount) ? count : requestCount;
+      requestFirst = (requestFirst + count) % JITTER_MAX_REQUESTS;
+      requestCount -= count;
+    }
+
+    //------------------------------------------------------------------------------//
+    //A frame has been added to the audio buffer. Its delay is measured from the
+    //oldest request still waiting, and the watermarks are moved with it. Returns
+    //the delay in ms, or -1 if no request was waiting.
+
+    int32_t addFrame(uint32_t now) {
+      int32_t measuredDelay = -1;
+
+      if (requestCount > 0) {
+        measuredDelay = int32_t(now - requestTimes[requestFirst]);
+        float delay = float(measuredDelay);
+        dropRequests(1);
+
+        //smoothed like a round trip time, mean and mean deviation. the peak falls
+        //back to the mean slowly, and the least delay, that of the link itself,
+        //rises slowly.
+        if (!delayMeasured) {
+          delayMean = delay;
+          delayDeviation = delay / 2;
+          delayPeak = delay;
+          delayLeast = delay;
+          delayMeasured = true;
+        }
+        else {
+          delayDeviation += (fabsf(delay - delayMean) - delayDeviation) / 4;
+          delayMean += (delay - delayMean) / 8;
+          delayPeak = (delay > delayPeak) ? delay : (delayPeak - ((delayPeak - delayMean) / JITTER_PEAK_DECAY_FRAMES));
+          delayLeast = (delay < delayLeast) ? delay : (delayLeast + ((delay - delayLeast) / JITTER_PEAK_DECAY_FRAMES));
+        }
+      }
+
+      //an underrun is forgotten slowly
+      boost -= boost / JITTER_PEAK_DECAY_FRAMES;
+      updateWatermarks();
+      return measuredDelay;
+    }
+
+    //------------------------------------------------------------------------------//
+    //The buffer ran dry. Playback starts again at the low watermark, which is raised.
+
+    void addUnderrun() {
+      uint32_t maxBoost = msToSamples(JITTER_MAX_BOOST_MS);
+      boost += msToSamples(JITTER_UNDERRUN_BOOST_MS);
+      boost = (boost > maxBoost) ? maxBoost : boost;
+      underrunCount++;
+      playing = false;
+      updateWatermarks();
+      startDepth = lowWatermark;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Returns true if there's enough in the buffer to start playing.
+
+    bool isReady(uint32_t depth) const {
+      return (depth >= startDepth) || (depth >= (capacity - frameSamples));
+    }
+
+    //------------------------------------------------------------------------------//
+    //Returns the no. of frames to ask for now, given the depth of the buffer and
+    //the frames already on the way.
+
+    uint32_t getFramesWanted(uint32_t depth, uint32_t framesInFlight) const {
+      uint32_t expected = depth + (framesInFlight * frameSamples);
+      uint32_t level = playing ? lowWatermark : ((startDepth > lowWatermark) ? startDepth : lowWatermark);
+
+      if (expected >= level) {
+        return 0;
+      }
+      return (level - expected + frameSamples - 1) / frameSamples;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Called regularly with the depth of the buffer, and whether it's being played.
+    //When the source keeps up, each frame arrives about the shortest delay after
+    //the depth fell below the low watermark, so the depth saws between there and a
+    //frame above, and its mean is half a frame above. A source that can't keep up,
+    //such as one with a slower clock, leaves the depth lower than that. The depth
+    //is smoothed, and once it's more than a quarter of a frame off, the playback
+    //rate is corrected in proportion.
+
+    void update(uint32_t now, uint32_t depth, bool playing) {
+      uint32_t elapsed = now - lastUpdateTime;
+      lastUpdateTime = now;
+
+      if (!playing) {
+        smoothedDepth = float(depth);
+        driftPpm = 0;
+        this->playing = false;
+        return;
+      }
+
+      if (!this->playing) {
+        this->playing = true;
+        smoothedDepth = float(depth);
+        return;
+      }
+
+      float alpha = float(elapsed) / JITTER_DRIFT_TIME_CONSTANT;
+      smoothedDepth += ((alpha < 1) ? alpha : 1) * (float(depth) - smoothedDepth);
+
+      float arrivalDepth = float(lowWatermark) - (delayLeast * sampleRate / 1000);
+      arrivalDepth = (arrivalDepth > 0) ? arrivalDepth : 0;
+      float error = smoothedDepth - (arrivalDepth + (frameSamples / 2));
+      float band = float(frameSamples) / 4;
+
+      if (fabsf(error) <= band) {
+        error = 0;
+      }
+      else {
+        error -= (error > 0) ? band : -band;
+      }
+
+      //a further quarter of a frame off is the full correction
+      float ppm = error * JITTER_MAX_DRIFT_PPM / band;
+      ppm = (ppm > JITTER_MAX_DRIFT_PPM) ? JITTER_MAX_DRIFT_PPM : ((ppm < -JITTER_MAX_DRIFT_PPM) ? -JITTER_MAX_DRIFT_PPM : ppm);
+      driftPpm = int32_t(ppm);
+    }
+
+    //------------------------------------------------------------------------------//
+    //The playback rate correction. Positive means a sample should be dropped every
+    //1000000 / driftPpm samples, negative means one should be repeated.
+
+    int32_t getDriftPpm() const {
+      return driftPpm;
+    }
+
+    uint32_t getLowWatermark() const {
+      return lowWatermark;
+    }
+
+    uint32_t getHighWatermark() const {
+      return highWatermark;
+    }
+
+    uint32_t getStartDepth() const {
+      return startDepth;
+    }
+
+    float getDelayMean() const {
+      return delayMean;
+    }
+
+    float getDelayDeviation() const {
+      return delayDeviation;
+    }
+
+    float getDelayPeak() const {
+      return delayPeak;
+    }
+
+    uint32_t getUnderrunCount() const {
+      return underrunCount;
+    }
+
+  private:
+    uint32_t sampleRate;
+    uint32_t frameSamples;
+    uint32_t capacity;
+    uint32_t prefillDepth;
+    uint32_t minDepth;
+    uint32_t startDepth;    //depth at which playback starts
+    uint32_t lowWatermark;  //frames are requested below this depth
+    uint32_t highWatermark; //and the depth never goes past this
+    bool delayMeasured;
+    float delayMean;        //time from a request to its frame, ms
+    float delayDeviation;
+    float delayPeak;        //longest recent delay
+    float delayLeast;       //shortest recent delay
+    uint32_t boost;         //raise of the low watermark after underruns, samples
+    uint32_t requestTimes[JITTER_MAX_REQUESTS];
+    uint32_t requestCount;
+    uint32_t requestFirst;
+    bool playing;
+    float smoothedDepth;
+    uint32_t lastUpdateTime;
+    int32_t driftPpm;
+    uint32_t underrunCount;
+
+    //------------------------------------------------------------------------------//
+
+    uint32_t msToSamples(float ms) const {
+      return uint32_t((ms * sampleRate) / 1000);
+    }
+
+    //------------------------------------------------------------------------------//
+    //The low watermark covers the delay of a frame with a margin for its jitter,
+    //or the longest recent delay. There must be room for a frame above it.
+
+    void updateWatermarks() {
+      float delay = delayMean + (JITTER_DELAY_DEVIATIONS * delayDeviation);
+      uint32_t depth = msToSamples((delay > delayPeak) ? delay : delayPeak) + boost;
+      uint32_t maxDepth = (capacity > frameSamples) ? (capacity - frameSamples) : 0;
+
+      depth = (depth < minDepth) ? minDepth : depth;
+      lowWatermark = (depth > maxDepth) ? maxDepth : depth;
+      highWatermark = lowWatermark + frameSamples;
+    }
+};
+
+#endif
@@ -0,0 +1,258 @@
+//==============================================================================//
+//
+//  AUDIFI Link Negotiation
+//  Version : v0.1
+//
+//  The server application's side of the capability exchange described in
+//  AUDIFI-Protocol.h. The transmitter is asked for its capabilities, and each
+//  baud rate both sides have, the fastest first, is switched to and tested with
+//  the test pattern before it's kept. The transmitter's side is in its sketch and
+//  in the loopback device.
+//
+//  discoverLink() finds the transmitter without being told the port. Every
+//  candidate port is probed with READY? at the same time, each from a thread of
+//  its own, and the first one to answer is kept.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_LINK_NEGOTIATION_H
+#define AUDIFI_LINK_NEGOTIATION_H
+
+#include "AUDIFI-Protocol.h"
+#include "AUDIFI-Serial-Transport.h"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define LINK_PROBE_TIMEOUT 100  //time to wait for the YES! to a probe, ms
+
+//a transmitter found by discoverLink()
+struct LinkDiscovery {
+  SerialTransport* port;  //open at baudRate, owned by the caller
+  std::string portName;
+  uint32_t baudRate;  //the rate it answered at
+  LinkCapabilities capabilities;
+};
+
+//==============================================================================//
+//Writes a negotiation line and the NL, and waits until it's sent.
+
+inline bool writeLinkLine(SerialTransport* port, const char* text) {
+  char line[PROTOCOL_LINE_MAX_LENGTH];
+  int length = snprintf(line, sizeof(line), "%s\n", text);
+
+  if ((length <= 0) || (length >= int(sizeof(line)))) {
+    return false;
+  }
+  return port->write((const uint8_t*) line, uint32_t(length));
+}
+
+//==============================================================================//
+//Waits for the next line that isn't empty. Returns false if none arrived
+//before the timeout.
+
+inline bool readLinkLine(SerialTransport* port, char* line, uint32_t timeout) {
+  uint32_t entryTime = millisNow();
+
+  while (true) {
+    uint32_t elapsed = millisNow() - entryTime;
+    uint32_t remaining = (elapsed < timeout) ? (timeout - elapsed) : 0;
+
+    if (port->readLine(line, PROTOCOL_LINE_MAX_LENGTH, remaining) <= 0) {
+      return false;
+    }
+    if (line[0] != 0) {
+      return true;
+    }
+  }
+}
+
+//==============================================================================//
+//Sends READY? at the port's current rate and waits for the YES!. Lines that are
+//not a YES!, eg. a request left over from before, are skipped. Returns false if
+//no valid answer came back before the timeout.
+
+inline bool queryLinkCapabilities(SerialTransport* port, uint32_t timeout, LinkCapabilities* capabilities) {
+  char line[PROTOCOL_LINE_MAX_LENGTH];
+  uint32_t entryTime = millisNow();
+  port->purgeInput();
+
+  if (!writeLinkLine(port, "READY?")) {
+    return false;
+  }
+
+  while (true) {
+    uint32_t elapsed = millisNow() - entryTime;
+
+    if ((elapsed >= timeout) || (!readLinkLine(port, line, timeout - elapsed))) {
+      return false;
+    }
+    if (parseCapabilities(line, capabilities)) {
+      return true;
+    }
+  }
+}
+
+//==============================================================================//
+//Sends the LINK# line and waits for the YES! at the port's current rate.
+
+inline bool confirmLinkSettings(SerialTransport* port, const LinkSettings& settings, uint32_t timeout) {
+  char line[PROTOCOL_LINE_MAX_LENGTH];
+  formatLinkSettings(line, sizeof(line), settings);
+
+  if (!writeLinkLine(port, line)) {
+    return false;
+  }
+  return readLinkLine(port, line, timeout) && (strcmp(line, "YES!") == 0);
+}
+
+//==============================================================================//
+//Moves both sides to settings.baudRate, checks that the test pattern gets there
+//and back unchanged, and sends the LINK#. If any of it fails, the port goes back
+//to startBaudRate and this returns once the transmitter has done the same.
+
+inline bool tryLinkBaudRate(SerialTransport* port, const LinkSettings& settings, uint32_t startBaudRate) {
+  char line[PROTOCOL_LINE_MAX_LENGTH];
+  snprintf(line, sizeof(line), "BAUD#%lu", (unsigned long) settings.baudRate);
+
+  if ((!writeLinkLine(port, line)) || (!readLinkLine(port, line, PROTOCOL_TEST_TIMEOUT)) || (strcmp(line, "OK!") != 0)) {
+    return false; //the transmitter stays where it is
+  }
+
+  //the transmitter switches right after its OK!
+  uint32_t switchTime = millisNow();
+  bool passed = port->setBaudRate(settings.baudRate);
+
+  if (passed) {
+    sleepMillis(PROTOCOL_SWITCH_DELAY);
+    port->purgeInput(); //bytes received while switching are garbage
+
+    uint8_t pattern[PROTOCOL_TEST_PATTERN_SIZE];
+    uint8_t echo[PROTOCOL_TEST_PATTERN_SIZE];
+
+    for (uint32_t i=0; i < PROTOCOL_TEST_PATTERN_SIZE; i++) {
+      pattern[i] = getTestPatternByte(i);
+    }
+
+    passed = port->write(pattern, PROTOCOL_TEST_PATTERN_SIZE) &&
+             (port->read(echo, PROTOCOL_TEST_PATTERN_SIZE, PROTOCOL_TEST_TIMEOUT / 2) == PROTOCOL_TEST_PATTERN_SIZE) &&
+             (memcmp(pattern, echo, PROTOCOL_TEST_PATTERN_SIZE) == 0);
+  }
+
+  //the LINK# has to arrive before the transmitter gives up on the rate
+  if (passed) {
+    uint32_t elapsed = millisNow() - switchTime;
+    passed = (elapsed < PROTOCOL_TEST_TIMEOUT) && confirmLinkSettings(port, settings, PROTOCOL_TEST_TIMEOUT);
+  }
+
+  if (!passed) {
+    port->setBaudRate(startBaudRate);
+    uint32_t elapsed = millisNow() - switchTime;
+    uint32_t settleTime = PROTOCOL_TEST_TIMEOUT + (2 * PROTOCOL_SWITCH_DELAY);
+
+    if (elapsed < settleTime) {
+      sleepMillis(settleTime - elapsed);
+    }
+    port->purgeInput();
+  }
+  return passed;
+}
+
+//==============================================================================//
+//Agrees on the link with a transmitter that answered READY? at startBaudRate.
+//The rates faster than that which both sides have are tried, the fastest first,
+//and the link stays at startBaudRate if none of them works. A version 0
+//transmitter is not sent anything. The port is left at the agreed rate.
+//Returns false if not even the LINK# at startBaudRate got through.
+
+inline bool negotiateLink(SerialTransport* port, const LinkCapabilities& local, const LinkCapabilities& remote,
+                          uint8_t preferredCodec, uint32_t startBaudRate, LinkSettings* settings) {
+  *settings = chooseLinkSettings(local, remote, preferredCodec, startBaudRate);
+
+  if (remote.version == 0) {
+    return true;
+  }
+
+  uint8_t baudRates = local.baudRates & remote.baudRates;
+
+  for (int i = PROTOCOL_BAUDRATE_COUNT - 1; (i >= 0) && (protocolBaudRates[i] > startBaudRate); i--) {
+    if (baudRates & (1 << i)) {
+      settings->baudRate = protocolBaudRates[i];
+
+      if (tryLinkBaudRate(port, *settings, startBaudRate)) {
+        return true;
+      }
+      printf("Link test at %lu baud failed.\n", (unsigned long) protocolBaudRates[i]);
+    }
+  }
+
+  settings->baudRate = startBaudRate;
+  return confirmLinkSettings(port, *settings, PROTOCOL_NEGOTIATE_TIMEOUT);
+}
+
+//==============================================================================//
+//Opens the port and sends READY? at each of the rates in turn, the base rate
+//first, until a YES! comes back, another port has answered, or the timeout
+//runs out. The first port to answer takes winner and keeps its port open.
+
+inline void probeLinkPort(const std::string& portName, int index, uint8_t baudRates, uint32_t timeout,
+                          std::atomic<int>* winner, LinkDiscovery* result) {
+  uint32_t entryTime = millisNow();
+  SerialTransport* port = createSerialTransport();
+
+  if (!port->open(portName.c_str(), PROTOCOL_BASE_BAUDRATE)) {
+    delete port;
+    return;
+  }
+
+  while (((millisNow() - entryTime) < timeout) && (*winner < 0)) {
+    for (int i=0; (i < PROTOCOL_BAUDRATE_COUNT) && (*winner < 0); i++) {
+      if (((baudRates & (1 << i)) == 0) || (!port->setBaudRate(protocolBaudRates[i]))) {
+        continue;
+      }
+
+      LinkCapabilities capabilities;
+
+      if (queryLinkCapabilities(port, LINK_PROBE_TIMEOUT, &capabilities)) {
+        int none = -1;
+
+        if (winner->compare_exchange_strong(none, index)) {
+          result->port = port;
+          result->portName = portName;
+          result->baudRate = protocolBaudRates[i];
+          result->capabilities = capabilities;
+          return;
+        }
+      }
+    }
+  }
+  port->close();
+  delete port;
+}
+
+//==============================================================================//
+//Probes all the ports at once at the rates in baudRates, for at most timeout ms.
+//Returns false if none of them answered.
+
+inline bool discoverLink(const std::vector<std::string>& portNames, uint8_t baudRates, uint32_t timeout,
+                         LinkDiscovery* result) {
+  std::atomic<int> winner(-1);
+  std::vector<LinkDiscovery> probes(portNames.size());
+  std::vector<std::thread> threads;
+
+  for (size_t i=0; i < portNames.size(); i++) {
+    threads.push_back(std::thread(probeLinkPort, std::cref(portNames[i]), int(i), baudRates, timeout, &winner, &probes[i]));
+  }
+  for (size_t i=0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+
+  if (winner < 0) {
+    return false;
+  }
+  *result = probes[winner];
+  return true;
+}
+
+#endif
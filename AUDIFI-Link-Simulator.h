@@ -0,0 +1,994 @@
+//==============================================================================//
+//
+//  AUDIFI Link Simulator
+//  Version : v0.1
+//
+//  Runs the whole chain in one process, in simulated time : the server's
+//  streamAudio(), the transmitter's serialTask() and loop(), and the receiver's
+//  loop(), requestData() and streamTask(). Each is a state machine that follows
+//  the real code step by step, and uses the same fragment, jitter buffer and
+//  ring buffer code. Only the audio is made up, as a counting pattern that the
+//  receiver checks. In stereo frames, the pattern counts on from each left sample
+//  to its right one.
+//
+//  The serial link carries a byte every 10 bits at the baud rate, one way at a
+//  time. The UDP link has an airtime per byte and per packet, a latency with
+//  jitter, and loses or holds back packets at random, both ways.
+//
+//  Time moves in steps of LINK_SIM_STEP us, and every part runs once per step,
+//  as if each had its own core. That's close enough for links that are slow
+//  compared to the step.
+//
+//  This file is used by the benchmark.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_LINK_SIMULATOR_H
+#define AUDIFI_LINK_SIMULATOR_H
+
+#include "AUDIFI-ADPCM.h"
+#include "AUDIFI-Fragment.h"
+#include "AUDIFI-Jitter-Buffer.h"
+#include "AUDIFI-Ring-Buffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define LINK_SIM_STEP 100             //us of simulated time per step
+#define LINK_SIM_FRAME_HEADER_SIZE PROTOCOL_FRAME_HEADER_SIZE
+#define LINK_SIM_MAX_FRAME_SAMPLES (FRAGMENT_FRAME_SIZE - LINK_SIM_FRAME_HEADER_SIZE)
+#define LINK_SIM_SAMPLE_RATE 11025    //the receiver's playback rate
+#define LINK_SIM_BUFFER_SIZE 110250   //the receiver's CB_SIZE, in bytes
+#define LINK_SIM_PATTERN_PERIOD 251   //the samples count up to this and start over
+
+//the timeouts and limits of the real code
+#define LINK_SIM_SERVER_CREDIT_MAX 64 //the server's CREDIT_MAX_FRAMES
+#define LINK_SIM_TX_CREDIT_MAX 64     //the transmitter's CREDIT_MAX_FRAMES
+#define LINK_SIM_TX_FRAME_BUFFERS 2   //the transmitter's TX_FRAME_BUFFER_COUNT
+#define LINK_SIM_ACK_TIMEOUT 1000     //the transmitter's serial read timeout, ms
+#define LINK_SIM_ACK_RETRIES 3
+#define LINK_SIM_CREDIT_TIMEOUT 3000  //the receiver's CREDIT_TIMEOUT, ms
+#define LINK_SIM_REQUEST_TIMEOUT 6000 //the receiver's wait in requestData(), ms
+#define LINK_SIM_FILL_TIMEOUT 30000   //the receiver's max. wait before playing, ms
+#define LINK_SIM_REORDER_HOLD 20000   //us a held back packet is late by, at most
+
+//==============================================================================//
+//The link and the protocol to simulate.
+
+struct LinkConfig {
+  uint32_t baudRate;      //serial link between the server and the transmitter
+  uint32_t creditWindow;  //frames the receiver grants ahead, 0 for the RD? handshake
+  uint8_t codec;          //how the server codes the frames
+  uint8_t channelCount;   //1, or 2 for stereo frames, with PCM only
+  bool fec;               //the transmitter sends the parity fragment
+  double udpLoss;         //share of the UDP packets lost, each way
+  double udpReorder;      //share of the UDP packets held back behind later ones
+  uint32_t udpLatency;    //least delay of a UDP packet, us
+  uint32_t udpJitter;     //max. extra delay, us
+  uint32_t udpBandwidth;  //bytes/s of airtime
+  uint32_t udpPacketOverhead; //us of airtime for each packet, whatever its length
+  uint32_t frameSize;     //length of a full frame, up to FRAGMENT_FRAME_SIZE
+  uint32_t duration;      //ms
+  uint32_t seed;          //for the random losses and delays
+};
+
+//------------------------------------------------------------------------------//
+//What the receiver saw.
+
+struct LinkResult {
+  uint32_t firstSampleTime; //ms from the first request to the first sample played
+  double throughput;        //samples/s received once playing, of both channels in stereo
+  double serialLoad;        //share of the time the serial link carried frames
+  double roundTripMean;     //ms from asking for a frame to having it
+  uint32_t roundTripMax;
+  uint32_t underruns;       //after the first sample
+  uint32_t framesReceived;
+  uint32_t framesLost;      //never completed, skipped by the frame assembler
+  uint32_t framesCorrupt;   //samples not in the order sent
+  uint32_t packetsSent;     //UDP packets, both ways
+  double udpLoad;           //share of the time the air carried packets to the receiver
+  uint32_t nackCount;
+};
+
+//------------------------------------------------------------------------------//
+//The no. of samples in a full frame, whole pairs in stereo, and the no. of ticks
+//of the receiver's timer it plays for.
+
+inline uint32_t getLinkFrameSamples(const LinkConfig& config) {
+  uint32_t sampleCount = config.frameSize - LINK_SIM_FRAME_HEADER_SIZE;
+  return (config.channelCount == 2) ? (sampleCount & ~uint32_t(1)) : sampleCount;
+}
+
+inline uint32_t getLinkFrameTicks(const LinkConfig& config) {
+  return getLinkFrameSamples(config) / config.channelCount;
+}
+
+//==============================================================================//
+//xorshift, so that every run with the same seed sees the same link.
+
+inline uint32_t linkRandom(uint32_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+//------------------------------------------------------------------------------//
+//A message on its way. Serial writes and UDP packets are each delivered whole,
+//once their last byte is in.
+
+struct LinkMessage {
+  uint64_t arrivalTime; //us
+  std::vector<uint8_t> data;
+};
+
+//==============================================================================//
+//One way of the serial link. A write starts when the previous one has left the
+//wire, and takes 10 bits per byte.
+
+class SerialPipe {
+  public:
+    SerialPipe() : baudRate(0), lineFreeTime(0), busyTime(0) {
+    }
+
+    void configure(uint32_t baudRate) {
+      this->baudRate = baudRate;
+      lineFreeTime = 0;
+      busyTime = 0;
+      messages.clear();
+    }
+
+    void write(uint64_t now, const uint8_t* data, uint32_t length) {
+      uint64_t startTime = (lineFreeTime > now) ? lineFreeTime : now;
+      uint64_t wireTime = (uint64_t(length) * 10 * 1000000) / baudRate;
+      LinkMessage message;
+
+      lineFreeTime = startTime + wireTime;
+      busyTime += wireTime;
+      message.arrivalTime = lineFreeTime;
+      message.data.assign(data, data + length);
+      messages.push_back(message);
+    }
+
+    void write(uint64_t now, const char* text) {
+      write(now, (const uint8_t*) text, uint32_t(strlen(text)));
+    }
+
+    //------------------------------------------------------------------------------//
+    //Returns the next message that has arrived, without taking it. NULL if none.
+
+    const LinkMessage* peek(uint64_t now) const {
+      return ((!messages.empty()) && (messages.front().arrivalTime <= now)) ? &messages.front() : NULL;
+    }
+
+    void take() {
+      messages.erase(messages.begin());
+    }
+
+    //------------------------------------------------------------------------------//
+    //Discards everything that has arrived, as purgeInput() does.
+
+    void purge(uint64_t now) {
+      while (peek(now) != NULL) {
+        take();
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+
+    bool isIdle(uint64_t now) const {
+      return (lineFreeTime <= now);
+    }
+
+    uint64_t getBusyTime() const {
+      return busyTime;
+    }
+
+  private:
+    uint32_t baudRate;
+    uint64_t lineFreeTime;  //when the last write is off the wire
+    uint64_t busyTime;      //total time spent sending
+    std::vector<LinkMessage> messages;  //in the order written
+};
+
+//==============================================================================//
+//One way of the UDP link. Packets take their turn on the air, and then arrive
+//after the latency and some jitter, unless lost. One held back arrives after
+//some of those sent after it.
+
+class UdpPipe {
+  public:
+    UdpPipe() : config(NULL), random(NULL), airFreeTime(0), airBusyTime(0), packetsSent(0) {
+    }
+
+    void configure(const LinkConfig* config, uint32_t* random) {
+      this->config = config;
+      this->random = random;
+      airFreeTime = 0;
+      airBusyTime = 0;
+      packetsSent = 0;
+      packets.clear();
+    }
+
+    void send(uint64_t now, const uint8_t* data, uint32_t length) {
+      uint64_t startTime = (airFreeTime > now) ? airFreeTime : now;
+      uint64_t airTime = config->udpPacketOverhead + ((uint64_t(length) * 1000000) / config->udpBandwidth);
+      airFreeTime = startTime + airTime;
+      airBusyTime += airTime;
+      packetsSent++;
+
+      if (isChance(config->udpLoss)) {
+        return;
+      }
+
+      LinkMessage packet;
+      packet.arrivalTime = airFreeTime + config->udpLatency + (linkRandom(random) % (config->udpJitter + 1));
+
+      if (isChance(config->udpReorder)) {
+        packet.arrivalTime += 1 + (linkRandom(random) % LINK_SIM_REORDER_HOLD);
+      }
+      packet.data.assign(data, data + length);
+      packets.push_back(packet);
+    }
+
+    void send(uint64_t now, const char* text) {
+      send(now, (const uint8_t*) text, uint32_t(strlen(text)));
+    }
+
+    //------------------------------------------------------------------------------//
+    //Takes the packet that arrived first, if any has by now.
+
+    bool receive(uint64_t now, std::vector<uint8_t>* data) {
+      size_t first = packets.size();
+
+      for (size_t i=0; i < packets.size(); i++) {
+        if ((packets[i].arrivalTime <= now) && ((first == packets.size()) || (packets[i].arrivalTime < packets[first].arrivalTime))) {
+          first = i;
+        }
+      }
+
+      if (first == packets.size()) {
+        return false;
+      }
+
+      data->swap(packets[first].data);
+      packets.erase(packets.begin() + first);
+      return true;
+    }
+
+    uint32_t getPacketsSent() const {
+      return packetsSent;
+    }
+
+    uint64_t getBusyTime() const {
+      return airBusyTime;
+    }
+
+  private:
+    const LinkConfig* config;
+    uint32_t* random;
+    uint64_t airFreeTime;
+    uint64_t airBusyTime;
+    uint32_t packetsSent;
+    std::vector<LinkMessage> packets;
+
+    bool isChance(double share) {
+      return ((linkRandom(random) % 1000000) < uint32_t(share * 1000000));
+    }
+};
+
+//==============================================================================//
+//The server application's streamAudio() and handleRequestLine(). The track
+//never ends. The next frame is always ready, and is written as soon as there's
+//credit for it and the previous write has left.
+
+class SimServer {
+  public:
+    void configure(const LinkConfig* config, SerialPipe* toTransmitter, SerialPipe* fromTransmitter) {
+      this->config = config;
+      this->toTransmitter = toTransmitter;
+      this->fromTransmitter = fromTransmitter;
+      requestCredit = 0;
+      sampleIndex = 0;
+      adpcmStepIndex = 0;
+      framesSent = 0;
+    }
+
+    void step(uint64_t now) {
+      const LinkMessage* line = NULL;
+
+      while ((line = fromTransmitter->peek(now)) != NULL) {
+        bool legacyRequest = handleRequestLine(now, line->data);
+        fromTransmitter->take();
+
+        if (legacyRequest) {
+          fromTransmitter->purge(now);
+        }
+      }
+
+      if ((requestCredit > 0) && toTransmitter->isIdle(now)) {
+        uint32_t frameLength = encodeFrame(frame);
+        toTransmitter->write(now, frame, frameLength);
+        requestCredit--;
+        framesSent++;
+      }
+    }
+
+    uint32_t getFramesSent() const {
+      return framesSent;
+    }
+
+  private:
+    const LinkConfig* config;
+    SerialPipe* toTransmitter;
+    SerialPipe* fromTransmitter;
+    uint32_t requestCredit;
+    uint32_t sampleIndex;
+    int32_t adpcmStepIndex;
+    uint32_t framesSent;
+    uint8_t frame[FRAGMENT_FRAME_SIZE];
+    int16_t adpcmInput[LINK_SIM_MAX_FRAME_SAMPLES];
+
+    //------------------------------------------------------------------------------//
+    //"RD?" is acknowledged and allows one frame, "RD#n" adds n frames of credit.
+    //Returns true for "RD?".
+
+    bool handleRequestLine(uint64_t now, const std::vector<uint8_t>& data) {
+      char line[16] = {0};
+      size_t length = (data.size() < (sizeof(line) - 1)) ? data.size() : (sizeof(line) - 1);
+      memcpy(line, data.data(), length);
+
+      if (strcmp(line, "RD?\n") == 0) {
+        toTransmitter->write(now, "ACK!\n");
+        requestCredit = 1;
+        return true;
+      }
+
+      if (strncmp(line, "RD#", 3) == 0) {
+        int grant = atoi(&line[3]);
+
+        if (grant > 0) {
+          requestCredit += uint32_t(grant);
+          requestCredit = (requestCredit > LINK_SIM_SERVER_CREDIT_MAX) ? LINK_SIM_SERVER_CREDIT_MAX : requestCredit;
+        }
+      }
+      return false;
+    }
+
+    //------------------------------------------------------------------------------//
+    //A full frame of the counting pattern, coded as configured.
+
+    uint32_t encodeFrame(uint8_t* frameBuffer) {
+      uint8_t* payload = frameBuffer + LINK_SIM_FRAME_HEADER_SIZE;
+      uint32_t sampleCount = getLinkFrameSamples(*config);
+      uint32_t payloadLength = sampleCount;
+
+      if (config->codec == FRAME_CODEC_IMA_ADPCM) {
+        for (uint32_t i=0; i < sampleCount; i++) {
+          adpcmInput[i] = int16_t(((sampleIndex + i) % LINK_SIM_PATTERN_PERIOD) * 256 - 32768);
+        }
+        payloadLength = adpcmEncode(adpcmInput, sampleCount, payload, &adpcmStepIndex);
+      }
+      else {
+        for (uint32_t i=0; i < sampleCount; i++) {
+          payload[i] = uint8_t((sampleIndex + i) % LINK_SIM_PATTERN_PERIOD);
+        }
+      }
+      sampleIndex += sampleCount;
+
+      frameBuffer[0] = uint8_t(sampleCount >> 8);
+      frameBuffer[1] = uint8_t(sampleCount & 0x00FF);
+      frameBuffer[2] = config->codec;
+      frameBuffer[3] = (config->channelCount == 2) ? FRAME_FLAG_STEREO : 0;
+      return LINK_SIM_FRAME_HEADER_SIZE + payloadLength;
+    }
+};
+
+//==============================================================================//
+//The transmitter's serialTask() and loop(), with fan-out off. Credit from the
+//receiver is forwarded to the server, and the frames read from serial are sent
+//as fragments. An "RD?" is forwarded and acknowledged first.
+
+class SimTransmitter {
+  public:
+    void configure(const LinkConfig* config, SerialPipe* toServer, SerialPipe* fromServer, UdpPipe* toReceiver, UdpPipe* fromReceiver) {
+      this->config = config;
+      this->toServer = toServer;
+      this->fromServer = fromServer;
+      this->toReceiver = toReceiver;
+      this->fromReceiver = fromReceiver;
+      creditGrantPending = 0;
+      creditOutstanding = 0;
+      dataRequestReceived = false;
+      dataRequestAcknowledged = false;
+      dataRequestSent = false;
+      requestRetryCount = 0;
+      requestTime = 0;
+      txFrameFillIndex = 0;
+      txFrameSendIndex = 0;
+      txFrameSequence = 0;
+
+      for (int i=0; i < LINK_SIM_TX_FRAME_BUFFERS; i++) {
+        txFrameLength[i] = 0;
+      }
+    }
+
+    void step(uint64_t now) {
+      serialTask(now);
+      loop(now);
+    }
+
+  private:
+    const LinkConfig* config;
+    SerialPipe* toServer;
+    SerialPipe* fromServer;
+    UdpPipe* toReceiver;
+    UdpPipe* fromReceiver;
+    uint32_t creditGrantPending;
+    uint32_t creditOutstanding;
+    bool dataRequestReceived;
+    bool dataRequestAcknowledged;
+    bool dataRequestSent;   //"RD?" has been sent to the server, and not timed out
+    uint32_t requestRetryCount;
+    uint64_t requestTime;
+    uint16_t txFrameLength[LINK_SIM_TX_FRAME_BUFFERS];  //0 if the buffer is free
+    uint8_t txFrameBuffer[LINK_SIM_TX_FRAME_BUFFERS][FRAGMENT_FRAME_SIZE];
+    int txFrameFillIndex;
+    int txFrameSendIndex;
+    uint16_t txFrameSequence;
+    RetransmitCache retransmitCache;
+    uint8_t fragmentBuffer[FRAGMENT_PACKET_SIZE];
+
+    //------------------------------------------------------------------------------//
+
+    void serialTask(uint64_t now) {
+      if (creditGrantPending > 0) {
+        char line[16];
+        snprintf(line, sizeof(line), "RD#%u\n", creditGrantPending);
+        toServer->write(now, line);
+        creditOutstanding += creditGrantPending;
+        creditGrantPending = 0;
+      }
+
+      if (creditOutstanding > 0) {
+        readCreditFrame(now);
+      }
+
+      if (!dataRequestReceived) {
+        return;
+      }
+
+      //ask the server, and again if there's no acknowledgement in time
+      if (!dataRequestAcknowledged) {
+        if (!dataRequestSent) {
+          fromServer->purge(now);
+          toServer->write(now, "RD?\n");
+          dataRequestSent = true;
+          requestTime = now;
+        }
+
+        const LinkMessage* message = fromServer->peek(now);
+
+        if ((message != NULL) && (message->data.size() == 5) && (memcmp(message->data.data(), "ACK!\n", 5) == 0)) {
+          fromServer->take();
+          dataRequestAcknowledged = true;
+        }
+        else if ((now - requestTime) >= (uint64_t(LINK_SIM_ACK_TIMEOUT) * 1000)) {
+          dataRequestSent = false;
+
+          if (++requestRetryCount == LINK_SIM_ACK_RETRIES) {
+            requestRetryCount = 0;
+            dataRequestReceived = false;
+          }
+        }
+        return;
+      }
+
+      //then read the frame that follows into the buffer the main task sends from
+      if ((txFrameLength[txFrameFillIndex] == 0) && readFrame(now, txFrameBuffer[txFrameFillIndex], &txFrameLength[txFrameFillIndex])) {
+        txFrameFillIndex = (txFrameFillIndex + 1) % LINK_SIM_TX_FRAME_BUFFERS;
+        dataRequestReceived = false;
+        dataRequestAcknowledged = false;
+        dataRequestSent = false;
+        requestRetryCount = 0;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //A frame is only read when there's a free buffer for it. Until then it waits
+    //in the serial receive buffer.
+
+    void readCreditFrame(uint64_t now) {
+      if ((txFrameLength[txFrameFillIndex] == 0) && readFrame(now, txFrameBuffer[txFrameFillIndex], &txFrameLength[txFrameFillIndex])) {
+        txFrameFillIndex = (txFrameFillIndex + 1) % LINK_SIM_TX_FRAME_BUFFERS;
+        creditOutstanding--;
+      }
+    }
+
+    bool readFrame(uint64_t now, uint8_t* frameBuffer, uint16_t* frameLength) {
+      const LinkMessage* message = fromServer->peek(now);
+
+      if ((message == NULL) || (message->data.size() <= LINK_SIM_FRAME_HEADER_SIZE) || (message->data.size() > FRAGMENT_FRAME_SIZE)) {
+        return false;
+      }
+
+      memcpy(frameBuffer, message->data.data(), message->data.size());
+      *frameLength = uint16_t(message->data.size());
+      fromServer->take();
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void loop(uint64_t now) {
+      std::vector<uint8_t> packet;
+
+      while (fromReceiver->receive(now, &packet)) {
+        char request[32] = {0};
+        memcpy(request, packet.data(), (packet.size() < (sizeof(request) - 1)) ? packet.size() : (sizeof(request) - 1));
+
+        if (strcmp(request, "RD?") == 0) {
+          dataRequestReceived = true;
+        }
+        else if (strncmp(request, "RD#", 3) == 0) {
+          uint32_t creditGrant = uint32_t(atoi(&request[3]));
+
+          if ((creditGrant > 0) && ((creditGrantPending + creditGrant) <= LINK_SIM_TX_CREDIT_MAX)) {
+            creditGrantPending += creditGrant;
+          }
+        }
+        else if (strncmp(request, "NK#", 3) == 0) {
+          retransmitFragments(now, request);
+        }
+      }
+
+      //send the frames in the order they were read
+      if (txFrameLength[txFrameSendIndex] > 0) {
+        sendFrame(now, txFrameBuffer[txFrameSendIndex], txFrameLength[txFrameSendIndex], txFrameSequence++);
+        txFrameLength[txFrameSendIndex] = 0;
+        txFrameSendIndex = (txFrameSendIndex + 1) % LINK_SIM_TX_FRAME_BUFFERS;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void sendFrame(uint64_t now, const uint8_t* frame, uint16_t length, uint16_t sequence) {
+      retransmitCache.store(sequence, frame, length);
+
+      for (uint8_t i=0; i < getFragmentCount(length); i++) {
+        toReceiver->send(now, fragmentBuffer, writeFragment(frame, length, sequence, i, 0, fragmentBuffer));
+      }
+      if (config->fec) {
+        toReceiver->send(now, fragmentBuffer, writeParityFragment(frame, length, sequence, fragmentBuffer));
+      }
+    }
+
+    void retransmitFragments(uint64_t now, const char* request) {
+      char* end = NULL;
+      uint16_t sequence = uint16_t(strtoul(&request[3], &end, 10));
+
+      if ((end == &request[3]) || (*end != '#')) {
+        return;
+      }
+
+      uint32_t mask = strtoul(end + 1, NULL, 10);
+      uint16_t length = 0;
+      const uint8_t* frame = retransmitCache.find(sequence, &length);
+
+      for (uint8_t i=0; (frame != NULL) && (i < getFragmentCount(length)); i++) {
+        if (mask & (uint32_t(1) << i)) {
+          toReceiver->send(now, fragmentBuffer, writeFragment(frame, length, sequence, i, FRAGMENT_FLAG_RETRANSMIT, fragmentBuffer));
+        }
+      }
+    }
+};
+
+//==============================================================================//
+//The receiver's loop(), streamWithCredit(), requestData() and streamTask().
+//The samples are checked against the pattern as they are pushed to the audio
+//buffer, which is an AudioRingBuffer as the receiver's.
+
+class SimReceiver {
+  public:
+    void configure(const LinkConfig* config, UdpPipe* toTransmitter, UdpPipe* fromTransmitter, LinkResult* result) {
+      this->config = config;
+      this->toTransmitter = toTransmitter;
+      this->fromTransmitter = fromTransmitter;
+      this->result = result;
+      audioBuffer.begin(LINK_SIM_BUFFER_SIZE);
+      jitterBuffer.configure(LINK_SIM_SAMPLE_RATE, getLinkFrameTicks(*config), LINK_SIM_BUFFER_SIZE / config->channelCount);
+      frameAssembler.reset();
+      audioBufferEmpty = true;
+      playbackRunning = false;
+      creditOutstanding = 0;
+      creditUpdateTime = 0;
+      bufferFillStartTime = 0;
+      requestPending = false;
+      requestTime = 0;
+      framesDropped = 0;
+      playbackPosition = 0;
+      driftAccumulator = 0;
+      expectedSample = -1;
+      requestTimes.clear();
+      roundTripSum = 0;
+      samplesSincePlaying = 0;
+      firstSampleTime = 0;
+      started = false;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void step(uint64_t now) {
+      uint32_t millisNow = uint32_t(now / 1000);
+
+      if (audioBuffer.isEmpty()) {
+        audioBufferEmpty = true;
+      }
+
+      if (audioBufferEmpty && playbackRunning) {
+        playbackRunning = false;
+        jitterBuffer.addUnderrun();
+        result->underruns++;
+      }
+
+      jitterBuffer.update(millisNow, audioBuffer.getOccupiedTicks(), !audioBufferEmpty);
+
+      if (config->creditWindow > 0) {
+        streamWithCredit(now);
+      }
+      else {
+        streamWithRequests(now);
+      }
+      streamTask(now);
+    }
+
+    //------------------------------------------------------------------------------//
+    //Works out the averages.
+
+    void finish(uint64_t now) {
+      uint32_t elapsed = (firstSampleTime > 0) ? (uint32_t(now / 1000) - firstSampleTime) : 0;
+
+      result->firstSampleTime = firstSampleTime;
+      result->throughput = (elapsed > 0) ? ((samplesSincePlaying * 1000.0) / elapsed) : 0;
+      result->roundTripMean = (result->framesReceived > 0) ? (roundTripSum / result->framesReceived) : 0;
+    }
+
+  private:
+    const LinkConfig* config;
+    UdpPipe* toTransmitter;
+    UdpPipe* fromTransmitter;
+    LinkResult* result;
+
+    AudioRingBuffer audioBuffer;
+    JitterBuffer jitterBuffer;
+    FrameAssembler frameAssembler;
+    bool audioBufferEmpty;
+    bool playbackRunning;
+    uint32_t creditOutstanding;
+    uint32_t creditUpdateTime;
+    uint32_t bufferFillStartTime;
+    bool requestPending;    //an "RD?" is waiting for its frame
+    uint32_t requestTime;
+    uint32_t framesDropped; //given up by the frame assembler, so far
+    double playbackPosition;
+    int32_t driftAccumulator;
+    int32_t expectedSample; //next sample of the pattern, -1 if not known
+
+    std::vector<uint32_t> requestTimes; //when each frame on the way was asked for
+    double roundTripSum;
+    uint64_t samplesSincePlaying;
+    uint32_t firstSampleTime;
+    bool started;
+
+    uint8_t frame[FRAGMENT_FRAME_SIZE];
+    uint8_t decoded[LINK_SIM_MAX_FRAME_SAMPLES];
+    uint8_t leftBlock[AUDIO_RING_BLOCK_TICKS];
+    uint8_t rightBlock[AUDIO_RING_BLOCK_TICKS];
+
+    //------------------------------------------------------------------------------//
+
+    void streamWithCredit(uint64_t now) {
+      uint32_t millisNow = uint32_t(now / 1000);
+      int framesWanted = int(jitterBuffer.getFramesWanted(audioBuffer.getOccupiedTicks(), creditOutstanding));
+      int framesVacant = int(audioBuffer.getVacantBytes() / getLinkFrameSamples(*config)) - int(creditOutstanding);
+      int framesWindow = int(config->creditWindow) - int(creditOutstanding);
+      int creditGrant = (framesVacant < framesWindow) ? framesVacant : framesWindow;
+      creditGrant = (framesWanted < creditGrant) ? framesWanted : creditGrant;
+
+      if (creditGrant > 0) {
+        char line[16];
+        snprintf(line, sizeof(line), "RD#%d", creditGrant);
+        toTransmitter->send(now, line);
+        creditOutstanding += uint32_t(creditGrant);
+        creditUpdateTime = millisNow;
+        jitterBuffer.addRequests(millisNow, uint32_t(creditGrant));
+        requestTimes.insert(requestTimes.end(), uint32_t(creditGrant), millisNow);
+      }
+
+      if (audioBufferEmpty && (bufferFillStartTime == 0)) {
+        bufferFillStartTime = millisNow + 1;
+      }
+
+      uint16_t framesSkipped = 0;
+      int sampleCount = receiveFrame(now, &framesSkipped);
+
+      if (sampleCount != 0) {
+        uint32_t creditUsed = framesSkipped + 1;
+        jitterBuffer.dropRequests(framesSkipped + ((sampleCount < 0) ? 1 : 0));
+        creditOutstanding = (creditOutstanding > creditUsed) ? (creditOutstanding - creditUsed) : 0;
+        creditUpdateTime = millisNow;
+      }
+
+      if ((creditOutstanding > 0) && ((millisNow - creditUpdateTime) >= LINK_SIM_CREDIT_TIMEOUT)) {
+        jitterBuffer.dropRequests(creditOutstanding);
+        eraseRequestTimes(creditOutstanding);
+        creditOutstanding = 0;
+      }
+
+      if (audioBufferEmpty && (audioBuffer.getOccupiedTicks() > 0)) {
+        if (jitterBuffer.isReady(audioBuffer.getOccupiedTicks()) || ((millisNow - (bufferFillStartTime - 1)) >= LINK_SIM_FILL_TIMEOUT)) {
+          bufferFillStartTime = 0;
+          startPlayback();
+        }
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //The RD? handshake. requestData() blocks the loop, but playback goes on in
+    //the output task, so here it's a request that is waited on over several steps.
+
+    void streamWithRequests(uint64_t now) {
+      uint32_t millisNow = uint32_t(now / 1000);
+      bool frameWanted = false;
+
+      if (audioBufferEmpty) {
+        if (bufferFillStartTime == 0) {
+          bufferFillStartTime = millisNow + 1;
+        }
+
+        bool filling = (!jitterBuffer.isReady(audioBuffer.getOccupiedTicks())) &&
+                       (audioBuffer.getVacantBytes() >= getLinkFrameSamples(*config)) &&
+                       ((millisNow - (bufferFillStartTime - 1)) < LINK_SIM_FILL_TIMEOUT);
+
+        if ((!filling) && (!requestPending) && (audioBuffer.getOccupiedTicks() > 0)) {
+          bufferFillStartTime = 0;
+          startPlayback();
+        }
+        frameWanted = filling;
+      }
+      else {
+        frameWanted = (audioBuffer.getVacantBytes() >= getLinkFrameSamples(*config)) &&
+                      (jitterBuffer.getFramesWanted(audioBuffer.getOccupiedTicks(), 0) > 0);
+      }
+
+      if (frameWanted && (!requestPending)) {
+        toTransmitter->send(now, "RD?");
+        jitterBuffer.addRequests(millisNow, 1);
+        requestTimes.push_back(millisNow);
+        requestPending = true;
+        requestTime = millisNow;
+        framesDropped = frameAssembler.getFramesDropped();
+      }
+
+      if (!requestPending) {
+        receiveFrame(now, NULL);
+        return;
+      }
+
+      uint16_t framesSkipped = 0;
+      int sampleCount = receiveFrame(now, &framesSkipped);
+
+      if (sampleCount != 0) {
+        if (sampleCount < 0) {
+          jitterBuffer.dropRequests(1);
+        }
+        requestPending = false;
+      }
+      else if ((frameAssembler.getFramesDropped() != framesDropped) || ((millisNow - requestTime) >= LINK_SIM_REQUEST_TIMEOUT)) {
+        //the frame was given up, or never came
+        jitterBuffer.dropRequests(1);
+        eraseRequestTimes(1);
+        requestPending = false;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Reads the fragments that have arrived, asks for the missing ones, and pushes
+    //the next complete frame. Returns its no. of samples, 0 if there's none, or -1
+    //if it's invalid.
+
+    int receiveFrame(uint64_t now, uint16_t* framesSkipped) {
+      uint32_t millisNow = uint32_t(now / 1000);
+      std::vector<uint8_t> packet;
+
+      while (fromTransmitter->receive(now, &packet)) {
+        if ((packet.size() > 0) && (packet[0] == FRAGMENT_MARKER)) {
+          frameAssembler.addFragment(packet.data(), uint32_t(packet.size()), millisNow);
+        }
+      }
+
+      uint16_t sequence = 0;
+      uint32_t missingMask = 0;
+
+      if (frameAssembler.getMissingFragments(millisNow, &sequence, &missingMask)) {
+        char line[24];
+        snprintf(line, sizeof(line), "NK#%u#%lu", sequence, (unsigned long) missingMask);
+        toTransmitter->send(now, line);
+        result->nackCount++;
+      }
+
+      uint16_t frameLength = 0;
+      uint16_t skipped = 0;
+
+      if (!frameAssembler.popFrame(frame, &frameLength, &sequence, &skipped, millisNow)) {
+        return 0;
+      }
+
+      if (framesSkipped != NULL) {
+        *framesSkipped = skipped;
+      }
+
+      //the lost frames were asked for too, and the pattern moves on past them
+      result->framesLost += skipped;
+      eraseRequestTimes(skipped);
+      expectedSample = (expectedSample < 0) ? -1 : int32_t((expectedSample + (skipped * getLinkFrameSamples(*config))) % LINK_SIM_PATTERN_PERIOD);
+
+      uint32_t sampleCount = (uint32_t(frame[0]) << 8) | frame[1];
+      uint32_t payloadLength = getFramePayloadLength(frame[2], sampleCount);
+      bool stereo = ((frame[3] & FRAME_FLAG_STEREO) != 0);
+
+      if ((sampleCount == 0) || (sampleCount > getLinkFrameSamples(*config)) || (payloadLength == 0) ||
+          (frameLength != (payloadLength + LINK_SIM_FRAME_HEADER_SIZE)) ||
+          (stereo && (((sampleCount % 2) != 0) || (frame[2] != FRAME_CODEC_PCM_U8)))) {
+        result->framesCorrupt++;
+        eraseRequestTimes(1);
+        return -1;
+      }
+
+      pushFrame(millisNow, sampleCount);
+      return int(sampleCount);
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void pushFrame(uint32_t millisNow, uint32_t sampleCount) {
+      uint8_t* samples = frame + LINK_SIM_FRAME_HEADER_SIZE;
+
+      jitterBuffer.addFrame(millisNow);
+      result->framesReceived++;
+
+      if (!requestTimes.empty()) {
+        uint32_t roundTrip = millisNow - requestTimes.front();
+        roundTripSum += roundTrip;
+        result->roundTripMax = (roundTrip > result->roundTripMax) ? roundTrip : result->roundTripMax;
+        requestTimes.erase(requestTimes.begin());
+      }
+
+      if (frame[2] == FRAME_CODEC_IMA_ADPCM) {
+        if (adpcmDecodeU8(samples, sampleCount, decoded) == 0) {
+          result->framesCorrupt++;
+          return;
+        }
+        samples = decoded;
+      }
+      else {
+        //the pattern carries on from the last frame, and counts up within this one
+        bool corrupt = (expectedSample >= 0) && (samples[0] != uint8_t(expectedSample));
+
+        for (uint32_t i=1; (i < sampleCount) && (!corrupt); i++) {
+          corrupt = (samples[i] != uint8_t((samples[i - 1] + 1) % LINK_SIM_PATTERN_PERIOD));
+        }
+        result->framesCorrupt += corrupt ? 1 : 0;
+        expectedSample = int32_t((samples[sampleCount - 1] + 1) % LINK_SIM_PATTERN_PERIOD);
+      }
+
+      audioBuffer.push(samples, sampleCount, ((frame[3] & FRAME_FLAG_STEREO) != 0));
+
+      if (started) {
+        samplesSincePlaying += sampleCount;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void startPlayback() {
+      audioBufferEmpty = false;
+      playbackRunning = true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Plays the samples due in this step, faster or slower by the drift correction.
+    //An empty buffer stops playback until it's started again.
+
+    void streamTask(uint64_t now) {
+      playbackPosition += (double(LINK_SIM_SAMPLE_RATE) * LINK_SIM_STEP) / 1000000.0;
+      uint32_t due = uint32_t(playbackPosition);
+      playbackPosition -= due;
+
+      if (audioBufferEmpty || (due == 0)) {
+        return;
+      }
+
+      driftAccumulator += jitterBuffer.getDriftPpm() * int32_t(due);
+
+      if (driftAccumulator >= 1000000) {
+        driftAccumulator -= 1000000;
+        due++;
+      }
+      else if ((driftAccumulator <= -1000000) && (due > 1)) {
+        driftAccumulator += 1000000;
+        due--;
+      }
+
+      uint32_t played = 0;
+      uint32_t popped = 0;
+
+      do {
+        popped = audioBuffer.pop(leftBlock, rightBlock, due - played);
+        played += popped;
+      } while ((popped > 0) && (played < due));
+
+      if ((played > 0) && (!started)) {
+        started = true;
+        firstSampleTime = uint32_t(now / 1000);
+      }
+
+      if (played < due) {
+        audioBufferEmpty = true;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void eraseRequestTimes(uint32_t count) {
+      count = (count < requestTimes.size()) ? count : uint32_t(requestTimes.size());
+      requestTimes.erase(requestTimes.begin(), requestTimes.begin() + count);
+    }
+};
+
+//==============================================================================//
+//Runs the whole chain for the configured duration and fills the result.
+
+inline void simulateLink(const LinkConfig& config, LinkResult* result) {
+  uint32_t random = config.seed;
+  SerialPipe* serialDown = new SerialPipe();
+  SerialPipe* serialUp = new SerialPipe();
+  UdpPipe* udpDown = new UdpPipe();
+  UdpPipe* udpUp = new UdpPipe();
+  SimServer* server = new SimServer();
+  SimTransmitter* transmitter = new SimTransmitter();
+  SimReceiver* receiver = new SimReceiver();
+  uint64_t endTime = uint64_t(config.duration) * 1000;
+  uint64_t now = 0;
+
+  memset(result, 0, sizeof(LinkResult));
+  serialDown->configure(config.baudRate);
+  serialUp->configure(config.baudRate);
+  udpDown->configure(&config, &random);
+  udpUp->configure(&config, &random);
+  server->configure(&config, serialDown, serialUp);
+  transmitter->configure(&config, serialUp, serialDown, udpDown, udpUp);
+  receiver->configure(&config, udpUp, udpDown, result);
+
+  for (now=0; now < endTime; now += LINK_SIM_STEP) {
+    receiver->step(now);
+    transmitter->step(now);
+    server->step(now);
+  }
+
+  receiver->finish(now);
+  result->serialLoad = double(serialDown->getBusyTime()) / double(endTime);
+  result->packetsSent = udpDown->getPacketsSent() + udpUp->getPacketsSent();
+  result->udpLoad = double(udpDown->getBusyTime()) / double(endTime);
+
+  delete receiver;
+  delete transmitter;
+  delete server;
+  delete udpUp;
+  delete udpDown;
+  delete serialUp;
+  delete serialDown;
+}
+
+#endif
@@ -0,0 +1,524 @@
+//==============================================================================//
+//
+//  AUDIFI Live Input
+//  Version : v0.1
+//
+//  Streams a live source, such as an ffmpeg or ALSA capture piped into the server,
+//  instead of the playlist. The samples are read from stdin or a named pipe by a
+//  thread of its own, as they arrive. A stream that starts with a RIFF header is
+//  taken as WAV and its format is read from the fmt chunk, and anything else is
+//  taken as raw PCM in the format given. The length in the header of a WAV stream
+//  is ignored, since it's not known when the header is written.
+//
+//  The capture thread converts the samples to mono float at the output rate and
+//  pushes them to a small ring, along with the time each run of samples was read.
+//  The serial writer builds a frame as soon as there are config.minFrameSamples
+//  samples in the ring, or all of them up to a full frame if there are more, so
+//  the frames are shorter than those of the playlist while the input keeps up.
+//
+//  If the receiver falls behind, at most config.backlog ms of samples are kept.
+//  The oldest are dropped when a frame is built, and the newest while the ring is
+//  full, so the delay never grows past the backlog. The capture time of the first
+//  sample of a frame is returned with the frame, for the latency from capture to
+//  the frame being sent.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_LIVE_INPUT_H
+#define AUDIFI_LIVE_INPUT_H
+
+#include "AUDIFI-Pipeline.h"
+
+#ifdef _WIN32
+  #include <fcntl.h>
+  #include <io.h>
+#else
+  #include <errno.h>
+  #include <fcntl.h>
+  #include <poll.h>
+  #include <unistd.h>
+#endif
+
+#define LIVE_READ_LENGTH 4096   //max no. of bytes read from the input at a time
+#define LIVE_MARK_SLOTS 1024    //capture times kept for the runs of samples in the ring
+#define LIVE_POLL_TIMEOUT 100   //ms a read waits for data before checking if it should stop
+
+//==============================================================================//
+
+struct LiveConfig {
+  uint32_t sampleRate;       //rate of the samples sent
+  int resamplerQuality;
+  uint8_t codec;             //FRAME_CODEC_*
+  uint32_t minFrameSamples;  //no. of samples a frame is built with as soon as they are there
+  uint32_t backlog;          //ms of samples kept at most while the receiver is behind
+};
+
+//==============================================================================//
+//The time a run of samples was read. sampleEnd counts the samples pushed to the
+//ring up to the end of the run.
+
+struct LiveMark {
+  uint64_t sampleEnd;
+  uint64_t captureTime; //us
+};
+
+//==============================================================================//
+
+class LiveInput {
+  public:
+    LiveInput() : fd(-1), running(false), inputEnded(true), resampling(false), backlogSamples(0),
+      pendingLength(0), pushedTotal(0), lastMarkEnd(0), consumedTotal(0), samplesCaptured(0), samplesDropped(0), adpcmStepIndex(0) {
+      memset(&config, 0, sizeof(config));
+      memset(&format, 0, sizeof(format));
+      memset(&currentMark, 0, sizeof(currentMark));
+    }
+
+    ~LiveInput() {
+      close();
+    }
+
+    //------------------------------------------------------------------------------//
+    //Opens stdin if the path is "-", or else the file or named pipe at path, and
+    //starts capturing. Opening a named pipe waits until something writes to it.
+    //rawFormat is used if the input has no WAV header.
+
+    bool open(const char* path, const WavFormat& rawFormat, const LiveConfig& config) {
+      int inputFd = -1;
+
+    #ifdef _WIN32
+      if (strcmp(path, "-") == 0) {
+        inputFd = _fileno(stdin);
+        _setmode(inputFd, _O_BINARY);
+      }
+      else {
+        inputFd = _open(path, _O_RDONLY | _O_BINARY);
+      }
+    #else
+      inputFd = (strcmp(path, "-") == 0) ? STDIN_FILENO : ::open(path, O_RDONLY);
+    #endif
+
+      if (inputFd < 0) {
+        return false;
+      }
+      return begin(inputFd, rawFormat, config);
+    }
+
+    //------------------------------------------------------------------------------//
+    //Starts capturing from an open file descriptor, which is closed along with the
+    //input. Waits for the first bytes to tell a WAV stream from raw PCM. Returns
+    //false if the format can't be converted.
+
+    bool begin(int inputFd, const WavFormat& rawFormat, const LiveConfig& config) {
+      close();
+      fd = inputFd;
+      this->config = config;
+
+      if ((!readHeader(rawFormat)) || (!inputConverter.configure(format))) {
+        closeInput();
+        return false;
+      }
+
+      resampling = (format.sampleRate != config.sampleRate);
+
+      if (resampling && (!resampler.configure(format.sampleRate, config.sampleRate, config.resamplerQuality))) {
+        closeInput();
+        return false;
+      }
+
+      backlogSamples = uint32_t((uint64_t(config.backlog) * config.sampleRate) / 1000);
+      backlogSamples = (backlogSamples > config.minFrameSamples) ? backlogSamples : config.minFrameSamples;
+
+      //twice the backlog, so a stalled writer finds more than it keeps
+      if ((!samples.begin((2 * backlogSamples) + PIPELINE_FRAME_SAMPLES)) || (!marks.begin(LIVE_MARK_SLOTS))) {
+        closeInput();
+        return false;
+      }
+
+      pushedTotal = 0;
+      lastMarkEnd = 0;
+      consumedTotal = 0;
+      samplesCaptured = 0;
+      samplesDropped = 0;
+      adpcmStepIndex = 0;
+      memset(&currentMark, 0, sizeof(currentMark));
+      inputEnded = false;
+      running = true;
+      captureThread = std::thread(&LiveInput::runCapture, this);
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Stops capturing and closes the input. On POSIX systems the capture thread
+    //sees this within LIVE_POLL_TIMEOUT. On Windows a read in progress has to
+    //return first, so this waits until the input sends more or is closed.
+
+    void close() {
+      if (captureThread.joinable()) {
+        running = false;
+        captureThread.join();
+      }
+      closeInput();
+      inputEnded = true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Writer side. Builds a frame of at most maxSamples samples once there are
+    //config.minFrameSamples, or the rest at the end of the input. The last frame
+    //is flagged with FRAME_FLAG_TRACK_END and FRAME_FLAG_STREAM_END. captureTime is
+    //set to the time the first sample was read, in pipelineMicros(). Returns the
+    //length of the frame, or 0 if the samples didn't arrive within the timeout or
+    //the input has ended.
+
+    uint32_t buildFrame(PipelineFrame* frame, uint32_t maxSamples, uint32_t timeout, uint64_t* captureTime) {
+      uint64_t entryTime = pipelineMicros();
+      uint32_t frameSamples = (maxSamples < PIPELINE_FRAME_SAMPLES) ? maxSamples : PIPELINE_FRAME_SAMPLES;
+      uint32_t minSamples = (config.minFrameSamples < frameSamples) ? config.minFrameSamples : frameSamples;
+
+      while (true) {
+        bool ended = inputEnded;  //read first, all the samples are in the ring once it's set
+        uint32_t occupied = samples.getOccupied();
+
+        if ((occupied >= minSamples) || (ended && (occupied > 0))) {
+          break;
+        }
+        if (ended || ((pipelineMicros() - entryTime) >= (uint64_t(timeout) * 1000))) {
+          return 0;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(PIPELINE_POLL_INTERVAL));
+      }
+
+      //the receiver is behind. the oldest samples go, so the delay stays bounded.
+      uint32_t occupied = samples.getOccupied();
+
+      if (occupied > backlogSamples) {
+        uint32_t dropped = samples.discard(occupied - backlogSamples);
+        samplesDropped += dropped;
+        consumedTotal += dropped;
+      }
+
+      *captureTime = findCaptureTime(consumedTotal);
+
+      bool ended = inputEnded;
+      uint32_t sampleCount = samples.pop(floatBuffer, frameSamples);
+      uint32_t payloadLength = 0;
+      uint8_t* payload = frame->data + PIPELINE_FRAME_HEADER_SIZE;
+      consumedTotal += sampleCount;
+
+      if (config.codec == FRAME_CODEC_IMA_ADPCM) {
+        outputConverter.quantizeS16(floatBuffer, sampleCount, adpcmInput);
+        payloadLength = adpcmEncode(adpcmInput, sampleCount, payload, &adpcmStepIndex);
+      }
+      else {
+        outputConverter.quantize(floatBuffer, sampleCount, payload);
+        payloadLength = sampleCount;
+      }
+
+      frame->trackIndex = 0;
+      frame->length = PIPELINE_FRAME_HEADER_SIZE + payloadLength;
+      frame->data[0] = uint8_t(sampleCount >> 8); //high byte
+      frame->data[1] = uint8_t(sampleCount & 0x00FF); //low byte
+      frame->data[2] = config.codec;
+      frame->data[3] = (ended && samples.isEmpty()) ? (FRAME_FLAG_TRACK_END | FRAME_FLAG_STREAM_END) : 0;
+      return frame->length;
+    }
+
+    //------------------------------------------------------------------------------//
+    //True once the input has ended and all its samples have been sent.
+
+    bool isFinished() const {
+      return inputEnded && samples.isEmpty();
+    }
+
+    const WavFormat& getFormat() const {
+      return format;
+    }
+
+    const Resampler& getResampler() const {
+      return resampler;
+    }
+
+    bool isResampling() const {
+      return resampling;
+    }
+
+    //samples at the output rate, captured and dropped since the input was opened
+    uint32_t getSamplesCaptured() const {
+      return samplesCaptured;
+    }
+
+    uint32_t getSamplesDropped() const {
+      return samplesDropped;
+    }
+
+    //samples waiting for a frame
+    uint32_t getBacklogSamples() const {
+      return samples.getOccupied();
+    }
+
+  private:
+    int fd;
+    LiveConfig config;
+    WavFormat format;
+    std::thread captureThread;
+    std::atomic<bool> running;
+    std::atomic<bool> inputEnded; //set by the capture thread after the last samples are pushed
+
+    SampleConverter inputConverter; //decodes in the capture thread
+    SampleConverter outputConverter;  //quantizes in the writer, needs no format
+    bool resampling;
+    Resampler resampler;
+    uint32_t backlogSamples;  //samples kept at most when a frame is built
+
+    RingBuffer<float> samples;  //at the output rate, capture thread to writer
+    RingBuffer<LiveMark> marks; //the times the samples were read
+    uint8_t pending[12];  //bytes read with the header that are audio data
+    uint32_t pendingLength;
+    uint64_t pushedTotal; //samples pushed, capture thread only
+    uint64_t lastMarkEnd; //sampleEnd of the last mark pushed, capture thread only
+    uint64_t consumedTotal; //samples popped or dropped, writer only
+    LiveMark currentMark; //the mark of the run consumedTotal is in, writer only
+    std::atomic<uint32_t> samplesCaptured;
+    std::atomic<uint32_t> samplesDropped;
+
+    float floatBuffer[PIPELINE_FRAME_SAMPLES];
+    int16_t adpcmInput[PIPELINE_FRAME_SAMPLES];
+    int32_t adpcmStepIndex;
+
+    LiveInput(const LiveInput&);
+    LiveInput& operator=(const LiveInput&);
+
+    //------------------------------------------------------------------------------//
+    //Reads up to length bytes. Returns the no. read, 0 if nothing arrived within
+    //LIVE_POLL_TIMEOUT, or -1 at the end of the input.
+
+    int readInput(uint8_t* data, uint32_t length) {
+    #ifdef _WIN32
+      int count = _read(fd, data, length);
+      return (count > 0) ? count : -1;
+    #else
+      struct pollfd pollFd;
+      pollFd.fd = fd;
+      pollFd.events = POLLIN;
+      pollFd.revents = 0;
+
+      int ready = poll(&pollFd, 1, LIVE_POLL_TIMEOUT);
+
+      if (ready == 0) {
+        return 0;
+      }
+      if (ready < 0) {
+        return (errno == EINTR) ? 0 : -1;
+      }
+
+      ssize_t count = ::read(fd, data, length);
+
+      if (count < 0) {
+        return ((errno == EINTR) || (errno == EAGAIN)) ? 0 : -1;
+      }
+      return (count > 0) ? int(count) : -1;
+    #endif
+    }
+
+    //------------------------------------------------------------------------------//
+    //Waits for exactly length bytes. Returns the no. read, less than length only at
+    //the end of the input.
+
+    uint32_t readFully(uint8_t* data, uint32_t length) {
+      uint32_t total = 0;
+
+      while (total < length) {
+        int count = readInput(data + total, length - total);
+
+        if (count < 0) {
+          break;
+        }
+        total += uint32_t(count);
+      }
+      return total;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Reads the WAV header up to the start of the data chunk, if there is one. The
+    //chunks can't be skipped with a seek on a pipe, so they are read. If there's
+    //no RIFF header, the bytes read are the first audio data of a raw stream.
+
+    bool readHeader(const WavFormat& rawFormat) {
+      uint8_t header[12];
+      uint32_t length = readFully(header, sizeof(header));
+      bool formatFound = false;
+
+      if ((length < sizeof(header)) || (memcmp(header, "RIFF", 4) != 0) || (memcmp(header + 8, "WAVE", 4) != 0)) {
+        format = rawFormat;
+        memcpy(pending, header, length);
+        pendingLength = length;
+        return isWavFormatSupported(format);
+      }
+
+      pendingLength = 0;
+      memset(&format, 0, sizeof(format));
+
+      while (true) {
+        uint8_t chunkHeader[8];
+
+        if (readFully(chunkHeader, 8) != 8) {
+          return false;
+        }
+
+        uint32_t chunkSize = readLE32(chunkHeader + 4);
+
+        if (memcmp(chunkHeader, "data", 4) == 0) {
+          return formatFound && isWavFormatSupported(format);
+        }
+
+        uint32_t skipLength = chunkSize + (chunkSize & 1);  //chunks are padded to an even length
+
+        if (memcmp(chunkHeader, "fmt ", 4) == 0) {
+          uint8_t fmt[40] = {0};
+          uint32_t fmtLength = (chunkSize < sizeof(fmt)) ? chunkSize : uint32_t(sizeof(fmt));
+
+          if ((fmtLength < 16) || (readFully(fmt, fmtLength) != fmtLength)) {
+            return false;
+          }
+          parseWavFormatChunk(fmt, fmtLength, &format);
+          formatFound = true;
+          skipLength -= fmtLength;
+        }
+
+        while (skipLength > 0) {
+          uint8_t skipped[64];
+          uint32_t count = (skipLength < sizeof(skipped)) ? skipLength : uint32_t(sizeof(skipped));
+
+          if (readFully(skipped, count) != count) {
+            return false;
+          }
+          skipLength -= count;
+        }
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //The capture thread. Whole audio frames are converted as soon as they are
+    //read, and a frame split between two reads waits for the rest of its bytes.
+
+    void runCapture() {
+      uint8_t data[WAV_MAX_CHANNELS * 4 + LIVE_READ_LENGTH];
+      uint32_t length = pendingLength;  //the bytes read with the header come first
+      uint64_t captureTime = pipelineMicros();
+      memcpy(data, pending, pendingLength);
+
+      while (true) {
+        uint32_t frameCount = length / format.blockAlign;
+        uint32_t used = frameCount * format.blockAlign;
+        captureFrames(data, frameCount, captureTime);
+        memmove(data, data + used, length - used);
+        length -= used;
+
+        int count = 0;
+
+        while (running && ((count = readInput(data + length, LIVE_READ_LENGTH)) == 0)) {
+        }
+        if (count <= 0) {
+          break;
+        }
+        captureTime = pipelineMicros();
+        length += uint32_t(count);
+      }
+
+      //the end of the input is pushed through the filter
+      if (running && resampling) {
+        float silence[CONVERTER_BLOCK_FRAMES] = {0};
+        uint32_t latency = resampler.getLatency();
+
+        while (latency > 0) {
+          uint32_t count = (latency < CONVERTER_BLOCK_FRAMES) ? latency : CONVERTER_BLOCK_FRAMES;
+          pushSamples(silence, count, pipelineMicros());
+          latency -= count;
+        }
+      }
+      inputEnded = true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Converts frameCount audio frames to the output rate and pushes them.
+
+    void captureFrames(const uint8_t* data, uint32_t frameCount, uint64_t captureTime) {
+      float decoded[CONVERTER_BLOCK_FRAMES];
+
+      while (frameCount > 0) {
+        uint32_t blockFrames = (frameCount < CONVERTER_BLOCK_FRAMES) ? frameCount : CONVERTER_BLOCK_FRAMES;
+        inputConverter.decode(data, blockFrames, decoded);
+        pushSamples(decoded, blockFrames, captureTime);
+        data += blockFrames * format.blockAlign;
+        frameCount -= blockFrames;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Resamples the samples if needed and pushes them to the ring with their
+    //capture time. What doesn't fit in the ring is dropped.
+
+    void pushSamples(const float* input, uint32_t count, uint64_t captureTime) {
+      float output[CONVERTER_BLOCK_FRAMES];
+      uint32_t used = 0;
+
+      while (used < count) {
+        uint32_t outputCount = 0;
+
+        if (resampling) {
+          uint32_t inputUsed = 0;
+          outputCount = resampler.process(input + used, count - used, &inputUsed, output, CONVERTER_BLOCK_FRAMES);
+          used += inputUsed;
+        }
+        else {
+          outputCount = ((count - used) < CONVERTER_BLOCK_FRAMES) ? (count - used) : CONVERTER_BLOCK_FRAMES;
+          memcpy(output, input + used, outputCount * sizeof(float));
+          used += outputCount;
+        }
+
+        if (outputCount == 0) {
+          continue;
+        }
+
+        uint32_t pushed = samples.push(output, outputCount);
+        samplesCaptured += outputCount;
+        samplesDropped += outputCount - pushed;
+        pushedTotal += pushed;
+      }
+
+      //a mark that doesn't fit is left out. its samples then get the time of the
+      //next run, which is a little later.
+      if (pushedTotal > lastMarkEnd) {
+        LiveMark mark = {pushedTotal, captureTime};
+        marks.push(mark);
+        lastMarkEnd = pushedTotal;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Finds the capture time of the sample with the given no. in the stream. The
+    //mark of a run is pushed after its samples, so it can be missing for a moment
+    //while the run is being pushed, and it's then about now.
+
+    uint64_t findCaptureTime(uint64_t sample) {
+      while ((currentMark.sampleEnd <= sample) && marks.pop(&currentMark)) {
+      }
+      return (currentMark.sampleEnd > sample) ? currentMark.captureTime : pipelineMicros();
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void closeInput() {
+    #ifdef _WIN32
+      if ((fd >= 0) && (fd != _fileno(stdin))) {
+        _close(fd);
+      }
+    #else
+      if ((fd >= 0) && (fd != STDIN_FILENO)) {
+        ::close(fd);
+      }
+    #endif
+      fd = -1;
+    }
+};
+
+#endif
@@ -0,0 +1,994 @@
+//==============================================================================//
+//
+//  AUDIFI Loopback Device
+//  Version : v0.1
+//
+//  A stand-in for the transmitter on POSIX systems. It creates a pseudo terminal
+//  and speaks the transmitter's side of the serial protocol on it, so that the
+//  server application can be run and load tested without an ESP32 attached.
+//  The receiver's circular buffer is emulated too. It is drained at the playback
+//  rate and is used to grant credit, the same way the real receiver does.
+//  It negotiates the link like the transmitter, and can be made to fail the test
+//  pattern above a baud rate, to see the server fall back.
+//  Checked frames are read the way the transmitter reads them. A frame that's
+//  damaged or missing is asked for again with RS#, and the frames after it wait
+//  until it's there, so the emulated buffer only ever gets whole frames in order.
+//  The device can be made to damage every nth frame it gets, to see that happen.
+//  Control messages are answered and applied to the emulated buffer, a pause
+//  stops it draining and a skip or a seek empties it.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_LOOPBACK_DEVICE_H
+#define AUDIFI_LOOPBACK_DEVICE_H
+
+#ifndef _WIN32
+
+#include "AUDIFI-Protocol.h"
+#include "AUDIFI-Serial-Transport.h"
+#include "AUDIFI-Frame-Check.h"
+#include "AUDIFI-Control.h"
+#include "AUDIFI-ADPCM.h"
+#include <stdlib.h>
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#define LOOPBACK_BUFFER_SIZE 110250     //emulated receiver buffer, same as CB_SIZE
+#define LOOPBACK_SAMPLE_RATE 11025      //rate at which the emulated buffer drains
+#define LOOPBACK_CREDIT_WINDOW 4        //max frames granted ahead
+#define LOOPBACK_CREDIT_TIMEOUT 3000    //time to wait for a granted frame
+#define LOOPBACK_REPORT_INTERVAL 5000   //time between status reports
+#define LOOPBACK_PENDING_FRAMES 4       //frames held while one is missing, same as TX_FRAME_BUFFER_COUNT
+#define LOOPBACK_RESEND_TIMEOUT 1000    //time to wait for a frame asked for with RS#
+#define LOOPBACK_RESEND_ATTEMPTS 2      //RS# sent for a frame before it's given up on
+
+//what happened to the checked frames
+struct LoopbackCheckStats {
+  uint32_t framesDelivered;   //whole frames passed on to the emulated buffer, in order
+  uint32_t crcErrors;         //frames whose CRC didn't match
+  uint32_t framesDamaged;     //frames that failed their CRC or had a header that made no sense
+  uint32_t resendsRequested;  //RS# sent
+  uint32_t framesRecovered;   //frames that arrived after an RS#
+  uint32_t framesLost;        //frames given up on
+  uint32_t framesDropped;     //new frames there was no room for
+  uint32_t bytesSkipped;      //bytes passed over looking for a sync word
+  uint32_t digest;            //CRC of the CRCs of the frames delivered, in order
+  uint32_t controlsApplied;   //new control messages
+  uint32_t controlErrors;     //control messages that failed their CRC
+  uint32_t bufferFlushes;     //times a skip or a seek emptied the emulated buffer
+};
+
+//==============================================================================//
+
+class LoopbackDevice {
+  public:
+    //frameHeaderSize is the no. of header bytes at the start of a frame, and
+    //frameDataSize is the max no. of samples in a frame. the incoming bytes are
+    //paced to the baud rate, so that the link behaves like the real one.
+    LoopbackDevice(uint32_t frameHeaderSize, uint32_t frameDataSize, uint32_t baudRate, bool legacyMode) :
+      masterFd(-1), slaveFd(-1), running(false),
+      frameHeaderSize(frameHeaderSize), frameDataSize(frameDataSize), baudRate(baudRate), legacyMode(legacyMode),
+      bufferOccupied(0), bufferTicks(LOOPBACK_BUFFER_SIZE), frameTicks(frameDataSize), streamStereo(false), creditOutstanding(0), playbackStarted(false),
+      streamEnded(false), stereoFrameCount(0), framesReceived(0), tracksReceived(0), bytesReceived(0), pacedBytes(0), paceStartTime(0), underrunCount(0), requestCount(0), startTime(0), lastByteTime(0),
+      workingBaudRate(0), linkReady(false), errorInterval(0), framesArrived(0), damageNextSync(false),
+      bytesSkippedSinceFrame(0), expectedSequence(0), playbackPaused(false), gainPercent(CONTROL_GAIN_UNITY),
+      controlsApplied(0) {
+      portName[0] = 0;
+      sampleBuffer.resize(frameDataSize);
+      capabilities.version = PROTOCOL_VERSION;
+      capabilities.baudRates = PROTOCOL_ALL_BAUDRATES;
+      capabilities.frameSize = uint16_t(frameHeaderSize + frameDataSize);
+      capabilities.codecs = PROTOCOL_CODEC_PCM_U8 | PROTOCOL_CODEC_IMA_ADPCM;
+      linkSettings.baudRate = baudRate;
+      linkSettings.frameSize = capabilities.frameSize;
+      linkSettings.codec = FRAME_CODEC_PCM_U8;
+      linkSettings.options = 0;
+      memset(&checkStats, 0, sizeof(checkStats));
+    }
+
+    ~LoopbackDevice() {
+      stop();
+    }
+
+    //------------------------------------------------------------------------------//
+    //What the device says it can do, a version of 0 makes it answer a plain YES!.
+    //The test pattern is corrupted at rates above workingBaudRate, 0 for none.
+    //Has to be set before start().
+
+    void setCapabilities(const LinkCapabilities& deviceCapabilities, uint32_t deviceWorkingBaudRate) {
+      capabilities = deviceCapabilities;
+      workingBaudRate = deviceWorkingBaudRate;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Damages every nth checked frame that arrives, 0 for none. Every other time it's
+    //a bit of the samples, and otherwise the sync word of the frame after it is
+    //missed. Has to be set before start().
+
+    void setErrorInterval(uint32_t interval) {
+      errorInterval = interval;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Creates the pseudo terminal and starts answering on it.
+
+    bool start() {
+      masterFd = posix_openpt(O_RDWR | O_NOCTTY);
+
+      if ((masterFd < 0) || (grantpt(masterFd) != 0) || (unlockpt(masterFd) != 0)) {
+        printf("Creating pseudo terminal failed.\n");
+        stop();
+        return false;
+      }
+
+      const char* slaveName = ptsname(masterFd);
+
+      if (slaveName == NULL) {
+        stop();
+        return false;
+      }
+      snprintf(portName, sizeof(portName), "%s", slaveName);
+
+      //keep the slave side open ourselves. otherwise the master sees a hangup
+      //whenever the server is not connected. the slave is raw so nothing is echoed.
+      slaveFd = ::open(portName, O_RDWR | O_NOCTTY);
+
+      if (slaveFd < 0) {
+        stop();
+        return false;
+      }
+
+      struct termios options;
+      tcgetattr(slaveFd, &options);
+      cfmakeraw(&options);
+      tcsetattr(slaveFd, TCSANOW, &options);
+
+      startTime = millisNow();
+      running = true;
+      worker = std::thread(&LoopbackDevice::run, this);
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void stop() {
+      if (running) {
+        //let the bytes still on the way arrive before stopping
+        uint32_t entryTime = millisNow();
+
+        while (((millisNow() - lastByteTime) < 500) && ((millisNow() - entryTime) < 5000)) {
+          sleepMillis(10);
+        }
+        running = false;
+        worker.join();
+        printReport();
+      }
+      if (slaveFd >= 0) {
+        ::close(slaveFd);
+        slaveFd = -1;
+      }
+      if (masterFd >= 0) {
+        ::close(masterFd);
+        masterFd = -1;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+
+    const char* getPortName() const {
+      return portName;
+    }
+
+    //------------------------------------------------------------------------------//
+    //True once the link has been negotiated, then getLinkSettings() is what was
+    //agreed on.
+
+    bool isLinkReady() const {
+      return linkReady;
+    }
+
+    const LinkSettings& getLinkSettings() const {
+      return linkSettings;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Only valid once the device is stopped.
+
+    const LoopbackCheckStats& getCheckStats() const {
+      return checkStats;
+    }
+
+    //------------------------------------------------------------------------------//
+    //The no. of new control messages applied so far, and what they left behind.
+    //These can be read while the device runs.
+
+    uint32_t getControlsApplied() const {
+      return controlsApplied;
+    }
+
+    bool isPaused() const {
+      return playbackPaused;
+    }
+
+    int32_t getGainPercent() const {
+      return gainPercent;
+    }
+
+    //------------------------------------------------------------------------------//
+    //The no. of stereo frames played, counted as they come in.
+
+    uint32_t getStereoFrameCount() const {
+      return stereoFrameCount;
+    }
+
+  private:
+    int masterFd;
+    int slaveFd;
+    char portName[64];
+    std::thread worker;
+    std::atomic<bool> running;
+
+    uint32_t frameHeaderSize;
+    uint32_t frameDataSize;
+    uint32_t baudRate;
+    bool legacyMode;
+
+    //emulated receiver
+    uint32_t bufferOccupied;  //no. of ticks in the emulated buffer, a stereo pair is one
+    uint32_t bufferTicks; //its capacity, a byte per tick in mono and two in stereo as the receiver's
+    uint32_t frameTicks;  //ticks a full frame fills, half of frameDataSize in stereo
+    bool streamStereo;  //the last frame was stereo
+    uint32_t creditOutstanding; //frames granted but not received yet
+    bool playbackStarted;
+    bool streamEnded; //the last frame of the playlist was received, so the buffer may run dry
+    std::atomic<uint32_t> stereoFrameCount;
+    std::vector<uint8_t> sampleBuffer;  //decoded samples of a coded frame
+
+    //status
+    uint32_t framesReceived;
+    uint32_t tracksReceived;  //no. of frames that ended a track
+    uint64_t bytesReceived;
+    uint64_t pacedBytes;  //bytes received since paceStartTime
+    uint32_t paceStartTime;
+    uint32_t underrunCount;
+    uint32_t requestCount;
+    uint32_t startTime;
+    std::atomic<uint32_t> lastByteTime;  //when the last byte was received
+
+    //link negotiation
+    LinkCapabilities capabilities;
+    uint32_t workingBaudRate; //fastest rate the test pattern gets through at, 0 for all
+    LinkSettings linkSettings;
+    std::atomic<bool> linkReady;
+
+    //checked frames
+    struct PendingFrame {
+      uint8_t sequence;
+      bool arrived;     //false while it's being asked for
+      bool lost;        //given up on, it's skipped
+      uint16_t sampleCount;
+      uint8_t flags;
+      uint32_t crc;
+      uint32_t requestTime; //when RS# was last sent for it
+      uint32_t requestCount;
+    };
+
+    uint32_t errorInterval;
+    uint32_t framesArrived;
+    bool damageNextSync;
+    uint32_t bytesSkippedSinceFrame;  //bytes passed over since the last sync word found
+    uint8_t expectedSequence; //sequence no. of the next new frame
+    std::deque<PendingFrame> pendingFrames; //from the oldest one missing on
+    LoopbackCheckStats checkStats;
+
+    //control messages
+    ControlFilter controlFilter;
+    std::atomic<bool> playbackPaused; //the emulated buffer doesn't drain
+    std::atomic<int32_t> gainPercent;
+    std::atomic<uint32_t> controlsApplied;
+
+    //------------------------------------------------------------------------------//
+
+    void run() {
+      uint8_t frameBuffer[65536];
+      char line[64];
+
+      //wait for the application the same way serialTask() does
+      while (running) {
+        if ((readLine(line, sizeof(line), 500) > 0) && (strcmp(line, "READY?") == 0)) {
+          negotiateLink();
+          printf("Loopback device: application connected at %u baud, %u byte frames, codec %u\n",
+            linkSettings.baudRate, unsigned(linkSettings.frameSize), unsigned(linkSettings.codec));
+          break;
+        }
+      }
+
+      bytesReceived = 0;
+      pacedBytes = 0;
+      startTime = millisNow();
+      paceStartTime = startTime;
+      uint32_t drainTime = startTime;
+      uint32_t reportTime = startTime;
+      uint32_t creditTime = startTime;
+
+      while (running) {
+        //drain the emulated buffer at the playback rate
+        uint32_t now = millisNow();
+        uint32_t drained = uint32_t((uint64_t(now - drainTime) * LOOPBACK_SAMPLE_RATE) / 1000);
+
+        if (drained > 0) {
+          drainTime += uint32_t((uint64_t(drained) * 1000) / LOOPBACK_SAMPLE_RATE);
+
+          if (playbackStarted && (!playbackPaused)) {
+            if (drained >= bufferOccupied) {
+              bufferOccupied = 0;
+              playbackStarted = false;
+              underrunCount += streamEnded ? 0 : 1;
+            }
+            else {
+              bufferOccupied -= drained;
+            }
+          }
+        }
+
+        if ((now - reportTime) >= LOOPBACK_REPORT_INTERVAL) {
+          reportTime = now;
+          printReport();
+        }
+
+        uint32_t framesVacant = (bufferTicks - bufferOccupied) / frameTicks;
+
+        if (legacyMode) {
+          //one request, one acknowledgement and one frame at a time
+          if (framesVacant == 0) {
+            sleepMillis(10);
+            continue;
+          }
+          //a frame asked for again comes before the next request
+          if (isChecked() && (!pendingFrames.empty())) {
+            receiveCheckedFrame(frameBuffer, 100);
+            checkResends();
+            continue;
+          }
+          writeAll("RD?\n");
+          requestCount++;
+
+          if ((readLine(line, sizeof(line), 2000) > 0) && (strcmp(line, "ACK!") == 0)) {
+            if (isChecked()) {
+              creditOutstanding = 1;
+              receiveCheckedFrame(frameBuffer, 2000);
+              creditOutstanding = 0;
+            }
+            else {
+              receiveFrame(frameBuffer, 2000);
+            }
+          }
+        }
+        else {
+          //grant the frames we can hold on top of those in flight. the frames
+          //held while one is missing take up their frame buffers too.
+          uint32_t creditWindow = LOOPBACK_CREDIT_WINDOW - uint32_t(pendingFrames.size());
+
+          if ((framesVacant > creditOutstanding) && (creditOutstanding < creditWindow)) {
+            uint32_t creditGrant = framesVacant - creditOutstanding;
+
+            if (creditGrant > (creditWindow - creditOutstanding)) {
+              creditGrant = creditWindow - creditOutstanding;
+            }
+
+            char grantLine[16];
+            snprintf(grantLine, sizeof(grantLine), "RD#%u\n", creditGrant);
+            writeAll(grantLine);
+            creditOutstanding += creditGrant;
+            creditTime = now;
+            requestCount++;
+          }
+
+          if ((creditOutstanding == 0) && pendingFrames.empty()) {
+            //a control message can still come, eg. the resume for a pause that
+            //let the buffer fill up
+            if (isControlled()) {
+              receiveCheckedFrame(frameBuffer, 10);
+            }
+            else {
+              sleepMillis(10);
+            }
+            continue;
+          }
+
+          if (isChecked()) {
+            //the credit is used up by the frames as they're seen
+            if (receiveCheckedFrame(frameBuffer, 100)) {
+              creditTime = millisNow();
+            }
+            checkResends();
+          }
+          else if (receiveFrame(frameBuffer, 100)) {
+            creditOutstanding--;
+            creditTime = millisNow();
+          }
+
+          //a checked frame whose sync word was missed only shows as skipped
+          //bytes, until a frame comes after it. if nothing does, it's asked for.
+          if (isChecked() && (creditOutstanding > 0) && pendingFrames.empty() && (bytesSkippedSinceFrame > 0) &&
+              ((millisNow() - creditTime) >= LOOPBACK_RESEND_TIMEOUT)) {
+            bytesSkippedSinceFrame = 0;
+            requestMissing();
+            creditTime = millisNow();
+          }
+          else if ((creditOutstanding > 0) && ((millisNow() - creditTime) >= LOOPBACK_CREDIT_TIMEOUT)) {
+            creditOutstanding = 0;  //the credit is lost, start over
+          }
+        }
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Answers READY? with the capabilities and follows the server through the
+    //BAUD#, test pattern and LINK# steps, the same way the transmitter does.
+
+    void negotiateLink() {
+      char line[PROTOCOL_LINE_MAX_LENGTH];
+      uint8_t pattern[PROTOCOL_TEST_PATTERN_SIZE];
+      uint32_t startBaudRate = baudRate;
+
+      if (capabilities.version == 0) {
+        writeAll("YES!\n");
+        linkReady = true;
+        return;
+      }
+
+      formatCapabilities(line, sizeof(line) - 1, capabilities);
+      strcat(line, "\n");
+      writeAll(line);
+
+      while (running) {
+        if (readLine(line, sizeof(line), PROTOCOL_NEGOTIATE_TIMEOUT) == 0) {
+          break;  //an older server, which starts right away
+        }
+
+        LinkSettings settings;
+
+        if (strncmp(line, "BAUD#", 5) == 0) {
+          uint32_t rate = uint32_t(strtoul(&line[5], NULL, 10));
+
+          if ((capabilities.baudRates & getBaudRateBit(rate)) == 0) {
+            writeAll("NO!\n");
+            continue;
+          }
+          writeAll("OK!\n");
+          setPace(rate);
+          uint32_t switchTime = millisNow();
+
+          if (readExact(pattern, PROTOCOL_TEST_PATTERN_SIZE, PROTOCOL_TEST_TIMEOUT, false) == PROTOCOL_TEST_PATTERN_SIZE) {
+            if ((workingBaudRate > 0) && (rate > workingBaudRate)) {
+              pattern[PROTOCOL_TEST_PATTERN_SIZE / 2] ^= 0x10;  //a bit error, as a link that can't hold the rate would have
+            }
+            writeBytes(pattern, PROTOCOL_TEST_PATTERN_SIZE);
+            uint32_t elapsed = millisNow() - switchTime;
+
+            if ((elapsed < PROTOCOL_TEST_TIMEOUT) && (readLine(line, sizeof(line), PROTOCOL_TEST_TIMEOUT - elapsed) > 0) &&
+                parseLinkSettings(line, &settings) && (settings.baudRate == rate)) {
+              linkSettings = settings;
+              writeAll("YES!\n");
+              break;
+            }
+          }
+          setPace(startBaudRate); //the rate didn't work, go back
+        }
+        else if (parseLinkSettings(line, &settings) && (settings.baudRate == baudRate)) {
+          linkSettings = settings;
+          writeAll("YES!\n");
+          break;
+        }
+        else if (strcmp(line, "READY?") == 0) {
+          formatCapabilities(line, sizeof(line) - 1, capabilities);
+          strcat(line, "\n");
+          writeAll(line);
+        }
+      }
+
+      //the frames are no larger than agreed, and the credit is granted for those
+      if ((linkSettings.frameSize > frameHeaderSize) && ((linkSettings.frameSize - frameHeaderSize) < frameDataSize)) {
+        frameDataSize = linkSettings.frameSize - frameHeaderSize;
+      }
+      frameTicks = frameDataSize / (streamStereo ? 2 : 1);
+      linkSettings.baudRate = baudRate;
+      expectedSequence = 0; //the sequence nos. start over with the link
+      pendingFrames.clear();
+      controlFilter.reset();
+      linkReady = true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Changes the baud rate the incoming bytes are paced to.
+
+    void setPace(uint32_t rate) {
+      baudRate = rate;
+      pacedBytes = 0;
+      paceStartTime = millisNow();
+    }
+
+    //------------------------------------------------------------------------------//
+    //Reads a single frame. Returns false if none started before the timeout.
+    //The length of the data follows from the no. of samples and the codec.
+
+    bool receiveFrame(uint8_t* frameBuffer, uint32_t timeout) {
+      if (readExact(frameBuffer, frameHeaderSize, timeout, true) != int(frameHeaderSize)) {
+        return false;
+      }
+
+      uint32_t sampleCount = (uint32_t(frameBuffer[0]) << 8) | frameBuffer[1];
+      uint32_t payloadLength = getFramePayloadLength(frameBuffer[2], sampleCount);
+
+      if ((sampleCount == 0) || (sampleCount > frameDataSize) || (payloadLength == 0) || (!isFrameFormatValid(frameBuffer))) {
+        printf("Loopback device: unexpected sample length %u, codec %u\n", sampleCount, frameBuffer[2]);
+        tcflush(masterFd, TCIFLUSH);
+        return false;
+      }
+
+      if (readExact(frameBuffer + frameHeaderSize, payloadLength, 2000, false) != int(payloadLength)) {
+        printf("Loopback device: frame incomplete\n");
+        return false;
+      }
+
+      //decode the frame as the receiver would, to catch a broken encoder
+      if ((frameBuffer[2] == FRAME_CODEC_IMA_ADPCM) &&
+          (adpcmDecodeU8(frameBuffer + frameHeaderSize, sampleCount, &sampleBuffer[0]) != payloadLength)) {
+        printf("Loopback device: invalid ADPCM frame\n");
+        return false;
+      }
+
+      playFrame(sampleCount, frameBuffer[3]);
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //As the receiver, a stereo frame holds whole pairs and is never coded.
+
+    bool isFrameFormatValid(const uint8_t* frameBuffer) const {
+      return ((frameBuffer[3] & FRAME_FLAG_STEREO) == 0) ||
+             (((frameBuffer[1] % 2) == 0) && (frameBuffer[2] == FRAME_CODEC_PCM_U8));
+    }
+
+    //------------------------------------------------------------------------------//
+    //Adds a whole frame to the emulated buffer. A stereo frame plays for half as
+    //many ticks as it has samples.
+
+    void playFrame(uint32_t sampleCount, uint8_t flags) {
+      bool stereo = ((flags & FRAME_FLAG_STEREO) != 0);
+
+      if (stereo != streamStereo) {
+        streamStereo = stereo;
+        frameTicks = frameDataSize / (stereo ? 2 : 1);
+        bufferTicks = LOOPBACK_BUFFER_SIZE / (stereo ? 2 : 1);
+      }
+      if (stereo) {
+        stereoFrameCount++;
+      }
+      framesReceived++;
+      bufferOccupied += stereo ? (sampleCount / 2) : sampleCount;
+
+      if (bufferOccupied > bufferTicks) {
+        bufferOccupied = bufferTicks;  //the real buffer would drop these
+      }
+      if ((!playbackStarted) && ((bufferTicks - bufferOccupied) < frameTicks)) {
+        playbackStarted = true;
+      }
+
+      //the tracks follow each other without a gap, only the end of the stream
+      //lets the buffer run dry
+      if (flags & FRAME_FLAG_TRACK_END) {
+        tracksReceived++;
+      }
+      streamEnded = ((flags & FRAME_FLAG_STREAM_END) != 0);
+      playbackStarted |= streamEnded;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    bool isChecked() const {
+      return (linkSettings.options & PROTOCOL_OPTION_CHECKED_FRAMES) != 0;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    bool isControlled() const {
+      return isChecked() && ((linkSettings.options & PROTOCOL_OPTION_CONTROL) != 0);
+    }
+
+    //------------------------------------------------------------------------------//
+    //Reads bytes until a sync word has gone by. Returns SYNC_FRAME or SYNC_CONTROL,
+    //or SYNC_NONE if neither came before the timeout.
+
+    int findSync(uint32_t timeout) {
+      uint8_t matched = 0;
+      bool damage = damageNextSync;
+      damageNextSync = false;
+
+      while (true) {
+        uint8_t oneByte = 0;
+        uint32_t skipped = 0;
+
+        if (readExact(&oneByte, 1, timeout, false) != 1) {
+          return SYNC_NONE;
+        }
+        if (damage) {
+          oneByte ^= 0x01;
+          damage = false;
+        }
+
+        int sync = scanSyncByte(oneByte, &matched, &skipped);
+        checkStats.bytesSkipped += skipped;
+        bytesSkippedSinceFrame += skipped;
+
+        if (sync == SYNC_FRAME) {
+          bytesSkippedSinceFrame = 0;
+        }
+        if (sync != SYNC_NONE) {
+          return sync;
+        }
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Reads the next checked frame, from its sync word on. Returns false if none
+    //started before the timeout. A frame that's damaged is never played, and the
+    //bytes that follow it are looked through for the next sync word. The control
+    //messages that come before it are applied on the way.
+
+    bool receiveCheckedFrame(uint8_t* frameBuffer, uint32_t timeout) {
+      int sync = SYNC_NONE;
+
+      while ((sync = findSync(timeout)) == SYNC_CONTROL) {
+        receiveControl();
+      }
+      if (sync == SYNC_NONE) {
+        return false;
+      }
+
+      uint8_t sequence = 0;
+
+      if ((readExact(&sequence, 1, 2000, false) != 1) ||
+          (readExact(frameBuffer, frameHeaderSize, 2000, false) != int(frameHeaderSize))) {
+        frameDamaged();
+        return true;
+      }
+
+      uint32_t sampleCount = (uint32_t(frameBuffer[0]) << 8) | frameBuffer[1];
+      uint32_t payloadLength = getFramePayloadLength(frameBuffer[2], sampleCount);
+      uint32_t frameLength = frameHeaderSize + payloadLength;
+
+      if ((sampleCount == 0) || (sampleCount > frameDataSize) || (payloadLength == 0) || (!isFrameFormatValid(frameBuffer)) ||
+          (readExact(frameBuffer + frameHeaderSize, payloadLength + FRAME_CHECK_CRC_SIZE, 2000, false) !=
+           int(payloadLength + FRAME_CHECK_CRC_SIZE))) {
+        frameDamaged();
+        return true;
+      }
+
+      framesArrived++;
+
+      if ((errorInterval > 0) && ((framesArrived % errorInterval) == 0)) {
+        if ((framesArrived / errorInterval) % 2) {
+          frameBuffer[frameHeaderSize + (framesArrived % payloadLength)] ^= 0x04;
+        }
+        else {
+          damageNextSync = true;
+        }
+      }
+
+      if (!checkFrameCrc(sequence, frameBuffer, frameLength, frameBuffer + frameLength)) {
+        checkStats.crcErrors++;
+        frameDamaged();
+        return true;
+      }
+
+      if ((frameBuffer[2] == FRAME_CODEC_IMA_ADPCM) &&
+          (adpcmDecodeU8(frameBuffer + frameHeaderSize, sampleCount, &sampleBuffer[0]) != payloadLength)) {
+        printf("Loopback device: invalid ADPCM frame\n");
+      }
+
+      PendingFrame frame = {sequence, true, false, uint16_t(sampleCount), frameBuffer[3],
+                            getFrameCrc(sequence, frameBuffer, frameLength), 0, 0};
+      storeFrame(frame);
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Reads a control message after its sync word and answers it with CA#, the way
+    //the transmitter does. A new one is applied.
+
+    void receiveControl() {
+      uint8_t data[CONTROL_MESSAGE_SIZE + FRAME_CHECK_CRC_SIZE];
+      ControlMessage message;
+
+      if ((readExact(data, sizeof(data), 2000, false) != int(sizeof(data))) || (!readControlEnvelope(data, &message))) {
+        checkStats.controlErrors++; //the server sends it again
+        return;
+      }
+
+      char line[16];
+      formatControlAck(line, sizeof(line) - 1, message.id);
+      strcat(line, "\n");
+      writeAll(line);
+
+      if (controlFilter.accept(message.id)) {
+        applyControl(message.type, message.value);
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //A pause stops the emulated buffer draining, and a skip or a seek empties it.
+
+    void applyControl(uint8_t type, int32_t value) {
+      if (type == CONTROL_PAUSE) {
+        playbackPaused = true;
+      }
+      else if (type == CONTROL_RESUME) {
+        playbackPaused = false;
+      }
+      else if (type == CONTROL_GAIN) {
+        gainPercent = value;
+      }
+      else {
+        //the new place fills the buffer up again before it plays
+        bufferOccupied = 0;
+        playbackStarted = false;
+        streamEnded = false;
+        checkStats.bufferFlushes++;
+      }
+      checkStats.controlsApplied++;
+      controlsApplied++;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Puts a frame that arrived whole in its place. It's either one that was asked
+    //for again, a new one, which may show that the ones before it went missing, or
+    //one that was seen before.
+
+    void storeFrame(const PendingFrame& frame) {
+      for (size_t i=0; i < pendingFrames.size(); i++) {
+        if ((!pendingFrames[i].arrived) && (pendingFrames[i].sequence == frame.sequence)) {
+          pendingFrames[i] = frame;
+          checkStats.framesRecovered++;
+          deliverFrames();
+          return;
+        }
+      }
+
+      int gap = getSequenceGap(expectedSequence, frame.sequence);
+
+      if (gap < 0) {
+        return; //sent again, but it had arrived after all
+      }
+      if ((pendingFrames.size() + gap + 1) > LOOPBACK_PENDING_FRAMES) {
+        checkStats.framesDropped++; //asked for again once the frame after it comes
+        return;
+      }
+
+      for (int i=0; i < gap; i++) {
+        requestMissing();
+      }
+      pendingFrames.push_back(frame);
+      expectedSequence++;
+      useCredit();
+      deliverFrames();
+    }
+
+    //------------------------------------------------------------------------------//
+    //A frame was seen but it's no use. If a new frame was due and nothing else is
+    //missing, it was most likely that one, and it's asked for again. Otherwise the
+    //gap shows once the next frame is there.
+
+    void frameDamaged() {
+      checkStats.framesDamaged++;
+
+      if ((creditOutstanding > 0) && pendingFrames.empty()) {
+        requestMissing();
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //The next new frame is missing. It's asked for and its place is kept.
+
+    void requestMissing() {
+      PendingFrame frame = {expectedSequence, false, false, 0, 0, 0, millisNow(), 0};
+      pendingFrames.push_back(frame);
+      expectedSequence++;
+      useCredit();
+      sendResendRequest(pendingFrames.back());
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void sendResendRequest(PendingFrame& frame) {
+      char requestLine[16];
+      snprintf(requestLine, sizeof(requestLine), "RS#%u\n", unsigned(frame.sequence));
+      writeAll(requestLine);
+      frame.requestTime = millisNow();
+      frame.requestCount++;
+      checkStats.resendsRequested++;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void useCredit() {
+      if (creditOutstanding > 0) {
+        creditOutstanding--;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Asks again for the frames that didn't come in time, and gives up on those
+    //that were asked for LOOPBACK_RESEND_ATTEMPTS times.
+
+    void checkResends() {
+      uint32_t now = millisNow();
+
+      for (size_t i=0; i < pendingFrames.size(); i++) {
+        PendingFrame& frame = pendingFrames[i];
+
+        if (frame.arrived || ((now - frame.requestTime) < LOOPBACK_RESEND_TIMEOUT)) {
+          continue;
+        }
+        if (frame.requestCount < LOOPBACK_RESEND_ATTEMPTS) {
+          sendResendRequest(frame);
+        }
+        else {
+          frame.arrived = true;
+          frame.lost = true;
+          checkStats.framesLost++;
+        }
+      }
+      deliverFrames();
+    }
+
+    //------------------------------------------------------------------------------//
+    //Plays the frames that are next in line.
+
+    void deliverFrames() {
+      while ((!pendingFrames.empty()) && pendingFrames.front().arrived) {
+        const PendingFrame& frame = pendingFrames.front();
+
+        if (!frame.lost) {
+          uint8_t crcBytes[4] = {uint8_t(frame.crc), uint8_t(frame.crc >> 8), uint8_t(frame.crc >> 16), uint8_t(frame.crc >> 24)};
+          checkStats.digest = crc32Update(checkStats.digest, crcBytes, 4);
+          checkStats.framesDelivered++;
+          playFrame(frame.sampleCount, frame.flags);
+        }
+        pendingFrames.pop_front();
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Reads exactly length bytes, paced to the baud rate. If startOnly is set, the
+    //timeout only applies to the first byte. Returns the no. of bytes read.
+
+    int readExact(uint8_t* buffer, uint32_t length, uint32_t timeout, bool startOnly) {
+      uint32_t bytesRead = 0;
+      uint32_t entryTime = millisNow();
+
+      while ((bytesRead < length) && running) {
+        uint32_t elapsed = millisNow() - entryTime;
+        uint32_t allowed = ((bytesRead > 0) && startOnly) ? 2000 : timeout;
+
+        if (elapsed >= allowed) {
+          break;
+        }
+
+        struct pollfd pfd = {masterFd, POLLIN, 0};
+
+        if (poll(&pfd, 1, int(allowed - elapsed)) <= 0) {
+          continue;
+        }
+
+        ssize_t count = ::read(masterFd, buffer + bytesRead, length - bytesRead);
+
+        if (count > 0) {
+          bytesRead += uint32_t(count);
+          lastByteTime = millisNow();
+          pace(uint32_t(count));
+        }
+      }
+      return int(bytesRead);
+    }
+
+    //------------------------------------------------------------------------------//
+    //Reads a line into the buffer without the NL. Returns the line length plus one,
+    //or 0 on timeout. Lines are short, so they are read a byte at a time.
+
+    int readLine(char* line, uint32_t maxLength, uint32_t timeout) {
+      uint32_t lineLength = 0;
+      uint8_t oneByte = 0;
+
+      while (readExact(&oneByte, 1, timeout, false) == 1) {
+        if (oneByte == '\n') {
+          line[lineLength] = 0;
+          return int(lineLength + 1);
+        }
+        if ((oneByte != '\r') && (lineLength < (maxLength - 1))) {
+          line[lineLength] = char(oneByte);
+          lineLength++;
+        }
+      }
+      return 0;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void writeAll(const char* text) {
+      writeBytes((const uint8_t*) text, uint32_t(strlen(text)));
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void writeBytes(const uint8_t* buffer, uint32_t length) {
+      uint32_t offset = 0;
+
+      while ((offset < length) && running) {
+        ssize_t count = ::write(masterFd, buffer + offset, length - offset);
+
+        if (count > 0) {
+          offset += uint32_t(count);
+        }
+        else {
+          sleepMillis(1);
+        }
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Sleeps so that the bytes received so far don't arrive faster than the baud
+    //rate allows. Every byte takes 10 bits on the wire. Time the link was idle is
+    //not made up for, otherwise a frame after a pause would arrive all at once.
+
+    void pace(uint32_t count) {
+      bytesReceived += count;
+      pacedBytes += count;
+
+      if (baudRate == 0) {
+        return;
+      }
+
+      uint32_t expected = uint32_t((pacedBytes * 10 * 1000) / baudRate);
+      uint32_t elapsed = millisNow() - paceStartTime;
+
+      if (expected > elapsed) {
+        sleepMillis(expected - elapsed);
+      }
+      else if ((elapsed - expected) > 10) {
+        paceStartTime = millisNow();
+        pacedBytes = 0;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void printReport() {
+      uint32_t elapsed = millisNow() - startTime;
+
+      if (elapsed == 0) {
+        elapsed = 1;
+      }
+      printf("Loopback device: frames %u, stereo %u, tracks %u, requests %u, bytes/s %u, buffer %u, underruns %u\n",
+        framesReceived, uint32_t(stereoFrameCount), tracksReceived, requestCount, uint32_t((bytesReceived * 1000) / elapsed),
+        bufferOccupied, underrunCount);
+
+      if (isChecked()) {
+        printf("Loopback device: damaged %u, CRC errors %u, resends %u, recovered %u, lost %u, dropped %u, skipped bytes %u\n",
+          checkStats.framesDamaged, checkStats.crcErrors, checkStats.resendsRequested, checkStats.framesRecovered,
+          checkStats.framesLost, checkStats.framesDropped, checkStats.bytesSkipped);
+      }
+      if (isControlled()) {
+        printf("Loopback device: controls %u, control errors %u, flushes %u, %s, gain %d%%\n",
+          checkStats.controlsApplied, checkStats.controlErrors, checkStats.bufferFlushes,
+          playbackPaused ? "paused" : "playing", int(gainPercent));
+      }
+    }
+};
+
+#endif
+
+#endif
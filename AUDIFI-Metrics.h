@@ -0,0 +1,208 @@
+//==============================================================================//
+//
+//  AUDIFI Metrics
+//  Version : v0.1
+//
+//  Counters and latency histograms that are cheap enough to update on every
+//  frame, from any task or thread. Updates are single relaxed atomic operations
+//  and never take a lock. Nothing is ever reset, so a reader takes the
+//  difference between two reports for a rate.
+//
+//  A histogram has fixed buckets that double in width, so that values from 1 to
+//  16383 fit in 15 buckets, and the 16th takes the rest.
+//
+//  Reports are lines of name=value pairs that start with the kind of record,
+//
+//    metrics uptime_ms=120000 frames_sent=118 bytes_sent=1301422
+//    histogram name=request_rtt_ms count=118 sum=28320 max=260 p50=256 p90=512
+//      p99=512 lt1=0 lt2=0 .. lt16384=0 inf=0
+//
+//  where a histogram is one line, and each ltN is the no. of values below N and
+//  at least the bound before it.
+//
+//  This file is shared by the server application, the transmitter and the
+//  receiver. Copy it to the sketch folders along with the sketches.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_METRICS_H
+#define AUDIFI_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+
+#define METRICS_HISTOGRAM_BUCKETS 16
+#define METRICS_LINE_MAX_LENGTH 384   //long enough for a histogram with all its buckets
+
+//==============================================================================//
+
+class MetricCounter {
+  public:
+    MetricCounter() : value(0) {
+    }
+
+    void add(uint32_t count) {
+      value.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    void increment() {
+      value.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint32_t get() const {
+      return value.load(std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint32_t> value;
+
+    MetricCounter(const MetricCounter&);
+    MetricCounter& operator=(const MetricCounter&);
+};
+
+//==============================================================================//
+
+class MetricHistogram {
+  public:
+    MetricHistogram() : count(0), sum(0), max(0) {
+      for (int i=0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        buckets[i].store(0, std::memory_order_relaxed);
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //The bucket of a value is the no. of bits it takes.
+
+    void record(uint32_t value) {
+      int bucket = 0;
+
+      for (uint32_t v = value; (v > 0) && (bucket < (METRICS_HISTOGRAM_BUCKETS - 1)); v >>= 1) {
+        bucket++;
+      }
+
+      buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+      count.fetch_add(1, std::memory_order_relaxed);
+      sum.fetch_add(value, std::memory_order_relaxed);
+
+      uint32_t oldMax = max.load(std::memory_order_relaxed);
+
+      while ((value > oldMax) && (!max.compare_exchange_weak(oldMax, value, std::memory_order_relaxed))) {
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Returns the upper bound of the bucket that holds the given share of the
+    //values, or the max. for the last bucket. 0 if there are no values.
+
+    uint32_t getPercentile(uint32_t percent) const {
+      uint32_t total = count.load(std::memory_order_relaxed);
+      uint32_t wanted = uint32_t((uint64_t(total) * percent + 99) / 100);
+      uint32_t seen = 0;
+
+      if (total == 0) {
+        return 0;
+      }
+
+      for (int i=0; i < (METRICS_HISTOGRAM_BUCKETS - 1); i++) {
+        seen += buckets[i].load(std::memory_order_relaxed);
+
+        if (seen >= wanted) {
+          return uint32_t(1) << i;
+        }
+      }
+      return max.load(std::memory_order_relaxed);
+    }
+
+    uint32_t getCount() const {
+      return count.load(std::memory_order_relaxed);
+    }
+
+    uint32_t getSum() const {
+      return sum.load(std::memory_order_relaxed);
+    }
+
+    uint32_t getMax() const {
+      return max.load(std::memory_order_relaxed);
+    }
+
+    uint32_t getBucket(int index) const {
+      return buckets[index].load(std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint32_t> buckets[METRICS_HISTOGRAM_BUCKETS];
+    std::atomic<uint32_t> count;
+    std::atomic<uint32_t> sum;
+    std::atomic<uint32_t> max;
+
+    MetricHistogram(const MetricHistogram&);
+    MetricHistogram& operator=(const MetricHistogram&);
+};
+
+//==============================================================================//
+//Builds a report line. Pairs that don't fit are left out whole.
+
+class MetricsLine {
+  public:
+    MetricsLine(const char* record) : length(0) {
+      text[0] = 0;
+      append("%s", record);
+    }
+
+    void add(const char* name, uint32_t value) {
+      append(" %s=%lu", name, (unsigned long) value);
+    }
+
+    void addSigned(const char* name, int32_t value) {
+      append(" %s=%ld", name, (long) value);
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void add(const char* name, const MetricHistogram& histogram) {
+      append(" name=%s", name);
+      add("count", histogram.getCount());
+      add("sum", histogram.getSum());
+      add("max", histogram.getMax());
+      add("p50", histogram.getPercentile(50));
+      add("p90", histogram.getPercentile(90));
+      add("p99", histogram.getPercentile(99));
+
+      for (int i=0; i < (METRICS_HISTOGRAM_BUCKETS - 1); i++) {
+        append(" lt%lu=%lu", (unsigned long) (uint32_t(1) << i), (unsigned long) histogram.getBucket(i));
+      }
+      add("inf", histogram.getBucket(METRICS_HISTOGRAM_BUCKETS - 1));
+    }
+
+    //------------------------------------------------------------------------------//
+
+    const char* getText() const {
+      return text;
+    }
+
+  private:
+    char text[METRICS_LINE_MAX_LENGTH];
+    uint32_t length;
+
+    template <typename A, typename B>
+    void append(const char* format, A a, B b) {
+      int count = snprintf(text + length, sizeof(text) - length, format, a, b);
+      commit(count);
+    }
+
+    template <typename A>
+    void append(const char* format, A a) {
+      int count = snprintf(text + length, sizeof(text) - length, format, a);
+      commit(count);
+    }
+
+    void commit(int count) {
+      if ((count > 0) && ((length + uint32_t(count)) < sizeof(text))) {
+        length += uint32_t(count);
+      }
+      text[length] = 0;
+    }
+};
+
+#endif
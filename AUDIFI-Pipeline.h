@@ -0,0 +1,886 @@
+//==============================================================================//
+//
+//  AUDIFI Pipeline
+//  Version : v0.1
+//
+//  Prepares the serial frames of a playlist ahead of the serial writer, in two
+//  threads of their own, so that a slow disk or a long filter never holds up a
+//  frame that has been requested.
+//
+//    reader  opens the tracks and reads their audio data in blocks
+//    DSP     converts, resamples and codes the blocks, and builds the frames
+//
+//  The serial writer, which is the server's main thread, takes the finished
+//  frames. The stages are joined by slot queues. A slot is filled by one stage and
+//  handed over to the next without being copied, and the next hands it back when
+//  it's done with it. Each queue has a fixed no. of slots, so a stage that runs
+//  ahead waits for the one after it, and no more than a few frames are ever
+//  prepared ahead.
+//
+//  The next track is opened while the last blocks of a track are still being
+//  coded, and its frames follow without a gap. The last frame of a track is
+//  flagged with FRAME_FLAG_TRACK_END, and the last frame of the playlist with
+//  FRAME_FLAG_STREAM_END too.
+//
+//  PCM frames can be stereo. Their samples are the left and right samples of the
+//  track in turn, and they are flagged with FRAME_FLAG_STEREO.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_PIPELINE_H
+#define AUDIFI_PIPELINE_H
+
+#include "AUDIFI-Protocol.h"
+#include "AUDIFI-Audio-Source.h"
+#include "AUDIFI-WAV-Parser.h"
+#include "AUDIFI-Sample-Converter.h"
+#include "AUDIFI-Resampler.h"
+#include "AUDIFI-ADPCM.h"
+#include "AUDIFI-Playlist.h"
+#include "AUDIFI-Ring-Buffer.h"
+#include "AUDIFI-Metrics.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#ifndef PIPELINE_FRAME_SAMPLES
+  #define PIPELINE_FRAME_SAMPLES REQUEST_DATA_SIZE  //max no. of samples in a frame
+#endif
+
+#define PIPELINE_FRAME_HEADER_SIZE PROTOCOL_FRAME_HEADER_SIZE
+#define PIPELINE_FRAME_MAX_LENGTH (PIPELINE_FRAME_HEADER_SIZE + PIPELINE_FRAME_SAMPLES) //coded frames are shorter
+#define PIPELINE_FRAME_SLOTS 6        //frames held by the DSP stage and the writer, and those ready in between
+#define PIPELINE_BLOCK_SLOTS 16       //blocks read ahead of the DSP stage
+#define PIPELINE_BLOCK_FRAMES (4 * CONVERTER_BLOCK_FRAMES)  //audio frames read at a time
+#define PIPELINE_BLOCK_LENGTH (PIPELINE_BLOCK_FRAMES * WAV_MAX_CHANNELS * 4)  //max bytes in a block
+#define PIPELINE_POLL_INTERVAL 100    //us a stage sleeps while its queue is full or empty
+
+//==============================================================================//
+
+inline uint64_t pipelineMicros() {
+  return uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+//==============================================================================//
+//A fixed set of slots passed from a producer thread to a consumer thread. The
+//producer takes a free slot, fills it and submits it. The consumer receives it,
+//uses it and releases it back. Both directions are lock-free rings of slot
+//indices, each with one producer and one consumer.
+
+template <typename T>
+class SlotQueue {
+  public:
+    SlotQueue() : slots(NULL), slotCount(0) {
+    }
+
+    ~SlotQueue() {
+      delete[] slots;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Allocates the slots, all free. Returns false if there's not enough memory.
+
+    bool begin(uint32_t count) {
+      delete[] slots;
+      slots = new T[count];
+      slotCount = count;
+
+      if ((!freeSlots.begin(count)) || (!readySlots.begin(count))) {
+        return false;
+      }
+      for (uint32_t i=0; i < count; i++) {
+        freeSlots.push(i);
+      }
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Producer side. Returns NULL if all slots are in use.
+
+    T* acquire() {
+      uint32_t index = 0;
+      return freeSlots.pop(&index) ? &slots[index] : NULL;
+    }
+
+    void submit(T* slot) {
+      readySlots.push(uint32_t(slot - slots));
+    }
+
+    //------------------------------------------------------------------------------//
+    //Consumer side. Returns NULL if no slot is ready.
+
+    T* receive() {
+      uint32_t index = 0;
+      return readySlots.pop(&index) ? &slots[index] : NULL;
+    }
+
+    void release(T* slot) {
+      freeSlots.push(uint32_t(slot - slots));
+    }
+
+    uint32_t getReadyCount() const {
+      return readySlots.getOccupied();
+    }
+
+  private:
+    T* slots;
+    uint32_t slotCount;
+    RingBuffer<uint32_t> freeSlots;   //from the consumer to the producer
+    RingBuffer<uint32_t> readySlots;  //from the producer to the consumer
+
+    SlotQueue(const SlotQueue&);
+    SlotQueue& operator=(const SlotQueue&);
+};
+
+//==============================================================================//
+//How to build the frames.
+
+struct PipelineConfig {
+  uint32_t frameSamples; //max no. of samples in a frame, up to PIPELINE_FRAME_SAMPLES
+  uint32_t sampleRate;   //rate of the samples sent
+  int resamplerQuality;
+  uint8_t codec;         //FRAME_CODEC_*
+  uint8_t channelCount;  //1, or 2 for stereo, with PCM frames only
+  bool preferMapped;     //map the audio files instead of reading them in chunks
+  bool printTracks;      //print the format of each track as it's opened
+  uint32_t firstTrack;   //playlist position to start at, eg. to resume after the link was lost
+  uint32_t firstTrackOffset; //ms into the first track to start at, for a seek
+};
+
+//==============================================================================//
+//An audio file being streamed. The reader uses the source and the DSP stage uses
+//the rest, once the reader has set them up.
+
+struct AudioTrack {
+  int index;  //position in the playlist
+  AudioSource* source;  //the file
+  WavFormat format; //format of the samples in the file
+  SampleConverter converter;  //converts the samples to the receiver's format
+  uint64_t dataRemaining; //no. of bytes of audio data not read yet
+  uint8_t splitFrame[WAV_MAX_CHANNELS * 4]; //a frame split between two views of the file
+  bool splitFrameRead;  //true when the acquired frame is in splitFrame
+
+  //used only if the file's sample rate is not the output rate
+  bool resampling;
+  Resampler resampler;
+  float decodedBuffer[CONVERTER_BLOCK_FRAMES];  //decoded samples at the file's rate
+  uint32_t decodedCount;  //no. of samples in decodedBuffer
+  uint32_t decodedUsed; //no. of samples in decodedBuffer already resampled
+  bool flushed; //true when the end of the file has been pushed through the filter
+
+  //the right channel, used only for stereo frames. the left one is the above.
+  Resampler rightResampler;
+  float rightDecodedBuffer[CONVERTER_BLOCK_FRAMES];
+
+  //used only if the frames are ADPCM coded
+  int16_t adpcmInput[PIPELINE_FRAME_SAMPLES];  //the samples of a frame before they are coded
+  int32_t adpcmStepIndex; //encoder state carried between frames
+};
+
+//==============================================================================//
+//Whole audio frames of a track as read from the file. A block with no frames
+//ends the track.
+
+struct PipelineBlock {
+  AudioTrack* track;
+  uint32_t frameCount;
+  bool lastTrack; //in the block that ends a track, true if no track follows
+  uint8_t data[PIPELINE_BLOCK_LENGTH];
+};
+
+//==============================================================================//
+
+struct PipelineFrame {
+  int trackIndex; //playlist position of the track the samples are from
+  uint32_t length;  //including the header
+  uint8_t data[PIPELINE_FRAME_MAX_LENGTH];
+};
+
+//==============================================================================//
+//Time a stage has run, and how much of it was spent waiting for the stage before
+//or after it. The rest is its own work.
+
+struct PipelineStage {
+  std::atomic<uint64_t> startTime;  //us
+  std::atomic<uint64_t> stopTime; //us, 0 while the stage runs
+  std::atomic<uint64_t> waitTime; //us
+  std::atomic<uint32_t> itemCount;  //blocks or frames passed on
+
+  PipelineStage() : startTime(0), stopTime(0), waitTime(0), itemCount(0) {
+  }
+
+  void begin() {
+    waitTime = 0;
+    itemCount = 0;
+    stopTime = 0;
+    startTime = pipelineMicros();
+  }
+
+  uint64_t getRunTime() const {
+    uint64_t start = startTime;
+    uint64_t stop = stopTime;
+    return (start == 0) ? 0 : (((stop != 0) ? stop : pipelineMicros()) - start);
+  }
+
+  uint64_t getBusyTime() const {
+    uint64_t run = getRunTime();
+    uint64_t wait = waitTime;
+    return (run > wait) ? (run - wait) : 0;
+  }
+
+  //the share of its run time the stage was busy, 0 to 1
+  double getUtilization() const {
+    uint64_t run = getRunTime();
+    return (run > 0) ? (double(getBusyTime()) / double(run)) : 0.0;
+  }
+};
+
+//==============================================================================//
+
+class FramePipeline {
+  public:
+    FramePipeline() : playlist(NULL), trackCache(NULL), running(false), finished(false),
+      readerTrack(NULL), dspTrack(NULL), dspBlock(NULL), dspBlockUsed(0) {
+      memset(&config, 0, sizeof(config));
+    }
+
+    ~FramePipeline() {
+      stop();
+    }
+
+    //------------------------------------------------------------------------------//
+    //Starts preparing the frames of the playlist. The track cache is optional and
+    //is only used by the reader thread until the pipeline is stopped.
+
+    bool start(const Playlist* playlist, TrackCache* trackCache, const PipelineConfig& config) {
+      stop();
+
+      if ((config.frameSamples == 0) || (config.frameSamples > PIPELINE_FRAME_SAMPLES)) {
+        return false;
+      }
+      if ((config.channelCount != 1) && ((config.channelCount != 2) || (config.codec != FRAME_CODEC_PCM_U8) ||
+          (config.frameSamples < 2))) {
+        return false;
+      }
+      if ((!blocks.begin(PIPELINE_BLOCK_SLOTS)) || (!frames.begin(PIPELINE_FRAME_SLOTS))) {
+        return false;
+      }
+
+      this->playlist = playlist;
+      this->trackCache = trackCache;
+      this->config = config;
+      finished = false;
+      running = true;
+      readerStage.begin();
+      dspStage.begin();
+      readerThread = std::thread(&FramePipeline::runReader, this);
+      dspThread = std::thread(&FramePipeline::runDsp, this);
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Stops both stages, even in the middle of a track.
+
+    void stop() {
+      if (!running) {
+        return;
+      }
+      running = false;
+      readerThread.join();
+      dspThread.join();
+
+      //a track is deleted by the DSP stage when it gets the block that ends it.
+      //the tracks of the blocks it didn't get are deleted here instead.
+      PipelineBlock* block = NULL;
+
+      while ((block = blocks.receive()) != NULL) {
+        if ((block->frameCount == 0) && (block->track != dspTrack)) {
+          closeTrack(block->track);
+        }
+        blocks.release(block);
+      }
+      if (readerTrack != dspTrack) {
+        closeTrack(readerTrack);
+      }
+      closeTrack(dspTrack);
+      readerTrack = NULL;
+      dspTrack = NULL;
+      dspBlock = NULL;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Writer side. Returns the next frame, or NULL if there's none yet within the
+    //timeout, or if all the frames have been taken. A frame must be released once
+    //it has been written.
+
+    PipelineFrame* getFrame(uint32_t timeout) {
+      uint64_t entryTime = pipelineMicros();
+
+      while (true) {
+        PipelineFrame* frame = frames.receive();
+
+        if (frame != NULL) {
+          return frame;
+        }
+        if (isFinished() || ((pipelineMicros() - entryTime) >= (uint64_t(timeout) * 1000))) {
+          return NULL;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(PIPELINE_POLL_INTERVAL));
+      }
+    }
+
+    void releaseFrame(PipelineFrame* frame) {
+      frames.release(frame);
+    }
+
+    //------------------------------------------------------------------------------//
+    //True once the last frame has been built and taken.
+
+    bool isFinished() const {
+      return finished && (frames.getReadyCount() == 0);
+    }
+
+    uint32_t getFramesReady() const {
+      return frames.getReadyCount();
+    }
+
+    const PipelineStage& getReaderStage() const {
+      return readerStage;
+    }
+
+    const PipelineStage& getDspStage() const {
+      return dspStage;
+    }
+
+    //time the DSP stage took for each frame, not counting waits, ms
+    const MetricHistogram& getFrameBuildTime() const {
+      return frameBuildTime;
+    }
+
+  private:
+    const Playlist* playlist;
+    TrackCache* trackCache;
+    PipelineConfig config;
+    std::atomic<bool> running;
+    std::atomic<bool> finished; //the DSP stage has built the last frame
+
+    SlotQueue<PipelineBlock> blocks;  //reader to DSP
+    SlotQueue<PipelineFrame> frames;  //DSP to writer
+    std::thread readerThread;
+    std::thread dspThread;
+    PipelineStage readerStage;
+    PipelineStage dspStage;
+    MetricHistogram frameBuildTime;
+
+    AudioTrack* readerTrack;  //the track being read
+    AudioTrack* dspTrack; //the track being coded
+    PipelineBlock* dspBlock;  //the block being coded
+    uint32_t dspBlockUsed;  //no. of audio frames of dspBlock already taken
+
+    //------------------------------------------------------------------------------//
+    //Sleeps a little while a queue is full or empty, and counts it as waiting.
+
+    void wait(PipelineStage* stage) {
+      uint64_t startTime = pipelineMicros();
+      std::this_thread::sleep_for(std::chrono::microseconds(PIPELINE_POLL_INTERVAL));
+      stage->waitTime += pipelineMicros() - startTime;
+    }
+
+    //------------------------------------------------------------------------------//
+    //The reader stage. The next track is opened before the block that ends a
+    //track is sent, so that block can tell if another track follows. If no track
+    //can be streamed at all, a single block with no track ends the stream.
+
+    void runReader() {
+      size_t nextIndex = config.firstTrack;
+      bool lastTrack = false;
+      readerTrack = loadTrack(&nextIndex);
+
+      if ((readerTrack != NULL) && (readerTrack->index == int(config.firstTrack)) && (config.firstTrackOffset > 0)) {
+        seekTrack(readerTrack, config.firstTrackOffset);
+      }
+
+      while (running && (!lastTrack)) {
+        PipelineBlock* block = NULL;
+
+        while (running && ((block = blocks.acquire()) == NULL)) {
+          wait(&readerStage);
+        }
+        if (block == NULL) {
+          break;
+        }
+
+        block->track = readerTrack;
+        block->frameCount = (readerTrack != NULL) ? readBlock(readerTrack, block->data) : 0;
+
+        if (block->frameCount == 0) {
+          AudioTrack* nextTrack = (readerTrack != NULL) ? loadTrack(&nextIndex) : NULL;
+          lastTrack = (nextTrack == NULL);
+          readerTrack = nextTrack;  //the DSP stage owns the track that ended now
+        }
+        block->lastTrack = lastTrack;
+        blocks.submit(block);
+        readerStage.itemCount++;
+      }
+      readerStage.stopTime = pipelineMicros();
+    }
+
+    //------------------------------------------------------------------------------//
+    //Reads up to a block of whole audio frames from the track to data.
+    //Returns the no. of frames, 0 at the end of the track.
+
+    uint32_t readBlock(AudioTrack* track, uint8_t* data) {
+      uint32_t frameCount = 0;
+
+      while (frameCount < PIPELINE_BLOCK_FRAMES) {
+        const uint8_t* frameData = NULL;
+        uint32_t count = acquireTrackFrames(track, PIPELINE_BLOCK_FRAMES - frameCount, &frameData);
+
+        if (count == 0) {
+          break;
+        }
+        memcpy(data + (frameCount * track->format.blockAlign), frameData, count * track->format.blockAlign);
+        releaseTrackFrames(track, count);
+        frameCount += count;
+      }
+      return frameCount;
+    }
+
+    //------------------------------------------------------------------------------//
+    //The DSP stage. A frame is held back until the next one is built, so that the
+    //last frame of a track is known before it's passed on.
+
+    void runDsp() {
+      PipelineFrame* heldFrame = NULL;
+      PipelineFrame* frame = NULL;
+
+      while (running) {
+        if (frame == NULL) {
+          while (running && ((frame = frames.acquire()) == NULL)) {
+            wait(&dspStage);
+          }
+          if (frame == NULL) {
+            break;
+          }
+        }
+
+        uint64_t buildStartTime = pipelineMicros();
+        uint64_t waitTimeBefore = dspStage.waitTime;
+        frame->length = encodeFrame(frame->data);
+        frame->trackIndex = (dspTrack != NULL) ? dspTrack->index : -1;
+
+        if (frame->length > 0) {
+          frameBuildTime.record(uint32_t((pipelineMicros() - buildStartTime - (dspStage.waitTime - waitTimeBefore)) / 1000));
+
+          if (heldFrame != NULL) {
+            frames.submit(heldFrame);
+            dspStage.itemCount++;
+          }
+          heldFrame = frame;
+          frame = NULL;  //a new slot for the next one
+          continue;
+        }
+
+        if (dspBlock == NULL) {
+          break;  //stopped while waiting for a block
+        }
+
+        //the track ended. the frame slot is kept for the next track, and the
+        //last frame is still held in case no frame of another track follows.
+        bool lastTrack = dspBlock->lastTrack;
+
+        if ((heldFrame != NULL) && (dspTrack != NULL) && (heldFrame->trackIndex == dspTrack->index)) {
+          heldFrame->data[3] |= FRAME_FLAG_TRACK_END;
+        }
+        if ((heldFrame != NULL) && lastTrack) {
+          heldFrame->data[3] |= FRAME_FLAG_STREAM_END;
+          frames.submit(heldFrame);
+          dspStage.itemCount++;
+          heldFrame = NULL;
+        }
+
+        blocks.release(dspBlock);
+        dspBlock = NULL;
+        closeTrack(dspTrack);
+        dspTrack = NULL;
+
+        if (lastTrack) {
+          break;
+        }
+      }
+
+      finished = true;
+      dspStage.stopTime = pipelineMicros();
+    }
+
+    //------------------------------------------------------------------------------//
+    //Gets up to maxFrames whole audio frames of the track being coded. A new track
+    //starts with the block after the one that ended the last. Returns the no. of
+    //frames at data, which have to be released after use, or 0 at the end of the
+    //track or if the pipeline was stopped.
+
+    uint32_t acquireBlockFrames(uint32_t maxFrames, const uint8_t** data) {
+      if ((dspBlock != NULL) && (dspBlock->frameCount > 0) && (dspBlockUsed == dspBlock->frameCount)) {
+        blocks.release(dspBlock);
+        dspBlock = NULL;
+      }
+
+      if (dspBlock == NULL) {
+        while (running && ((dspBlock = blocks.receive()) == NULL)) {
+          wait(&dspStage);
+        }
+        if (dspBlock == NULL) {
+          return 0;
+        }
+        dspTrack = dspBlock->track;
+        dspBlockUsed = 0;
+      }
+
+      uint32_t frameCount = dspBlock->frameCount - dspBlockUsed;
+      frameCount = (frameCount < maxFrames) ? frameCount : maxFrames;
+
+      if (frameCount == 0) {
+        return 0;
+      }
+      *data = dspBlock->data + (dspBlockUsed * dspTrack->format.blockAlign);
+      return frameCount;
+    }
+
+    void releaseBlockFrames(uint32_t frameCount) {
+      dspBlockUsed += frameCount;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Builds a complete serial frame in frameBuffer from the track being coded.
+    //The header is followed by the samples, converted to the receiver's format and
+    //coded with the codec. A stereo frame holds whole pairs, so it may be a sample
+    //short of frameSamples. Returns the total length of the frame, or 0 if there's
+    //no data left in the track.
+
+    uint32_t encodeFrame(uint8_t* frameBuffer) {
+      uint8_t* payload = frameBuffer + PIPELINE_FRAME_HEADER_SIZE;
+      uint32_t sampleCount = 0;
+      uint32_t payloadLength = 0;
+      float floatBuffer[CONVERTER_BLOCK_FRAMES];
+      float rightBuffer[CONVERTER_BLOCK_FRAMES];
+      const uint8_t* data = NULL;
+
+      //the first block of a track tells which track it is
+      acquireBlockFrames(0, &data);
+
+      if (dspTrack == NULL) {
+        return 0;
+      }
+
+      if (config.codec == FRAME_CODEC_IMA_ADPCM) {
+        //the whole frame is collected at 16 bits first, then coded in blocks
+        while (sampleCount < config.frameSamples) {
+          uint32_t count = readTrackSamples(floatBuffer, config.frameSamples - sampleCount);
+
+          if (count == 0) {
+            break;
+          }
+          dspTrack->converter.quantizeS16(floatBuffer, count, dspTrack->adpcmInput + sampleCount);
+          sampleCount += count;
+        }
+        payloadLength = adpcmEncode(dspTrack->adpcmInput, sampleCount, payload, &dspTrack->adpcmStepIndex);
+      }
+      else if (config.channelCount == 2) {
+        uint32_t frameCount = 0;
+
+        while (frameCount < (config.frameSamples / 2)) {
+          uint32_t count = 0;
+
+          if (dspTrack->resampling) {
+            count = readTrackSamples(floatBuffer, (config.frameSamples / 2) - frameCount, rightBuffer);
+            dspTrack->converter.quantizeStereo(floatBuffer, rightBuffer, count, payload + (frameCount * 2));
+          }
+          else {
+            count = acquireBlockFrames((config.frameSamples / 2) - frameCount, &data);
+            dspTrack->converter.convertStereo(data, count, payload + (frameCount * 2));
+            releaseBlockFrames(count);
+          }
+
+          if (count == 0) {
+            break;
+          }
+          frameCount += count;
+        }
+        sampleCount = frameCount * 2;
+        payloadLength = sampleCount;
+      }
+      else {
+        while (sampleCount < config.frameSamples) {
+          uint32_t count = 0;
+
+          if (dspTrack->resampling) {
+            count = readTrackSamples(floatBuffer, config.frameSamples - sampleCount);
+            dspTrack->converter.quantize(floatBuffer, count, payload + sampleCount);
+          }
+          else {
+            //straight from the source bytes to 8 bits
+            count = acquireBlockFrames(config.frameSamples - sampleCount, &data);
+            dspTrack->converter.convert(data, count, payload + sampleCount);
+            releaseBlockFrames(count);
+          }
+
+          if (count == 0) {
+            break;
+          }
+          sampleCount += count;
+        }
+        payloadLength = sampleCount;
+      }
+
+      if (sampleCount == 0) {
+        return 0;
+      }
+
+      frameBuffer[0] = uint8_t(sampleCount >> 8); //high byte
+      frameBuffer[1] = uint8_t(sampleCount & 0x00FF); //low byte
+      frameBuffer[2] = config.codec;
+      frameBuffer[3] = (config.channelCount == 2) ? FRAME_FLAG_STEREO : 0; //flags
+      return PIPELINE_FRAME_HEADER_SIZE + payloadLength;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Produces up to maxCount float samples at the output rate. If the track has to
+    //be resampled, the blocks are decoded and put through the resampler. Once the
+    //track ends, the filter is fed with silence to get the last samples out. With
+    //right given, output gets the left channel and right the right one instead of
+    //the mix. Returns the no. of samples, or 0 when the track is done.
+
+    uint32_t readTrackSamples(float* output, uint32_t maxCount, float* right = NULL) {
+      if (maxCount > CONVERTER_BLOCK_FRAMES) {
+        maxCount = CONVERTER_BLOCK_FRAMES;
+      }
+
+      const uint8_t* data = NULL;
+
+      if (!dspTrack->resampling) {
+        uint32_t frameCount = acquireBlockFrames(maxCount, &data);
+
+        if ((frameCount > 0) && (right != NULL)) {
+          dspTrack->converter.decodeStereo(data, frameCount, output, right, 1);
+          releaseBlockFrames(frameCount);
+        }
+        else if (frameCount > 0) {
+          dspTrack->converter.decode(data, frameCount, output);
+          releaseBlockFrames(frameCount);
+        }
+        return frameCount;
+      }
+
+      AudioTrack* track = dspTrack;
+
+      while (true) {
+        if (track->decodedUsed == track->decodedCount) {
+          uint32_t frameCount = acquireBlockFrames(CONVERTER_BLOCK_FRAMES, &data);
+
+          if ((frameCount > 0) && (right != NULL)) {
+            track->converter.decodeStereo(data, frameCount, track->decodedBuffer, track->rightDecodedBuffer, 1);
+            releaseBlockFrames(frameCount);
+          }
+          else if (frameCount > 0) {
+            track->converter.decode(data, frameCount, track->decodedBuffer);
+            releaseBlockFrames(frameCount);
+          }
+          else if ((!track->flushed) && (dspBlock != NULL)) {
+            frameCount = track->resampler.getLatency();
+            memset(track->decodedBuffer, 0, frameCount * sizeof(float));
+            memset(track->rightDecodedBuffer, 0, frameCount * sizeof(float));
+            track->flushed = true;
+          }
+          else {
+            return 0;
+          }
+          track->decodedCount = frameCount;
+          track->decodedUsed = 0;
+        }
+
+        //the filter may need more input before the next output
+        uint32_t inputUsed = 0;
+        uint32_t count = track->resampler.process(track->decodedBuffer + track->decodedUsed,
+          track->decodedCount - track->decodedUsed, &inputUsed, output, maxCount);
+
+        //both filters are set up alike, so they take and give the same no. of samples
+        if (right != NULL) {
+          uint32_t rightUsed = 0;
+          track->rightResampler.process(track->rightDecodedBuffer + track->decodedUsed,
+            track->decodedCount - track->decodedUsed, &rightUsed, right, maxCount);
+        }
+        track->decodedUsed += inputUsed;
+
+        if (count > 0) {
+          return count;
+        }
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Opens the first track that can be streamed, starting at the playlist entry at
+    //index, and sets it up for the DSP stage. index is moved past the track. Files
+    //that can't be streamed are skipped. Returns NULL at the end of the playlist.
+
+    AudioTrack* loadTrack(size_t* index) {
+      AudioTrack* track = NULL;
+
+      while ((track == NULL) && (*index < playlist->getCount()) && running) {
+        //open a file from the path found in the playlist file.
+        //the file is read as it is streamed and is never loaded as a whole.
+        const char* path = playlist->getPath(*index);
+        track = new AudioTrack();
+        track->index = int(*index);
+        track->source = openAudioSource(path, config.preferMapped);
+        (*index)++;
+
+        if (track->source == NULL) {
+          printf("Failed to load audio file at %d\n", track->index);
+        }
+        else if (!prepareTrack(track, path)) {
+          printf("Audio file %d is not a supported WAV file.\n", track->index);
+        }
+        else if (track->format.dataLength == 0) {
+          printf("Audio file %d has no audio data.\n", track->index);
+        }
+        else {  //if audio file is valid
+          if (config.printTracks) {
+            printf("Opened audio file %d. %u Hz, %u-bit, %u channel(s), %llu bytes of audio. Conversion: %s\n", track->index,
+              track->format.sampleRate, track->format.bitsPerSample, track->format.channelCount,
+              (unsigned long long) track->format.dataLength, track->converter.getKernelName());
+          }
+
+          track->splitFrameRead = false;
+          track->dataRemaining = track->format.dataLength; //the source is at the first sample
+          track->resampling = (track->format.sampleRate != config.sampleRate);
+          track->decodedCount = 0;
+          track->decodedUsed = 0;
+          track->flushed = false;
+          track->adpcmStepIndex = 0;
+
+          if (track->resampling) {
+            track->resampler.configure(track->format.sampleRate, config.sampleRate, config.resamplerQuality);
+          }
+          if (track->resampling && (config.channelCount == 2)) {
+            track->rightResampler.configure(track->format.sampleRate, config.sampleRate, config.resamplerQuality);
+          }
+          if (track->resampling && config.printTracks) {
+            printf("Resampling to %u Hz. Quality: %s, %u taps, %u phases, %s\n", config.sampleRate,
+              track->resampler.getQualityName(), track->resampler.getTapCount(),
+              track->resampler.getPhaseCount(), track->resampler.getKernelName());
+          }
+          continue;
+        }
+        closeTrack(track);
+        track = NULL;
+      }
+
+      if ((trackCache != NULL) && (!trackCache->save())) {
+        printf("Could not save the track cache\n");
+      }
+      return track;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Moves a track that was just loaded offset ms on, or to its end if it's not
+    //that long. Returns false if the source can't seek, and it's then left at the
+    //first sample.
+
+    bool seekTrack(AudioTrack* track, uint32_t offset) {
+      uint64_t skipLength = ((uint64_t(offset) * track->format.sampleRate) / 1000) * track->format.blockAlign;
+      skipLength = (skipLength < track->dataRemaining) ? skipLength : track->dataRemaining;
+
+      if (!track->source->seek(track->source->getPosition() + skipLength)) {
+        return false;
+      }
+      track->dataRemaining -= skipLength;
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Finds the format of the track and positions the source at the first sample.
+    //The format comes from the track cache if the file hasn't changed since it was
+    //cached, and the file is parsed otherwise, and cached. Returns false if the
+    //file is not a WAV file we can convert.
+
+    bool prepareTrack(AudioTrack* track, const char* path) {
+      TrackInfo info;
+
+      if ((trackCache != NULL) && trackCache->lookup(path, &info) &&
+          (info.fileSize == track->source->getSize()) && track->source->seek(info.format.dataOffset)) {
+        track->format = info.format;
+      }
+      else if (parseWav(track->source, &track->format)) {
+        if (trackCache != NULL) {
+          trackCache->store(path, track->format);
+        }
+      }
+      else {
+        return false;
+      }
+      return track->converter.configure(track->format);
+    }
+
+    //------------------------------------------------------------------------------//
+    //Gets up to maxFrames whole frames of audio data from the file, without copying
+    //them if possible. A frame split between two views of the file is copied instead.
+    //Returns the no. of frames at data, which have to be released after use. Returns
+    //0 if there's no data left.
+
+    static uint32_t acquireTrackFrames(AudioTrack* track, uint32_t maxFrames, const uint8_t** data) {
+      uint32_t blockAlign = track->format.blockAlign;
+      uint64_t wanted = uint64_t(maxFrames) * blockAlign;
+
+      if (wanted > track->dataRemaining) {
+        wanted = track->dataRemaining;
+      }
+      if (wanted == 0) {
+        return 0;
+      }
+
+      uint32_t available = track->source->acquire(data, uint32_t(wanted));
+
+      if (available == 0) { //the file is shorter than its header says
+        track->dataRemaining = 0;
+        return 0;
+      }
+
+      uint32_t frameCount = available / blockAlign;
+
+      if (frameCount == 0) {
+        if (track->source->read(track->splitFrame, blockAlign) != blockAlign) {
+          track->dataRemaining = 0;
+          return 0;
+        }
+        *data = track->splitFrame;
+        track->splitFrameRead = true;
+        return 1;
+      }
+      return frameCount;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    static void releaseTrackFrames(AudioTrack* track, uint32_t frameCount) {
+      if (!track->splitFrameRead) {
+        track->source->release(frameCount * track->format.blockAlign);
+      }
+      track->splitFrameRead = false;
+      track->dataRemaining -= uint64_t(frameCount) * track->format.blockAlign;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    static void closeTrack(AudioTrack* track) {
+      if (track != NULL) {
+        delete track->source;
+        delete track;
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,351 @@
+//==============================================================================//
+//
+//  AUDIFI Playlist
+//  Version : v0.1
+//
+//  The playlist is a text file with the path of an audio file on each line. It is
+//  read in one pass, in large blocks, and there is no limit to the no. of lines or
+//  to the length of a path other than memory. Empty lines and lines starting with
+//  # are skipped, so an M3U playlist can be used as it is.
+//
+//  The track cache keeps the format of each audio file already parsed, so that a
+//  track can start streaming without parsing the file, and the playlist can be
+//  summed up without opening any file. An entry is keyed by the path, and is only
+//  used if the size and the modification time of the file are still the same.
+//  The cache is a text file with one track on each line,
+//
+//    <size> <mtime> <format> <channels> <rate> <bits> <block align>
+//    <data offset> <data length> <duration ms>\t<path>
+//
+//  all on one line. The file is replaced as a whole when it's saved, so it's
+//  never left half written.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_PLAYLIST_H
+#define AUDIFI_PLAYLIST_H
+
+#include "AUDIFI-WAV-Parser.h"
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#define PLAYLIST_READ_BLOCK_SIZE 65536  //bytes read from the playlist at a time
+#define TRACK_CACHE_VERSION "AUDIFI-TRACK-CACHE 1"
+
+//==============================================================================//
+//Gets the size and the modification time of a file. Returns false if the file
+//can not be found.
+
+inline bool getFileStatus(const char* path, uint64_t* size, int64_t* modifiedTime) {
+#ifdef _WIN32
+  struct _stat64 status;
+
+  if (_stat64(path, &status) != 0) {
+    return false;
+  }
+#else
+  struct stat status;
+
+  if (stat(path, &status) != 0) {
+    return false;
+  }
+#endif
+  *size = uint64_t(status.st_size);
+  *modifiedTime = int64_t(status.st_mtime);
+  return true;
+}
+
+//==============================================================================//
+
+class Playlist {
+  public:
+    //------------------------------------------------------------------------------//
+    //Reads the playlist file. A CR before the NL and a UTF-8 byte order mark at
+    //the start are removed. Returns false if the file can not be opened.
+
+    bool load(const char* fileName) {
+      FILE* file = fopen(fileName, "rb");
+      paths.clear();
+
+      if (file == NULL) {
+        return false;
+      }
+
+      std::vector<char> block(PLAYLIST_READ_BLOCK_SIZE);
+      std::string line;
+      size_t length = 0;
+      bool firstBlock = true;
+
+      while ((length = fread(block.data(), 1, block.size(), file)) > 0) {
+        size_t lineStart = 0;
+
+        if (firstBlock && (length >= 3) && (memcmp(block.data(), "\xEF\xBB\xBF", 3) == 0)) {
+          lineStart = 3;
+        }
+        firstBlock = false;
+
+        //whole lines are added straight from the block. a line that goes past
+        //the end of the block is carried over to the next one.
+        for (size_t i=lineStart; i < length; i++) {
+          if (block[i] == '\n') {
+            line.append(&block[lineStart], i - lineStart);
+            addLine(line);
+            line.clear();
+            lineStart = i + 1;
+          }
+        }
+        line.append(&block[lineStart], length - lineStart);
+      }
+
+      addLine(line);  //the last line may have no NL
+      fclose(file);
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    size_t getCount() const {
+      return paths.size();
+    }
+
+    const char* getPath(size_t index) const {
+      return paths[index].c_str();
+    }
+
+    void add(const char* path) {
+      paths.push_back(path);
+    }
+
+  private:
+    std::vector<std::string> paths;
+
+    //------------------------------------------------------------------------------//
+
+    void addLine(std::string& line) {
+      if ((!line.empty()) && (line[line.size() - 1] == '\r')) {
+        line.erase(line.size() - 1);
+      }
+      if ((!line.empty()) && (line[0] != '#')) {
+        paths.push_back(line);
+      }
+    }
+};
+
+//==============================================================================//
+//What is known about an audio file without opening it.
+
+struct TrackInfo {
+  uint64_t fileSize;
+  int64_t modifiedTime;   //seconds since the epoch
+  WavFormat format;
+  uint32_t duration;      //ms
+};
+
+//==============================================================================//
+
+class TrackCache {
+  public:
+    TrackCache() : modified(false) {
+    }
+
+    //------------------------------------------------------------------------------//
+    //Reads the cache file. A missing file is an empty cache, and so is a file from
+    //another version. Lines that can't be read are skipped.
+
+    bool load(const char* fileName) {
+      this->fileName = fileName;
+      entries.clear();
+      modified = false;
+
+      FILE* file = fopen(fileName, "rb");
+
+      if (file == NULL) {
+        return false;
+      }
+
+      std::string line;
+      bool versionFound = false;
+
+      while (readLine(file, &line)) {
+        if (!versionFound) {
+          versionFound = (line == TRACK_CACHE_VERSION);
+
+          if (!versionFound) {
+            break;
+          }
+          continue;
+        }
+
+        TrackInfo info;
+        std::string path;
+
+        if (parseEntry(line, &info, &path)) {
+          entries[path] = info;
+        }
+      }
+
+      fclose(file);
+      return versionFound;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Writes the cache to a new file, which then replaces the old one. Does nothing
+    //if nothing was added since it was loaded or saved.
+
+    bool save() {
+      if ((!modified) || fileName.empty()) {
+        return true;
+      }
+
+      std::string newFileName = fileName + ".new";
+      FILE* file = fopen(newFileName.c_str(), "wb");
+
+      if (file == NULL) {
+        return false;
+      }
+
+      bool written = (fprintf(file, "%s\n", TRACK_CACHE_VERSION) > 0);
+
+      for (std::unordered_map<std::string, TrackInfo>::const_iterator entry = entries.begin();
+           written && (entry != entries.end()); ++entry) {
+        const TrackInfo& info = entry->second;
+
+        written = (fprintf(file, "%llu %lld %u %u %lu %u %u %llu %llu %lu\t%s\n",
+          (unsigned long long) info.fileSize, (long long) info.modifiedTime, unsigned(info.format.formatTag),
+          unsigned(info.format.channelCount), (unsigned long) info.format.sampleRate, unsigned(info.format.bitsPerSample),
+          unsigned(info.format.blockAlign), (unsigned long long) info.format.dataOffset,
+          (unsigned long long) info.format.dataLength, (unsigned long) info.duration, entry->first.c_str()) > 0);
+      }
+
+      written &= (fclose(file) == 0);
+
+    #ifdef _WIN32
+      remove(fileName.c_str()); //rename doesn't replace a file on Windows
+    #endif
+
+      if ((!written) || (rename(newFileName.c_str(), fileName.c_str()) != 0)) {
+        remove(newFileName.c_str());
+        return false;
+      }
+      modified = false;
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Finds the track and checks that the file hasn't changed since it was cached.
+    //Returns false if it isn't cached, or the entry is out of date.
+
+    bool lookup(const char* path, TrackInfo* info) const {
+      std::unordered_map<std::string, TrackInfo>::const_iterator entry = entries.find(path);
+      uint64_t size = 0;
+      int64_t modifiedTime = 0;
+
+      if ((entry == entries.end()) || (!getFileStatus(path, &size, &modifiedTime))) {
+        return false;
+      }
+      if ((entry->second.fileSize != size) || (entry->second.modifiedTime != modifiedTime)) {
+        return false;
+      }
+      *info = entry->second;
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Same as lookup, but the file is never looked at, so the entry may be out of
+    //date. Quick enough for the whole playlist.
+
+    const TrackInfo* find(const char* path) const {
+      std::unordered_map<std::string, TrackInfo>::const_iterator entry = entries.find(path);
+      return (entry != entries.end()) ? &entry->second : NULL;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Adds or updates the track with its parsed format.
+
+    bool store(const char* path, const WavFormat& format) {
+      TrackInfo info;
+
+      if (!getFileStatus(path, &info.fileSize, &info.modifiedTime)) {
+        return false;
+      }
+
+      info.format = format;
+      info.duration = uint32_t((format.dataLength / format.blockAlign) * 1000 / format.sampleRate);
+      entries[path] = info;
+      modified = true;
+      return true;
+    }
+
+    size_t getCount() const {
+      return entries.size();
+    }
+
+  private:
+    std::unordered_map<std::string, TrackInfo> entries;
+    std::string fileName;
+    bool modified;  //true if there are entries not saved yet
+
+    //------------------------------------------------------------------------------//
+
+    static bool readLine(FILE* file, std::string* line) {
+      char buffer[512];
+      line->clear();
+
+      while (fgets(buffer, sizeof(buffer), file) != NULL) {
+        line->append(buffer);
+
+        if ((!line->empty()) && ((*line)[line->size() - 1] == '\n')) {
+          line->erase(line->size() - 1);
+          return true;
+        }
+      }
+      return !line->empty();
+    }
+
+    //------------------------------------------------------------------------------//
+
+    static bool parseEntry(const std::string& line, TrackInfo* info, std::string* path) {
+      size_t tab = line.find('\t');
+
+      if ((tab == std::string::npos) || ((tab + 1) == line.size())) {
+        return false;
+      }
+
+      unsigned long long values[10];
+      const char* field = line.c_str();
+
+      for (int i=0; i < 10; i++) {
+        char* end = NULL;
+        values[i] = (i == 1) ? (unsigned long long) strtoll(field, &end, 10) : strtoull(field, &end, 10);
+
+        if (end == field) {
+          return false;
+        }
+        field = end;
+      }
+
+      memset(info, 0, sizeof(TrackInfo));
+      info->fileSize = values[0];
+      info->modifiedTime = int64_t(values[1]);
+      info->format.formatTag = uint16_t(values[2]);
+      info->format.channelCount = uint16_t(values[3]);
+      info->format.sampleRate = uint32_t(values[4]);
+      info->format.bitsPerSample = uint16_t(values[5]);
+      info->format.blockAlign = uint16_t(values[6]);
+      info->format.dataOffset = values[7];
+      info->format.dataLength = values[8];
+      info->duration = uint32_t(values[9]);
+      *path = line.substr(tab + 1);
+
+      //an entry that makes no sense is as good as missing
+      return isWavFormatSupported(info->format) && ((info->format.dataOffset + info->format.dataLength) <= info->fileSize);
+    }
+};
+
+#endif
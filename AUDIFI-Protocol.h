@@ -0,0 +1,386 @@
+//==============================================================================//
+//
+//  AUDIFI Protocol
+//  Version : v0.1
+//
+//  The sizes that the server application, the transmitter and the receiver have
+//  to agree on, in one place. A frame is the 4-byte header and the samples of one
+//  request. The transmitter splits it into fragments, each a UDP packet with an
+//  8-byte fragment header and up to PROTOCOL_FRAGMENT_DATA_SIZE bytes of the
+//  frame.
+//
+//  The classic frame is 11029 bytes, 11025 samples and the header. That's 7 full
+//  fragments and an 8th with only 865 bytes in it, which costs a whole packet of
+//  airtime for a little over half a packet of data. With PROTOCOL_MTU_ALIGNED set
+//  to 1, a frame is exactly PROTOCOL_ALIGNED_FRAGMENTS full fragments instead, and
+//  carries more samples in the same no. of packets. All three programs have to
+//  be built with the same setting.
+//
+//  FrameLayout works out the fragments of a frame size at compile time, and the
+//  static_asserts below check the layout in use when each program is built.
+//
+//  The link between the server application and the transmitter starts at
+//  PROTOCOL_BASE_BAUDRATE. The transmitter answers READY? with its capabilities,
+//  and the two agree on the fastest baud rate both can hold, the frame size and
+//  the codec, see "Link negotiation" below. From version 2 on, the frames on
+//  the link are checked with a CRC and sent again if they're damaged, see
+//  AUDIFI-Frame-Check.h. From version 3 on, control messages can be sent in
+//  between them, see AUDIFI-Control.h. From version 4 on, a frame can be
+//  stereo (FRAME_FLAG_STEREO). The receivers tell the transmitter their
+//  version, see "Receiver version" below. The transmitter passes a stereo frame
+//  on as it is to a receiver of version 4, which plays both channels, and
+//  folds it to mono for an older one.
+//
+//  This file is shared by the server application, the transmitter and the
+//  receiver. Copy it to the sketch folders along with the sketches.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_PROTOCOL_H
+#define AUDIFI_PROTOCOL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROTOCOL_PACKET_SIZE 1460         //max UDP packet, the MTU
+#define PROTOCOL_FRAME_HEADER_SIZE 4      //[samples hi][samples lo][codec][flags]
+#define PROTOCOL_FRAGMENT_HEADER_SIZE 8   //see AUDIFI-Fragment.h
+#define PROTOCOL_FRAGMENT_DATA_SIZE (PROTOCOL_PACKET_SIZE - PROTOCOL_FRAGMENT_HEADER_SIZE)
+#define PROTOCOL_FRAGMENT_MAX_COUNT 32    //missing fragments are asked for with a 32-bit mask
+
+#define PROTOCOL_CLASSIC_FRAME_SIZE 11029 //11025 samples, a second at the playback rate
+#define PROTOCOL_ALIGNED_FRAGMENTS 8      //fragments in an MTU aligned frame
+#define PROTOCOL_ALIGNED_FRAME_SIZE (PROTOCOL_ALIGNED_FRAGMENTS * PROTOCOL_FRAGMENT_DATA_SIZE)
+
+#ifndef PROTOCOL_MTU_ALIGNED
+  #define PROTOCOL_MTU_ALIGNED 0          //1 to size the frames to whole fragments
+#endif
+
+//the names used by the programs
+#if PROTOCOL_MTU_ALIGNED
+  #define REQUEST_SIZE PROTOCOL_ALIGNED_FRAME_SIZE  //max frame length including the header
+#else
+  #define REQUEST_SIZE PROTOCOL_CLASSIC_FRAME_SIZE  //max frame length including the header
+#endif
+#define REQUEST_HEADER_SIZE PROTOCOL_FRAME_HEADER_SIZE
+#define REQUEST_DATA_SIZE (REQUEST_SIZE - REQUEST_HEADER_SIZE)  //max no. of samples in a frame
+#define UDP_MTU_SIZE PROTOCOL_PACKET_SIZE
+
+//==============================================================================//
+//How a frame of frameSize bytes is sent in packets of packetSize bytes.
+
+template <uint32_t frameSize, uint32_t packetSize = PROTOCOL_PACKET_SIZE>
+struct FrameLayout {
+  static_assert(frameSize > PROTOCOL_FRAME_HEADER_SIZE, "a frame has to have room for samples");
+  static_assert((frameSize - PROTOCOL_FRAME_HEADER_SIZE) <= 0xFFFF, "the sample count of a frame is 16 bits");
+  static_assert(packetSize > PROTOCOL_FRAGMENT_HEADER_SIZE, "a packet has to have room for data");
+
+  static constexpr uint32_t getFrameSize() {
+    return frameSize;
+  }
+
+  static constexpr uint32_t getPayloadSize() {
+    return frameSize - PROTOCOL_FRAME_HEADER_SIZE;
+  }
+
+  static constexpr uint32_t getFragmentDataSize() {
+    return packetSize - PROTOCOL_FRAGMENT_HEADER_SIZE;
+  }
+
+  static constexpr uint32_t getFragmentCount() {
+    return (frameSize + getFragmentDataSize() - 1) / getFragmentDataSize();
+  }
+
+  //the data in the last fragment, the others are full
+  static constexpr uint32_t getLastFragmentDataSize() {
+    return frameSize - ((getFragmentCount() - 1) * getFragmentDataSize());
+  }
+
+  //UDP payload bytes it takes to send the frame, with the fragment headers
+  static constexpr uint32_t getWireSize() {
+    return frameSize + (getFragmentCount() * PROTOCOL_FRAGMENT_HEADER_SIZE);
+  }
+
+  static constexpr bool isMtuAligned() {
+    return getLastFragmentDataSize() == getFragmentDataSize();
+  }
+};
+
+typedef FrameLayout<REQUEST_SIZE, UDP_MTU_SIZE> ProtocolFrameLayout;  //the layout in use
+
+//==============================================================================//
+
+static_assert(ProtocolFrameLayout::getFragmentCount() <= PROTOCOL_FRAGMENT_MAX_COUNT,
+  "a frame can't have more fragments than the NACK mask has bits");
+static_assert(FrameLayout<PROTOCOL_ALIGNED_FRAME_SIZE>::isMtuAligned() &&
+  (FrameLayout<PROTOCOL_ALIGNED_FRAME_SIZE>::getFragmentCount() == PROTOCOL_ALIGNED_FRAGMENTS),
+  "an aligned frame has to fill its fragments");
+static_assert((!PROTOCOL_MTU_ALIGNED) || ProtocolFrameLayout::isMtuAligned(), "the frames are not MTU aligned");
+
+//==============================================================================//
+//Link negotiation
+//
+//  server                                transmitter
+//  READY?                            ->
+//                                    <-  YES!#<version>#<baud rates>#<frame size>#<codecs>
+//  BAUD#<rate>                       ->
+//                                    <-  OK! (or NO!), then both switch to the rate
+//  PROTOCOL_TEST_PATTERN_SIZE bytes  ->
+//                                    <-  the same bytes
+//  LINK#<rate>#<frame size>#<codec>[#<options>]
+//                                    ->
+//                                    <-  YES!
+//
+//The baud rates are a mask of protocolBaudRates[] and the codecs a mask of
+//1 << FRAME_CODEC_*. The server tries the rates both sides have, the fastest
+//first. A rate is only kept if the test pattern comes back unchanged and the
+//LINK# line gets through. Otherwise both sides go back to the rate the handshake
+//started at, the transmitter on its own once PROTOCOL_TEST_TIMEOUT has passed
+//without a LINK#, and the next rate is tried. LINK# is sent at the starting rate
+//if none of the faster ones worked.
+//
+//The options are a mask of PROTOCOL_OPTION_*, and are left out if there are
+//none, so a version 1 transmitter still understands the line. They are only
+//asked of a transmitter of the version that has them.
+//
+//A transmitter that only answers "YES!" is version 0. It keeps the base rate,
+//classic frames and PCM, as the firmware from before the codecs can only play
+//that. A transmitter that gets no BAUD# or LINK#
+//within PROTOCOL_NEGOTIATE_TIMEOUT is talking to an older server, and keeps the
+//rate it's at.
+
+#define PROTOCOL_VERSION 4
+#define PROTOCOL_BASE_BAUDRATE 500000     //the rate both sides start at
+#define PROTOCOL_BAUDRATE_COUNT 4
+#define PROTOCOL_ALL_BAUDRATES ((1 << PROTOCOL_BAUDRATE_COUNT) - 1)
+#define PROTOCOL_TEST_PATTERN_SIZE 256    //bytes sent to test a new rate, every byte value once
+#define PROTOCOL_SWITCH_DELAY 20          //ms to let a UART settle after a rate change
+#define PROTOCOL_TEST_TIMEOUT 300         //ms from a rate change to the LINK# line
+#define PROTOCOL_NEGOTIATE_TIMEOUT 1000   //ms the transmitter waits for the next line
+#define PROTOCOL_LINE_MAX_LENGTH 48       //max length of a negotiation line including NL
+
+#define PROTOCOL_CODEC_PCM_U8 0x01        //1 << FRAME_CODEC_PCM_U8
+#define PROTOCOL_CODEC_IMA_ADPCM 0x02     //1 << FRAME_CODEC_IMA_ADPCM
+
+#define PROTOCOL_OPTION_CHECKED_FRAMES 0x01 //frames are sent with a sync word and a CRC, from version 2
+#define PROTOCOL_OPTION_CONTROL 0x02        //control messages between the frames, from version 3, with checked frames only
+#define PROTOCOL_OPTION_STEREO 0x04         //stereo frames may be sent, from version 4
+#define PROTOCOL_CHECKED_FRAMES_VERSION 2
+#define PROTOCOL_CONTROL_VERSION 3
+#define PROTOCOL_STEREO_VERSION 4
+
+//slowest first, the first one is PROTOCOL_BASE_BAUDRATE
+static const uint32_t protocolBaudRates[PROTOCOL_BAUDRATE_COUNT] = {500000, 921600, 1000000, 2000000};
+
+//what a side of the link can do
+struct LinkCapabilities {
+  uint8_t version;    //0 for a transmitter that only says YES!
+  uint8_t baudRates;  //mask of protocolBaudRates[]
+  uint16_t frameSize; //max frame length including the header
+  uint8_t codecs;     //mask of PROTOCOL_CODEC_*
+};
+
+//what both sides agreed on
+struct LinkSettings {
+  uint32_t baudRate;
+  uint16_t frameSize;
+  uint8_t codec;      //FRAME_CODEC_*
+  uint8_t options;    //mask of PROTOCOL_OPTION_*
+};
+
+//------------------------------------------------------------------------------//
+//Returns the bit of the rate in a baud rate mask, or 0 if it's not one of ours.
+
+inline uint8_t getBaudRateBit(uint32_t baudRate) {
+  for (int i=0; i < PROTOCOL_BAUDRATE_COUNT; i++) {
+    if (protocolBaudRates[i] == baudRate) {
+      return uint8_t(1 << i);
+    }
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------//
+//Byte i of the test pattern. Alternating bits, and every byte value once.
+
+inline uint8_t getTestPatternByte(uint32_t index) {
+  return uint8_t(index) ^ 0x55;
+}
+
+//------------------------------------------------------------------------------//
+//The YES! answer to READY?, without the NL. Returns the length of the line.
+
+inline int formatCapabilities(char* line, uint32_t maxLength, const LinkCapabilities& capabilities) {
+  return snprintf(line, maxLength, "YES!#%u#%u#%u#%u", unsigned(capabilities.version), unsigned(capabilities.baudRates),
+    unsigned(capabilities.frameSize), unsigned(capabilities.codecs));
+}
+
+//------------------------------------------------------------------------------//
+//Reads the answer to READY?. A plain "YES!" is a version 0 transmitter. Returns
+//false if the line is not a YES! or the capabilities make no sense.
+
+inline bool parseCapabilities(const char* line, LinkCapabilities* capabilities) {
+  if (strncmp(line, "YES!", 4) != 0) {
+    return false;
+  }
+
+  if (line[4] == 0) {
+    capabilities->version = 0;
+    capabilities->baudRates = getBaudRateBit(PROTOCOL_BASE_BAUDRATE);
+    capabilities->frameSize = PROTOCOL_CLASSIC_FRAME_SIZE;
+    capabilities->codecs = PROTOCOL_CODEC_PCM_U8;
+    return true;
+  }
+
+  unsigned long fields[4] = {0};
+  const char* position = &line[4];
+
+  for (int i=0; i < 4; i++) {
+    char* end = NULL;
+
+    if (*position != '#') {
+      return false;
+    }
+    fields[i] = strtoul(position + 1, &end, 10);
+
+    if (end == (position + 1)) {
+      return false;
+    }
+    position = end;
+  }
+
+  if ((*position != 0) || (fields[0] == 0) || (fields[0] > 255) || (fields[1] > PROTOCOL_ALL_BAUDRATES) ||
+      (fields[2] <= PROTOCOL_FRAME_HEADER_SIZE) || (fields[2] > 0xFFFF) || (fields[3] > 255)) {
+    return false;
+  }
+
+  capabilities->version = uint8_t(fields[0]);
+  capabilities->baudRates = uint8_t(fields[1]) | getBaudRateBit(PROTOCOL_BASE_BAUDRATE);
+  capabilities->frameSize = uint16_t(fields[2]);
+  capabilities->codecs = uint8_t(fields[3]) | PROTOCOL_CODEC_PCM_U8;  //PCM always works
+  return true;
+}
+
+//------------------------------------------------------------------------------//
+//The LINK# line, without the NL. Returns the length of the line.
+
+inline int formatLinkSettings(char* line, uint32_t maxLength, const LinkSettings& settings) {
+  if (settings.options != 0) {
+    return snprintf(line, maxLength, "LINK#%lu#%u#%u#%u", (unsigned long) settings.baudRate,
+      unsigned(settings.frameSize), unsigned(settings.codec), unsigned(settings.options));
+  }
+  return snprintf(line, maxLength, "LINK#%lu#%u#%u", (unsigned long) settings.baudRate,
+    unsigned(settings.frameSize), unsigned(settings.codec));
+}
+
+//------------------------------------------------------------------------------//
+//Reads a LINK# line. The options are 0 if there are none. Returns false if it's
+//not a LINK# line.
+
+inline bool parseLinkSettings(const char* line, LinkSettings* settings) {
+  if (strncmp(line, "LINK#", 5) != 0) {
+    return false;
+  }
+
+  char* end = NULL;
+  unsigned long baudRate = strtoul(&line[5], &end, 10);
+
+  if (*end != '#') {
+    return false;
+  }
+  unsigned long frameSize = strtoul(end + 1, &end, 10);
+
+  if (*end != '#') {
+    return false;
+  }
+  unsigned long codec = strtoul(end + 1, &end, 10);
+  unsigned long options = 0;
+
+  if (*end == '#') {
+    options = strtoul(end + 1, &end, 10);
+  }
+
+  if ((*end != 0) || (options > 255) || (getBaudRateBit(uint32_t(baudRate)) == 0) || (frameSize <= PROTOCOL_FRAME_HEADER_SIZE) ||
+      (frameSize > 0xFFFF) || (codec > 7)) {
+    return false;
+  }
+
+  settings->baudRate = uint32_t(baudRate);
+  settings->frameSize = uint16_t(frameSize);
+  settings->codec = uint8_t(codec);
+  settings->options = uint8_t(options);
+  return true;
+}
+
+//------------------------------------------------------------------------------//
+//What the server asks for, given both sides and the codec it would like. The
+//baud rate is left at startBaudRate, the rates are tried one by one. The frames
+//are checked, the control messages sent and stereo frames allowed, if both sides
+//can do it.
+
+inline LinkSettings chooseLinkSettings(const LinkCapabilities& local, const LinkCapabilities& remote,
+                                       uint8_t preferredCodec, uint32_t startBaudRate) {
+  LinkSettings settings;
+  settings.baudRate = startBaudRate;
+  settings.frameSize = (local.frameSize < remote.frameSize) ? local.frameSize : remote.frameSize;
+  settings.codec = ((local.codecs & remote.codecs) & (1 << preferredCodec)) ? preferredCodec : 0;  //FRAME_CODEC_PCM_U8
+  settings.options = 0;
+
+  if ((local.version >= PROTOCOL_CHECKED_FRAMES_VERSION) && (remote.version >= PROTOCOL_CHECKED_FRAMES_VERSION)) {
+    settings.options |= PROTOCOL_OPTION_CHECKED_FRAMES;
+  }
+  if ((local.version >= PROTOCOL_CONTROL_VERSION) && (remote.version >= PROTOCOL_CONTROL_VERSION)) {
+    settings.options |= PROTOCOL_OPTION_CONTROL;
+  }
+  if ((local.version >= PROTOCOL_STEREO_VERSION) && (remote.version >= PROTOCOL_STEREO_VERSION)) {
+    settings.options |= PROTOCOL_OPTION_STEREO;
+  }
+  return settings;
+}
+
+//==============================================================================//
+//Receiver version
+//
+//  transmitter                           receiver
+//  READY?                            ->
+//                                    <-  YES!
+//                                    <-  VER#<version>
+//
+//The receiver sends its version right after the YES!, in a packet of its own,
+//so an older transmitter still takes the YES! and skips the VER#. A receiver
+//that sends no VER# is version 0, and so is one whose VER# hasn't arrived yet.
+//
+//PROTOCOL_OPTION_STEREO only lets the server send stereo frames to the
+//transmitter. Those frames are sent on as they are to a receiver of
+//PROTOCOL_STEREO_VERSION or later, and folded to mono for any other, which
+//would play the pairs as mono samples at half the speed. In fan-out mode a
+//frame goes to all receivers, so it's folded if any of them is older.
+
+//------------------------------------------------------------------------------//
+//The VER# line of a receiver. Returns the length of the line.
+
+inline int formatReceiverVersion(char* line, uint32_t maxLength, uint8_t version) {
+  return snprintf(line, maxLength, "VER#%u", unsigned(version));
+}
+
+//------------------------------------------------------------------------------//
+//Reads a VER# line. Returns false if it's not one.
+
+inline bool parseReceiverVersion(const char* line, uint8_t* version) {
+  if (strncmp(line, "VER#", 4) != 0) {
+    return false;
+  }
+
+  char* end = NULL;
+  unsigned long value = strtoul(&line[4], &end, 10);
+
+  if ((end == &line[4]) || (*end != 0) || (value > 255)) {
+    return false;
+  }
+  *version = uint8_t(value);
+  return true;
+}
+
+#endif
@@ -17,6 +17,10 @@
 #include "ptScheduler.h"
 #include "soc/timer_group_struct.h"
 #include "soc/timer_group_reg.h"
+#include "AUDIFI-Protocol.h"
+#include "AUDIFI-ADPCM.h"
+#include "AUDIFI-Ring-Buffer.h"
+#include "AUDIFI-Jitter-Buffer.h"
 
 //===================================================================//
 
@@ -25,12 +29,24 @@
 #define WIFI_PASS "12345678"
 #define UDP_PORT 4210
 #define DEBUG_LED 2
-// #define REQUEST_SIZE 22054  //size required for data
-// #define REQUEST_SIZE 11029  //size required for data
-#define REQUEST_SIZE 11029  //size required for data
-#define REQUEST_HEADER_SIZE 4 //size required for buffer header info
 
-#define CB_SIZE 110250
+//REQUEST_SIZE, REQUEST_HEADER_SIZE and UDP_MTU_SIZE are in AUDIFI-Protocol.h, and
+//have to be the same as in the transmitter and the server application.
+#define CB_SIZE 110250  //bytes, 10 s of mono or 5 s of stereo at the playback rate
+#define PLAYBACK_BLOCK_SIZE 64  //ticks the output task takes from the audio buffer at a time, up to AUDIO_RING_BLOCK_TICKS
+#define PLAYBACK_SAMPLE_RATE 11025  //rate of the timer
+
+//playback starts once the prefill is buffered, and frames are requested to keep the
+//buffer above a low watermark. the watermark follows the delay of the frames, and
+//is never below the min. depth.
+#define PLAYBACK_PREFILL_MS 200
+#define PLAYBACK_MIN_DEPTH_MS 250
+
+//in credit mode we grant the server a number of frames based on the free space in
+//the circular buffer, and the frames are streamed without waiting for a request each
+//time. set the window to 0 to fall back to the RD?/ACK! handshake.
+#define CREDIT_WINDOW_FRAMES 4  //max no. of frames granted ahead
+#define CREDIT_TIMEOUT 3000 //time to wait for a granted frame before giving up the credit
 
 //ESP32 pins
 #define PIN_LEFT_CHANNEL 13
@@ -41,31 +57,50 @@
 
 #define DEBUG_SERIAL_BAUDRATE 500000
 
-#define UDP_MTU_SIZE 1460
+//frames arrive as fragments with a sequence no. and an index, and are assembled in
+//order whatever order the fragments come in. missing fragments are asked for again
+//with "NK#<sequence>#<mask>", unless the parity fragment is enough to rebuild them.
+#include "AUDIFI-Fragment.h"
 
-//this is to make it easy to deifine a new circular buffer
-#define CIRC_BBUF_DEF(x,y)                \
-    uint8_t x##_data_space[y];            \
-    circ_buf_t x = {                      \
-        .buffer = x##_data_space,         \
-        .head = 0,                        \
-        .tail = 0,                        \
-        .maxlen = y                       \
-    }
+//control messages from the transmitter, see AUDIFI-Control.h, are acted on as
+//they arrive. a pause and a gain are applied by the output task. a skip or a
+//seek empties the audio buffer, and the frames before the first one from the
+//new place are thrown away.
+#include "AUDIFI-Control.h"
 
-//===================================================================//
+//the link metrics are printed to the debug serial as lines of name=value pairs,
+//see AUDIFI-Metrics.h.
+#define METRICS_REPORT_INTERVAL 10000000  //time between reports, us
+
+#include "AUDIFI-Metrics.h"
 
-//Circular Buffer struct.
-typedef struct {
-    uint8_t* buffer;
-    int head;
-    int tail;
-    int maxlen;
-} circ_buf_t;
+//===================================================================//
 
-circ_buf_t audioBuffer;
+//the audio buffer is filled by the main loop and drained by the output task.
+//it's lock-free, as there's only one of each. the samples are kept as they come,
+//a byte for each tick of the timer in mono and a pair in stereo, and a mono sample
+//is played on both channels. a full frame takes the same no. of bytes either way,
+//and its depth is counted in ticks, see AudioRingBuffer.
+AudioRingBuffer audioBuffer;
+bool streamStereo = false;  //the last frame was stereo
+uint32_t frameTicks = REQUEST_SIZE - REQUEST_HEADER_SIZE; //ticks a full frame fills, half as many in stereo
 
 bool audioBufferEmpty = true;
+bool playbackRunning = false; //the loop's view of audioBufferEmpty, to tell when it ran dry
+bool streamEndReceived = false; //the last frame of the playlist, so the buffer is meant to run dry
+
+//decides when playback starts and when frames are requested, and corrects the
+//playback rate for the drift between the timer and the source.
+JitterBuffer jitterBuffer;
+volatile int32_t playbackDriftPpm = 0;
+
+//control parameters
+ControlFilter controlFilter;
+volatile bool playbackPaused = false; //the output task holds the samples and plays silence
+volatile int32_t playbackGainScale = 256; //in 1/256ths, see getControlGainScale()
+volatile bool playbackFlushPending = false; //set by the loop, the output task empties the buffer
+bool frameFlushActive = false;  //frames before frameFlushSequence are thrown away
+uint16_t frameFlushSequence = 0;
 
 //UDP parameters
 WiFiUDP UDP;
@@ -73,16 +108,23 @@ IPAddress server_IP (192,168,4,1);
 IPAddress client_IP (192,168,4,2);
 
 //this is a temp buffer used during UDP data transfer.
-//this is required because the UDP RX buffer may be reused for receiving fragmented data.
-//the data will be assmebled in the below buffer before it is copied to the next
-//audio data buffer.
+//the fragments are assembled by the frame assembler, and a complete frame is
+//copied to the below buffer before it is copied to the next audio data buffer.
+FrameAssembler frameAssembler;
 uint16_t tempAudioBufferLength = 0;
 uint8_t tempAudioBuffer[REQUEST_SIZE] = {0};
 
+//the samples of a frame can be coded, as told by the third header byte. the no. of
+//bytes in the frame then differs from the no. of samples. coded frames are decoded
+//to the buffer below before they are pushed to the audio buffer.
+uint32_t tempAudioBufferPayloadLength = 0;  //no. of data bytes after the header
+uint8_t decodedAudioBuffer[REQUEST_SIZE - REQUEST_HEADER_SIZE] = {0};
+
 //periodic tasks
 ptScheduler pwmTask = ptScheduler(100);
 ptScheduler ledTask = ptScheduler(500000);
 ptScheduler dataRequestTask = ptScheduler(2000000);
+ptScheduler metricsTask = ptScheduler(METRICS_REPORT_INTERVAL);
 
 //PWM parameters
 const int pwmFrequency = 22000;
@@ -92,11 +134,11 @@ uint8_t leftDutycycle = 0;
 uint8_t rightDutycycle = 0;
 const int pwmResolution = 8;
 
-volatile int interruptCounter = 0;
 int totalInterruptCounter = 0;
 int totalServedInterruptCounter = 0;
  
 hw_timer_t* timer = NULL;
+TaskHandle_t streamTaskHandle = NULL;  //woken by the timer
 portMUX_TYPE timerMux = portMUX_INITIALIZER_UNLOCKED;
 portMUX_TYPE bufferSignalMux = portMUX_INITIALIZER_UNLOCKED;
 
@@ -108,49 +150,130 @@ int udpRxPacketSize = 0;
 int udpRxDataLength = 0;
 char udpRxDataBuffer[UDP_MTU_SIZE] = {0};
 
+//credit mode parameters
+uint16_t creditOutstanding = 0; //no. of frames granted but not received yet
+uint32_t creditUpdateTime = 0;  //last time a grant was sent or a frame was received
+uint32_t bufferFillStartTime = 0; //when we started filling an empty buffer
+
+//link metrics
+MetricCounter framesReceived;
+MetricCounter framesLost; //never arrived, or given up
+MetricCounter framesInvalid;
+MetricCounter tracksReceived; //frames that ended a track
+MetricCounter nacksSent;
+MetricCounter requestsSent; //frames asked for, with RD? or RD#n
+MetricCounter requestFailures;  //requests that timed out
+MetricCounter underruns;  //the buffer ran dry while playing
+MetricCounter samplesPlayed;  //counted by the output task
+MetricCounter ticksMissed;  //timer ticks the output task woke up too late for
+MetricCounter controlsReceived; //control messages, not counting the resends
+MetricCounter framesFlushed;  //frames thrown away after a skip or a seek
+MetricCounter stereoFrames;
+MetricHistogram requestTime;  //time from a request to its frame, ms
+
 //===================================================================//
 
-int requestData (int length = REQUEST_SIZE);
+int requestData();
 
 //===================================================================//
-//This function is invoked at a frequency of 44.1Khz.
-//It increments a counter indicating how many interrupts have been
-//occured.
+//This function is invoked at the sample rate.
+//It counts the interrupt and wakes the output task.
 
 void IRAM_ATTR onTimer() {
   portENTER_CRITICAL_ISR(&timerMux);  //lock the mutex
-  interruptCounter++;
   totalInterruptCounter++;
   portEXIT_CRITICAL_ISR(&timerMux); //unlock the mutex
+
+  BaseType_t higherPriorityTaskWoken = pdFALSE;
+
+  if (streamTaskHandle != NULL) {
+    vTaskNotifyGiveFromISR(streamTaskHandle, &higherPriorityTaskWoken);
+  }
+  if (higherPriorityTaskWoken) {
+    portYIELD_FROM_ISR();
+  }
 }
 
 //===================================================================//
-//This function checks if the 44.1Khz timer was interrupted.
-//If it was interrupted, send a single sample to both L and R PWM pins.
-//The interrupt counter may have a value more than 1. In such case,
-//transmit samples of that many.
+//This task sleeps until the timer wakes it, and then sends a sample to
+//each of the left and right PWM pins. The samples are taken from the
+//audio buffer a block of ticks at a time, split into the two channels. If
+//the task was woken late, one tick is used up for each one missed so that
+//playback keeps pace with the timer, and the last one is played. To
+//correct the drift, a tick is skipped or played twice every
+//1000000 / playbackDriftPpm ticks. While paused, the samples are kept
+//and the output is silent, as when the buffer runs dry.
 
 void streamTask(void* pvParameters) {
+  uint8_t leftBlock[PLAYBACK_BLOCK_SIZE] = {0};
+  uint8_t rightBlock[PLAYBACK_BLOCK_SIZE] = {0};
+  uint32_t playbackLength = 0;  //no. of ticks in the block
+  uint32_t playbackIndex = 0; //next tick to play from the block
+  int32_t driftAccumulator = 0;
+
   while(1) {
-    if (interruptCounter > 0) { //if the timer was interrupted
-      //start reading the CB only if it is not empty.
-      if (!audioBufferEmpty) {
-        uint8_t sampleByte = 0;
-        int cbState = cbPop(&audioBuffer, &sampleByte);
-        
-        if (cbState == 0) {
-          ledcWrite(rightChannel, sampleByte);
+    uint32_t tickCount = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    if (tickCount > 1) {
+      ticksMissed.add(tickCount - 1);
+    }
+
+    //a skip or a seek, the samples from the old place are dropped
+    if (playbackFlushPending) {
+      audioBuffer.discardAll();
+      playbackLength = 0;
+      playbackIndex = 0;
+      playbackFlushPending = false;
+    }
+
+    if (playbackPaused) {
+      ledcWrite(leftChannel, 0);
+      ledcWrite(rightChannel, 0);
+      tickCount = 0;
+    }
+
+    //start reading the audio buffer only if it is not empty.
+    if ((tickCount > 0) && (!audioBufferEmpty)) {
+      uint32_t sampleIndex = 0;
+      bool samplePlayed = false;
+
+      while (tickCount > 0) {
+        if (playbackIndex == playbackLength) {
+          playbackLength = audioBuffer.pop(leftBlock, rightBlock, PLAYBACK_BLOCK_SIZE);
+          playbackIndex = 0;
+
+          if (playbackLength == 0) {
+            break;
+          }
         }
-        else {
-          portENTER_CRITICAL(&bufferSignalMux);
-            audioBufferEmpty = true;
-          portEXIT_CRITICAL(&bufferSignalMux);
-          ledcWrite(rightChannel, 0);
+        sampleIndex = playbackIndex++;
+        samplePlayed = true;
+        tickCount--;
+        samplesPlayed.increment();
+
+        driftAccumulator += playbackDriftPpm;
+
+        if (driftAccumulator >= 1000000) {
+          driftAccumulator -= 1000000;
+          playbackIndex += (playbackIndex < playbackLength) ? 1 : 0;  //skip the next one
         }
+        else if (driftAccumulator <= -1000000) {
+          driftAccumulator += 1000000;
+          playbackIndex--;  //play this one again
+        }
+      }
+
+      if (samplePlayed) {
+        ledcWrite(leftChannel, applyControlGain(leftBlock[sampleIndex], playbackGainScale));
+        ledcWrite(rightChannel, applyControlGain(rightBlock[sampleIndex], playbackGainScale));
+      }
+      else {
+        portENTER_CRITICAL(&bufferSignalMux);
+          audioBufferEmpty = true;
+        portEXIT_CRITICAL(&bufferSignalMux);
+        ledcWrite(leftChannel, 0);
+        ledcWrite(rightChannel, 0);
       }
-      portENTER_CRITICAL(&timerMux);
-        interruptCounter = 0;
-      portEXIT_CRITICAL(&timerMux);
     }
     wdtFeed();
   }
@@ -164,10 +287,8 @@ void setup() {
   // if (quadBuffer == NULL) {
   //   debugSerial.println("Memory allocation failed");
   // }
-  audioBuffer.head = 0;
-  audioBuffer.tail = 0;
-  audioBuffer.maxlen = (CB_SIZE+1);
-  audioBuffer.buffer = (uint8_t*) malloc(sizeof(uint8_t) * (CB_SIZE+1));
+  audioBuffer.begin(CB_SIZE);
+  jitterBuffer.configure(PLAYBACK_SAMPLE_RATE, frameTicks, CB_SIZE, PLAYBACK_PREFILL_MS, PLAYBACK_MIN_DEPTH_MS);
 
   pinMode(DEBUG_LED, OUTPUT);
   // pinMode(0, OUTPUT);
@@ -233,7 +354,7 @@ void setup() {
     3000,             //Stack size in words
     NULL,              //Task input parameter
     5,                 //Priority of the task
-    NULL,              //Task handle.
+    &streamTaskHandle, //Task handle.
     0);                //Core where the task should run
 }
 
@@ -242,60 +363,75 @@ void setup() {
 void loop() {
   authenticateServer();
 
-  if (isCbEmpty(&audioBuffer)) {
+  if (audioBuffer.isEmpty()) {
     audioBufferEmpty = true;
   }
 
-  if (serverReady) {
-    //if audio buffer is ever empty, fill it completely.
+  //the buffer ran dry while playing. unless the stream ended, it has to be deeper.
+  if (audioBufferEmpty && playbackRunning) {
+    playbackRunning = false;
+
+    if (!streamEndReceived) {
+      jitterBuffer.addUnderrun();
+      underruns.increment();
+      debugSerial.print("Buffer underrun, low watermark: ");
+      debugSerial.println(jitterBuffer.getLowWatermark());
+    }
+  }
+
+  jitterBuffer.update(millis(), audioBuffer.getOccupiedTicks(), (!audioBufferEmpty) && (!playbackPaused));
+  playbackDriftPpm = jitterBuffer.getDriftPpm();
+
+  if (metricsTask.call()) {
+    printMetrics();
+  }
+
+  if (serverReady && (CREDIT_WINDOW_FRAMES > 0)) {
+    streamWithCredit();
+  }
+  else if (serverReady) {
+    //if audio buffer is ever empty, fill it enough to start playing.
     if (audioBufferEmpty) {
       uint32_t entryTime = millis();
 
-      //fill the buffer until it is full or until timeout.
-      while ((!isCbFull(&audioBuffer)) && ((millis() - entryTime) < 30000)) {
+      //fill the buffer until it's ready to play, it can't hold another frame, or until timeout.
+      while ((!jitterBuffer.isReady(audioBuffer.getOccupiedTicks())) &&
+             (audioBuffer.getVacantBytes() >= (REQUEST_SIZE-REQUEST_HEADER_SIZE)) && ((millis() - entryTime) < 30000)) {
         if (requestData() != -1) {
           if (tempAudioBufferLength > 0) {
-            //push the received samples to the audio buffer.
-            for (int i = REQUEST_HEADER_SIZE; i < (REQUEST_HEADER_SIZE + tempAudioBufferLength); i++) {
-              cbPush(&audioBuffer, tempAudioBuffer[i]);
-            }
+            pushFrame(tempAudioBufferLength);
           }
         }
         else {
           debugSerial.println("Data request failed");
+          requestFailures.increment();
           vTaskDelay(1000);
         }
       }
       
-      //after the timeout, the CB doesn't have to be full always.
+      //after the timeout, the CB doesn't have to be ready always.
       //in such case, if the CB is non-empty, we can signal the streaming task
       //to start reading the CB.
-      if (getCbOccupiedLength(&audioBuffer) > 0) {
-        portENTER_CRITICAL(&bufferSignalMux);
-          audioBufferEmpty = false;
-        portEXIT_CRITICAL(&bufferSignalMux);
-        debugSerial.println("Buffer has been filled");
+      if (audioBuffer.getOccupiedTicks() > 0) {
+        startPlayback();
       }
     }
 
-    //if audio buffer is not empty, check how much space is left in the audio buffer.
-    //if the space is larger than our data request size, we can make a new request and fill
-    //the buffer.
+    //if audio buffer is not empty, check if it's below the low watermark and
+    //has space for another frame. if so, we can make a new request and fill the buffer.
     else {
-      //check if there's enough space in CB to make a new request.
-      if (getCbVacantLength(&audioBuffer) >= (REQUEST_SIZE-REQUEST_HEADER_SIZE)) {
+      if ((audioBuffer.getVacantBytes() >= (REQUEST_SIZE-REQUEST_HEADER_SIZE)) &&
+          (jitterBuffer.getFramesWanted(audioBuffer.getOccupiedTicks(), 0) > 0)) {
         debugSerial.println("Requesting data..");
         
         if (requestData() != -1) {
           if (tempAudioBufferLength > 0) {
-            //push the received samples to the audio buffer.
-            for (int i = REQUEST_HEADER_SIZE; i < (REQUEST_HEADER_SIZE + tempAudioBufferLength); i++) {
-              cbPush(&audioBuffer, tempAudioBuffer[i]);
-            }
+            pushFrame(tempAudioBufferLength);
           }
         }
         else {
           debugSerial.println("Data request failed");
+          requestFailures.increment();
           vTaskDelay(1000);
         }
       }
@@ -304,175 +440,422 @@ void loop() {
 }
 
 //===================================================================//
+//Keeps the server streaming in credit mode. New credit is granted as soon as the
+//buffer, counting the frames already in flight, falls below the low watermark, so
+//the next frame is on the way before it runs dry. An empty buffer is filled the
+//same way up to the start depth before playback starts.
+
+void streamWithCredit() {
+  //grant only the frames wanted and that we can hold, on top of those still in flight.
+  int framesWanted = int(jitterBuffer.getFramesWanted(audioBuffer.getOccupiedTicks(), creditOutstanding));
+  int framesVacant = int(audioBuffer.getVacantBytes() / (REQUEST_SIZE - REQUEST_HEADER_SIZE)) - creditOutstanding;
+  int framesWindow = CREDIT_WINDOW_FRAMES - creditOutstanding;
+  int creditGrant = (framesVacant < framesWindow) ? framesVacant : framesWindow;
+  creditGrant = (framesWanted < creditGrant) ? framesWanted : creditGrant;
+
+  if ((creditGrant > 0) && (WiFi.status() == WL_CONNECTED)) {
+    char buffer[12] = {0};
+    snprintf(buffer, sizeof(buffer), "RD#%d", creditGrant);
+    sendUDP((uint8_t*)buffer, strlen(buffer));
+    creditOutstanding += creditGrant;
+    creditUpdateTime = millis();
+    jitterBuffer.addRequests(millis(), creditGrant);
+    requestsSent.add(creditGrant);
+  }
 
-int requestData (int length) {
-  UDP.flush();
+  if (audioBufferEmpty && (bufferFillStartTime == 0)) {
+    bufferFillStartTime = millis();
+  }
 
-  udpRxPacketSize = 0;
-  udpRxDataLength = 0;
-  tempAudioBufferLength = 0;
-  int packetFragmentCount = 0;  //no. of fragments we need to read
-  int packetFragmentCounter = 0;  //no. of fragments we have read so far
-  int byteCounter = 0;
+  int frameLength = receiveFrame();
 
-  if (length <= UDP_MTU_SIZE) {
-    packetFragmentCount = 1;
+  if (frameLength > 0) {
+    pushFrame(frameLength);
   }
-  else {
-    //find how many fragments of data we need to retrieve based on the MTU size.
-    //calculate the mod of the length to determine if it is a multiple of MTU size.
-    packetFragmentCount = ((length % UDP_MTU_SIZE) == 0) ? (length / UDP_MTU_SIZE) : (length / UDP_MTU_SIZE) + 1;
+
+  //the granted frames never arrived. they are probably lost, so start over.
+  if ((creditOutstanding > 0) && ((millis() - creditUpdateTime) >= CREDIT_TIMEOUT)) {
+    debugSerial.println("Data request failed");
+    requestFailures.increment();
+    jitterBuffer.dropRequests(creditOutstanding);
+    creditOutstanding = 0;
   }
 
-  //send a request for data
-  if (serverReady && (WiFi.status() == WL_CONNECTED)) {
-    uint8_t buffer[] = "RD?";
-    sendUDP(buffer, strlen((char*)buffer)); //send to client
+  //an empty buffer is filled until it's ready to play, or the server sends
+  //the last frame of the stream, or until timeout.
+  if (audioBufferEmpty && (audioBuffer.getOccupiedTicks() > 0)) {
+    if (jitterBuffer.isReady(audioBuffer.getOccupiedTicks()) || ((frameLength > 0) && streamEndReceived) ||
+        ((millis() - bufferFillStartTime) >= 30000)) {
+      bufferFillStartTime = 0;
+      startPlayback();
+    }
   }
-  
-  uint32_t entryTime = millis();
+}
 
-  while ((packetFragmentCounter < packetFragmentCount) && ((millis() - entryTime) < 6000)) {
-    udpRxPacketSize = UDP.parsePacket();
+//===================================================================//
+//Signals the output task to start reading the audio buffer.
+
+void startPlayback() {
+  portENTER_CRITICAL(&bufferSignalMux);
+    audioBufferEmpty = false;
+  portEXIT_CRITICAL(&bufferSignalMux);
+  playbackRunning = true;
+  debugSerial.print("Buffer has been filled: ");
+  debugSerial.println(audioBuffer.getOccupiedTicks());
+}
 
-    if (udpRxPacketSize) {
-      //read the data
-      udpRxDataLength = UDP.read(udpRxDataBuffer, UDP_MTU_SIZE);
-
-      //determine the no. of samples we need to read.
-      //this has to be done only when reading the first fragment.
-      if (packetFragmentCounter == 0) {
-        tempAudioBufferLength = uint16_t(udpRxDataBuffer[0] << 8);  //high byte
-        tempAudioBufferLength |= udpRxDataBuffer[1];  //low byte
-      }
+//===================================================================//
+//Assembles a frame from the UDP fragments without waiting. Each call reads at most
+//one fragment. Returns the no. of samples once the whole frame has been received,
+//or 0 if the frame is not complete yet. -1 is returned if the frame is invalid.
 
-      //because we are receiving fragments each time.
-      packetFragmentCounter++;
+int receiveFrame() {
+  receiveFragment();
 
-      //only if the sample length is valid.
-      if ((tempAudioBufferLength > 0) && (tempAudioBufferLength <= (REQUEST_SIZE - REQUEST_HEADER_SIZE))) {
-        int j = 0;
-        //byteCounter will keep track of the index position in the temp buffer.
-        for (int i = byteCounter; i < (byteCounter + udpRxDataLength); i++) {
-          tempAudioBuffer[i] = udpRxDataBuffer[j];
-          j++;
-        }
-        byteCounter += udpRxDataLength;
+  uint16_t framesSkipped = 0;
+  int sampleCount = popFrame(&framesSkipped);
 
-        if ((byteCounter >= length) || (byteCounter >= (tempAudioBufferLength + REQUEST_HEADER_SIZE))) {
-          return byteCounter;
-        }
-      }
-      else {
-        debugSerial.print("Unexpected sample length: ");
-        debugSerial.println(tempAudioBufferLength);
-        return -1;
-      }
-    }
+  if (sampleCount == 0) {
+    return 0;
   }
 
-  return byteCounter;
+  //the frames lost on the way used up their credit too, and will never arrive.
+  //so did one that was invalid or thrown away.
+  jitterBuffer.dropRequests(framesSkipped + ((sampleCount < 0) ? 1 : 0));
+  uint16_t creditUsed = framesSkipped + 1;
+  creditOutstanding = (creditOutstanding > creditUsed) ? (creditOutstanding - creditUsed) : 0;
+  creditUpdateTime = millis();
+  return sampleCount;
 }
 
 //===================================================================//
+//Reads a UDP packet if there's one and adds it to the frames being assembled,
+//or acts on it if it's a control message. Then asks the transmitter for any
+//fragments that went missing.
 
-void udpCallResponse() {
-  if (1) {
-    udpRxDataLength = 0;
-    udpRxDataBuffer[0] = '\0';
-    udpRxPacketSize = UDP.parsePacket(); //listen to server
-    if (udpRxPacketSize) {
-      udpRxDataBuffer[0] = '\0';
-      udpRxDataLength = UDP.read(udpRxDataBuffer, 255); //read the data to buffer
-      if (udpRxDataLength > 0) {
-        udpRxDataBuffer[udpRxDataLength] = '\0';
-        
-        debugSerial.print("Request received: ");
-        debugSerial.print(udpRxDataBuffer);
-        debugSerial.print(" ");
-        debugSerial.println(strlen(udpRxDataBuffer));
-      }
+void receiveFragment() {
+  udpRxPacketSize = UDP.parsePacket();
+
+  if (udpRxPacketSize > 0) {
+    udpRxDataLength = UDP.read(udpRxDataBuffer, UDP_MTU_SIZE);
+
+    if ((udpRxDataLength > 0) && (!answerReadyRequest()) && (!receiveControl())) {
+      frameAssembler.addFragment((uint8_t*)udpRxDataBuffer, udpRxDataLength, millis());
     }
   }
 
-  if (1) {
-    uint8_t buffer[] = "YES!";
-    sendUDP(buffer, strlen((char*)buffer)); //send to client
-    vTaskDelay(500);
+  uint16_t sequence = 0;
+  uint32_t missingMask = 0;
+
+  if (frameAssembler.getMissingFragments(millis(), &sequence, &missingMask) && (WiFi.status() == WL_CONNECTED)) {
+    char buffer[24] = {0};
+    snprintf(buffer, sizeof(buffer), "NK#%u#%lu", sequence, (unsigned long) missingMask);
+    sendUDP((uint8_t*)buffer, strlen(buffer));
+    nacksSent.increment();
   }
 }
 
 //===================================================================//
-//checks if the circular buffer is full.
+//Copies the next complete frame to tempAudioBuffer. framesSkipped is set to the
+//no. of frames lost before it. Returns the no. of samples, 0 if there's no frame
+//yet, -1 if the frame is invalid, or -2 if it's from before a skip or a seek.
 
-bool isCbFull(circ_buf_t* c) {
-  if ((c->head + 1) == (c->tail)) {
-    return true;
+int popFrame(uint16_t* framesSkipped) {
+  uint16_t frameLength = 0;
+  uint16_t sequence = 0;
+
+  if (!frameAssembler.popFrame(tempAudioBuffer, &frameLength, &sequence, framesSkipped, millis())) {
+    return 0;
   }
-  return false;
-}
 
-//===================================================================//
+  if (*framesSkipped > 0) {
+    debugSerial.print("Frames lost: ");
+    debugSerial.println(*framesSkipped);
+    framesLost.add(*framesSkipped);
+  }
+
+  if (frameFlushActive) {
+    if (int16_t(sequence - frameFlushSequence) < 0) {
+      framesFlushed.increment();
+      tempAudioBufferLength = 0;
+      return -2;
+    }
+    frameFlushActive = false;
+  }
 
-int getCbOccupiedLength(circ_buf_t* c) {
-  return (c->head - c->tail);
+  //the frame header has the no. of samples in the frame and the codec.
+  //a stereo frame has whole pairs, and is never coded.
+  tempAudioBufferLength = uint16_t(tempAudioBuffer[0] << 8);  //high byte
+  tempAudioBufferLength |= tempAudioBuffer[1];  //low byte
+  tempAudioBufferPayloadLength = getFramePayloadLength(tempAudioBuffer[2], tempAudioBufferLength);
+  bool stereo = ((tempAudioBuffer[3] & FRAME_FLAG_STEREO) != 0);
+
+  if ((tempAudioBufferLength == 0) || (tempAudioBufferLength > (REQUEST_SIZE - REQUEST_HEADER_SIZE)) ||
+      (tempAudioBufferPayloadLength == 0) || (frameLength != (tempAudioBufferPayloadLength + REQUEST_HEADER_SIZE)) ||
+      (stereo && (((tempAudioBufferLength % 2) != 0) || (tempAudioBuffer[2] != FRAME_CODEC_PCM_U8)))) {
+    debugSerial.print("Unexpected sample length: ");
+    debugSerial.println(tempAudioBufferLength);
+    framesInvalid.increment();
+    tempAudioBufferLength = 0;
+    return -1;
+  }
+  return tempAudioBufferLength;
 }
 
 //===================================================================//
+//Pushes the samples of the frame in tempAudioBuffer to the audio buffer.
+//Coded frames are decoded first. The next track follows the last frame of a
+//track without a gap, and only the end of the stream is flagged as such.
+//A stream can go from mono to stereo frames and back, eg. with a new server.
+
+void pushFrame(int sampleCount) {
+  uint8_t* samples = &tempAudioBuffer[REQUEST_HEADER_SIZE];
+  bool stereo = ((tempAudioBuffer[3] & FRAME_FLAG_STEREO) != 0);
+
+  if (stereo != streamStereo) {
+    streamStereo = stereo;
+    frameTicks = (REQUEST_SIZE - REQUEST_HEADER_SIZE) / (stereo ? 2 : 1);
+    jitterBuffer.resize(frameTicks, CB_SIZE / (stereo ? 2 : 1));
+    debugSerial.println(stereo ? "Stereo stream" : "Mono stream");
+  }
+
+  if (stereo) {
+    stereoFrames.increment();
+  }
 
-int getCbVacantLength (circ_buf_t* c) {
-  return (CB_SIZE - (c->head - c->tail));
+  int32_t delay = jitterBuffer.addFrame(millis());
+
+  if (delay >= 0) {
+    requestTime.record(uint32_t(delay));
+  }
+  framesReceived.increment();
+  streamEndReceived = ((tempAudioBuffer[3] & FRAME_FLAG_STREAM_END) != 0);
+
+  if (tempAudioBuffer[3] & FRAME_FLAG_TRACK_END) {
+    tracksReceived.increment();
+    debugSerial.println(streamEndReceived ? "End of stream received" : "End of track received");
+  }
+
+  if (tempAudioBuffer[2] == FRAME_CODEC_IMA_ADPCM) {
+    if (adpcmDecodeU8(samples, sampleCount, decodedAudioBuffer) == 0) {
+      debugSerial.println("Invalid ADPCM frame");
+      return;
+    }
+    samples = decodedAudioBuffer;
+  }
+
+  //push the received samples to the audio buffer.
+  audioBuffer.push(samples, uint32_t(sampleCount), stereo);
 }
 
 //===================================================================//
-//pushes a byte to the CB.
+//Requests a single frame and waits for it. Returns the frame length, 0 on
+//timeout, or -1 if the frame was invalid or had to be given up.
 
-int cbPush (circ_buf_t* c, uint8_t data) {
-  int next;
+int requestData() {
+  UDP.flush();
 
-  next = c->head + 1;  // next is where head will point to after this write.
+  udpRxPacketSize = 0;
+  udpRxDataLength = 0;
+  tempAudioBufferLength = 0;
+
+  //send a request for data
+  if (serverReady && (WiFi.status() == WL_CONNECTED)) {
+    uint8_t buffer[] = "RD?";
+    sendUDP(buffer, strlen((char*)buffer)); //send to client
+    jitterBuffer.addRequests(millis(), 1);
+    requestsSent.increment();
+  }
   
-  if (next >= c->maxlen) {
-    next = 0;
+  uint32_t framesDropped = frameAssembler.getFramesDropped();
+  uint32_t entryTime = millis();
+
+  while ((millis() - entryTime) < 6000) {
+    receiveFragment();
+
+    uint16_t framesSkipped = 0;
+    int sampleCount = popFrame(&framesSkipped);
+
+    if (sampleCount > 0) {
+      return (tempAudioBufferPayloadLength + REQUEST_HEADER_SIZE);
+    }
+    if (sampleCount == -2) {
+      jitterBuffer.dropRequests(1);
+      return 0;
+    }
+    if (sampleCount < 0) {
+      jitterBuffer.dropRequests(1);
+      return -1;
+    }
+
+    //no use waiting for a frame that has been given up
+    if (frameAssembler.getFramesDropped() != framesDropped) {
+      jitterBuffer.dropRequests(1);
+      return -1;
+    }
   }
 
-  if (next == c->tail) {  // if the head + 1 == tail, circular buffer is full
-    return -1;
+  jitterBuffer.dropRequests(1);
+  return 0;
+}
+
+//===================================================================//
+//A transmitter in fan-out mode keeps broadcasting READY? until all stations have
+//answered, and it may have been restarted too. The packet in udpRxDataBuffer is
+//answered if it's a READY?, instead of being taken as audio data.
+//Returns true if it was.
+
+bool answerReadyRequest() {
+  if ((udpRxDataLength != 6) || (memcmp(udpRxDataBuffer, "READY?", 6) != 0)) {
+    return false;
   }
 
-  c->buffer[c->head] = data;  // Load data and then move
-  c->head = next;             // head to next data offset.
-  return 0;  // return success to indicate successful push.
+  sendReadyAnswer();
+  return true;
+}
+
+//===================================================================//
+//Answers a READY? with YES!, and our version in a packet of its own, so that
+//stereo frames are only sent to us once the transmitter knows we can play them.
+//See "Receiver version" in AUDIFI-Protocol.h.
+
+void sendReadyAnswer() {
+  char line[PROTOCOL_LINE_MAX_LENGTH] = "YES!";
+  sendUDP((uint8_t*)line, strlen(line));
+
+  int length = formatReceiverVersion(line, sizeof(line), PROTOCOL_VERSION);
+  sendUDP((uint8_t*)line, uint32_t(length));
 }
 
 //===================================================================//
-//checks if the circular buffer is empty.
+//Answers the control message in udpRxDataBuffer with CA#, and acts on it unless
+//it was sent again. Returns false if the packet is not a control message.
+
+bool receiveControl() {
+  ControlMessage message;
 
-bool isCbEmpty(circ_buf_t* c) {
-  if (c->head == c->tail) {  // if the head == tail, we don't have any data
+  if ((udpRxDataLength != CONTROL_PACKET_SIZE) || ((uint8_t)udpRxDataBuffer[0] != CONTROL_MARKER)) {
+    return false;
+  }
+  if (!readControlPacket((uint8_t*)udpRxDataBuffer, udpRxDataLength, &message)) {
     return true;
   }
-  return false;
+
+  char buffer[8] = {0};
+  formatControlAck(buffer, sizeof(buffer), message.id);
+  sendUDP((uint8_t*)buffer, strlen(buffer));
+
+  if (controlFilter.accept(message.id)) {
+    controlsReceived.increment();
+    applyControl(message);
+  }
+  return true;
 }
 
 //===================================================================//
-//pops a byte from the CB.
 
-int cbPop (circ_buf_t* c, uint8_t* data) {
-  int next;
+void applyControl(const ControlMessage& message) {
+  debugSerial.print("Control: ");
+  debugSerial.println(getControlName(message.type));
 
-  if (c->head == c->tail) {  // if the head == tail, we don't have any data
-    return -1;
+  if (message.type == CONTROL_PAUSE) {
+    playbackPaused = true;
+  }
+  else if (message.type == CONTROL_RESUME) {
+    playbackPaused = false;
+  }
+  else if (message.type == CONTROL_GAIN) {
+    playbackGainScale = getControlGainScale(message.value);
   }
+  else if (isControlFlush(message.type)) {
+    flushPlayback(message.frameSequence);
+  }
+}
+
+//===================================================================//
+//Empties the audio buffer for a skip or a seek, and throws away the frames on
+//the way before the first one from the new place. The buffer is then filled up
+//to the start depth again before playback starts.
+
+void flushPlayback(uint16_t firstSequence) {
+  frameFlushActive = true;
+  frameFlushSequence = firstSequence;
+
+  portENTER_CRITICAL(&bufferSignalMux);
+    audioBufferEmpty = true;
+  portEXIT_CRITICAL(&bufferSignalMux);
+  playbackRunning = false;
+  playbackFlushPending = true;
+
+  //the output task empties it at its next tick
+  uint32_t flushStartTime = millis();
 
-  next = c->tail + 1;  // next is where tail will point to after this read.
-  if(next >= c->maxlen) {
-    next = 0;
+  while (playbackFlushPending && ((millis() - flushStartTime) < 100)) {
+    vTaskDelay(1);
   }
+  bufferFillStartTime = 0;
+  streamEndReceived = false;
+}
 
-  *data = c->buffer[c->tail];  // Read data and then move
-  c->tail = next;              // tail to next offset.
-  return 0;  // return success to indicate successful pop.
+//===================================================================//
+//Prints the link metrics to the debug serial. Counters only ever grow, so
+//rates are the difference between two reports. The buffer depth, watermark and
+//drift are as they are now.
+
+void printMetrics() {
+  MetricsLine line("metrics");
+  line.add("uptime_ms", millis());
+  line.add("interrupts", uint32_t(totalInterruptCounter));
+  line.add("samples_played", samplesPlayed.get());
+  line.add("ticks_missed", ticksMissed.get());
+  line.add("frames_received", framesReceived.get());
+  line.add("frames_lost", framesLost.get());
+  line.add("frames_invalid", framesInvalid.get());
+  line.add("frames_recovered", frameAssembler.getFramesRecovered());
+  line.add("tracks", tracksReceived.get());
+  line.add("nacks", nacksSent.get());
+  line.add("requests", requestsSent.get());
+  line.add("request_failures", requestFailures.get());
+  line.add("underruns", underruns.get());
+  line.add("controls", controlsReceived.get());
+  line.add("frames_flushed", framesFlushed.get());
+  line.add("stereo_frames", stereoFrames.get());
+  line.add("buffer_depth", audioBuffer.getOccupiedTicks());
+  line.add("low_watermark", jitterBuffer.getLowWatermark());
+  line.addSigned("drift_ppm", jitterBuffer.getDriftPpm());
+  debugSerial.println(line.getText());
+
+  MetricsLine requestLine("histogram");
+  requestLine.add("request_rtt_ms", requestTime);
+  debugSerial.println(requestLine.getText());
+}
+
+//===================================================================//
+
+void udpCallResponse() {
+  if (1) {
+    udpRxDataLength = 0;
+    udpRxDataBuffer[0] = '\0';
+    udpRxPacketSize = UDP.parsePacket(); //listen to server
+    if (udpRxPacketSize) {
+      udpRxDataBuffer[0] = '\0';
+      udpRxDataLength = UDP.read(udpRxDataBuffer, 255); //read the data to buffer
+      if (udpRxDataLength > 0) {
+        udpRxDataBuffer[udpRxDataLength] = '\0';
+        
+        debugSerial.print("Request received: ");
+        debugSerial.print(udpRxDataBuffer);
+        debugSerial.print(" ");
+        debugSerial.println(strlen(udpRxDataBuffer));
+      }
+    }
+  }
+
+  if (1) {
+    uint8_t buffer[] = "YES!";
+    sendUDP(buffer, strlen((char*)buffer)); //send to client
+    vTaskDelay(500);
+  }
 }
 
 //===================================================================//
@@ -521,9 +904,13 @@ void authenticateServer() {
           debugSerial.println(strlen(udpRxDataBuffer));
           
           if (strcmp(udpRxDataBuffer, "READY?") == 0) {
-            uint8_t buffer[] = "YES!";
-            sendUDP(buffer, strlen((char*)buffer));
+            sendReadyAnswer();
             debugSerial.println("Server is ready");
+            frameAssembler.reset();
+            jitterBuffer.reset();
+            controlFilter.reset();  //the transmitter starts the ids over
+            frameFlushActive = false;
+            playbackPaused = false;
             serverReady = true;
             return;
           }
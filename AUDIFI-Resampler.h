@@ -0,0 +1,362 @@
+//==============================================================================//
+//
+//  AUDIFI Resampler
+//  Version : v0.1
+//
+//  Converts a stream of float samples from the sample rate of a file to the
+//  playback rate of the receiver, which is set by its timer to about 11025 Hz.
+//  Without this, files with other rates play at the wrong speed and pitch.
+//
+//  It's a polyphase FIR filter. The windowed sinc is tabulated at a fixed no. of
+//  phases between two input samples, and the output is interpolated between the
+//  two nearest phases, so any ratio of rates works. The cutoff follows the lower
+//  of the two rates, so downsampling does not alias. The presets trade the length
+//  of the filter and the no. of phases for CPU time.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_RESAMPLER_H
+#define AUDIFI_RESAMPLER_H
+
+#include "AUDIFI-SIMD.h"
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+
+#define RESAMPLER_QUALITY_LOW 0
+#define RESAMPLER_QUALITY_MEDIUM 1
+#define RESAMPLER_QUALITY_HIGH 2
+
+#define RESAMPLER_MAX_TAPS 512          //longest filter, for large downsampling ratios
+#define RESAMPLER_BUFFER_LENGTH 2048    //input samples held on top of the filter history
+
+typedef void (*ResamplerKernel)(const float* input, const float* row0, const float* row1, uint32_t tapCount, float* sum0, float* sum1);
+
+//==============================================================================//
+//Filter kernels. Each computes the dot products of the input with two adjacent
+//phases of the filter in one pass. The no. of taps is always a multiple of 8.
+
+inline void dotPairScalar(const float* input, const float* row0, const float* row1, uint32_t tapCount, float* sum0, float* sum1) {
+  float acc0 = 0.0f;
+  float acc1 = 0.0f;
+
+  for (uint32_t i=0; i < tapCount; i++) {
+    acc0 += input[i] * row0[i];
+    acc1 += input[i] * row1[i];
+  }
+  *sum0 = acc0;
+  *sum1 = acc1;
+}
+
+#ifdef AUDIFI_X86
+
+//------------------------------------------------------------------------------//
+
+AUDIFI_TARGET_SSE2 inline float horizontalSumSse2(__m128 value) {
+  value = _mm_add_ps(value, _mm_movehl_ps(value, value));
+  value = _mm_add_ss(value, _mm_shuffle_ps(value, value, 1));
+  return _mm_cvtss_f32(value);
+}
+
+//------------------------------------------------------------------------------//
+
+AUDIFI_TARGET_SSE2 inline void dotPairSse2(const float* input, const float* row0, const float* row1, uint32_t tapCount, float* sum0, float* sum1) {
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+
+  for (uint32_t i=0; i < tapCount; i += 4) {
+    __m128 sample = _mm_loadu_ps(input + i);
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(sample, _mm_loadu_ps(row0 + i)));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(sample, _mm_loadu_ps(row1 + i)));
+  }
+  *sum0 = horizontalSumSse2(acc0);
+  *sum1 = horizontalSumSse2(acc1);
+}
+
+//------------------------------------------------------------------------------//
+
+AUDIFI_TARGET_AVX2 inline void dotPairAvx2(const float* input, const float* row0, const float* row1, uint32_t tapCount, float* sum0, float* sum1) {
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+
+  for (uint32_t i=0; i < tapCount; i += 8) {
+    __m256 sample = _mm256_loadu_ps(input + i);
+    acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(sample, _mm256_loadu_ps(row0 + i)));
+    acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(sample, _mm256_loadu_ps(row1 + i)));
+  }
+
+  __m128 half0 = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+  __m128 half1 = _mm_add_ps(_mm256_castps256_ps128(acc1), _mm256_extractf128_ps(acc1, 1));
+  *sum0 = horizontalSumSse2(half0);
+  *sum1 = horizontalSumSse2(half1);
+}
+
+#endif
+
+//==============================================================================//
+//Converts a stream of mono float samples from one rate to another. configure()
+//has to be called first. The input can be given in blocks of any size.
+
+class Resampler {
+  public:
+    Resampler() : inputRate(0), outputRate(0), quality(RESAMPLER_QUALITY_MEDIUM), tapCount(8), phaseCount(1),
+      step(0), position(0), bufferLength(0), kernel(dotPairScalar), kernelLevel(KERNEL_SCALAR) {
+      setKernelLevel(detectKernelLevel());
+    }
+
+    //------------------------------------------------------------------------------//
+    //Builds the filter for the given rates and quality preset.
+    //Returns false if a rate is zero or the quality is unknown.
+
+    bool configure(uint32_t newInputRate, uint32_t newOutputRate, int newQuality) {
+      double baseTaps, rolloff, beta;
+
+      switch (newQuality) {
+        case RESAMPLER_QUALITY_LOW: baseTaps = 8; phaseCount = 32; rolloff = 0.85; beta = 5.0; break;
+        case RESAMPLER_QUALITY_MEDIUM: baseTaps = 16; phaseCount = 128; rolloff = 0.91; beta = 7.0; break;
+        case RESAMPLER_QUALITY_HIGH: baseTaps = 32; phaseCount = 512; rolloff = 0.95; beta = 9.0; break;
+        default: return false;
+      }
+
+      if ((newInputRate == 0) || (newOutputRate == 0)) {
+        return false;
+      }
+
+      inputRate = newInputRate;
+      outputRate = newOutputRate;
+      quality = newQuality;
+
+      //the cutoff is relative to the input Nyquist frequency. when downsampling,
+      //the filter gets longer by the same factor, so the transition stays as steep.
+      double cutoff = rolloff;
+
+      if (outputRate < inputRate) {
+        cutoff = rolloff * double(outputRate) / double(inputRate);
+      }
+
+      tapCount = uint32_t(ceil(baseTaps * rolloff / cutoff));
+      tapCount = (tapCount + 7) & ~7u;
+
+      if (tapCount > RESAMPLER_MAX_TAPS) {
+        tapCount = RESAMPLER_MAX_TAPS;
+      }
+
+      //phase p holds the taps for an output p / phaseCount of the way between two
+      //input samples. there is one more phase than needed, for the interpolation.
+      coefficients.assign(size_t(phaseCount + 1) * tapCount, 0.0f);
+      double halfLength = double(tapCount) / 2.0;
+      double besselBeta = besselI0(beta);
+
+      for (uint32_t p=0; p <= phaseCount; p++) {
+        float* row = &coefficients[size_t(p) * tapCount];
+        double sum = 0.0;
+
+        for (uint32_t i=0; i < tapCount; i++) {
+          double x = double(i) - (halfLength - 1.0) - (double(p) / double(phaseCount));
+          double ratio = x / halfLength;
+          double window = (fabs(ratio) < 1.0) ? besselI0(beta * sqrt(1.0 - (ratio * ratio))) / besselBeta : 0.0;
+          double value = cutoff * sinc(cutoff * x) * window;
+          row[i] = float(value);
+          sum += value;
+        }
+
+        //every phase gets unity gain, so that there's no ripple on a DC signal
+        for (uint32_t i=0; i < tapCount; i++) {
+          row[i] = float(row[i] / sum);
+        }
+      }
+
+      step = (uint64_t(inputRate) << 32) / outputRate;
+      buffer.assign(RESAMPLER_BUFFER_LENGTH + tapCount, 0.0f);
+      reset();
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Clears the history, as if the stream started over.
+
+    void reset() {
+      //the first output is centred on the first input sample, so the taps before
+      //it are zero
+      bufferLength = (tapCount / 2) - 1;
+      memset(&buffer[0], 0, buffer.size() * sizeof(float));
+      position = 0;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Selects the kernel, capped to what the CPU supports.
+
+    void setKernelLevel(int level) {
+      int supported = detectKernelLevel();
+      kernelLevel = (level < supported) ? level : supported;
+      kernel = dotPairScalar;
+
+    #ifdef AUDIFI_X86
+      if (kernelLevel == KERNEL_SSE2) {
+        kernel = dotPairSse2;
+      }
+      else if (kernelLevel == KERNEL_AVX2) {
+        kernel = dotPairAvx2;
+      }
+    #endif
+    }
+
+    //------------------------------------------------------------------------------//
+    //Resamples the input to at most outputCapacity samples. Not all of the input
+    //may be used, if the output is full. The no. of input samples used is returned
+    //in inputUsed, and the no. of output samples as the return value.
+
+    uint32_t process(const float* input, uint32_t inputCount, uint32_t* inputUsed, float* output, uint32_t outputCapacity) {
+      uint32_t produced = 0;
+      uint32_t used = 0;
+
+      if (buffer.empty()) { //not configured
+        *inputUsed = 0;
+        return 0;
+      }
+
+      while (true) {
+        while (produced < outputCapacity) {
+          uint32_t index = uint32_t(position >> 32);
+
+          if ((index + tapCount) > bufferLength) {
+            break;  //needs more input
+          }
+
+          //the fraction selects the two nearest phases and the weight between them
+          uint64_t phasePosition = uint64_t(uint32_t(position)) * phaseCount;
+          uint32_t phase = uint32_t(phasePosition >> 32);
+          float weight = float(uint32_t(phasePosition)) * (1.0f / 4294967296.0f);
+          const float* row = &coefficients[size_t(phase) * tapCount];
+          float sum0, sum1;
+
+          kernel(&buffer[index], row, row + tapCount, tapCount, &sum0, &sum1);
+          output[produced] = sum0 + ((sum1 - sum0) * weight);
+          produced++;
+          position += step;
+        }
+
+        if ((produced == outputCapacity) || (used == inputCount)) {
+          break;
+        }
+
+        //drop the samples no output needs anymore. when downsampling, the position
+        //can be past the end of the buffer. the input is then skipped as it arrives.
+        uint32_t discard = uint32_t(position >> 32);
+
+        if (discard > bufferLength) {
+          discard = bufferLength;
+        }
+        if (discard > 0) {
+          memmove(&buffer[0], &buffer[discard], (bufferLength - discard) * sizeof(float));
+          bufferLength -= discard;
+          position -= uint64_t(discard) << 32;
+        }
+
+        uint32_t copyCount = uint32_t(buffer.size()) - bufferLength;
+
+        if (copyCount > (inputCount - used)) {
+          copyCount = inputCount - used;
+        }
+        memcpy(&buffer[bufferLength], input + used, copyCount * sizeof(float));
+        bufferLength += copyCount;
+        used += copyCount;
+      }
+
+      *inputUsed = used;
+      return produced;
+    }
+
+    //------------------------------------------------------------------------------//
+    //No. of zero samples to put in after the last sample, so that the end of the
+    //stream comes out of the filter.
+
+    uint32_t getLatency() const {
+      return tapCount / 2;
+    }
+
+    uint32_t getTapCount() const {
+      return tapCount;
+    }
+
+    uint32_t getPhaseCount() const {
+      return phaseCount;
+    }
+
+    const char* getQualityName() const {
+      return getQualityName(quality);
+    }
+
+    const char* getKernelName() const {
+      return getKernelLevelName(kernelLevel);
+    }
+
+    //------------------------------------------------------------------------------//
+
+    static const char* getQualityName(int quality) {
+      return (quality == RESAMPLER_QUALITY_LOW) ? "low" : ((quality == RESAMPLER_QUALITY_HIGH) ? "high" : "medium");
+    }
+
+    //------------------------------------------------------------------------------//
+    //Returns the preset for a name, or -1 if there's none.
+
+    static int parseQualityName(const char* name) {
+      if (strcmp(name, "low") == 0) {
+        return RESAMPLER_QUALITY_LOW;
+      }
+      if (strcmp(name, "medium") == 0) {
+        return RESAMPLER_QUALITY_MEDIUM;
+      }
+      if (strcmp(name, "high") == 0) {
+        return RESAMPLER_QUALITY_HIGH;
+      }
+      return -1;
+    }
+
+  private:
+    uint32_t inputRate;
+    uint32_t outputRate;
+    int quality;
+    uint32_t tapCount;
+    uint32_t phaseCount;
+    std::vector<float> coefficients;  //(phaseCount + 1) rows of tapCount taps
+
+    uint64_t step;      //input samples per output sample, 32.32 fixed point
+    uint64_t position;  //position of the next output in the buffer, 32.32 fixed point
+    std::vector<float> buffer;  //filter history and buffered input
+    uint32_t bufferLength;  //no. of samples in the buffer
+
+    ResamplerKernel kernel;
+    int kernelLevel;
+
+    //------------------------------------------------------------------------------//
+
+    static double sinc(double x) {
+      if (fabs(x) < 1e-9) {
+        return 1.0;
+      }
+      const double pi = 3.14159265358979323846;
+      return sin(pi * x) / (pi * x);
+    }
+
+    //------------------------------------------------------------------------------//
+    //Modified Bessel function of the first kind, for the Kaiser window.
+
+    static double besselI0(double x) {
+      double sum = 1.0;
+      double term = 1.0;
+
+      for (int k=1; k < 50; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+
+        if (term < (sum * 1e-12)) {
+          break;
+        }
+      }
+      return sum;
+    }
+};
+
+#endif
@@ -0,0 +1,356 @@
+//==============================================================================//
+//
+//  AUDIFI Ring Buffer
+//  Version : v0.1
+//
+//  A lock-free ring for one producer and one consumer, such as the receiver's
+//  network loop and its sample output task. The producer only moves the head and
+//  the consumer only moves the tail, so neither needs a lock. The head is
+//  published with release order after the data is written, and read with acquire
+//  order before the data is read, and the same for the tail the other way.
+//
+//  Samples are moved in spans with memcpy, at most two per call when the span
+//  wraps around the end of the storage, instead of one call per sample.
+//
+//  The element type must be trivially copyable.
+//
+//  AudioRingBuffer is the receiver's audio buffer, built on two of them. It
+//  keeps mono and stereo samples as they come, and tells the consumer which is
+//  which.
+//
+//  This file is shared by the receiver and the benchmark. Copy it to the sketch
+//  folder along with the sketch.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_RING_BUFFER_H
+#define AUDIFI_RING_BUFFER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+//==============================================================================//
+
+template <typename T>
+class RingBuffer {
+  public:
+    RingBuffer() : buffer(NULL), size(0), head(0), tail(0) {
+    }
+
+    ~RingBuffer() {
+      free(buffer);
+    }
+
+    //------------------------------------------------------------------------------//
+    //Allocates room for capacity elements. One more slot is used to tell a full
+    //ring from an empty one. Returns false if the memory could not be allocated.
+
+    bool begin(uint32_t capacity) {
+      free(buffer);
+      buffer = (T*) malloc(sizeof(T) * (capacity + 1));
+      size = (buffer != NULL) ? (capacity + 1) : 0;
+      head.store(0, std::memory_order_relaxed);
+      tail.store(0, std::memory_order_relaxed);
+      return (buffer != NULL);
+    }
+
+    //------------------------------------------------------------------------------//
+    //Producer side. Pushes as many of count elements as there is room for, and
+    //returns the no. pushed.
+
+    uint32_t push(const T* data, uint32_t count) {
+      uint32_t writeIndex = head.load(std::memory_order_relaxed);
+      uint32_t readIndex = tail.load(std::memory_order_acquire);
+      uint32_t vacant = getVacant(writeIndex, readIndex);
+
+      count = (count < vacant) ? count : vacant;
+
+      if (count == 0) {
+        return 0;
+      }
+
+      uint32_t firstSpan = ((size - writeIndex) < count) ? (size - writeIndex) : count;
+      memcpy(&buffer[writeIndex], data, sizeof(T) * firstSpan);
+      memcpy(&buffer[0], &data[firstSpan], sizeof(T) * (count - firstSpan));
+
+      writeIndex += count;
+      writeIndex = (writeIndex >= size) ? (writeIndex - size) : writeIndex;
+      head.store(writeIndex, std::memory_order_release);
+      return count;
+    }
+
+    bool push(const T& value) {
+      uint32_t writeIndex = head.load(std::memory_order_relaxed);
+      uint32_t nextIndex = ((writeIndex + 1) == size) ? 0 : (writeIndex + 1);
+
+      if ((size == 0) || (nextIndex == tail.load(std::memory_order_acquire))) {
+        return false;
+      }
+
+      buffer[writeIndex] = value;
+      head.store(nextIndex, std::memory_order_release);
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Consumer side. Pops up to count elements, and returns the no. popped.
+
+    uint32_t pop(T* data, uint32_t count) {
+      uint32_t readIndex = tail.load(std::memory_order_relaxed);
+      uint32_t writeIndex = head.load(std::memory_order_acquire);
+      uint32_t occupied = getOccupied(writeIndex, readIndex);
+
+      count = (count < occupied) ? count : occupied;
+
+      if (count == 0) {
+        return 0;
+      }
+
+      uint32_t firstSpan = ((size - readIndex) < count) ? (size - readIndex) : count;
+      memcpy(data, &buffer[readIndex], sizeof(T) * firstSpan);
+      memcpy(&data[firstSpan], &buffer[0], sizeof(T) * (count - firstSpan));
+
+      readIndex += count;
+      readIndex = (readIndex >= size) ? (readIndex - size) : readIndex;
+      tail.store(readIndex, std::memory_order_release);
+      return count;
+    }
+
+    bool pop(T* value) {
+      uint32_t readIndex = tail.load(std::memory_order_relaxed);
+
+      if (readIndex == head.load(std::memory_order_acquire)) {
+        return false;
+      }
+
+      *value = buffer[readIndex];
+      tail.store((((readIndex + 1) == size) ? 0 : (readIndex + 1)), std::memory_order_release);
+      return true;
+    }
+
+    //Drops up to count elements without copying them, and returns the no. dropped.
+
+    uint32_t discard(uint32_t count) {
+      uint32_t readIndex = tail.load(std::memory_order_relaxed);
+      uint32_t occupied = getOccupied(head.load(std::memory_order_acquire), readIndex);
+
+      count = (count < occupied) ? count : occupied;
+      readIndex += count;
+      readIndex = (readIndex >= size) ? (readIndex - size) : readIndex;
+      tail.store(readIndex, std::memory_order_release);
+      return count;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Either side can ask. The answer may be out of date by the time it's used, but
+    //only in the safe direction for the side asking.
+
+    uint32_t getOccupied() const {
+      return getOccupied(head.load(std::memory_order_acquire), tail.load(std::memory_order_acquire));
+    }
+
+    uint32_t getVacant() const {
+      return getVacant(head.load(std::memory_order_acquire), tail.load(std::memory_order_acquire));
+    }
+
+    uint32_t getCapacity() const {
+      return (size > 0) ? (size - 1) : 0;
+    }
+
+    bool isEmpty() const {
+      return (getOccupied() == 0);
+    }
+
+    bool isFull() const {
+      return (getVacant() == 0);
+    }
+
+  private:
+    T* buffer;
+    uint32_t size;  //no. of slots, one more than the capacity
+    std::atomic<uint32_t> head; //next slot written, moved by the producer
+    std::atomic<uint32_t> tail; //next slot read, moved by the consumer
+
+    RingBuffer(const RingBuffer&);
+    RingBuffer& operator=(const RingBuffer&);
+
+    //------------------------------------------------------------------------------//
+
+    uint32_t getOccupied(uint32_t writeIndex, uint32_t readIndex) const {
+      return (writeIndex >= readIndex) ? (writeIndex - readIndex) : (size - readIndex + writeIndex);
+    }
+
+    uint32_t getVacant(uint32_t writeIndex, uint32_t readIndex) const {
+      return (size > 0) ? (size - 1 - getOccupied(writeIndex, readIndex)) : 0;
+    }
+};
+
+//==============================================================================//
+//The receiver's audio buffer. The 8-bit samples are kept as they come in, one
+//byte per tick of the timer for mono and a pair, left first, for stereo, so a
+//mono stream has as many ticks as there are bytes. The places where the stream
+//switches between mono and stereo are kept in a small ring of their own as byte
+//counts, and the consumer takes them in turn, so every sample is played as what
+//it is. The depth is counted in ticks, and the room in bytes, which is the same
+//for a full frame either way.
+
+#define AUDIO_RING_SWITCHES 8       //switches between mono and stereo the buffer can hold
+#define AUDIO_RING_BLOCK_TICKS 64   //max no. of ticks popped at a time
+
+class AudioRingBuffer {
+  public:
+    AudioRingBuffer() : producerStereo(false), bytesPushed(0), consumerStereo(false), bytesPopped(0),
+      switchPending(false), nextSwitch(0), ticksPushed(0), ticksPopped(0) {
+    }
+
+    //------------------------------------------------------------------------------//
+    //Allocates room for capacity bytes. The stream starts as mono. Returns false if
+    //the memory could not be allocated.
+
+    bool begin(uint32_t capacity) {
+      producerStereo = false;
+      bytesPushed = 0;
+      consumerStereo = false;
+      bytesPopped = 0;
+      switchPending = false;
+      ticksPushed.store(0, std::memory_order_relaxed);
+      ticksPopped.store(0, std::memory_order_relaxed);
+      return samples.begin(capacity) && switches.begin(AUDIO_RING_SWITCHES);
+    }
+
+    //------------------------------------------------------------------------------//
+    //Producer side. Pushes the samples of a frame, which are pairs if it's stereo.
+    //Nothing is pushed if there's no room for all of them, or for another switch.
+    //Returns false if they were not pushed.
+
+    bool push(const uint8_t* data, uint32_t count, bool stereo) {
+      bool switching = (stereo != producerStereo);
+      count = stereo ? (count & ~uint32_t(1)) : count;
+
+      if ((samples.getVacant() < count) || (switching && switches.isFull())) {
+        return false;
+      }
+
+      //the switch is published before the samples after it
+      if (switching) {
+        switches.push(bytesPushed);
+        producerStereo = stereo;
+      }
+      samples.push(data, count);
+      bytesPushed += count;
+      ticksPushed.store(ticksPushed.load(std::memory_order_relaxed) + (stereo ? (count / 2) : count),
+                        std::memory_order_release);
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Consumer side. Pops up to count ticks, at most AUDIO_RING_BLOCK_TICKS, to the
+    //left and the right samples. A mono sample goes to both. Returns the no. of
+    //ticks popped.
+
+    uint32_t pop(uint8_t* left, uint8_t* right, uint32_t count) {
+      uint32_t available = getRunLength(samples.getOccupied());
+      count = (count < AUDIO_RING_BLOCK_TICKS) ? count : AUDIO_RING_BLOCK_TICKS;
+
+      if (consumerStereo) {
+        count = ((available / 2) < count) ? (available / 2) : count;
+        samples.pop(pairBlock, count * 2);
+
+        for (uint32_t i=0; i < count; i++) {
+          left[i] = pairBlock[i * 2];
+          right[i] = pairBlock[(i * 2) + 1];
+        }
+        bytesPopped += count * 2;
+      }
+      else {
+        count = (available < count) ? available : count;
+        samples.pop(left, count);
+        memcpy(right, left, count);
+        bytesPopped += count;
+      }
+
+      ticksPopped.store(ticksPopped.load(std::memory_order_relaxed) + count, std::memory_order_release);
+      return count;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Consumer side. Drops all the samples, and the switches between them.
+
+    void discardAll() {
+      uint32_t occupied = samples.getOccupied();
+
+      while (occupied > 0) {
+        uint32_t run = getRunLength(occupied);
+        samples.discard(run);
+        bytesPopped += run;
+        occupied -= run;
+        ticksPopped.store(ticksPopped.load(std::memory_order_relaxed) + (consumerStereo ? (run / 2) : run),
+                          std::memory_order_release);
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Either side can ask, as with RingBuffer.
+
+    uint32_t getOccupiedTicks() const {
+      return ticksPushed.load(std::memory_order_acquire) - ticksPopped.load(std::memory_order_acquire);
+    }
+
+    uint32_t getVacantBytes() const {
+      return samples.getVacant();
+    }
+
+    bool isEmpty() const {
+      return samples.isEmpty();
+    }
+
+  private:
+    RingBuffer<uint8_t> samples;
+    RingBuffer<uint32_t> switches;  //bytesPushed at each switch
+
+    //producer
+    bool producerStereo;  //the last samples pushed were stereo
+    uint32_t bytesPushed;
+
+    //consumer
+    bool consumerStereo;  //the next samples popped are stereo
+    uint32_t bytesPopped;
+    bool switchPending;   //nextSwitch has been taken from switches
+    uint32_t nextSwitch;
+    uint8_t pairBlock[AUDIO_RING_BLOCK_TICKS * 2];
+
+    std::atomic<uint32_t> ticksPushed;
+    std::atomic<uint32_t> ticksPopped;
+
+    AudioRingBuffer(const AudioRingBuffer&);
+    AudioRingBuffer& operator=(const AudioRingBuffer&);
+
+    //------------------------------------------------------------------------------//
+    //Passes the switches the consumer has reached, and returns the no. of bytes
+    //of the occupied ones it can take before the next switch. The occupied count
+    //has to be read before the switches, so that the switch before any of those
+    //bytes has been published.
+
+    uint32_t getRunLength(uint32_t occupied) {
+      while (true) {
+        if (!switchPending) {
+          switchPending = switches.pop(&nextSwitch);
+        }
+        if (!switchPending) {
+          return occupied;
+        }
+
+        uint32_t run = nextSwitch - bytesPopped;
+
+        if (run > 0) {
+          return (run < occupied) ? run : occupied;
+        }
+        consumerStereo = !consumerStereo;
+        switchPending = false;
+      }
+    }
+};
+
+#endif
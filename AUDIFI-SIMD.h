@@ -0,0 +1,77 @@
+//==============================================================================//
+//
+//  AUDIFI SIMD
+//  Version : v0.1
+//
+//  Instruction set selection for the DSP kernels of the server application.
+//  Kernels are compiled for their instruction set regardless of the build flags
+//  and are only called if the CPU supports them.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_SIMD_H
+#define AUDIFI_SIMD_H
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+  #define AUDIFI_X86
+  #include <emmintrin.h>
+  #include <immintrin.h>
+  #ifdef _MSC_VER
+    #include <intrin.h>
+  #endif
+#endif
+
+#if defined(AUDIFI_X86) && defined(__GNUC__)
+  #define AUDIFI_TARGET_SSE2 __attribute__((target("sse2")))
+  #define AUDIFI_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+  #define AUDIFI_TARGET_SSE2
+  #define AUDIFI_TARGET_AVX2
+#endif
+
+#define KERNEL_SCALAR 0
+#define KERNEL_SSE2 1
+#define KERNEL_AVX2 2
+
+//==============================================================================//
+//Returns the best kernel level the CPU supports.
+
+inline int detectKernelLevel() {
+#if defined(AUDIFI_X86) && defined(__GNUC__)
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    return KERNEL_AVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return KERNEL_SSE2;
+  }
+#elif defined(AUDIFI_X86) && defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  int maxLeaf = info[0];
+  __cpuid(info, 1);
+  bool hasSse2 = (info[3] & (1 << 26)) != 0;
+  bool hasAvx = ((info[2] & (1 << 27)) != 0) && ((info[2] & (1 << 28)) != 0);  //OSXSAVE and AVX
+
+  if (hasAvx && (maxLeaf >= 7) && ((_xgetbv(0) & 6) == 6)) {  //the OS saves the YMM registers
+    __cpuidex(info, 7, 0);
+
+    if ((info[1] & (1 << 5)) != 0) {
+      return KERNEL_AVX2;
+    }
+  }
+  if (hasSse2) {
+    return KERNEL_SSE2;
+  }
+#endif
+  return KERNEL_SCALAR;
+}
+
+//==============================================================================//
+
+inline const char* getKernelLevelName(int level) {
+  return (level == KERNEL_AVX2) ? "AVX2" : ((level == KERNEL_SSE2) ? "SSE2" : "scalar");
+}
+
+#endif
@@ -0,0 +1,491 @@
+//==============================================================================//
+//
+//  AUDIFI Sample Converter
+//  Version : v0.1
+//
+//  Converts WAV samples to the receiver's format, which is unsigned 8-bit
+//  samples, either a single channel with all channels mixed down, or stereo with
+//  the left and right samples in turn. The samples are requantized to 8 bits with
+//  TPDF dither, so that the low bits are not simply cut off. 8, 16, 24 and 32-bit
+//  integer and 32-bit float input is handled.
+//
+//  16-bit stereo, the most common format, has dedicated integer kernels for both
+//  outputs. The other formats are decoded to float and then quantized. All have
+//  SSE2 and AVX2 versions, picked at runtime, and a scalar fallback for other
+//  CPUs.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_SAMPLE_CONVERTER_H
+#define AUDIFI_SAMPLE_CONVERTER_H
+
+#include "AUDIFI-WAV-Parser.h"
+#include "AUDIFI-SIMD.h"
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#define CONVERTER_BLOCK_FRAMES 1024 //frames decoded to float at a time
+
+//the kernels work on a 17-bit "mix" scale where the sum of a 16-bit stereo pair
+//fits as is. full scale is +/-65536, and one 8-bit step is 512.
+#define MIX_FULL_SCALE 65536
+#define MIX_QUANTIZE_SHIFT 9
+
+typedef void (*S16StereoKernel)(const int16_t* input, uint32_t frameCount, uint8_t* output, uint32_t* ditherState);
+typedef void (*S16Kernel)(const int16_t* input, uint32_t count, uint8_t* output, uint32_t* ditherState);
+typedef void (*QuantizeKernel)(const float* input, uint32_t count, uint8_t* output, uint32_t* ditherState);
+
+//==============================================================================//
+//Requantizes a single mix scale value to 8 bits. The dither is the sum of two
+//9-bit uniform random numbers from a xorshift generator, which gives a triangular
+//distribution of +/-1 step around the value.
+
+inline uint8_t ditherToU8(int32_t value, uint32_t* ditherState) {
+  uint32_t x = *ditherState;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *ditherState = x;
+
+  int32_t dither = int32_t(x & 0x1FF) + int32_t((x >> 9) & 0x1FF);
+  int32_t result = (value + MIX_FULL_SCALE - 255 + dither) >> MIX_QUANTIZE_SHIFT;
+
+  if (result < 0) {
+    return 0;
+  }
+  if (result > 255) {
+    return 255;
+  }
+  return uint8_t(result);
+}
+
+//==============================================================================//
+//Scalar kernels
+
+inline void convertS16StereoScalar(const int16_t* input, uint32_t frameCount, uint8_t* output, uint32_t* ditherState) {
+  for (uint32_t i=0; i < frameCount; i++) {
+    output[i] = ditherToU8(int32_t(input[i * 2]) + int32_t(input[(i * 2) + 1]), ditherState);
+  }
+}
+
+//------------------------------------------------------------------------------//
+//Each sample on its own, for stereo output. A 16-bit sample is half the mix scale.
+
+inline void convertS16Scalar(const int16_t* input, uint32_t count, uint8_t* output, uint32_t* ditherState) {
+  for (uint32_t i=0; i < count; i++) {
+    output[i] = ditherToU8(int32_t(input[i]) * 2, ditherState);
+  }
+}
+
+//------------------------------------------------------------------------------//
+
+inline void quantizeScalar(const float* input, uint32_t count, uint8_t* output, uint32_t* ditherState) {
+  for (uint32_t i=0; i < count; i++) {
+    float sample = input[i];
+    sample = (sample > 1.0f) ? 1.0f : ((sample < -1.0f) ? -1.0f : sample);
+    output[i] = ditherToU8(int32_t(sample * float(MIX_FULL_SCALE)), ditherState);
+  }
+}
+
+#ifdef AUDIFI_X86
+
+//==============================================================================//
+//SSE2 kernels. Four dither generators run side by side, one per 32-bit lane.
+
+AUDIFI_TARGET_SSE2 inline __m128i ditherSse2(__m128i value, __m128i* state) {
+  __m128i x = *state;
+  x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+  x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+  x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+  *state = x;
+
+  const __m128i mask = _mm_set1_epi32(0x1FF);
+  __m128i dither = _mm_add_epi32(_mm_and_si128(x, mask), _mm_and_si128(_mm_srli_epi32(x, 9), mask));
+  value = _mm_add_epi32(value, _mm_set1_epi32(MIX_FULL_SCALE - 255));
+  return _mm_srai_epi32(_mm_add_epi32(value, dither), MIX_QUANTIZE_SHIFT);
+}
+
+//------------------------------------------------------------------------------//
+//16 frames per iteration. madd adds the L and R samples of each frame, and the two
+//saturating packs clamp the result to 0..255.
+
+AUDIFI_TARGET_SSE2 inline void convertS16StereoSse2(const int16_t* input, uint32_t frameCount, uint8_t* output, uint32_t* ditherState) {
+  __m128i state = _mm_loadu_si128((const __m128i*) ditherState);
+  const __m128i ones = _mm_set1_epi16(1);
+  uint32_t i = 0;
+
+  for (; (i + 16) <= frameCount; i += 16) {
+    const __m128i* source = (const __m128i*) (input + (i * 2));
+    __m128i mix0 = ditherSse2(_mm_madd_epi16(_mm_loadu_si128(source), ones), &state);
+    __m128i mix1 = ditherSse2(_mm_madd_epi16(_mm_loadu_si128(source + 1), ones), &state);
+    __m128i mix2 = ditherSse2(_mm_madd_epi16(_mm_loadu_si128(source + 2), ones), &state);
+    __m128i mix3 = ditherSse2(_mm_madd_epi16(_mm_loadu_si128(source + 3), ones), &state);
+    __m128i packed = _mm_packus_epi16(_mm_packs_epi32(mix0, mix1), _mm_packs_epi32(mix2, mix3));
+    _mm_storeu_si128((__m128i*) (output + i), packed);
+  }
+
+  _mm_storeu_si128((__m128i*) ditherState, state);
+  convertS16StereoScalar(input + (i * 2), frameCount - i, output + i, ditherState);
+}
+
+//------------------------------------------------------------------------------//
+//16 samples per iteration. Unpacking with zeros puts each sample in the high half
+//of a 32-bit lane, and the arithmetic shift brings it down to the mix scale.
+
+AUDIFI_TARGET_SSE2 inline void convertS16Sse2(const int16_t* input, uint32_t count, uint8_t* output, uint32_t* ditherState) {
+  __m128i state = _mm_loadu_si128((const __m128i*) ditherState);
+  const __m128i zero = _mm_setzero_si128();
+  uint32_t i = 0;
+
+  for (; (i + 16) <= count; i += 16) {
+    const __m128i* source = (const __m128i*) (input + i);
+    __m128i samples0 = _mm_loadu_si128(source);
+    __m128i samples1 = _mm_loadu_si128(source + 1);
+    __m128i mix0 = ditherSse2(_mm_srai_epi32(_mm_unpacklo_epi16(zero, samples0), 15), &state);
+    __m128i mix1 = ditherSse2(_mm_srai_epi32(_mm_unpackhi_epi16(zero, samples0), 15), &state);
+    __m128i mix2 = ditherSse2(_mm_srai_epi32(_mm_unpacklo_epi16(zero, samples1), 15), &state);
+    __m128i mix3 = ditherSse2(_mm_srai_epi32(_mm_unpackhi_epi16(zero, samples1), 15), &state);
+    __m128i packed = _mm_packus_epi16(_mm_packs_epi32(mix0, mix1), _mm_packs_epi32(mix2, mix3));
+    _mm_storeu_si128((__m128i*) (output + i), packed);
+  }
+
+  _mm_storeu_si128((__m128i*) ditherState, state);
+  convertS16Scalar(input + i, count - i, output + i, ditherState);
+}
+
+//------------------------------------------------------------------------------//
+
+AUDIFI_TARGET_SSE2 inline void quantizeSse2(const float* input, uint32_t count, uint8_t* output, uint32_t* ditherState) {
+  __m128i state = _mm_loadu_si128((const __m128i*) ditherState);
+  const __m128 scale = _mm_set1_ps(float(MIX_FULL_SCALE));
+  const __m128 upper = _mm_set1_ps(1.0f);
+  const __m128 lower = _mm_set1_ps(-1.0f);
+  __m128i mix[4];
+  uint32_t i = 0;
+
+  for (; (i + 16) <= count; i += 16) {
+    for (int j=0; j < 4; j++) {
+      __m128 sample = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(input + i + (j * 4)), lower), upper);
+      mix[j] = ditherSse2(_mm_cvttps_epi32(_mm_mul_ps(sample, scale)), &state);
+    }
+    __m128i packed = _mm_packus_epi16(_mm_packs_epi32(mix[0], mix[1]), _mm_packs_epi32(mix[2], mix[3]));
+    _mm_storeu_si128((__m128i*) (output + i), packed);
+  }
+
+  _mm_storeu_si128((__m128i*) ditherState, state);
+  quantizeScalar(input + i, count - i, output + i, ditherState);
+}
+
+//==============================================================================//
+//AVX2 kernels. Eight dither generators, 32 samples per iteration. The packs work
+//within 128-bit halves, so the 32-bit groups are put back in order at the end.
+
+AUDIFI_TARGET_AVX2 inline __m256i ditherAvx2(__m256i value, __m256i* state) {
+  __m256i x = *state;
+  x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+  x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+  x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+  *state = x;
+
+  const __m256i mask = _mm256_set1_epi32(0x1FF);
+  __m256i dither = _mm256_add_epi32(_mm256_and_si256(x, mask), _mm256_and_si256(_mm256_srli_epi32(x, 9), mask));
+  value = _mm256_add_epi32(value, _mm256_set1_epi32(MIX_FULL_SCALE - 255));
+  return _mm256_srai_epi32(_mm256_add_epi32(value, dither), MIX_QUANTIZE_SHIFT);
+}
+
+//------------------------------------------------------------------------------//
+
+AUDIFI_TARGET_AVX2 inline __m256i packAvx2(__m256i mix0, __m256i mix1, __m256i mix2, __m256i mix3) {
+  __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(mix0, mix1), _mm256_packs_epi32(mix2, mix3));
+  return _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
+
+//------------------------------------------------------------------------------//
+
+AUDIFI_TARGET_AVX2 inline void convertS16StereoAvx2(const int16_t* input, uint32_t frameCount, uint8_t* output, uint32_t* ditherState) {
+  __m256i state = _mm256_loadu_si256((const __m256i*) ditherState);
+  const __m256i ones = _mm256_set1_epi16(1);
+  uint32_t i = 0;
+
+  for (; (i + 32) <= frameCount; i += 32) {
+    const __m256i* source = (const __m256i*) (input + (i * 2));
+    __m256i mix0 = ditherAvx2(_mm256_madd_epi16(_mm256_loadu_si256(source), ones), &state);
+    __m256i mix1 = ditherAvx2(_mm256_madd_epi16(_mm256_loadu_si256(source + 1), ones), &state);
+    __m256i mix2 = ditherAvx2(_mm256_madd_epi16(_mm256_loadu_si256(source + 2), ones), &state);
+    __m256i mix3 = ditherAvx2(_mm256_madd_epi16(_mm256_loadu_si256(source + 3), ones), &state);
+    _mm256_storeu_si256((__m256i*) (output + i), packAvx2(mix0, mix1, mix2, mix3));
+  }
+
+  _mm256_storeu_si256((__m256i*) ditherState, state);
+  convertS16StereoScalar(input + (i * 2), frameCount - i, output + i, ditherState);
+}
+
+//------------------------------------------------------------------------------//
+
+AUDIFI_TARGET_AVX2 inline void convertS16Avx2(const int16_t* input, uint32_t count, uint8_t* output, uint32_t* ditherState) {
+  __m256i state = _mm256_loadu_si256((const __m256i*) ditherState);
+  __m256i mix[4];
+  uint32_t i = 0;
+
+  for (; (i + 32) <= count; i += 32) {
+    for (int j=0; j < 4; j++) {
+      __m256i samples = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*) (input + i + (j * 8))));
+      mix[j] = ditherAvx2(_mm256_slli_epi32(samples, 1), &state);
+    }
+    _mm256_storeu_si256((__m256i*) (output + i), packAvx2(mix[0], mix[1], mix[2], mix[3]));
+  }
+
+  _mm256_storeu_si256((__m256i*) ditherState, state);
+  convertS16Scalar(input + i, count - i, output + i, ditherState);
+}
+
+//------------------------------------------------------------------------------//
+
+AUDIFI_TARGET_AVX2 inline void quantizeAvx2(const float* input, uint32_t count, uint8_t* output, uint32_t* ditherState) {
+  __m256i state = _mm256_loadu_si256((const __m256i*) ditherState);
+  const __m256 scale = _mm256_set1_ps(float(MIX_FULL_SCALE));
+  const __m256 upper = _mm256_set1_ps(1.0f);
+  const __m256 lower = _mm256_set1_ps(-1.0f);
+  __m256i mix[4];
+  uint32_t i = 0;
+
+  for (; (i + 32) <= count; i += 32) {
+    for (int j=0; j < 4; j++) {
+      __m256 sample = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(input + i + (j * 8)), lower), upper);
+      mix[j] = ditherAvx2(_mm256_cvttps_epi32(_mm256_mul_ps(sample, scale)), &state);
+    }
+    _mm256_storeu_si256((__m256i*) (output + i), packAvx2(mix[0], mix[1], mix[2], mix[3]));
+  }
+
+  _mm256_storeu_si256((__m256i*) ditherState, state);
+  quantizeScalar(input + i, count - i, output + i, ditherState);
+}
+
+#endif
+
+//==============================================================================//
+//Converts the frames of a WAV file to mono or stereo unsigned 8-bit samples.
+//configure() has to be called with the format of the file first. For stereo, a
+//mono file is played on both channels, and a file with more than two channels
+//only has its first two, the front left and right, played.
+
+class SampleConverter {
+  public:
+    SampleConverter() : s16StereoKernel(convertS16StereoScalar), s16Kernel(convertS16Scalar), quantizeKernel(quantizeScalar), kernelLevel(KERNEL_SCALAR) {
+      memset(&format, 0, sizeof(format));
+
+      //the generators must never be zero. every lane starts differently.
+      for (int i=0; i < 8; i++) {
+        ditherState[i] = 0x9E3779B9u * uint32_t(i + 1);
+      }
+      setKernelLevel(detectKernelLevel());
+    }
+
+    //------------------------------------------------------------------------------//
+
+    bool configure(const WavFormat& newFormat) {
+      if (!isWavFormatSupported(newFormat)) {
+        return false;
+      }
+      format = newFormat;
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+    //Selects the kernels. The level is capped to what the CPU supports, so this
+    //can be used to compare the kernels.
+
+    void setKernelLevel(int level) {
+      int supported = detectKernelLevel();
+      kernelLevel = (level < supported) ? level : supported;
+      s16StereoKernel = convertS16StereoScalar;
+      s16Kernel = convertS16Scalar;
+      quantizeKernel = quantizeScalar;
+
+    #ifdef AUDIFI_X86
+      if (kernelLevel == KERNEL_SSE2) {
+        s16StereoKernel = convertS16StereoSse2;
+        s16Kernel = convertS16Sse2;
+        quantizeKernel = quantizeSse2;
+      }
+      else if (kernelLevel == KERNEL_AVX2) {
+        s16StereoKernel = convertS16StereoAvx2;
+        s16Kernel = convertS16Avx2;
+        quantizeKernel = quantizeAvx2;
+      }
+    #endif
+    }
+
+    //------------------------------------------------------------------------------//
+
+    const char* getKernelName() const {
+      return getKernelLevelName(kernelLevel);
+    }
+
+    //------------------------------------------------------------------------------//
+    //Converts frameCount frames from input to frameCount samples in output.
+
+    void convert(const uint8_t* input, uint32_t frameCount, uint8_t* output) {
+      if ((format.formatTag == WAV_FORMAT_PCM) && (format.bitsPerSample == 16) && (format.channelCount == 2)) {
+        s16StereoKernel((const int16_t*) input, frameCount, output, ditherState);
+        return;
+      }
+
+      //8-bit samples are already in the right format, they are only mixed down
+      if ((format.formatTag == WAV_FORMAT_PCM) && (format.bitsPerSample == 8)) {
+        for (uint32_t i=0; i < frameCount; i++) {
+          uint32_t sum = 0;
+
+          for (uint32_t j=0; j < format.channelCount; j++) {
+            sum += input[(i * format.channelCount) + j];
+          }
+          output[i] = uint8_t(sum / format.channelCount);
+        }
+        return;
+      }
+
+      while (frameCount > 0) {
+        uint32_t blockFrames = (frameCount < CONVERTER_BLOCK_FRAMES) ? frameCount : CONVERTER_BLOCK_FRAMES;
+        decode(input, blockFrames, floatBuffer);
+        quantizeKernel(floatBuffer, blockFrames, output, ditherState);
+        input += blockFrames * format.blockAlign;
+        output += blockFrames;
+        frameCount -= blockFrames;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Converts frameCount frames from input to frameCount left and right pairs, so
+    //2 * frameCount samples, in output.
+
+    void convertStereo(const uint8_t* input, uint32_t frameCount, uint8_t* output) {
+      if ((format.formatTag == WAV_FORMAT_PCM) && (format.bitsPerSample == 16) && (format.channelCount == 2)) {
+        s16Kernel((const int16_t*) input, frameCount * 2, output, ditherState);
+        return;
+      }
+
+      if ((format.formatTag == WAV_FORMAT_PCM) && (format.bitsPerSample == 8)) {
+        uint32_t right = (format.channelCount > 1) ? 1 : 0;
+
+        for (uint32_t i=0; i < frameCount; i++) {
+          output[i * 2] = input[i * format.channelCount];
+          output[(i * 2) + 1] = input[(i * format.channelCount) + right];
+        }
+        return;
+      }
+
+      while (frameCount > 0) {
+        uint32_t blockFrames = (frameCount < CONVERTER_BLOCK_FRAMES) ? frameCount : CONVERTER_BLOCK_FRAMES;
+        decodeStereo(input, blockFrames, floatBuffer, floatBuffer + 1);
+        quantizeKernel(floatBuffer, blockFrames * 2, output, ditherState);
+        input += blockFrames * format.blockAlign;
+        output += blockFrames * 2;
+        frameCount -= blockFrames;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Decodes frameCount frames to mono float samples in the range of +/-1.
+
+    void decode(const uint8_t* input, uint32_t frameCount, float* output) const {
+      uint32_t channelCount = format.channelCount;
+      float gain = 1.0f / float(channelCount);
+
+      for (uint32_t i=0; i < frameCount; i++) {
+        float sum = 0.0f;
+
+        for (uint32_t j=0; j < channelCount; j++) {
+          sum += decodeSample(input);
+          input += format.bitsPerSample / 8;
+        }
+        output[i] = sum * gain;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Decodes frameCount frames to left and right float samples. The samples of a
+    //channel are step floats apart, so they can go to a buffer of their own with a
+    //step of 1, or be put in turn in a single buffer with a step of 2.
+
+    void decodeStereo(const uint8_t* input, uint32_t frameCount, float* left, float* right, uint32_t step = 2) const {
+      uint32_t sampleSize = format.bitsPerSample / 8;
+      uint32_t rightOffset = (format.channelCount > 1) ? sampleSize : 0;
+
+      for (uint32_t i=0; i < frameCount; i++) {
+        left[i * step] = decodeSample(input);
+        right[i * step] = decodeSample(input + rightOffset);
+        input += format.blockAlign;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Quantizes float samples to unsigned 8 bits with dither.
+
+    void quantize(const float* input, uint32_t count, uint8_t* output) {
+      quantizeKernel(input, count, output, ditherState);
+    }
+
+    //------------------------------------------------------------------------------//
+    //Quantizes separate left and right float samples to frameCount pairs.
+
+    void quantizeStereo(const float* left, const float* right, uint32_t frameCount, uint8_t* output) {
+      while (frameCount > 0) {
+        uint32_t blockFrames = (frameCount < CONVERTER_BLOCK_FRAMES) ? frameCount : CONVERTER_BLOCK_FRAMES;
+
+        for (uint32_t i=0; i < blockFrames; i++) {
+          floatBuffer[i * 2] = left[i];
+          floatBuffer[(i * 2) + 1] = right[i];
+        }
+        quantizeKernel(floatBuffer, blockFrames * 2, output, ditherState);
+        left += blockFrames;
+        right += blockFrames;
+        output += blockFrames * 2;
+        frameCount -= blockFrames;
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+    //Converts float samples to signed 16 bits, for the ADPCM encoder. The error of
+    //the codec is far above that of rounding to 16 bits, so there's no dither.
+
+    void quantizeS16(const float* input, uint32_t count, int16_t* output) const {
+      for (uint32_t i=0; i < count; i++) {
+        float sample = input[i] * 32768.0f;
+        sample = (sample > 32767.0f) ? 32767.0f : ((sample < -32768.0f) ? -32768.0f : sample);
+        output[i] = int16_t(lrintf(sample));
+      }
+    }
+
+  private:
+    WavFormat format;
+    S16StereoKernel s16StereoKernel;
+    S16Kernel s16Kernel;
+    QuantizeKernel quantizeKernel;
+    int kernelLevel;
+    uint32_t ditherState[8];  //one generator per SIMD lane
+    float floatBuffer[CONVERTER_BLOCK_FRAMES * 2];  //room for stereo
+
+    //------------------------------------------------------------------------------//
+
+    float decodeSample(const uint8_t* sample) const {
+      if (format.formatTag == WAV_FORMAT_FLOAT) {
+        float value;
+        memcpy(&value, sample, sizeof(value));
+        return value;
+      }
+
+      switch (format.bitsPerSample) {
+        case 8:
+          return float(int32_t(sample[0]) - 128) * (1.0f / 128.0f);
+        case 16:
+          return float(int16_t(readLE16(sample))) * (1.0f / 32768.0f);
+        case 24:
+          return float(int32_t((uint32_t(sample[0]) << 8) | (uint32_t(sample[1]) << 16) | (uint32_t(sample[2]) << 24)) >> 8) * (1.0f / 8388608.0f);
+        default:
+          return float(int32_t(readLE32(sample))) * (1.0f / 2147483648.0f);
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,834 @@
+//==============================================================================//
+//
+//  AUDIFI Serial Transport
+//  Version : v0.1
+//
+//  Serial port access for the server application. The SerialTransport interface
+//  hides the platform specific calls, so that the server can run on Windows with
+//  COM ports and on Linux with termios devices (including pseudo terminals).
+//  listSerialPorts() finds the ports a transmitter could be connected to.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_SERIAL_TRANSPORT_H
+#define AUDIFI_SERIAL_TRANSPORT_H
+
+#ifdef _WIN32
+  #include <windows.h>
+#else
+  #include <dirent.h>
+  #include <fcntl.h>
+  #include <poll.h>
+  #include <termios.h>
+  #include <unistd.h>
+  #include <errno.h>
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define SERIAL_RX_BUFFER_SIZE 4096  //bytes read from the driver in one go
+
+//==============================================================================//
+//Returns a monotonic time in milliseconds. Only differences are meaningful.
+
+inline uint32_t millisNow() {
+  return uint32_t(std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+//==============================================================================//
+
+inline void sleepMillis(uint32_t duration) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(duration));
+}
+
+//==============================================================================//
+//A serial port. The backends only have to provide the raw operations. Line and
+//exact length reads are built on top of readSome() with a receive buffer, so a
+//single driver call can return many bytes and nothing is read one byte at a time.
+//
+//All timeouts are in milliseconds and are deadlines for the whole operation.
+//A timeout of zero only returns what has already arrived.
+
+class SerialTransport {
+  public:
+    SerialTransport() : rxStart(0), rxEnd(0) {}
+    virtual ~SerialTransport() {}
+
+    virtual bool open(const char* portName, uint32_t baudRate) = 0;
+    virtual void close() = 0;
+    virtual bool isOpen() const = 0;
+
+    //changes the baud rate of the open port, once the bytes being written are sent.
+    virtual bool setBaudRate(uint32_t baudRate) = 0;
+
+    //writes the bytes and waits until they are sent.
+    virtual bool write(const uint8_t* buffer, uint32_t length) = 0;
+
+    //starts writing the bytes in the background and returns. the buffer must
+    //stay untouched until the next writeAsync() or waitWrite() returns.
+    //only a single background write is in flight at any time.
+    virtual bool writeAsync(const uint8_t* buffer, uint32_t length) = 0;
+
+    //waits until the background write is complete.
+    virtual bool waitWrite() = 0;
+
+    //discards everything received so far.
+    void purgeInput() {
+      rxStart = 0;
+      rxEnd = 0;
+      purgeDriverInput();
+    }
+
+    //------------------------------------------------------------------------------//
+    //Reads exactly length bytes unless the timeout expires first.
+    //Returns the no. of bytes read, or -1 on error.
+
+    int read(uint8_t* buffer, uint32_t length, uint32_t timeout) {
+      uint32_t entryTime = millisNow();
+      uint32_t bytesRead = 0;
+
+      while (bytesRead < length) {
+        if (rxStart == rxEnd) { //nothing buffered, wait for the driver
+          uint32_t elapsed = millisNow() - entryTime;
+          uint32_t remaining = (elapsed < timeout) ? (timeout - elapsed) : 0;
+
+          if (fillRxBuffer(remaining) < 0) {
+            return -1;
+          }
+          if ((rxStart == rxEnd) && (remaining == 0)) {
+            break;  //timed out
+          }
+          continue;
+        }
+
+        uint32_t count = rxEnd - rxStart;
+
+        if (count > (length - bytesRead)) {
+          count = length - bytesRead;
+        }
+        memcpy(buffer + bytesRead, rxBuffer + rxStart, count);
+        rxStart += count;
+        bytesRead += count;
+      }
+      return int(bytesRead);
+    }
+
+    //------------------------------------------------------------------------------//
+    //Reads a line ending with an NL. The line is null terminated without the NL,
+    //and CR chars are dropped. A line longer than the buffer is truncated.
+    //Returns the length of the line including the NL, 0 if no complete line was
+    //received before the timeout, or -1 on error. Partially received lines are
+    //kept, so they can be completed by the next call.
+
+    int readLine(char* line, uint32_t maxLength, uint32_t timeout) {
+      uint32_t entryTime = millisNow();
+      uint32_t scanned = rxStart;
+
+      while (true) {
+        for (; scanned < rxEnd; scanned++) {
+          if (rxBuffer[scanned] == '\n') {  //found a complete line
+            uint32_t lineLength = 0;
+
+            for (uint32_t i = rxStart; i < scanned; i++) {
+              if ((rxBuffer[i] != '\r') && (lineLength < (maxLength - 1))) {
+                line[lineLength] = char(rxBuffer[i]);
+                lineLength++;
+              }
+            }
+            line[lineLength] = 0;
+            uint32_t consumed = scanned - rxStart + 1;
+            rxStart = scanned + 1;
+            return int(consumed);
+          }
+        }
+
+        //a line that doesn't fit the receive buffer can never complete
+        if ((rxStart == 0) && (rxEnd == SERIAL_RX_BUFFER_SIZE)) {
+          rxEnd = 0;
+          scanned = 0;
+        }
+
+        uint32_t elapsed = millisNow() - entryTime;
+        uint32_t remaining = (elapsed < timeout) ? (timeout - elapsed) : 0;
+        uint32_t offset = scanned - rxStart;
+        int bytesRead = fillRxBuffer(remaining);
+
+        if (bytesRead < 0) {
+          return -1;
+        }
+        scanned = rxStart + offset;  //the buffer may have been compacted
+
+        if ((bytesRead == 0) && (remaining == 0)) {
+          return 0;
+        }
+      }
+    }
+
+  protected:
+    //reads whatever is available, up to length bytes. waits for at most timeout
+    //milliseconds for the first byte. returns the no. of bytes read or -1 on error.
+    virtual int readSome(uint8_t* buffer, uint32_t length, uint32_t timeout) = 0;
+    virtual void purgeDriverInput() = 0;
+
+  private:
+    uint8_t rxBuffer[SERIAL_RX_BUFFER_SIZE];
+    uint32_t rxStart; //first unread byte
+    uint32_t rxEnd;   //end of the received bytes
+
+    //------------------------------------------------------------------------------//
+    //Moves the unread bytes to the start of the buffer and reads more after them.
+
+    int fillRxBuffer(uint32_t timeout) {
+      if (rxStart > 0) {
+        memmove(rxBuffer, rxBuffer + rxStart, rxEnd - rxStart);
+        rxEnd -= rxStart;
+        rxStart = 0;
+      }
+
+      if (rxEnd == SERIAL_RX_BUFFER_SIZE) {
+        return 0;
+      }
+
+      int bytesRead = readSome(rxBuffer + rxEnd, SERIAL_RX_BUFFER_SIZE - rxEnd, timeout);
+
+      if (bytesRead > 0) {
+        rxEnd += uint32_t(bytesRead);
+      }
+      return bytesRead;
+    }
+};
+
+//==============================================================================//
+
+#ifdef _WIN32
+
+//==============================================================================//
+//Win32 COM port backend. The port is opened for overlapped I/O. The read timeouts
+//make ReadFile() return immediately with whatever is in the driver queue, and
+//WaitCommEvent() is used to sleep until new bytes arrive.
+
+class Win32SerialTransport : public SerialTransport {
+  public:
+    Win32SerialTransport() : handle(INVALID_HANDLE_VALUE), writePending(false), writeLength(0) {
+      memset(&readOverlapped, 0, sizeof(readOverlapped));
+      memset(&writeOverlapped, 0, sizeof(writeOverlapped));
+      memset(&asyncOverlapped, 0, sizeof(asyncOverlapped));
+      memset(&eventOverlapped, 0, sizeof(eventOverlapped));
+    }
+
+    ~Win32SerialTransport() {
+      close();
+    }
+
+    //------------------------------------------------------------------------------//
+    //The port name can either be a COM port number or a full device name.
+
+    bool open(const char* portName, uint32_t baudRate) {
+      char portPath[64] = {0};
+
+      if ((portName[0] >= '0') && (portName[0] <= '9')) {
+        snprintf(portPath, sizeof(portPath), "\\\\.\\COM%s", portName);
+      }
+      else {
+        snprintf(portPath, sizeof(portPath), "%s", portName);
+      }
+
+      handle = CreateFileA (portPath,                 //port name
+                            GENERIC_READ | GENERIC_WRITE, //Read/Write
+                            0,                        // No Sharing
+                            NULL,                     // No Security
+                            OPEN_EXISTING,            // Open existing port only
+                            FILE_FLAG_OVERLAPPED,     // Overlapped I/O
+                            NULL);                    // Null for Comm Devices
+
+      if (handle == INVALID_HANDLE_VALUE) {
+        printf("Error opening serial port.\n");
+        return false;
+      }
+      printf("Opening serial port successful.\n");
+
+      //------------------------------------------------------------------------------//
+      //Serial port configuration
+
+      DCB dcbSerialParams = {0};
+      dcbSerialParams.DCBlength = sizeof(dcbSerialParams);
+
+      if (GetCommState(handle, &dcbSerialParams)) {  //try to read the serial port parameters
+        printf("Getting COM status successful.\n");
+      }
+      else {
+        printf("Getting COM status failed.\n");
+        close();
+        return false;
+      }
+
+      //add parameters
+      dcbSerialParams.BaudRate = baudRate;
+      dcbSerialParams.ByteSize = 8;
+      dcbSerialParams.StopBits = ONESTOPBIT;
+      dcbSerialParams.Parity = NOPARITY;
+
+      if (SetCommState(handle, &dcbSerialParams)) {  //set parameters
+        printf("Setting COM parameters successful.\n");
+      }
+      else {
+        printf("Setting COM parameters failed.\n");
+        close();
+        return false;
+      }
+
+      //------------------------------------------------------------------------------//
+      //Set serial port timeouts. reads return immediately with what's available.
+
+      COMMTIMEOUTS timeouts = {0};
+      timeouts.ReadIntervalTimeout = MAXDWORD;
+      timeouts.ReadTotalTimeoutMultiplier = 0;
+      timeouts.ReadTotalTimeoutConstant =  0;
+      timeouts.WriteTotalTimeoutConstant = 0;
+      timeouts.WriteTotalTimeoutMultiplier = 0;
+
+      if (!SetCommTimeouts(handle, &timeouts)) {
+        printf("Setting timeout parameters failed.\n");
+        close();
+        return false;
+      }
+      printf("Setting timeout parameters successful.\n");
+
+      if (!SetCommMask(handle, EV_RXCHAR | EV_ERR)) {
+        printf("Setting COM event mask failed.\n");
+        close();
+        return false;
+      }
+
+      //manual reset events to wait for the overlapped operations
+      readOverlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+      writeOverlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+      asyncOverlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+      eventOverlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+      if ((readOverlapped.hEvent == NULL) || (writeOverlapped.hEvent == NULL) ||
+          (asyncOverlapped.hEvent == NULL) || (eventOverlapped.hEvent == NULL)) {
+        printf("Creating serial events failed.\n");
+        close();
+        return false;
+      }
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void close() {
+      if (handle != INVALID_HANDLE_VALUE) {
+        CancelIo(handle);
+        CloseHandle(handle);
+        handle = INVALID_HANDLE_VALUE;
+      }
+      closeEvent(readOverlapped);
+      closeEvent(writeOverlapped);
+      closeEvent(asyncOverlapped);
+      closeEvent(eventOverlapped);
+      writePending = false;
+    }
+
+    bool isOpen() const {
+      return (handle != INVALID_HANDLE_VALUE);
+    }
+
+    //------------------------------------------------------------------------------//
+
+    bool setBaudRate(uint32_t baudRate) {
+      if (!waitWrite()) {
+        return false;
+      }
+
+      DCB dcbSerialParams = {0};
+      dcbSerialParams.DCBlength = sizeof(dcbSerialParams);
+
+      if (!GetCommState(handle, &dcbSerialParams)) {
+        return false;
+      }
+      dcbSerialParams.BaudRate = baudRate;
+      return (SetCommState(handle, &dcbSerialParams) != 0);
+    }
+
+    //------------------------------------------------------------------------------//
+
+    bool write(const uint8_t* buffer, uint32_t length) {
+      if (!waitWrite()) { //keep the order of the bytes
+        return false;
+      }
+
+      DWORD bytesSent = 0;
+      prepare(writeOverlapped);
+
+      if (!WriteFile(handle, buffer, length, &bytesSent, &writeOverlapped)) {
+        if (GetLastError() != ERROR_IO_PENDING) {
+          return false;
+        }
+        if (!GetOverlappedResult(handle, &writeOverlapped, &bytesSent, TRUE)) {
+          return false;
+        }
+      }
+      return (bytesSent == length);
+    }
+
+    //------------------------------------------------------------------------------//
+
+    bool writeAsync(const uint8_t* buffer, uint32_t length) {
+      if (!waitWrite()) {
+        return false;
+      }
+
+      DWORD bytesSent = 0;
+      prepare(asyncOverlapped);
+      writeLength = length;
+
+      if (WriteFile(handle, buffer, length, &bytesSent, &asyncOverlapped)) {
+        return (bytesSent == length); //completed right away
+      }
+
+      if (GetLastError() == ERROR_IO_PENDING) {
+        writePending = true;
+        return true;
+      }
+      return false;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    bool waitWrite() {
+      if (!writePending) {
+        return true;
+      }
+
+      writePending = false;
+      DWORD bytesSent = 0;
+
+      if (GetOverlappedResult(handle, &asyncOverlapped, &bytesSent, TRUE)) {
+        return (bytesSent == writeLength);
+      }
+      return false;
+    }
+
+  protected:
+    //------------------------------------------------------------------------------//
+
+    int readSome(uint8_t* buffer, uint32_t length, uint32_t timeout) {
+      uint32_t entryTime = millisNow();
+
+      while (true) {
+        DWORD errors = 0;
+        COMSTAT status = {0};
+
+        if (!ClearCommError(handle, &errors, &status)) {
+          return -1;
+        }
+
+        if (status.cbInQue > 0) { //read everything that's queued in one go
+          DWORD bytesRead = 0;
+          DWORD count = (status.cbInQue < length) ? status.cbInQue : length;
+          prepare(readOverlapped);
+
+          if (!ReadFile(handle, buffer, count, &bytesRead, &readOverlapped)) {
+            if (GetLastError() != ERROR_IO_PENDING) {
+              return -1;
+            }
+            if (!GetOverlappedResult(handle, &readOverlapped, &bytesRead, TRUE)) {
+              return -1;
+            }
+          }
+          return int(bytesRead);
+        }
+
+        uint32_t elapsed = millisNow() - entryTime;
+
+        if (elapsed >= timeout) {
+          return 0;
+        }
+
+        //sleep until the driver reports new bytes or the deadline passes
+        DWORD eventMask = 0;
+        DWORD unused = 0;
+        prepare(eventOverlapped);
+
+        if (!WaitCommEvent(handle, &eventMask, &eventOverlapped)) {
+          if (GetLastError() != ERROR_IO_PENDING) {
+            return -1;
+          }
+
+          if (WaitForSingleObject(eventOverlapped.hEvent, timeout - elapsed) != WAIT_OBJECT_0) {
+            SetCommMask(handle, EV_RXCHAR | EV_ERR);  //completes the pending wait
+            GetOverlappedResult(handle, &eventOverlapped, &unused, TRUE);
+          }
+        }
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void purgeDriverInput() {
+      PurgeComm(handle, PURGE_RXCLEAR);
+    }
+
+  private:
+    HANDLE handle;
+    OVERLAPPED readOverlapped;  //used by reads
+    OVERLAPPED writeOverlapped; //used by blocking writes
+    OVERLAPPED asyncOverlapped; //used by background writes
+    OVERLAPPED eventOverlapped; //used to wait for comm events
+    bool writePending;  //true while a background write is in flight
+    DWORD writeLength;  //length of the background write
+
+    static void prepare(OVERLAPPED& overlapped) {
+      ResetEvent(overlapped.hEvent);
+      overlapped.Offset = 0;
+      overlapped.OffsetHigh = 0;
+    }
+
+    static void closeEvent(OVERLAPPED& overlapped) {
+      if (overlapped.hEvent != NULL) {
+        CloseHandle(overlapped.hEvent);
+        overlapped.hEvent = NULL;
+      }
+    }
+};
+
+//==============================================================================//
+
+inline SerialTransport* createSerialTransport() {
+  return new Win32SerialTransport();
+}
+
+//==============================================================================//
+//Orders the COM port numbers by their value, so that 2 comes before 10. The
+//numbers have no leading zeros, so the shorter one is the smaller.
+
+inline bool isComPortBefore(const std::string& a, const std::string& b) {
+  if (a.size() != b.size()) {
+    return a.size() < b.size();
+  }
+  return a < b;
+}
+
+//==============================================================================//
+//Lists the COM ports known to the system, as port numbers, the lowest first.
+
+inline std::vector<std::string> listSerialPorts() {
+  std::vector<std::string> portNames;
+  std::vector<char> devices(65536);
+
+  if (QueryDosDeviceA(NULL, &devices[0], DWORD(devices.size())) == 0) {
+    return portNames;
+  }
+
+  //the names are null terminated, and an empty one ends the list
+  for (const char* name = &devices[0]; *name != 0; name += strlen(name) + 1) {
+    if ((strncmp(name, "COM", 3) == 0) && (name[3] >= '0') && (name[3] <= '9')) {
+      portNames.push_back(std::string(name + 3));
+    }
+  }
+  std::sort(portNames.begin(), portNames.end(), isComPortBefore);
+  return portNames;
+}
+
+#else
+
+//==============================================================================//
+//POSIX termios backend. The device is opened in non-blocking mode. poll() is used
+//to wait for incoming bytes and for room in the driver's output queue, so a
+//background write keeps making progress while we wait for input.
+
+class PosixSerialTransport : public SerialTransport {
+  public:
+    PosixSerialTransport() : fd(-1), pendingBuffer(NULL), pendingLength(0), pendingOffset(0) {}
+
+    ~PosixSerialTransport() {
+      close();
+    }
+
+    //------------------------------------------------------------------------------//
+    //The port name is the device path, eg. /dev/ttyUSB0.
+
+    bool open(const char* portName, uint32_t baudRate) {
+      fd = ::open(portName, O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+      if (fd < 0) {
+        printf("Error opening serial port.\n");
+        return false;
+      }
+      printf("Opening serial port successful.\n");
+
+      struct termios options;
+
+      if (tcgetattr(fd, &options) == 0) {
+        printf("Getting port attributes successful.\n");
+      }
+      else {
+        printf("Getting port attributes failed.\n");
+        close();
+        return false;
+      }
+
+      //raw 8N1, no flow control
+      cfmakeraw(&options);
+      options.c_cflag |= (CLOCAL | CREAD);
+      options.c_cflag &= ~(CSTOPB | PARENB);
+      options.c_cc[VMIN] = 0;
+      options.c_cc[VTIME] = 0;
+
+      speed_t speed = baudToSpeed(baudRate);
+
+      if ((speed == 0) || (cfsetispeed(&options, speed) != 0) || (cfsetospeed(&options, speed) != 0)) {
+        printf("Baud rate %u is not supported.\n", baudRate);
+        close();
+        return false;
+      }
+
+      if (tcsetattr(fd, TCSANOW, &options) == 0) {
+        printf("Setting port parameters successful.\n");
+      }
+      else {
+        printf("Setting port parameters failed.\n");
+        close();
+        return false;
+      }
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void close() {
+      if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+      }
+      pendingLength = 0;
+      pendingOffset = 0;
+    }
+
+    bool isOpen() const {
+      return (fd >= 0);
+    }
+
+    //------------------------------------------------------------------------------//
+
+    bool setBaudRate(uint32_t baudRate) {
+      if (!waitWrite()) {
+        return false;
+      }
+
+      struct termios options;
+      speed_t speed = baudToSpeed(baudRate);
+
+      if ((speed == 0) || (tcgetattr(fd, &options) != 0)) {
+        return false;
+      }
+      if ((cfsetispeed(&options, speed) != 0) || (cfsetospeed(&options, speed) != 0)) {
+        return false;
+      }
+      return (tcsetattr(fd, TCSADRAIN, &options) == 0);
+    }
+
+    //------------------------------------------------------------------------------//
+
+    bool write(const uint8_t* buffer, uint32_t length) {
+      if (!writeAsync(buffer, length)) {
+        return false;
+      }
+      return waitWrite();
+    }
+
+    //------------------------------------------------------------------------------//
+    //Writes as much as the driver takes right now. The rest is written while we
+    //wait in readSome() or waitWrite().
+
+    bool writeAsync(const uint8_t* buffer, uint32_t length) {
+      if (!waitWrite()) {
+        return false;
+      }
+
+      pendingBuffer = buffer;
+      pendingLength = length;
+      pendingOffset = 0;
+      return continueWrite();
+    }
+
+    //------------------------------------------------------------------------------//
+
+    bool waitWrite() {
+      while (pendingOffset < pendingLength) {
+        struct pollfd pfd = {fd, POLLOUT, 0};
+
+        if ((poll(&pfd, 1, 1000) < 0) && (errno != EINTR)) {
+          return false;
+        }
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+          return false;
+        }
+        if (!continueWrite()) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+  protected:
+    //------------------------------------------------------------------------------//
+
+    int readSome(uint8_t* buffer, uint32_t length, uint32_t timeout) {
+      uint32_t entryTime = millisNow();
+
+      while (true) {
+        ssize_t bytesRead = ::read(fd, buffer, length);
+
+        if (bytesRead > 0) {
+          return int(bytesRead);
+        }
+        if ((bytesRead < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+          return -1;
+        }
+
+        uint32_t elapsed = millisNow() - entryTime;
+
+        if (elapsed >= timeout) {
+          return 0;
+        }
+
+        //also wake up when the background write can continue
+        struct pollfd pfd = {fd, POLLIN, 0};
+
+        if (pendingOffset < pendingLength) {
+          pfd.events |= POLLOUT;
+        }
+
+        int result = poll(&pfd, 1, int(timeout - elapsed));
+
+        if ((result < 0) && (errno != EINTR)) {
+          return -1;
+        }
+        if ((result > 0) && (pfd.revents & (POLLERR | POLLNVAL))) {
+          return -1;
+        }
+        if ((result > 0) && (pfd.revents & POLLOUT)) {
+          if (!continueWrite()) {
+            return -1;
+          }
+        }
+        if ((result > 0) && (pfd.revents & POLLHUP) && !(pfd.revents & POLLIN)) {
+          return -1;  //the other end is gone
+        }
+      }
+    }
+
+    //------------------------------------------------------------------------------//
+
+    void purgeDriverInput() {
+      tcflush(fd, TCIFLUSH);
+    }
+
+  private:
+    int fd;
+    const uint8_t* pendingBuffer; //the background write
+    uint32_t pendingLength;
+    uint32_t pendingOffset; //no. of bytes of the background write sent so far
+
+    //------------------------------------------------------------------------------//
+    //Writes until the driver would block. Returns false on errors.
+
+    bool continueWrite() {
+      while (pendingOffset < pendingLength) {
+        ssize_t bytesSent = ::write(fd, pendingBuffer + pendingOffset, pendingLength - pendingOffset);
+
+        if (bytesSent > 0) {
+          pendingOffset += uint32_t(bytesSent);
+        }
+        else if ((bytesSent < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+          return true;  //the driver is full, try again later
+        }
+        else if ((bytesSent < 0) && (errno == EINTR)) {
+          continue;
+        }
+        else {
+          pendingLength = 0;
+          pendingOffset = 0;
+          return false;
+        }
+      }
+      return true;
+    }
+
+    //------------------------------------------------------------------------------//
+
+    static speed_t baudToSpeed(uint32_t baudRate) {
+      switch (baudRate) {
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+      #ifdef B460800
+        case 460800: return B460800;
+      #endif
+      #ifdef B500000
+        case 500000: return B500000;
+      #endif
+      #ifdef B921600
+        case 921600: return B921600;
+      #endif
+      #ifdef B1000000
+        case 1000000: return B1000000;
+      #endif
+      #ifdef B2000000
+        case 2000000: return B2000000;
+      #endif
+        default: return 0;
+      }
+    }
+};
+
+//==============================================================================//
+
+inline SerialTransport* createSerialTransport() {
+  return new PosixSerialTransport();
+}
+
+//==============================================================================//
+//Lists the USB serial devices, /dev/ttyUSB* and /dev/ttyACM* on Linux and
+///dev/cu.usbserial* and /dev/cu.usbmodem* on macOS.
+
+inline std::vector<std::string> listSerialPorts() {
+  const char* prefixes[] = {"ttyUSB", "ttyACM", "cu.usbserial", "cu.usbmodem"};
+  std::vector<std::string> portNames;
+  DIR* directory = opendir("/dev");
+
+  if (directory == NULL) {
+    return portNames;
+  }
+
+  struct dirent* entry = NULL;
+
+  while ((entry = readdir(directory)) != NULL) {
+    for (size_t i=0; i < (sizeof(prefixes) / sizeof(prefixes[0])); i++) {
+      if (strncmp(entry->d_name, prefixes[i], strlen(prefixes[i])) == 0) {
+        portNames.push_back(std::string("/dev/") + entry->d_name);
+        break;
+      }
+    }
+  }
+  closedir(directory);
+  std::sort(portNames.begin(), portNames.end());
+  return portNames;
+}
+
+#endif
+
+#endif
@@ -21,8 +21,18 @@
 //==============================================================================//
 
 //includes
-#include <windows.h>
+#include "AUDIFI-Protocol.h"
+#include "AUDIFI-Serial-Transport.h"
+#include "AUDIFI-Frame-Check.h"
+#include "AUDIFI-Control.h"
+#include "AUDIFI-Control-Input.h"
+#include "AUDIFI-Link-Negotiation.h"
+#include "AUDIFI-Loopback-Device.h"
+#include "AUDIFI-Pipeline.h"
+#include "AUDIFI-Live-Input.h"
+#include "AUDIFI-Metrics.h"
 #include <stdio.h>
+#include <signal.h>
 #include <string>
 #include <iostream>
 
@@ -33,101 +43,418 @@
 //a single request. every request will include 4 bytes of header
 //information at the start of the sequence. first two bytes indicates
 //the number of audio samples cotained in the request, so that the
-//receiver can stop at the end of a song. the next two bytes in the header
-//are reserved for future use.
-#define REQUEST_SIZE 11029  //number of bytes per request
-#define REQUEST_HEADER_SIZE 4 //bytes containing header information
-#define REQUEST_DATA_SIZE REQUEST_SIZE-REQUEST_HEADER_SIZE //size of actual data in a request
+//receiver can stop at the end of a song. the third byte tells how the
+//samples are coded (FRAME_CODEC_*), and the last one holds flags (FRAME_FLAG_*).
+//the sizes, REQUEST_SIZE, REQUEST_HEADER_SIZE and REQUEST_DATA_SIZE, are in
+//AUDIFI-Protocol.h, and are the same in the transmitter and the receiver.
+
+//a request can either be the legacy "RD?" which asks for a single frame and
+//waits for an "ACK!", or a credit grant "RD#n" from a windowed receiver. a grant
+//adds n frames to the credit and the frames are then streamed back to back
+//without any further handshake, until the credit runs out.
+//frames sent over serial carry the whole header, and the transmitter passes
+//them on as they are. the frames are read, converted and coded ahead of time by
+//the reader and DSP threads of the frame pipeline, and this thread only writes
+//them, each with a single call. a frame stays in its pipeline slot until its
+//write is done.
+//on a link with checked frames, a frame is wrapped with its sync word and CRC in
+//the frame history instead, and written from there. "RS#n" asks for frame n
+//again, which is written right away and uses no credit.
+//on a link with control messages, the commands typed in with --control are sent
+//in between the frames, and "CA#n" answers message n. the transmitter can send
+//a command typed in at its end with "CT#<type>#<value>". a skip or a seek starts
+//the pipeline over at the new place, and the frames already prepared are dropped.
+#define FRAME_HEADER_SIZE REQUEST_HEADER_SIZE //header bytes at the start of a serial frame
+#define FRAME_WAIT_TIMEOUT 100  //ms to wait for the pipeline before checking the metrics
+
+static_assert(REQUEST_DATA_SIZE <= PIPELINE_FRAME_SAMPLES, "the pipeline's frame slots are too small for a request");
+
+#define REQUEST_LINE_MAX_LENGTH 24        //max length of a request line including NL
+#define CREDIT_MAX_FRAMES 64              //upper limit of accumulated credit
+#define RESEND_LINGER_TIME 2000           //time RS# is still answered after the last frame, ms
+#define LOOPBACK_ERROR_INTERVAL 0         //frames between the loopback device's errors, 0 for none
+#define CONTROL_POLL_INTERVAL 20          //ms a wait for a request is split into, to see the commands typed in
 
 #define TX_DATA_BUFFER_MAX_LENGTH 1024    //max size of serial transmit buffer
-#define RX_DATA_BUFFER_MAX_LENGTH 1024    //max size of serial receive buffer
 #define SERIAL_READ_TIMEOUT 2000          //time to wait for serial data
-#define MAX_FILE_COUNT  10                //max number of audio files in a playlist
-#define MAX_LINE_COUNT  MAX_FILE_COUNT    //max lines to scan on a playlist 
-#define MAX_FILE_PATH_LENGTH  256         //max lnegth of path to an audio file
-// #define SERIAL_BAUDRATE 2000000
-#define SERIAL_BAUDRATE 500000            //speed at which data is sent to transmitter
+#define MAX_FILE_PATH_LENGTH  256         //max length of the serial device path
+
+//the port is opened at the base rate. once the transmitter answers READY? with its
+//capabilities, the fastest rate both sides can hold is switched to, see
+//AUDIFI-Protocol.h. --baud limits the rates tried.
+#define SERIAL_BAUDRATE PROTOCOL_BASE_BAUDRATE  //speed the link starts at
+#define SERIAL_MAX_BAUDRATE 2000000       //fastest rate tried by default
+#define DEVICE_READY_TIMEOUT 1000         //time to wait for the YES! at each rate
+
+//without --port, every serial port that could be the transmitter is probed at
+//once, and the one that answers is used. the same is done to find it again if
+//the link is lost, and the playlist is resumed at the track that was playing.
+#define DISCOVERY_TIMEOUT 1000            //time all the ports are probed for in one go
+#define DISCOVERY_RETRY_INTERVAL 500      //time between attempts when nothing answered
+
+//the receiver plays the samples with a timer at 80 MHz / 7256, which is about
+//11025 Hz. files with other rates are resampled to this, unless --rate says otherwise.
+#define OUTPUT_SAMPLE_RATE 11025          //default rate of the samples sent
+
+//with --live, a live source is streamed from stdin or a named pipe instead of the
+//playlist, see AUDIFI-Live-Input.h. a frame is sent as soon as LIVE_FRAME_SAMPLES
+//samples have arrived, and at most LIVE_BACKLOG ms of samples wait for the
+//receiver. raw PCM is taken to be in the --live-format, which defaults to what
+//ffmpeg sends with -f s16le -ac 2 -ar 44100.
+#define LIVE_FRAME_SAMPLES 128            //samples in a live frame, about 12 ms at 11025 Hz
+#define LIVE_BACKLOG 200                  //ms of samples kept while the receiver is behind
+#define LIVE_RAW_SAMPLE_RATE 44100        //default format of raw PCM input
+#define LIVE_RAW_BITS 16
+#define LIVE_RAW_CHANNELS 2
+
+//the metrics are printed as machine readable lines every --metrics seconds, at
+//the end of each track, and whenever the process gets SIGUSR1 (Ctrl+Break on
+//Windows).
+#ifdef _WIN32
+#define METRICS_SIGNAL SIGBREAK
+#else
+#define METRICS_SIGNAL SIGUSR1
+#endif
 
 //==============================================================================//
 //Globals
 
-DWORD serialBytesSent = 0;  //number of bytes sent via serial
-DWORD serialBytesRead = 0;  //number of bytes read from serial
-
-HANDLE hSerial;
-DCB dcbSerialParams = {0};
-COMMTIMEOUTS timeouts = {0};
-COMSTAT hSerialStatus = {0};
-LPDWORD hSerialError = 0;
+SerialTransport* serialPort = NULL;  //the serial port connected to the transmitter
 
 std::string inputString = "";
 
-bool delimFound = false;  //true when the delimiter character is found
-int rxDataBufferIndex = 0;  //index var for receive buffer
 int txDataBufferIndex = 0;  //index var for transmit buffer
 char txDataBuffer[TX_DATA_BUFFER_MAX_LENGTH] = {0}; //transmit buffer
-char rxDataBuffer[RX_DATA_BUFFER_MAX_LENGTH] = {0}; //receive buffer
 uint16_t txDataLength = 0;  //length of data in tx buffer
 uint16_t rxDataLength = 0;  //length of data in rx buffer
-uint16_t sampleCounter = 0; //audio sample byte counter
-
-FILE *playlistFptr; //the playlist file containing the list of audio files
-FILE *audioFptr;
-
-char filePathList[MAX_LINE_COUNT][MAX_FILE_PATH_LENGTH] = {0};
-int fileCount = 0;
 
-int comPortNumber = -1;
+Playlist playlist; //the paths of the audio files to stream
+TrackCache trackCache;  //formats of the audio files parsed before
+FramePipeline pipeline; //prepares the frames in its own threads
+FrameHistory frameHistory;  //the checked frames last sent, for RS#
+LiveInput liveInput;  //captures the live source in its own thread
+PipelineFrame liveFrames[2];  //the live frame being written and the one being built
+ControlInput controlInput;  //reads the commands typed in, in its own thread
+ControlQueue serialControls;  //control messages sent to the transmitter, until their CA#
+
+char comPortName[MAX_FILE_PATH_LENGTH] = {0};  //COM port number or device path
+
+bool loopbackRequested = false; //run against the built-in loopback device
+bool loopbackLegacy = false;  //the loopback device uses the RD?/ACK! handshake
+uint32_t loopbackErrorInterval = LOOPBACK_ERROR_INTERVAL; //the loopback device damages every nth frame
+bool readAheadRequested = false;  //read audio files in chunks instead of mapping them
+bool liveRequested = false; //stream the live input instead of the playlist
+char livePath[MAX_FILE_PATH_LENGTH] = {0};  //named pipe or file of the live input, - for stdin
+WavFormat liveRawFormat = {WAV_FORMAT_PCM, LIVE_RAW_CHANNELS, LIVE_RAW_SAMPLE_RATE, LIVE_RAW_BITS,
+  LIVE_RAW_CHANNELS * (LIVE_RAW_BITS / 8), 0, 0}; //format of raw PCM input
+uint32_t liveFrameSamples = LIVE_FRAME_SAMPLES; //samples a live frame is sent with
+uint32_t liveBacklog = LIVE_BACKLOG;  //ms of live samples kept at most
+char controlPath[MAX_FILE_PATH_LENGTH] = {0};  //named pipe or file the commands are read from, - for stdin
+uint32_t outputSampleRate = OUTPUT_SAMPLE_RATE; //rate of the samples sent to the receiver
+int resamplerQuality = RESAMPLER_QUALITY_MEDIUM;  //resampler preset
+uint8_t frameCodec = FRAME_CODEC_PCM_U8; //how the samples in a frame are coded
+bool stereoRequested = false; //send the tracks in stereo, if the link takes it
+uint8_t frameChannelCount = 1;  //channels of the frames sent, 2 once the link takes stereo
+uint32_t maxBaudRate = SERIAL_MAX_BAUDRATE; //fastest rate to negotiate
+LinkSettings linkSettings = {SERIAL_BAUDRATE, REQUEST_SIZE, FRAME_CODEC_PCM_U8, 0}; //what the transmitter agreed to
 
 bool serialEstablished = false;
 bool serialDisconnected = false;
-bool serialReadTimedout = false;
 bool serverReady = false;
-bool dataRequestReceived = false;
-bool dataOutgoing = false;
+uint32_t resumeTrack = 0; //playlist position to start at after the link was lost
+bool restartRequested = false;  //a skip or a seek, the pipeline starts over before the next frame
+uint32_t restartTrack = 0;  //playlist position it starts over at
+uint32_t restartOffset = 0; //ms into the track
+int discoveryPortCount = -1;  //no. of ports the last discovery found, so a retry only prints changes
+bool creditModeActive = false;  //true when the receiver grants credit with RD#n
+
+uint16_t requestCredit = 0; //no. of frames we are allowed to send without waiting
+char requestLineBuffer[REQUEST_LINE_MAX_LENGTH] = {0};  //holds a single request line
+
+//link health, see printMetrics()
+MetricCounter framesSent;
+MetricCounter bytesSent;  //frame bytes queued on the serial port
+MetricCounter legacyRequests; //RD? requests
+MetricCounter creditGranted;  //frames granted with RD#n
+MetricCounter creditClipped;  //frames granted past CREDIT_MAX_FRAMES
+MetricCounter requestsIncomplete; //lines that were not a valid request
+MetricCounter requestTimeouts;  //no request within SERIAL_READ_TIMEOUT
+MetricCounter writeErrors;
+MetricCounter framesResent; //checked frames sent again for RS#
+MetricCounter resendsMissed;  //RS# for frames no longer kept
+MetricHistogram creditWaitTime; //time spent waiting for a request before a frame, ms
+MetricHistogram writeWaitTime;  //time a frame write waited for the one before it, ms
+MetricHistogram frameWaitTime; //time a frame was waited for after the credit was there, ms
+MetricCounter framesNotReady; //frames that were not ready when they could be sent
+MetricHistogram liveLatency;  //time from reading the first sample of a live frame to sending it, ms
+MetricCounter controlsSent; //control messages, not counting the resends
+MetricCounter controlsResent;
+
+uint32_t metricsInterval = 0; //ms between reports, 0 for none
+uint32_t metricsStartTime = 0;
+uint32_t metricsLastTime = 0; //time of the last report
+uint32_t metricsLastBytes = 0;  //bytesSent at the last report
+volatile sig_atomic_t metricsRequested = 0; //set by METRICS_SIGNAL
 
 char playlistFileName[] = "Playlist-001.txt";
-
-int lineBreaks[MAX_LINE_COUNT] = {0};
-int byteBuffer = -1;
-int seekPosition = 0;
-int lineCount = 0;
-int lineLength = 0;
-int lineLengthList[MAX_LINE_COUNT] = {0};
+char trackCacheFileName[] = "AUDIFI-Track-Cache.txt";
 
 //==============================================================================//
 //Function declarations
 
 void loop();
+bool parseArguments(int argc, char** argv);
 bool openComPort();
-bool promptComPort();
-int readSerial(uint32_t length, bool waitForDelim=false);
+void connectDevice();
+bool discoverDevice();
+bool setupLink(uint32_t startBaudRate, const LinkCapabilities& device);
 bool writeSerial(uint32_t length, bool appendDelim=true);
 bool writeSerial(uint8_t* buffer, uint32_t length);
-int streamAudio();
+bool streamAudio();
+bool openLiveInput();
+bool streamLive();
+bool waitCredit();
+bool sendFrame(const PipelineFrame* frame);
 int readPlaylist();
 bool checkDevice();
+LinkCapabilities getLocalCapabilities();
+bool readRequestLine(uint32_t timeout);
+bool handleRequestLine();
+void answerResends();
+void serviceControls();
+void handleControl(const ControlMessage& message);
+void writeControls(bool afterAck);
+void handleMetricsSignal(int signalNumber);
+void checkMetrics(bool force);
+void printMetrics();
 
 //==============================================================================//
 
-int main() {
+int main(int argc, char** argv) {
   printf("\nAUDIFI - Audio over Wi-Fi\n");
   printf("-------------------------\n");
-  printf("\nPlease connect the AUDIFI server device.\n");
 
-  while(!serialEstablished) {
-    if (!promptComPort()) {
-      printf("\nDevice discovery failed.\n");
-      printf("Try reconnecting the device and enter the correct COM port.\n");
+  if (!parseArguments(argc, argv)) {
+    return 1;
+  }
+
+  metricsStartTime = millisNow();
+  metricsLastTime = metricsStartTime;
+  signal(METRICS_SIGNAL, handleMetricsSignal);
+
+#ifndef _WIN32
+  //the loopback device stands in for the transmitter on a pseudo terminal
+  LoopbackDevice loopbackDevice(FRAME_HEADER_SIZE, REQUEST_DATA_SIZE, SERIAL_BAUDRATE, loopbackLegacy);
+  loopbackDevice.setErrorInterval(loopbackErrorInterval);
+
+  if (loopbackRequested) {
+    if (!loopbackDevice.start()) {
+      printf("\nStarting the loopback device failed.\n");
+      return 1;
+    }
+    snprintf(comPortName, sizeof(comPortName), "%s", loopbackDevice.getPortName());
+    printf("\nLoopback device is at %s\n", comPortName);
+  }
+#else
+  if (loopbackRequested) {
+    printf("\nThe loopback device is only available on POSIX systems.\n");
+    return 1;
+  }
+#endif
+
+  if (controlPath[0] != 0) {
+    if (!controlInput.open(controlPath)) {
+      printf("\nCould not open the control input at %s\n", controlPath);
+      return 1;
+    }
+    printf("\nCommands are read from %s: pause, resume, next, prev, skip <tracks>, seek <m:ss>, gain <percent>\n",
+      (strcmp(controlPath, "-") == 0) ? "stdin" : controlPath);
+  }
+
+  if (liveRequested) {
+    if (!openLiveInput()) {
+      return 1;
     }
   }
+  else {
+    readPlaylist();
+  }
+
+  //start over whenever the link is lost, until the whole playlist or input is sent
+  do {
+    connectDevice();
+  } while (!(liveRequested ? streamLive() : streamAudio()));
 
-  checkDevice();
-  readPlaylist();
-  streamAudio();
+  serialPort->waitWrite();
+  delete serialPort;
   return 0;
 }
 
+//==============================================================================//
+//Reads the command line options.
+//  --port <port>     COM port number or device path of the transmitter, instead
+//                    of probing all the serial ports for it
+//  --loopback        stream to the built-in loopback device (POSIX only)
+//  --loopback-legacy same, but the device uses the RD?/ACK! handshake
+//  --loopback-errors <n>  the loopback device damages every nth frame it gets
+//  --read-ahead      read audio files in chunks instead of mapping them
+//  --rate <Hz>       sample rate to send, the receiver's playback rate
+//  --quality <q>     resampler quality, low, medium or high
+//  --codec <c>       how the samples are sent, pcm or adpcm, if the transmitter takes it
+//  --stereo          send the tracks in stereo, if the transmitter takes it. PCM
+//                    only, ADPCM frames and the live input stay mono
+//  --baud <rate>     fastest baud rate to negotiate with the transmitter
+//  --metrics <s>     print the metrics every s seconds
+//  --live <path>     stream a live source from a named pipe, or from stdin with -
+//  --live-format <rate>,<bits>,<channels>
+//                    format of the live input if it has no WAV header
+//  --live-frame <n>  samples a live frame is sent with, at most a full frame
+//  --live-backlog <ms>  live samples kept at most while the receiver is behind
+//  --control <path>  read commands, eg. pause or seek 1:30, from a named pipe, or
+//                    from stdin with -, see AUDIFI-Control.h
+
+bool parseArguments(int argc, char** argv) {
+  for (int i=1; i < argc; i++) {
+    if ((strcmp(argv[i], "--port") == 0) && ((i + 1) < argc)) {
+      i++;
+      snprintf(comPortName, sizeof(comPortName), "%s", argv[i]);
+    }
+    else if (strcmp(argv[i], "--loopback") == 0) {
+      loopbackRequested = true;
+    }
+    else if (strcmp(argv[i], "--loopback-legacy") == 0) {
+      loopbackRequested = true;
+      loopbackLegacy = true;
+    }
+    else if ((strcmp(argv[i], "--loopback-errors") == 0) && ((i + 1) < argc)) {
+      i++;
+      int interval = atoi(argv[i]);
+
+      if (interval <= 0) {
+        printf("\nInvalid loopback error interval: %s\n", argv[i]);
+        return false;
+      }
+      loopbackErrorInterval = uint32_t(interval);
+    }
+    else if (strcmp(argv[i], "--read-ahead") == 0) {
+      readAheadRequested = true;
+    }
+    else if ((strcmp(argv[i], "--rate") == 0) && ((i + 1) < argc)) {
+      i++;
+      outputSampleRate = uint32_t(atoi(argv[i]));
+
+      if ((outputSampleRate < 1000) || (outputSampleRate > 192000)) {
+        printf("\nInvalid sample rate: %s\n", argv[i]);
+        return false;
+      }
+    }
+    else if ((strcmp(argv[i], "--quality") == 0) && ((i + 1) < argc)) {
+      i++;
+      resamplerQuality = Resampler::parseQualityName(argv[i]);
+
+      if (resamplerQuality < 0) {
+        printf("\nUnknown resampler quality: %s\n", argv[i]);
+        return false;
+      }
+    }
+    else if ((strcmp(argv[i], "--codec") == 0) && ((i + 1) < argc)) {
+      i++;
+
+      if (strcmp(argv[i], "pcm") == 0) {
+        frameCodec = FRAME_CODEC_PCM_U8;
+      }
+      else if (strcmp(argv[i], "adpcm") == 0) {
+        frameCodec = FRAME_CODEC_IMA_ADPCM;
+      }
+      else {
+        printf("\nUnknown codec: %s\n", argv[i]);
+        return false;
+      }
+    }
+    else if (strcmp(argv[i], "--stereo") == 0) {
+      stereoRequested = true;
+    }
+    else if ((strcmp(argv[i], "--baud") == 0) && ((i + 1) < argc)) {
+      i++;
+      maxBaudRate = uint32_t(atoi(argv[i]));
+
+      if (getBaudRateBit(maxBaudRate) == 0) {
+        printf("\nUnsupported baud rate: %s\n", argv[i]);
+        return false;
+      }
+    }
+    else if ((strcmp(argv[i], "--metrics") == 0) && ((i + 1) < argc)) {
+      i++;
+      int interval = atoi(argv[i]);
+
+      if (interval <= 0) {
+        printf("\nInvalid metrics interval: %s\n", argv[i]);
+        return false;
+      }
+      metricsInterval = uint32_t(interval) * 1000;
+    }
+    else if ((strcmp(argv[i], "--live") == 0) && ((i + 1) < argc)) {
+      i++;
+      liveRequested = true;
+      snprintf(livePath, sizeof(livePath), "%s", argv[i]);
+    }
+    else if ((strcmp(argv[i], "--live-format") == 0) && ((i + 1) < argc)) {
+      i++;
+      unsigned rate = 0, bits = 0, channels = 0;
+      int fieldCount = sscanf(argv[i], "%u,%u,%u", &rate, &bits, &channels);
+
+      liveRawFormat.sampleRate = rate;
+      liveRawFormat.bitsPerSample = uint16_t(bits);
+      liveRawFormat.channelCount = uint16_t(channels);
+      liveRawFormat.blockAlign = uint16_t(channels * (bits / 8));
+
+      if ((fieldCount != 3) || (!isWavFormatSupported(liveRawFormat))) {
+        printf("\nUnsupported live input format: %s\n", argv[i]);
+        return false;
+      }
+    }
+    else if ((strcmp(argv[i], "--live-frame") == 0) && ((i + 1) < argc)) {
+      i++;
+      int samples = atoi(argv[i]);
+
+      if ((samples <= 0) || (samples > PIPELINE_FRAME_SAMPLES)) {
+        printf("\nInvalid live frame size: %s\n", argv[i]);
+        return false;
+      }
+      liveFrameSamples = uint32_t(samples);
+    }
+    else if ((strcmp(argv[i], "--live-backlog") == 0) && ((i + 1) < argc)) {
+      i++;
+      int backlog = atoi(argv[i]);
+
+      if (backlog <= 0) {
+        printf("\nInvalid live backlog: %s\n", argv[i]);
+        return false;
+      }
+      liveBacklog = uint32_t(backlog);
+    }
+    else if ((strcmp(argv[i], "--control") == 0) && ((i + 1) < argc)) {
+      i++;
+      snprintf(controlPath, sizeof(controlPath), "%s", argv[i]);
+    }
+    else {
+      printf("\nUnknown option: %s\n", argv[i]);
+      printf("Usage: %s [--port <port>] [--loopback | --loopback-legacy] [--loopback-errors <n>] [--read-ahead]\n", argv[0]);
+      printf("       [--rate <Hz>] [--quality <low | medium | high>] [--codec <pcm | adpcm>] [--stereo]\n");
+      printf("       [--baud <rate>] [--metrics <seconds>]\n");
+      printf("       [--live <path | -> [--live-format <rate>,<bits>,<channels>] [--live-frame <samples>]\n");
+      printf("       [--live-backlog <ms>]] [--control <path | ->]\n");
+      return false;
+    }
+  }
+
+  if (liveRequested && (strcmp(livePath, "-") == 0) && (strcmp(controlPath, "-") == 0)) {
+    printf("\nThe live input and the commands can't both come from stdin.\n");
+    return false;
+  }
+  return true;
+}
+
 //==============================================================================//
 
 void loop() {
@@ -136,369 +463,834 @@ void loop() {
 }
 
 //==============================================================================//
+//Streams the playlist from resumeTrack on. Returns false if the link was lost
+//before the end, and resumeTrack is then the track that was playing.
 
-int streamAudio() {
-  if (serialEstablished) {
-    for (int i=0; i < lineCount; i++) {
-      //open a file from the path found in the playlist file.
-      //once a file is fully streamed, we can open a new file.
-      //the file has to be opened in binary mode, otherwise
-      //fgetc will return bad values.
-      audioFptr = fopen(filePathList[i], "rb");
-
-      if (audioFptr == NULL) {
-        printf("Failed to load audio file at %d\n", i);
+bool streamAudio() {
+  if (!serialEstablished) {
+    return false;
+  }
+
+  PipelineConfig config;
+  config.frameSamples = linkSettings.frameSize - FRAME_HEADER_SIZE;
+  config.sampleRate = outputSampleRate;
+  config.resamplerQuality = resamplerQuality;
+  config.codec = frameCodec;
+  config.channelCount = frameChannelCount;
+  config.preferMapped = !readAheadRequested;
+  config.printTracks = true;
+  config.firstTrack = resumeTrack;
+  config.firstTrackOffset = 0;
+  restartRequested = false;
+
+  if (!pipeline.start(&playlist, &trackCache, config)) {
+    printf("Starting the frame pipeline failed.\n");
+    return true;
+  }
+
+  PipelineFrame* sentFrame = NULL; //the frame being written, its slot is still in use
+  bool streamEnded = false;
+  bool firstFrame = true;
+
+  //loop until all data is sent
+  while (!streamEnded) {
+    if (!waitCredit()) {
+      break;
+    }
+
+    //a skip or a seek. the frames prepared from the old place are dropped, but
+    //the one being written is finished first.
+    if (restartRequested) {
+      restartRequested = false;
+      serialPort->waitWrite();
+
+      if (sentFrame != NULL) {
+        pipeline.releaseFrame(sentFrame);
+        sentFrame = NULL;
+      }
+
+      config.firstTrack = restartTrack;
+      config.firstTrackOffset = restartOffset;
+      resumeTrack = restartTrack;
+
+      if (!pipeline.start(&playlist, &trackCache, config)) {
+        printf("Starting the frame pipeline failed.\n");
+        break;
+      }
+    }
+
+    //the frame should be ready by the time it's asked for. the first one
+    //waits for the first track to be opened.
+    uint32_t waitStartTime = millisNow();
+    bool frameReady = (pipeline.getFramesReady() > 0);
+    PipelineFrame* frame = NULL;
+
+    while (((frame = pipeline.getFrame(FRAME_WAIT_TIMEOUT)) == NULL) && (!pipeline.isFinished())) {
+      serviceControls();
+      checkMetrics(false);
+    }
+
+    if (frame == NULL) {
+      if (firstFrame) {
+        printf("No audio file could be streamed.\n");
       }
-      else {  //if audio file is valid
-        //reset the pointer to end so that we can get the size of the file
-        fseek(audioFptr, 0, SEEK_END);
-        int memorySize = ftell(audioFptr);
-
-        if (memorySize > 44) {
-          //allocate memory for the file
-          uint8_t* memPointer = (uint8_t*) malloc(memorySize * sizeof(uint8_t));
-
-          if (memPointer != NULL) { //if allocation was successful
-            printf("Memory allocation successful for %d. Memory size: %d\n", i, memorySize);
-            printf("Loading audio file to memory..\n");
-            fseek(audioFptr, 0, SEEK_SET);  //reset to start so that we can read the file
-            
-            //load the audio file to allocated memory
-            for (int i=0; i < memorySize; i++) {
-              memPointer[i] = uint8_t(fgetc(audioFptr));
-            }
-
-            printf("Streaming audio..\n");
-            
-            //create a two byte buffer so that we can send L and R samples
-            uint8_t pairBuffer[2] = {0};
-
-            printf("Waiting for server request..\n");
-            
-            //loop until all data is sent
-            for (int i=44; i < memorySize; i++) {
-              //wait for a data request from server device
-              while (!dataRequestReceived) {
-                // printf("Waiting for server request..\n");
-                //Arduino's println sends \r\n
-                if (readSerial(4, true) == 4) { //read the incoming request from server
-                  rxDataBuffer[3] = 0;  //remove the NL
-                  if (strcmp("RD?", rxDataBuffer) == 0) {
-                    // printf("Data request received\n");
-                    uint8_t tempBuffer[] = "ACK!\n";
-                    writeSerial(tempBuffer, strlen((char*)tempBuffer));
-                    dataRequestReceived = true; //move to next step
-                    dataOutgoing = false;
-                    PurgeComm(hSerial, PURGE_RXCLEAR);
-                  }
-                  else {
-                    if (strlen((char*)rxDataBuffer) > 0) {
-                      printf("Data request incomplete: %s, %d\n", rxDataBuffer, strlen((char*)rxDataBuffer));
-                    }
-                    Sleep(500);
-                  }
-                }
-                else {
-                  if (strlen((char*)rxDataBuffer) > 0) {
-                    printf("Data request incomplete: %s, %d\n", rxDataBuffer, strlen((char*)rxDataBuffer));
-                  }
-                  Sleep(500);
-                }
-              }
-
-              //if a request was received from server
-              if (dataRequestReceived) {
-                //for every single request we need to calculate remaining no. of samples only once
-                if (!dataOutgoing) {
-                  if ((memorySize-i) < REQUEST_DATA_SIZE) {  //check if there's data left to fill the buffer entirely
-                    txDataLength = memorySize - i;  //calculate no. of remaining samples
-                  }
-                  else {
-                    txDataLength = REQUEST_DATA_SIZE;
-                  }
-                  uint8_t tempBuffer[2];
-                  tempBuffer[0] = uint8_t(txDataLength >> 8); //high byte
-                  tempBuffer[1] = uint8_t(txDataLength & 0x00FF); //high byte
-                  writeSerial(tempBuffer, 2); //send the the data length bytes
-                  dataOutgoing = true;  //actual samples can now be sent
-                  sampleCounter = 0;
-                  // printf("Request received. Sending %u samples..\n", txDataLength);
-                }
-
-                //send the requested amount of samples
-                if (sampleCounter <= txDataLength) {
-                  if ((i % 2) == 0) { //left channel samples
-                    pairBuffer[0] = memPointer[i];
-                    // pairBuffer[1] = 'L';
-                    writeSerial(pairBuffer, 1);
-                    // printf("%c %u %d\n", pairBuffer[0], pairBuffer[1], i);
-                    // Sleep(500);
-                    sampleCounter++;  //increment until the requested amount of samples
-                  } else {
-                    // pairBuffer[0] = memPointer[i];
-                    // // pairBuffer[1] = 'R';
-                    // writeSerial(pairBuffer, 1);
-                    // // printf("%c %u %d\n", pairBuffer[0], pairBuffer[1], i);
-                    // // Sleep(500);
-                  }
-                  // sampleCounter++;  //increment until the requested amount of samples
-                }
-                
-                //once the requested amount of samples are sent
-                if (sampleCounter == txDataLength) {
-                  // printf("Samples sent: %d\n", sampleCounter);
-                  sampleCounter = 0;  //reset
-                  // txDataLength = 0;
-                  dataOutgoing = false;
-                  dataRequestReceived = false;  //can wait for the next request now
-                  PurgeComm(hSerial, PURGE_RXCLEAR);
-                }
-              }
-            }
-            free(memPointer); //once all data is read
-          } else {
-            printf("Memory allocation failed for track %d", i);
-            exit(1);
-          }
-        } else {
-          printf("Audio file %d is not valid.\n", i);
-        }
-        fclose(audioFptr);
+      break;
+    }
+
+    if (firstFrame) {
+      printf("Streaming audio..%s%s\n", (frameCodec == FRAME_CODEC_IMA_ADPCM) ? " Frames are IMA ADPCM coded." : "",
+        (frameChannelCount == 2) ? " Frames are stereo." : "");
+      firstFrame = false;
+    }
+    else {
+      frameWaitTime.record(millisNow() - waitStartTime);
+
+      if (!frameReady) {
+        framesNotReady.increment();
       }
     }
+
+    resumeTrack = uint32_t(frame->trackIndex);
+    bool sent = sendFrame(frame);
+
+    //the write of the frame before is done once the next one is queued
+    if (sentFrame != NULL) {
+      pipeline.releaseFrame(sentFrame);
+    }
+    sentFrame = frame;
+
+    if (!sent) {
+      break;
+    }
+
+    if (frame->data[3] & FRAME_FLAG_TRACK_END) {
+      printf("Audio file %d has been streamed.\n", frame->trackIndex);
+      checkMetrics(true);
+    }
+    streamEnded = ((frame->data[3] & FRAME_FLAG_STREAM_END) != 0);
+    serviceControls();
+    checkMetrics(false);
+  }
+
+  serialPort->waitWrite(); //the slot can't be reused while a write is pending
+
+  if (sentFrame != NULL) {
+    pipeline.releaseFrame(sentFrame);
+  }
+  pipeline.stop();
+
+  if (streamEnded) {
+    answerResends();
+  }
+
+  if (!serialEstablished) {
+    printf("Lost the device. Reconnecting..\n");
+    return false;
   }
-  return 1;
+  return true;
 }
 
 //==============================================================================//
-//Opens a text file containing absolute paths of audio files.
-//Each line holds a single path. This will scan all lines and save the paths to
-//an array so that we can open the audio files later.
+//Opens the live input and starts capturing it. Returns false if it can't be
+//opened or its format is not supported.
 
-int readPlaylist() {
-  //open the file in read mode
-  playlistFptr = fopen(playlistFileName, "r");
-
-  if (playlistFptr != NULL) { //if playlist file is valid
-    fseek(playlistFptr, 0, SEEK_SET); //reset the file read pointer to the start
-    //this does something similar to what fgets does.
-    //but you have better control over reading the lines.
-    //a custom delimiter can be used and the delim position
-    //is saved for easy file seeking, though this is not necessary
-    //for this application.
-    do {
-      byteBuffer = fgetc(playlistFptr);  //get a single char and advance postion
-
-      if (byteBuffer != EOF) { //if EOF has not reached
-        // printf("%c", c);
-        seekPosition++; //actually this could be replaced with ftell()
-        lineLength++; //the length of line currently being scanned
-        if (byteBuffer == '\n') {  //if an NL is found
-          if (lineCount < MAX_LINE_COUNT) { //if the line length reaches the set max
-            lineBreaks[lineCount] = seekPosition-1; //save the position of the NL
-            lineLengthList[lineCount] = lineLength; //inlcudes delim char
-          }
-          lineCount++;  //number of lines found
-          lineLength = 0; //reset length to scan the next line
-        }
-      }
-      else {  //find a line with no NL but ends with EOF
-        if (lineLength != 0) {
-          lineCount++;  //the last line with non-zero chars and no NL is still a line
-          // lineLength = 0;
-        }
-      }
-    } while (byteBuffer != EOF);  //scan until the EOF
+bool openLiveInput() {
+  LiveConfig config;
+  config.sampleRate = outputSampleRate;
+  config.resamplerQuality = resamplerQuality;
+  config.codec = frameCodec;
+  config.minFrameSamples = liveFrameSamples;
+  config.backlog = liveBacklog;
+
+  printf("\nWaiting for the live input at %s..\n", (strcmp(livePath, "-") == 0) ? "stdin" : livePath);
+
+  if (!liveInput.open(livePath, liveRawFormat, config)) {
+    printf("Could not open the live input, or its format is not supported.\n");
+    return false;
+  }
+
+  const WavFormat& format = liveInput.getFormat();
+  printf("Live input: %u Hz, %u-bit, %u channel(s). Frames of %u samples, %u ms backlog.\n",
+    format.sampleRate, format.bitsPerSample, format.channelCount, liveFrameSamples, liveBacklog);
 
-    //------------------------------------------------------------------------------//
+  if (liveInput.isResampling()) {
+    const Resampler& resampler = liveInput.getResampler();
+    printf("Resampling to %u Hz. Quality: %s, %u taps, %u phases, %s\n", outputSampleRate,
+      resampler.getQualityName(), resampler.getTapCount(), resampler.getPhaseCount(), resampler.getKernelName());
+  }
+  return true;
+}
+
+//==============================================================================//
+//Streams the live input until it ends. A frame is built once there's credit for
+//it, from the samples that have arrived by then, so the frame sent is always the
+//latest. The samples that arrive while the link is lost are dropped past the
+//backlog. Returns false if the link was lost before the input ended.
 
-    //print the parameters
-    printf("\nLine count: %d\n", lineCount);
-    printf("Last line length: %d\n", lineLength);
-    printf("Last file seek position: %d\n", seekPosition);
-    printf("Line break positions: ");
+bool streamLive() {
+  if (!serialEstablished) {
+    return false;
+  }
+
+  uint32_t frameSamples = linkSettings.frameSize - FRAME_HEADER_SIZE;
+  uint32_t frameIndex = 0;
+  bool streamEnded = false;
+  bool firstFrame = true;
 
-    //print the line break positions
-    for (int i=0; i < lineCount; i++) {
-      printf("%d ", lineBreaks[i]);
+  while (!streamEnded) {
+    if (!waitCredit()) {
+      break;
     }
-    printf("\n");
 
-    //print line lengths
-    printf("Line lengths: ");
+    //the write of the frame before is still pending, so the other one is used
+    PipelineFrame* frame = &liveFrames[frameIndex];
+    uint64_t captureTime = 0;
+    uint32_t waitStartTime = millisNow();
+    uint32_t length = 0;
 
-    for (int i=0; i < lineCount; i++) {
-      printf("%d ", lineLengthList[i]);
+    while (((length = liveInput.buildFrame(frame, frameSamples, FRAME_WAIT_TIMEOUT, &captureTime)) == 0) &&
+           (!liveInput.isFinished())) {
+      serviceControls();
+      checkMetrics(false);
     }
-    printf("\n");
 
-    //------------------------------------------------------------------------------//
+    if (length == 0) {
+      break;  //the input ended without a frame to flag, eg. it was empty
+    }
 
-    //scan the playlist file again for lines using linebreak and line count info
-    fseek(playlistFptr, 0, SEEK_SET);
-    
-    for (int i=0; i < lineCount; i++) {
-      for(int j=0; j < lineBreaks[i]; j++) {
-        filePathList[i][j] = fgetc(playlistFptr);
-        // filePathList[i][j] = (filePathList[i][j] == '\n') ? 0 : filePathList[i][j];
-      }
+    if (firstFrame) {
+      printf("Streaming live audio..%s\n", (frameCodec == FRAME_CODEC_IMA_ADPCM) ? " Frames are IMA ADPCM coded." : "");
+      firstFrame = false;
     }
+    else {
+      frameWaitTime.record(millisNow() - waitStartTime);
+    }
+
+    if (!sendFrame(frame)) {
+      break;
+    }
+    liveLatency.record(uint32_t((pipelineMicros() - captureTime) / 1000));
+    frameIndex ^= 1;
+
+    streamEnded = ((frame->data[3] & FRAME_FLAG_STREAM_END) != 0);
+    serviceControls();
+    checkMetrics(false);
+  }
+
+  serialPort->waitWrite();
+
+  if (streamEnded) {
+    answerResends();
+  }
+
+  if (!serialEstablished) {
+    printf("Lost the device. Reconnecting..\n");
+    return false;
+  }
 
-    // //print the lines
-    // printf("Lines:\n");
+  printf("The live input has ended.\n");
+  checkMetrics(true);
+  liveInput.close();
+  return true;
+}
 
-    // for (int i=0; i < lineCount; i++) {
-    //   for(int j=0; j < lineBreaks[i]; j++) {
-    //     printf("%c", filePathList[i][j]);
-    //   }
-    // }
-    // printf("\n");
+//==============================================================================//
+//Waits for a request if there's no credit. In credit mode the requests have
+//already arrived ahead of time. While commands can come in or control messages
+//are waiting for their CA#, the wait is split into CONTROL_POLL_INTERVAL ms so
+//they're seen in time, eg. the resume for a receiver that filled up while it was
+//paused. Returns false if the serial port is gone.
+
+bool waitCredit() {
+  uint32_t waitStartTime = millisNow();
+  uint32_t requestWaitTime = waitStartTime; //since the last request or timeout
+
+  while (requestCredit == 0) {
+    if (!serialEstablished) {
+      return false;
+    }
+    bool polling = controlInput.isOpen() || (serialControls.getCount() > 0);
 
-    if (lineCount > 0) {
-      printf("%d audio file(s) found in the playlist.\n", lineCount);
-    } else {
-      printf("No audio files were found.\n");
-      return 0;
+    // printf("Waiting for server request..\n");
+    //Arduino's println sends \r\n
+    if (readRequestLine(polling ? CONTROL_POLL_INTERVAL : SERIAL_READ_TIMEOUT)) { //read the incoming request from server
+      handleRequestLine();
+      requestWaitTime = millisNow();
     }
-    fclose(playlistFptr);
-  } else {
-    printf("Could not open playlist file %s\n", playlistFileName);
-    return 0;
+    else if ((millisNow() - requestWaitTime) >= SERIAL_READ_TIMEOUT) {
+      requestTimeouts.increment();
+      requestWaitTime = millisNow();
+    }
+    serviceControls();
+    checkMetrics(false);
+  }
+  creditWaitTime.record(millisNow() - waitStartTime);
+  return true;
+}
+
+//==============================================================================//
+//Sends the frame with a single write. This returns as soon as the write is
+//queued, after the previous one is done. A checked frame is written from the
+//frame history. Returns false if the write failed.
+
+bool sendFrame(const PipelineFrame* frame) {
+  uint32_t writeStartTime = millisNow();
+  const uint8_t* data = frame->data;
+  uint32_t length = frame->length;
+
+  if (linkSettings.options & PROTOCOL_OPTION_CHECKED_FRAMES) {
+    //a resend may still be writing from the slot that is filled next
+    if (!serialPort->waitWrite()) {
+      printf("Writing frame to serial port failed\n");
+      writeErrors.increment();
+      serialEstablished = false;
+      return false;
+    }
+    data = frameHistory.add(frame->data, frame->length, &length);
+  }
+
+  if (!serialPort->writeAsync(data, length)) {
+    printf("Writing frame to serial port failed\n");
+    writeErrors.increment();
+    serialEstablished = false;  //the port is gone
+    return false;
+  }
+  writeWaitTime.record(millisNow() - writeStartTime);
+  framesSent.increment();
+  bytesSent.add(length);
+  requestCredit--;  //one frame of credit is used up
+
+  if (creditModeActive) {
+    //pick up any credit that arrived while the frame was being sent.
+    //this never blocks, so the next frame follows immediately.
+    while (readRequestLine(0)) {
+      handleRequestLine();
+    }
+  }
+  else if ((linkSettings.options & PROTOCOL_OPTION_CHECKED_FRAMES) == 0) {
+    serialPort->purgeInput();  //can wait for the next request now
   }
-  return lineCount;
+  return true;
 }
 
 //==============================================================================//
-//This sends a "READY" query to the connected device. The device has to respond
-//with "YES". Only then the interface is validated.
+//Reads a single request line from the serial port. A line that is only partially
+//received is kept by the transport, so it's not lost. Returns true once a full line
+//ending with an NL is available. A timeout of zero only looks at the bytes that have
+//already arrived and never waits. A read error means the port is gone.
 
-bool checkDevice() {
-  if (serialEstablished) {  //only if serial port was established
-    printf("Checking if device is ready..\n");
-    // PurgeComm(hSerial, PURGE_RXCLEAR);
-    // printf("Purged buffers\n");
-    
-    do {  //repeat until confirmation is received
-      PurgeComm(hSerial, PURGE_RXCLEAR);  //purge RX buffer so that we can read clean
-      strcpy(txDataBuffer, "READY?");  //copy the command to transmit buffer
-      writeSerial(6); //NL will be included which makes the total char count 6
-      Sleep(500);  //works wihout delay
-
-      if (readSerial(4) == 4) { //read three chars and the return indicates the no. of chars read before timeout
-        rxDataBuffer[4] = 0;  //null terminate the buffer
-
-        if (strcmp("YES!", rxDataBuffer) == 0) { //compare the strings
-          printf("Device is ready : %s\n", rxDataBuffer);
-          Sleep(500);
-          serverReady = true; //device is now ready
-          PurgeComm(hSerial, PURGE_RXCLEAR);
-          return true;
-        }
-        else {
-          printf("Device is not ready.\n");
-          serverReady = false;
-          Sleep(1000);
-        }
+bool readRequestLine(uint32_t timeout) {
+  if (!serialEstablished) {
+    return false;
+  }
+
+  int length = serialPort->readLine(requestLineBuffer, REQUEST_LINE_MAX_LENGTH, timeout);
+
+  if (length < 0) {
+    serialEstablished = false;
+  }
+  return (length > 0);
+}
+
+//==============================================================================//
+//Interprets the request line in requestLineBuffer.
+//"RD?" is the legacy stop-and-wait request. It is acknowledged and allows exactly
+//one frame. "RD#n" grants n frames of credit which are added to the current credit.
+//"RS#n" asks for the checked frame with sequence no. n again. "CA#n" answers
+//control message n and "CT#<type>#<value>" is a command typed in at the
+//transmitter. Returns true if the line was a valid request, or false if it wasn't
+//or the port is gone.
+
+bool handleRequestLine() {
+  if (strcmp("RD?", requestLineBuffer) == 0) {
+    // printf("Data request received\n");
+    uint8_t tempBuffer[] = "ACK!\n";
+    writeSerial(tempBuffer, strlen((char*)tempBuffer));
+    creditModeActive = false;
+    requestCredit = 1;  //move to next step
+    legacyRequests.increment();
+
+    if ((linkSettings.options & PROTOCOL_OPTION_CHECKED_FRAMES) == 0) {
+      serialPort->purgeInput();
+    }
+    writeControls(true);  //the transmitter looks for the frame now
+    return true;
+  }
+
+  ControlMessage message;
+  uint8_t controlId = 0;
+
+  if (parseControlAck(requestLineBuffer, &controlId)) {
+    serialControls.acknowledge(controlId);
+    return true;
+  }
+
+  if (parseControlLine(requestLineBuffer, &message)) {
+    handleControl(message);
+    return true;
+  }
+
+  if (strncmp("RS#", requestLineBuffer, 3) == 0) {
+    char* end = NULL;
+    unsigned long sequence = strtoul(&requestLineBuffer[3], &end, 10);
+
+    if ((end != &requestLineBuffer[3]) && (*end == 0) && (sequence <= 0xFF)) {
+      uint32_t length = 0;
+      const uint8_t* envelope = frameHistory.find(uint8_t(sequence), &length);
+
+      if (envelope == NULL) {
+        resendsMissed.increment();  //the transmitter gives up on it
+        return true;
+      }
+
+      if (!serialPort->writeAsync(envelope, length)) {
+        printf("Writing frame to serial port failed\n");
+        writeErrors.increment();
+        serialEstablished = false;
+        return false;
+      }
+      framesResent.increment();
+      bytesSent.add(length);
+      return true;
+    }
+  }
+
+  if (strncmp("RD#", requestLineBuffer, 3) == 0) {
+    int grant = atoi(&requestLineBuffer[3]);
+
+    if (grant > 0) {
+      creditModeActive = true;
+
+      if ((requestCredit + grant) > CREDIT_MAX_FRAMES) {
+        creditClipped.add(uint32_t(requestCredit + grant - CREDIT_MAX_FRAMES));
+        requestCredit = CREDIT_MAX_FRAMES;
       }
-      else {  //when no reply is received within the timeout period
-        printf("Serial timed out. Device is not ready.\n");
-        serverReady = false;
+      else {
+        requestCredit += grant;
       }
-    } while (!serverReady);
+      creditGranted.add(uint32_t(grant));
+      return true;
+    }
+  }
+
+  if (strlen(requestLineBuffer) > 0) {
+    printf("Data request incomplete: %s, %d\n", requestLineBuffer, (int) strlen(requestLineBuffer));
+    requestsIncomplete.increment();
   }
   return false;
 }
 
 //==============================================================================//
-//This asks the user to enter the COM port number of the connected server device.
-//If the COM port can not be found or it is busy, this will fail.
+//Acts on the commands typed in since the last call, and writes the control
+//messages that are due, the new ones and those still without a CA#. Never waits,
+//except for a frame still being written.
 
-bool promptComPort() {
-  printf("Enter COM port number: ");
-  scanf("%d", &comPortNumber);
-  printf("Connecting to COM port %d..\n", comPortNumber);
+void serviceControls() {
+  ControlMessage message;
 
-  if (comPortNumber >= 0) {
-    return openComPort(); //try opening the COM port
+  while (controlInput.take(&message)) {
+    handleControl(message);
   }
-  return false;
+  writeControls(false);
 }
 
 //==============================================================================//
-//This actually opens the COM port.
+//A command typed in here or at the transmitter. A skip or a seek moves the
+//playlist, from the track of the last frame sent, and the pipeline starts over
+//there before the next frame. Every command goes on to the receiver, ahead of the
+//frames on the way. A pause is only sent to a receiver that grants credit, one
+//that asks for each frame with RD? would never ask for the resume.
+
+void handleControl(const ControlMessage& message) {
+  bool controlled = ((linkSettings.options & PROTOCOL_OPTION_CONTROL) != 0);
+
+  if (isControlFlush(message.type)) {
+    if (liveRequested || (playlist.getCount() == 0)) {
+      printf("Skip and seek only work with a playlist.\n");
+      return;
+    }
 
-bool openComPort () {
-  char comPortNumberString[10] = {0};
-  itoa(comPortNumber, comPortNumberString, 10); //convert the number to c-string
-  char comPortString[20] = "\\\\.\\COM";  //format the string
-  strcat(comPortString, comPortNumberString); //add the COM port number at the end
+    int64_t track = restartRequested ? restartTrack : resumeTrack;
+    track += (message.type == CONTROL_SKIP) ? message.value : 0;
+    track = (track < 0) ? 0 : track;
+    track = (track >= int64_t(playlist.getCount())) ? (int64_t(playlist.getCount()) - 1) : track;
 
-  // printf("Com port string is %s\n", comPortString);
+    restartTrack = uint32_t(track);
+    restartOffset = (message.type == CONTROL_SEEK) ? uint32_t(message.value) : 0;
+    restartRequested = true;
+    printf("Control: %s, track %u at %u:%02u\n", getControlName(message.type), restartTrack,
+      restartOffset / 60000, (restartOffset / 1000) % 60);
+  }
+  else if ((message.type == CONTROL_PAUSE) && controlled && (!creditModeActive)) {
+    printf("The receiver asks for each frame, it can't be paused.\n");
+    return;
+  }
+  else {
+    printf("Control: %s", getControlName(message.type));
+    printf((message.type == CONTROL_GAIN) ? " %ld%%\n" : "\n", long(message.value));
+  }
 
-  hSerial = CreateFileA (comPortString,                //port name
-                      GENERIC_READ | GENERIC_WRITE, //Read/Write
-                      0,                            // No Sharing
-                      NULL,                         // No Security
-                      OPEN_EXISTING,// Open existing port only
-                      0,            // Non Overlapped I/O
-                      NULL);        // Null for Comm Devices
+  if (!controlled) {
+    printf("The device does not take control messages%s.\n", isControlFlush(message.type) ? ", the receiver plays its buffer first" : "");
+    return;
+  }
+  serialControls.add(message);
+  controlsSent.increment();
+  writeControls(false);
+}
 
-  if (hSerial == INVALID_HANDLE_VALUE) {
-    printf("Error opening serial port.\n");
+//==============================================================================//
+//Writes the control messages that are due, each right after the frame being
+//written. A transmitter in the RD?/ACK! handshake only looks for them right
+//after the ACK!, before the frame, so there afterAck has to be set.
+
+void writeControls(bool afterAck) {
+  if ((!serialEstablished) || ((linkSettings.options & PROTOCOL_OPTION_CONTROL) == 0) ||
+      ((!creditModeActive) && (!afterAck))) {
+    return;
   }
-  else {
-    printf("Opening serial port successful.\n");
-    // CloseHandle(hSerial);
+
+  ControlMessage message;
+  uint8_t envelope[CONTROL_ENVELOPE_SIZE];
+  uint32_t givenUp = serialControls.getGivenUp();
+  bool resent = false;
+
+  while (serialControls.getDue(millisNow(), &message, &resent)) {
+    uint32_t length = writeControlEnvelope(envelope, message);
+
+    if (!writeSerial(envelope, length)) {
+      printf("Writing control message to serial port failed\n");
+      writeErrors.increment();
+      serialEstablished = false;
+      return;
+    }
+    bytesSent.add(length);
+
+    if (resent) {
+      controlsResent.increment();
+    }
   }
 
-  //------------------------------------------------------------------------------//
-  //Serial port configuration
+  if (serialControls.getGivenUp() != givenUp) {
+    printf("A control message got no answer from the device.\n");
+  }
+}
 
-  dcbSerialParams.DCBlength = sizeof(dcbSerialParams);
+//==============================================================================//
+//The last frames may still be asked for again once the stream has ended, so on
+//a link with checked frames the requests are answered until none has come for
+//RESEND_LINGER_TIME.
 
-  if (GetCommState(hSerial, &dcbSerialParams)) {  //try to read the serial port parameters
-    printf("Getting COM status successful.\n");
+void answerResends() {
+  if ((linkSettings.options & PROTOCOL_OPTION_CHECKED_FRAMES) == 0) {
+    return;
   }
-  else {
-    printf("Getting COM status failed.\n");
+
+  while (readRequestLine(RESEND_LINGER_TIME)) {
+    handleRequestLine();
+  }
+  serialPort->waitWrite();
+}
+
+//==============================================================================//
+//Only sets a flag, printing is not safe in a signal handler. Some systems reset
+//the handler once it's called, so it's installed again.
+
+void handleMetricsSignal(int signalNumber) {
+  metricsRequested = 1;
+  signal(signalNumber, handleMetricsSignal);
+}
+
+//==============================================================================//
+//Prints the metrics if they were asked for with the signal, if the interval is
+//up, or if force is true.
+
+void checkMetrics(bool force) {
+  bool intervalDone = (metricsInterval > 0) && ((millisNow() - metricsLastTime) >= metricsInterval);
+
+  if (force || intervalDone || metricsRequested) {
+    metricsRequested = 0;
+    printMetrics();
+  }
+}
+
+//==============================================================================//
+//Prints one metrics line and one line for each histogram. The serial rate is
+//the average since the last report.
+
+void printMetrics() {
+  uint32_t now = millisNow();
+  uint32_t elapsed = now - metricsLastTime;
+  uint32_t bytes = bytesSent.get();
+  uint32_t byteRate = (elapsed > 0) ? uint32_t((uint64_t(bytes - metricsLastBytes) * 1000) / elapsed) : 0;
+
+  metricsLastTime = now;
+  metricsLastBytes = bytes;
+
+  MetricsLine line("metrics");
+  line.add("uptime_ms", now - metricsStartTime);
+  line.add("link_baud", linkSettings.baudRate);
+  line.add("frames_sent", framesSent.get());
+  line.add("bytes_sent", bytes);
+  line.add("serial_bytes_per_s", byteRate);
+  line.add("legacy_requests", legacyRequests.get());
+  line.add("credit_granted", creditGranted.get());
+  line.add("credit_clipped", creditClipped.get());
+  line.add("requests_incomplete", requestsIncomplete.get());
+  line.add("request_timeouts", requestTimeouts.get());
+  line.add("write_errors", writeErrors.get());
+  line.add("frames_resent", framesResent.get());
+  line.add("resends_missed", resendsMissed.get());
+  line.add("controls_sent", controlsSent.get());
+  line.add("controls_resent", controlsResent.get());
+  line.add("controls_given_up", serialControls.getGivenUp());
+  printf("%s\n", line.getText());
+
+  MetricsLine creditWaitLine("histogram");
+  creditWaitLine.add("credit_wait_ms", creditWaitTime);
+  printf("%s\n", creditWaitLine.getText());
+
+  MetricsLine writeWaitLine("histogram");
+  writeWaitLine.add("write_wait_ms", writeWaitTime);
+  printf("%s\n", writeWaitLine.getText());
+
+  MetricsLine frameWaitLine("histogram");
+  frameWaitLine.add("frame_wait_ms", frameWaitTime);
+  printf("%s\n", frameWaitLine.getText());
+
+  if (liveRequested) {
+    MetricsLine liveLine("live");
+    liveLine.add("samples_captured", liveInput.getSamplesCaptured());
+    liveLine.add("samples_dropped", liveInput.getSamplesDropped());
+    liveLine.add("backlog_samples", liveInput.getBacklogSamples());
+    printf("%s\n", liveLine.getText());
+
+    MetricsLine latencyLine("histogram");
+    latencyLine.add("live_latency_ms", liveLatency);
+    printf("%s\n", latencyLine.getText());
+    fflush(stdout);
+    return; //the frame pipeline isn't used
+  }
+
+  MetricsLine encodeLine("histogram");
+  encodeLine.add("encode_ms", pipeline.getFrameBuildTime());
+  printf("%s\n", encodeLine.getText());
+
+  //busy is the time a stage spent on its own work, wait the time it waited
+  //for the stage before or after it. a stage that's busy most of the time is
+  //the one that holds the others up.
+  const PipelineStage& reader = pipeline.getReaderStage();
+  const PipelineStage& dsp = pipeline.getDspStage();
+  MetricsLine pipelineLine("pipeline");
+  pipelineLine.add("reader_busy_ms", uint32_t(reader.getBusyTime() / 1000));
+  pipelineLine.add("reader_wait_ms", uint32_t(reader.waitTime / 1000));
+  pipelineLine.add("blocks_read", reader.itemCount);
+  pipelineLine.add("dsp_busy_ms", uint32_t(dsp.getBusyTime() / 1000));
+  pipelineLine.add("dsp_wait_ms", uint32_t(dsp.waitTime / 1000));
+  pipelineLine.add("frames_built", dsp.itemCount);
+  pipelineLine.add("frames_ready", pipeline.getFramesReady());
+  pipelineLine.add("frames_not_ready", framesNotReady.get());
+  printf("%s\n", pipelineLine.getText());
+  fflush(stdout);
+}
+
+//==============================================================================//
+//Reads the playlist, a text file containing absolute paths of audio files, one on
+//each line, and the track cache. No audio file is opened here. The total duration
+//is that of the tracks found in the cache.
+
+int readPlaylist() {
+  if (!playlist.load(playlistFileName)) {
+    printf("Could not open playlist file %s\n", playlistFileName);
+    return 0;
+  }
+
+  if (playlist.getCount() == 0) {
+    printf("No audio files were found.\n");
+    return 0;
+  }
+
+  trackCache.load(trackCacheFileName);
+
+  size_t cachedCount = 0;
+  uint64_t cachedDuration = 0;
+
+  for (size_t i=0; i < playlist.getCount(); i++) {
+    const TrackInfo* info = trackCache.find(playlist.getPath(i));
+
+    if (info != NULL) {
+      cachedCount++;
+      cachedDuration += info->duration;
+    }
+  }
+
+  printf("\n%d audio file(s) found in the playlist.\n", int(playlist.getCount()));
+  printf("%d of them are in the track cache, %d:%02d:%02d long.\n", int(cachedCount),
+    int(cachedDuration / 3600000), int((cachedDuration / 60000) % 60), int((cachedDuration / 1000) % 60));
+  return int(playlist.getCount());
+}
+
+//==============================================================================//
+//Finds the transmitter and agrees on the link, and keeps trying until it's done.
+//With --port only that port is tried, otherwise all the serial ports are.
+
+void connectDevice() {
+  serverReady = false;
+
+  while (!serverReady) {
+    if (comPortName[0] != 0) {
+      if ((!openComPort()) || (!checkDevice())) {
+        sleepMillis(DISCOVERY_RETRY_INTERVAL);
+      }
+    }
+    else if (!discoverDevice()) {
+      sleepMillis(DISCOVERY_RETRY_INTERVAL);
+    }
+  }
+}
+
+//==============================================================================//
+//Probes every serial port that could be the transmitter at the same time, and
+//uses the first one that answers READY?.
+
+bool discoverDevice() {
+  std::vector<std::string> portNames = listSerialPorts();
+  bool portsChanged = (int(portNames.size()) != discoveryPortCount);
+  discoveryPortCount = int(portNames.size());
+
+  if (portNames.empty()) {
+    if (portsChanged) {
+      printf("No serial ports found. Please connect the AUDIFI server device.\n");
+    }
+    return false;
+  }
+
+  if (portsChanged) {
+    printf("Looking for the device on %d serial port(s)..\n", int(portNames.size()));
+  }
+
+  uint32_t startTime = millisNow();
+  LinkDiscovery discovery;
+
+  if (!discoverLink(portNames, getLocalCapabilities().baudRates, DISCOVERY_TIMEOUT, &discovery)) {
+    if (portsChanged) {
+      printf("No device answered, still looking.\n");
+    }
     return false;
   }
 
-  //add parameters
-  dcbSerialParams.BaudRate = SERIAL_BAUDRATE;
-  dcbSerialParams.ByteSize = 8;
-  dcbSerialParams.StopBits = ONESTOPBIT;
-  dcbSerialParams.Parity = NOPARITY;
+  printf("Found the device at %s in %u ms\n", discovery.portName.c_str(), millisNow() - startTime);
+  delete serialPort;
+  serialPort = discovery.port;
+  serialEstablished = true;
+  discoveryPortCount = -1;
+  return setupLink(discovery.baudRate, discovery.capabilities);
+}
+
+//==============================================================================//
+//This sends a "READY?" query to the connected device. The device has to respond
+//with "YES!", followed by its capabilities if it has any. Only then the interface
+//is validated, and the baud rate, frame size and codec are agreed on. A device
+//left at a faster rate by the last session answers at that rate, so the rates
+//are tried in turn, the base rate first.
+
+bool checkDevice() {
+  if (serialEstablished) {  //only if serial port was established
+    printf("Checking if device is ready..\n");
+    LinkCapabilities local = getLocalCapabilities();
+    LinkCapabilities device;
+
+    for (int i=0; i < PROTOCOL_BAUDRATE_COUNT; i++) {
+      if (((local.baudRates & (1 << i)) == 0) || (!serialPort->setBaudRate(protocolBaudRates[i]))) {
+        continue;
+      }
 
-  if (SetCommState(hSerial, &dcbSerialParams)) {  //set parameters
-    printf("Setting COM parameters successful.\n");
+      if (queryLinkCapabilities(serialPort, DEVICE_READY_TIMEOUT, &device)) {
+        return setupLink(protocolBaudRates[i], device);
+      }
+    }
+    printf("Serial timed out. Device is not ready.\n");  //when no reply is received within the timeout period
   }
-  else {
-    printf("Setting COM parameters failed.\n");
+  return false;
+}
+
+//==============================================================================//
+//Agrees on the link with a device that answered READY? at startBaudRate.
+
+bool setupLink(uint32_t startBaudRate, const LinkCapabilities& device) {
+  printf("Device is ready : version %u\n", unsigned(device.version));
+
+  if (!negotiateLink(serialPort, getLocalCapabilities(), device, frameCodec, startBaudRate, &linkSettings)) {
+    printf("Link negotiation failed.\n");
     return false;
   }
 
-  //------------------------------------------------------------------------------//
-  //Set serial port timeouts
+  if (linkSettings.codec != frameCodec) {
+    printf("The device does not take the codec, frames are sent as PCM.\n");
+    frameCodec = linkSettings.codec;
+  }
 
-  timeouts.ReadIntervalTimeout = MAXDWORD;
-  timeouts.ReadTotalTimeoutMultiplier = 0;
-  timeouts.ReadTotalTimeoutConstant =  0;
-  timeouts.WriteTotalTimeoutConstant = 0;
-  timeouts.WriteTotalTimeoutMultiplier = 0;
+  //IMA ADPCM keeps one predictor, so its frames are always mono
+  frameChannelCount = 1;
 
-  if (SetCommTimeouts(hSerial, &timeouts)) {  //set parameters
-    printf("Setting timeout parameters successful.\n");
-    serialEstablished = true;
+  if (stereoRequested && ((linkSettings.options & PROTOCOL_OPTION_STEREO) == 0)) {
+    printf("The device does not take stereo frames, they are sent as mono.\n");
   }
-  else {
-    printf("Setting timeout parameters failed.\n");
-    serialEstablished = false;
+  else if (stereoRequested && (frameCodec != FRAME_CODEC_PCM_U8)) {
+    printf("Stereo frames are only sent as PCM, ADPCM frames are mono.\n");
+  }
+  else if (stereoRequested) {
+    frameChannelCount = 2;
+  }
+  printf("Link : %lu baud, %u byte frames%s\n", (unsigned long) linkSettings.baudRate, unsigned(linkSettings.frameSize),
+    (linkSettings.options & PROTOCOL_OPTION_CHECKED_FRAMES) ? ", checked" : "");
+
+  if (linkSettings.options & PROTOCOL_OPTION_CONTROL) {
+    printf("Control messages are sent between the frames.\n");
   }
+  frameHistory.reset();  //the sequence nos. start over with the link
+  serialControls.reset(); //and so do the control message ids
 
+  //the handshake of a versioned device ends with the YES! to the LINK#, and the
+  //requests it sends right after that are kept
+  if (device.version == 0) {
+    serialPort->purgeInput();
+  }
+  serverReady = true; //device is now ready
   return true;
 }
 
+//==============================================================================//
+//What the server can do. The frames are never larger than the pipeline's slots.
+
+LinkCapabilities getLocalCapabilities() {
+  LinkCapabilities local;
+  local.version = PROTOCOL_VERSION;
+  local.baudRates = 0;
+  local.frameSize = REQUEST_SIZE;
+  local.codecs = PROTOCOL_CODEC_PCM_U8 | PROTOCOL_CODEC_IMA_ADPCM;
+
+  for (int i=0; i < PROTOCOL_BAUDRATE_COUNT; i++) {
+    if (protocolBaudRates[i] <= maxBaudRate) {
+      local.baudRates |= uint8_t(1 << i);
+    }
+  }
+  return local;
+}
+
+//==============================================================================//
+//This actually opens the COM port.
+
+bool openComPort () {
+  if (serialPort == NULL) {
+    serialPort = createSerialTransport();
+  }
+
+  serialPort->close();
+  serialEstablished = serialPort->open(comPortName, SERIAL_BAUDRATE);
+  return serialEstablished;
+}
+
 //==============================================================================//
 //Writes a series of bytes to the serial port.
 //The data first have to be saved to the txDataBuffer array. It has a max length of
@@ -515,79 +1307,20 @@ bool writeSerial(uint32_t length, bool appendDelim) {
         length++;
       }
     }
-    if (WriteFile(hSerial, txDataBuffer, length, &serialBytesSent, NULL)) {
-      return true;
-    }
+    return writeSerial((uint8_t*) txDataBuffer, length);
   }
   return false;
 }
 
 //==============================================================================//
+//Writes a series of bytes and waits until they are sent. Any frame being written
+//in the background is finished first, so that the bytes are not mixed up.
 
 bool writeSerial(uint8_t* buffer, uint32_t length) {
   if (serialEstablished) {
-    if (WriteFile(hSerial, buffer, length, &serialBytesSent, NULL)) {
-      return true;
-    }
+    return serialPort->write(buffer, length);
   }
   return false;
 }
 
-//==============================================================================//
-//This reads a series of bytes from the serial port. First parameter is the no. of
-//bytes you want to read. The max no. of bytes you can read is 1024 bytes.
-//Second parameter is to whether wait for a delimiter character. If a delimiter is
-//specified, the read finishes before reaching the specified no. of bytes. Means, 
-//the length is ignored if you specify to wait for a delim.
-//The delim is included in the returned data length and the data buffer.
-
-int readSerial(uint32_t length, bool waitForDelim) {
-  if (serialEstablished) {
-    DWORD entryTime = GetTickCount();
-    char oneByteBuffer[1] = {0};
-    serialBytesRead = 0;
-    rxDataBufferIndex = 0;
-    
-    //Read from serial port for the specified duration
-    while ((GetTickCount() - entryTime) < SERIAL_READ_TIMEOUT) {
-      // printf("Reading bytes..\n");
-      if (ReadFile(hSerial, oneByteBuffer, 1, &serialBytesRead, NULL)) { //read one byte
-        rxDataBuffer[rxDataBufferIndex] = oneByteBuffer[0]; //copy the read byte to main buffer
-        // printf("Received 1 byte %u\n", rxDataBuffer[rxDataBufferIndex]);
-        
-        if (rxDataBufferIndex < RX_DATA_BUFFER_MAX_LENGTH) {
-          rxDataBufferIndex++;  //advance the buffer position once
-        }
-
-        //if the specified number of bytes have been read or the max limit has reached
-        if ((rxDataBufferIndex == RX_DATA_BUFFER_MAX_LENGTH) || ((!waitForDelim) && (rxDataBufferIndex >= length))) {
-          serialReadTimedout = false;
-          delimFound = (oneByteBuffer[0] == '\n') ? true : false;
-          return rxDataBufferIndex;
-        }
-        
-        //if the delmiter was found
-        if ((waitForDelim) && (oneByteBuffer[0] == '\n')) {
-          delimFound = true;
-          serialReadTimedout = false;
-          return rxDataBufferIndex;
-        }
-      }
-      else {
-        // printf("Reading serial failed\n");
-        // serialEstablished = false;
-        // serialDisconnected = true;
-        // CloseHandle(hSerial);
-        return -1;
-      }
-    }
-
-    serialReadTimedout = true;
-    delimFound = (oneByteBuffer[0] == '\n') ? true : false;
-    return rxDataBufferIndex;
-  }
-  printf("Serial connection is not ready\n");
-  return -1;
-}
-
-//==============================================================================//
+//==============================================================================//
\ No newline at end of file
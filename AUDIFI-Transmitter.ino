@@ -17,6 +17,8 @@
 #include "soc/timer_group_struct.h"
 #include "soc/timer_group_reg.h"
 #include "soc/rtc_wdt.h"
+#include "AUDIFI-Protocol.h"
+#include "AUDIFI-ADPCM.h"
 
 //===================================================================//
  
@@ -32,13 +34,69 @@
 #define dataSerial Serial
 
 #define DEBUG_SERIAL_BAUDRATE 500000
-// #define DATA_SERIAL_BAUDRATE 2000000
-#define DATA_SERIAL_BAUDRATE 500000
 
-#define REQUEST_SIZE 11029  //size required for data
-#define REQUEST_HEADER_SIZE 4 //size required for buffer header info
-
-#define UDP_MTU_SIZE 1460
+//the data serial starts at the base rate. the application then switches it to the
+//fastest of these rates that the link holds, see "Link negotiation" in
+//AUDIFI-Protocol.h.
+#define DATA_SERIAL_BAUDRATE PROTOCOL_BASE_BAUDRATE
+#define DATA_SERIAL_BAUDRATES PROTOCOL_ALL_BAUDRATES  //mask of protocolBaudRates[] we can switch to
+#define DATA_SERIAL_TIMEOUT 1000  //Stream timeout for the frame reads, the Arduino default
+
+//a frame from the application starts with the same 4-byte header that is sent
+//to the client. the first two bytes are the no. of samples and the third is the
+//codec, which together give the no. of data bytes that follow. the frame is
+//passed on without looking at the samples, unless it's stereo and a receiver
+//is older than PROTOCOL_STEREO_VERSION, which gets it folded to mono. the
+//receivers report their version with "VER#<version>" after their YES!.
+//REQUEST_SIZE, REQUEST_HEADER_SIZE and UDP_MTU_SIZE are in AUDIFI-Protocol.h.
+
+//in credit mode the receiver grants a number of frames with "RD#n" and the application
+//streams them back to back. the frame buffers let the serial task read the next frames
+//while the main task is still sending the previous one over UDP.
+#define TX_FRAME_BUFFER_COUNT 4
+#define CREDIT_MAX_FRAMES 64  //upper limit of the credit we forward to the application
+
+//on a link with checked frames, see AUDIFI-Frame-Check.h, a frame that's damaged
+//or missing is asked for again with "RS#<sequence>", and keeps its frame buffer.
+//the frames after it are read into the next buffers, and the main task sends them
+//once it's there, so they still go out in order. a frame that doesn't come is
+//given up on, and the frames after it go out without it.
+#define FRAME_RESEND_TIMEOUT 1000 //time to wait for a frame asked for again
+#define FRAME_RESEND_ATTEMPTS 2 //RS# sent for a frame before it's given up on
+
+#include "AUDIFI-Frame-Check.h"
+
+//on a link with control messages, see AUDIFI-Control.h, the server sends them in
+//between the frames and they're passed on to the receiver ahead of the frames
+//still waiting here. a skip or a seek makes the frames read before it stale, and
+//they're dropped. commands typed in at the debug serial go to the receiver, and a
+//skip or a seek to the server, which starts the stream over from there.
+#include "AUDIFI-Control.h"
+
+//fan-out mode feeds one stream to several receivers. the frames from the application
+//are kept in a ring and sent to every registered receiver, either one copy each
+//(FAN_OUT_UNICAST) or once to the whole network (FAN_OUT_BROADCAST). receivers
+//register by answering the READY? that is broadcast while stations are unregistered.
+//0 keeps the single receiver at client_IP.
+#define FAN_OUT_MODE 0
+#define FAN_OUT_ANNOUNCE_INTERVAL 1000  //time between READY? broadcasts
+#define FAN_OUT_REQUEST_TIMEOUT 3000  //time to wait for requested frames before asking again
+
+#include "AUDIFI-Fan-Out.h"
+
+//a frame is sent as fragments that carry its sequence no., so the receiver can ask
+//for the ones it missed with "NK#<sequence>#<mask>". the last frames are kept for
+//that. with FEC on, a parity fragment is added to each frame, from which the
+//receiver can rebuild one lost fragment on its own.
+#define FRAGMENT_FEC 1
+
+#include "AUDIFI-Fragment.h"
+
+//the link metrics are printed to the debug serial as lines of name=value pairs,
+//see AUDIFI-Metrics.h.
+#define METRICS_REPORT_INTERVAL 10000000  //time between reports, us
+
+#include "AUDIFI-Metrics.h"
 
 //===================================================================//
  
@@ -48,21 +106,63 @@ IPAddress server_IP (192,168,4,1);
 IPAddress client_IP (192,168,4,2);
 IPAddress gateway (192,168,4,1);
 IPAddress subnet (255,255,255,0);
+IPAddress broadcast_IP (192,168,4,255);
 
 //a task to print the total interrupt count.
 ptScheduler printTask(1000000);
+ptScheduler metricsTask(METRICS_REPORT_INTERVAL);
 // ptScheduler monitorConnectionTask(200000);
 
 volatile bool applicationReady = false;
 volatile bool clientConnected = false;
 volatile bool clientDisconnected = false;
 volatile bool clientReady = false;
+uint8_t clientVersion = 0;  //protocol version the client reported with VER#, 0 until it has
 volatile bool dataRequestReceived = false;
 volatile bool dataReady = false;
 volatile bool serialDataIncoming = false;
 volatile bool dataRequestAcknowledged = false;
 volatile bool serialDataReadError = false;
 
+//what the application agreed to in the handshake
+uint32_t dataSerialBaudRate = DATA_SERIAL_BAUDRATE;
+LinkSettings linkSettings = {DATA_SERIAL_BAUDRATE, REQUEST_SIZE, FRAME_CODEC_PCM_U8, 0};
+
+//credit mode parameters
+volatile uint16_t creditGrantPending = 0; //credit received from client, not yet forwarded
+uint16_t creditOutstanding = 0; //frames the application is yet to send us
+volatile bool txFrameReady[TX_FRAME_BUFFER_COUNT] = {false};  //true if the frame is waiting to be sent
+uint16_t txFrameLength[TX_FRAME_BUFFER_COUNT] = {0}; //frame length including the header
+uint8_t txFrameBuffer[TX_FRAME_BUFFER_COUNT][REQUEST_SIZE] = {{0}};
+int txFrameFillIndex = 0; //buffer the serial task fills next
+int txFrameSendIndex = 0; //buffer the main task sends next
+
+//checked frames. only the serial task uses these.
+bool txFrameMissing[TX_FRAME_BUFFER_COUNT] = {false}; //the buffer is kept for a frame asked for again
+uint8_t txFrameCheckSequence[TX_FRAME_BUFFER_COUNT] = {0};  //sequence no. of the frame asked for
+uint32_t txFrameResendTime[TX_FRAME_BUFFER_COUNT] = {0};  //when it was last asked for
+uint8_t txFrameResendCount[TX_FRAME_BUFFER_COUNT] = {0};
+uint16_t txFramesMissing = 0; //no. of buffers waiting for a frame asked for again
+uint8_t serialExpectedSequence = 0; //sequence no. of the next new frame
+uint8_t serialSyncMatched = 0;  //bytes of the sync word seen so far
+uint32_t serialBytesSkipped = 0;  //bytes passed over since the last sync word found
+uint32_t serialSkipTime = 0;  //when a byte was last passed over
+
+//control messages. the serial task hands those from the server to the main task,
+//which sends them to the receiver. each skip or seek starts a new epoch, and a
+//frame read in an earlier one is not sent.
+ControlMessage controlHandOff[CONTROL_QUEUE_SIZE];
+volatile uint8_t controlHandOffCount = 0;
+volatile uint8_t serialControlEpoch = 0;  //epoch of the frames the serial task reads now
+uint8_t txFrameEpoch[TX_FRAME_BUFFER_COUNT] = {0};  //epoch the frame in the buffer was read in
+uint8_t udpTxDataEpoch = 0;
+ControlFilter serialControlFilter;  //only the serial task uses this
+ControlQueue airControls; //sent to the receiver, until their CA#. only the main task uses this.
+char controlLine[PROTOCOL_LINE_MAX_LENGTH] = {0}; //CT# line for the server, written by the serial task
+volatile bool controlLinePending = false;
+char commandLine[CONTROL_COMMAND_MAX_LENGTH] = {0}; //command being typed in at the debug serial
+uint8_t commandLength = 0;
+
 //UDP receive buffer and parameters
 int udpRxPacketSize = 0;  //the packet size with header data
 int udpRxDataLength = 0;  //the length of samples in a packet (packet size - header)
@@ -78,10 +178,55 @@ uint16_t serialRxDataLength = 0;
 uint8_t serialRxDataBuffer[REQUEST_SIZE+50] = {0};
 
 uint16_t sampleDataLength = 0;  //the length of samples read from serial buffer
+uint16_t frameDataLength = 0; //no. of data bytes after the header, depends on the codec
 uint32_t outgoingPacketCounter = 0; //the number of packets sent to the client
 
+//fragment parameters
+RetransmitCache retransmitCache;
+uint16_t txFrameSequence = 0; //sequence no. of the next frame
+uint8_t fragmentBuffer[FRAGMENT_PACKET_SIZE] = {0};
+
 portMUX_TYPE criticalMux = portMUX_INITIALIZER_UNLOCKED;
 
+//link metrics, updated by both tasks
+MetricCounter framesSent;
+MetricCounter fragmentsSent;
+MetricCounter fragmentsResent;  //sent again for a NK#
+MetricCounter nacksReceived;
+MetricCounter legacyRequests; //RD? forwarded to the application
+MetricCounter requestRetries; //RD? that were not acknowledged
+MetricCounter creditForwarded;  //frames granted to the application with RD#n
+MetricCounter creditClipped;  //frames granted by the client past CREDIT_MAX_FRAMES
+MetricCounter serialBytes;  //frame bytes read from the application
+MetricCounter serialReadErrors; //frames that were cut short or made no sense
+MetricCounter excessBytes;  //bytes found after a frame and thrown away
+MetricCounter crcErrors;  //checked frames whose CRC didn't match
+MetricCounter resendRequests; //RS# sent to the application
+MetricCounter framesRecovered;  //frames that arrived after an RS#
+MetricCounter framesLost; //frames given up on
+MetricCounter controlsReceived; //control messages from the server, not counting the resends
+MetricCounter controlErrors;  //control messages that failed their CRC or made no sense
+MetricCounter controlsSent; //control messages sent to the receiver, not counting the resends
+MetricCounter framesFlushed;  //frames dropped after a skip or a seek
+MetricCounter framesDownmixed;  //stereo frames folded to mono for an older receiver
+MetricHistogram requestTime;  //time from a request to the application to its frame, ms
+MetricHistogram serialReadTime; //time to read the samples of a frame, ms
+
+//times the credit was forwarded, one for each frame, so that each frame is timed
+//against the grant it answers. only the serial task uses these.
+uint32_t creditRequestTimes[CREDIT_MAX_FRAMES] = {0};
+uint16_t creditRequestFirst = 0;
+uint16_t creditRequestCount = 0;
+uint32_t legacyRequestTime = 0; //when the last RD? was sent
+
+#if FAN_OUT_MODE > 0
+//fan-out parameters
+FanOut fanOut(FAN_OUT_MODE);
+uint16_t fanOutFramesRequested = 0; //frames asked from the application, not in the ring yet
+uint32_t fanOutRequestTime = 0; //when frames were last requested or received
+uint32_t fanOutAnnounceTime = 0;  //when READY? was last broadcast
+#endif
+
 //===================================================================//
 
 void serialTask(void* pvParameters) {
@@ -89,26 +234,89 @@ void serialTask(void* pvParameters) {
     //if the windows application is not ready, try sending requests
     //and wait for a response.
     if (!applicationReady) {
-      //the termination char is not included in the string.
+      //the termination char is not included in the string. the application tries
+      //the other rates too, so there may be garbage before the READY?.
       String serialRxString = dataSerial.readStringUntil('\n');
-      if ((serialRxString == "READY?") || (serialRxString == "READY?\n")) {
-        //send a response
-        dataSerial.print("YES!\n");
+      if (serialRxString.endsWith("READY?")) {
+        //send a response and agree on the link
+        negotiateLink();
         debugSerial.println("Application connected");
         applicationReady = true;
       }
 
-      //if the response from application was different, wait for some time
-      //before sending a new request.
+      //if the response from application was different, wait a little before
+      //reading again. the application probes all its ports at once with short
+      //deadlines, so the READY? has to be answered quickly.
       else {
         // debugSerial.print("Device is not ready. Response: ");
         // debugSerial.println(serialRxString);
-        vTaskDelay(500);
+        vTaskDelay(10);
       }
     }
 
     //if the application is ready, we ca request data to it.
     if (applicationReady) {
+      //nothing is sent to us while no frames are due, except a READY? from an
+      //application that was restarted.
+      //a control message can come as well.
+      if ((creditOutstanding == 0) && (creditGrantPending == 0) && (!dataRequestReceived) && (txFramesMissing == 0) &&
+          (dataSerial.available() > 0) && (linkSettings.options & PROTOCOL_OPTION_CONTROL) &&
+          ((serialSyncMatched > 0) || (dataSerial.peek() == frameSyncWord[0]))) {
+        readCheckedFrame();
+      }
+      else if ((creditOutstanding == 0) && (creditGrantPending == 0) && (!dataRequestReceived) && (txFramesMissing == 0) &&
+          (dataSerial.available() > 0)) {
+        String serialRxString = dataSerial.readStringUntil('\n');
+
+        if (serialRxString.endsWith("READY?")) {
+          negotiateLink();
+          debugSerial.println("Application reconnected");
+        }
+        else {
+          excessBytes.add(serialRxString.length());
+        }
+      }
+
+      //a skip or a seek typed in here goes to the server
+      if (controlLinePending) {
+        dataSerial.print(controlLine);
+        dataSerial.print("\n");
+        controlLinePending = false;
+      }
+
+      //forward the credit granted by the client. there is no acknowledgement for
+      //a grant, the frames simply start arriving.
+      if (creditGrantPending > 0) {
+        uint16_t creditGrant = 0;
+
+        portENTER_CRITICAL(&criticalMux);
+          creditGrant = creditGrantPending;
+          creditGrantPending = 0;
+        portEXIT_CRITICAL(&criticalMux);
+
+        dataSerial.print("RD#");
+        dataSerial.print(creditGrant);
+        dataSerial.print("\n");
+        creditOutstanding += creditGrant;
+        creditForwarded.add(creditGrant);
+
+        for (uint16_t i=0; (i < creditGrant) && (creditRequestCount < CREDIT_MAX_FRAMES); i++) {
+          creditRequestTimes[(creditRequestFirst + creditRequestCount) % CREDIT_MAX_FRAMES] = millis();
+          creditRequestCount++;
+        }
+      }
+
+      //read the frames as they arrive.
+      if (linkSettings.options & PROTOCOL_OPTION_CHECKED_FRAMES) {
+        if (((creditOutstanding > 0) || (txFramesMissing > 0)) && (dataSerial.available() > 0)) {
+          readCheckedFrame();
+        }
+        checkMissingFrames();
+      }
+      else if ((creditOutstanding > 0) && (dataSerial.available() >= REQUEST_HEADER_SIZE)) {
+        readCreditFrame();
+      }
+
       //if a data request was made by the client.
       if (dataRequestReceived && (!serialDataIncoming)) {
         int requestRetryCount = 0;
@@ -123,8 +331,13 @@ void serialTask(void* pvParameters) {
 
           //this is to clear the buffer any remaining unread data from previous transfers.
           //we have to do this because, Arduino's flush() function no more does this.
-          while (dataSerial.available() > 0) {
-              dataSerial.read();
+          //checked frames are found by their sync word instead.
+          if ((linkSettings.options & PROTOCOL_OPTION_CHECKED_FRAMES) == 0) {
+            while (dataSerial.available() > 0) {
+              if (dataSerial.read() != -1) {
+                excessBytes.increment();
+              }
+            }
           }
 
           // debugSerial.print("Clearing excess bytes ");
@@ -133,6 +346,8 @@ void serialTask(void* pvParameters) {
           //send a request. sending a newline at the end makes it easier
           //for the other end to read the data.
           dataSerial.print("RD?\n");
+          legacyRequestTime = millis();
+          legacyRequests.increment();
 
           //read the response from the application
           uint8_t serialRxString[6] = {0};
@@ -166,6 +381,7 @@ void serialTask(void* pvParameters) {
             // }
 
             requestRetryCount++;
+            requestRetries.increment();
             dataRequestAcknowledged = false;
 
             //if retries are exhausted
@@ -184,13 +400,17 @@ void serialTask(void* pvParameters) {
           }
         }
 
+        //a checked frame is read whole, and asked for again if it's damaged.
+        if (dataRequestAcknowledged && (linkSettings.options & PROTOCOL_OPTION_CHECKED_FRAMES)) {
+          readLegacyCheckedFrame();
+        }
         //when the application acks the data request.
-        if (dataRequestAcknowledged) {
+        else if (dataRequestAcknowledged) {
           if (dataSerial.available()) { //check if any data available
-            uint8_t tempBuffer[2] = {0};
-            //read the first two bytes that determines the incoming data length
-            if (dataSerial.readBytes(tempBuffer, 2) == 2) {
-              serialRxDataLength = 2; //because we just read two bytes
+            uint8_t tempBuffer[REQUEST_HEADER_SIZE] = {0};
+            //read the header that determines the incoming data length
+            if (dataSerial.readBytes(tempBuffer, REQUEST_HEADER_SIZE) == REQUEST_HEADER_SIZE) {
+              serialRxDataLength = REQUEST_HEADER_SIZE; //because we just read the header
             } else {
               //this is the only place this var is reset.
               serialRxDataLength = 0;
@@ -199,15 +419,13 @@ void serialTask(void* pvParameters) {
             portENTER_CRITICAL(&criticalMux);
               sampleDataLength = uint16_t(tempBuffer[0] << 8);  //high byte
               sampleDataLength |= tempBuffer[1];  //low byte
+              frameDataLength = getFramePayloadLength(tempBuffer[2], sampleDataLength);
             portEXIT_CRITICAL(&criticalMux);
             
-            if (sampleDataLength > 0) { //if length is non-zero
-              if (sampleDataLength <= (REQUEST_SIZE - REQUEST_HEADER_SIZE)) { //if the length does't exceed
+            if ((sampleDataLength > 0) && (frameDataLength > 0)) { //if length and codec are valid
+              if (frameDataLength <= (linkSettings.frameSize - REQUEST_HEADER_SIZE)) { //if the length does't exceed
                 serialDataIncoming = true;
-                udpTxDataBuffer[0] = tempBuffer[0]; //save the length value
-                udpTxDataBuffer[1] = tempBuffer[1];
-                udpTxDataBuffer[2] = 0; //reserved
-                udpTxDataBuffer[3] = 0; //reserved
+                memcpy(udpTxDataBuffer, tempBuffer, REQUEST_HEADER_SIZE); //save the header as it is
                 // debugSerial.print("Data incoming.. ");
                 // debugSerial.println(sampleDataLength);
               }
@@ -237,13 +455,16 @@ void serialTask(void* pvParameters) {
           if (dataRequestReceived && serialDataIncoming) {
             //readBytes() is a timedout function unlike read().
             //the incoming data will be saved starting from index 0.
-            //since we have already read two bytes, we only have to read the samples now.
-            serialRxDataLength += dataSerial.readBytes(serialRxDataBuffer, sampleDataLength);
+            //since we have already read the header, we only have to read the samples now.
+            uint32_t readStartTime = millis();
+            serialRxDataLength += dataSerial.readBytes(serialRxDataBuffer, frameDataLength);
+            serialReadTime.record(millis() - readStartTime);
+            serialBytes.add(serialRxDataLength);
 
             //the data in the serial buffer has to be transferred to the UDP transmit buffer.
             //we cannot use memcpy() or others since we have an index offset.
             int j = 0;
-            for (int i = REQUEST_HEADER_SIZE; i < (sampleDataLength + REQUEST_HEADER_SIZE); i++) {  //TODO
+            for (int i = REQUEST_HEADER_SIZE; i < (frameDataLength + REQUEST_HEADER_SIZE); i++) {  //TODO
               udpTxDataBuffer[i] = serialRxDataBuffer[j];
               j++;
             }
@@ -264,12 +485,16 @@ void serialTask(void* pvParameters) {
             // debugSerial.print("Excess bytes found: ");
             // debugSerial.println(excessBytesCounter);
 
+            excessBytes.add(excessBytesCounter);
+
             //check if we have read the same amount of bytes we should.
-            if (serialRxDataLength != (sampleDataLength + 2)) {
+            if (serialRxDataLength != (frameDataLength + REQUEST_HEADER_SIZE)) {
               serialDataReadError = true; //if not, that's an error
+              serialReadErrors.increment();
             }
             else {
               serialDataReadError = false;
+              requestTime.record(millis() - legacyRequestTime);
             }
 
             //at the end, reset everything so that we can fulfill another request.
@@ -288,6 +513,12 @@ void serialTask(void* pvParameters) {
     //if request for data was received but the application is not ready yet.
     //dataReady should not be reset here, because it pevents the main task from reading
     //any previously fetched data.
+    if ((!applicationReady) && (creditGrantPending > 0)) {
+      portENTER_CRITICAL(&criticalMux);
+        creditGrantPending = 0;
+      portEXIT_CRITICAL(&criticalMux);
+    }
+
     if ((!applicationReady) && dataRequestReceived) {
       debugSerial.println("Data request received. But application is not ready.");
       portENTER_CRITICAL(&criticalMux);
@@ -301,6 +532,563 @@ void serialTask(void* pvParameters) {
   }
 }
 
+//===================================================================//
+//Reads a single frame sent by the application in credit mode.
+//A frame starts with the header followed by the coded samples. The header and the
+//samples are read straight into the UDP transmit buffer. If both buffers are still
+//waiting to be sent, this returns without reading and we try again later.
+
+void readCreditFrame() {
+  if (txFrameReady[txFrameFillIndex]) { //main task hasn't sent this buffer yet
+    return;
+  }
+
+  uint8_t* frameBuffer = txFrameBuffer[txFrameFillIndex];
+
+  if (dataSerial.readBytes(frameBuffer, REQUEST_HEADER_SIZE) != REQUEST_HEADER_SIZE) {
+    return;
+  }
+
+  uint16_t frameSampleCount = uint16_t(frameBuffer[0] << 8);  //high byte
+  frameSampleCount |= frameBuffer[1];  //low byte
+  uint32_t payloadLength = getFramePayloadLength(frameBuffer[2], frameSampleCount);
+
+  //a frame we can not hold means we have lost track of the stream.
+  //discard everything and let the client grant new credit.
+  if ((frameSampleCount == 0) || (payloadLength == 0) || (payloadLength > (linkSettings.frameSize - REQUEST_HEADER_SIZE))) {
+    while (dataSerial.available() > 0) {
+      if (dataSerial.read() != -1) {
+        excessBytes.increment();
+      }
+    }
+    creditOutstanding = 0;
+    creditRequestCount = 0;
+    serialDataReadError = true;
+    serialReadErrors.increment();
+    return;
+  }
+
+  uint32_t readStartTime = millis();
+  uint16_t bytesRead = dataSerial.readBytes((frameBuffer + REQUEST_HEADER_SIZE), payloadLength);
+  serialReadTime.record(millis() - readStartTime);
+  serialBytes.add(REQUEST_HEADER_SIZE + bytesRead);
+  takeCredit(true);
+
+  if (bytesRead != payloadLength) {
+    serialDataReadError = true; //the frame is incomplete and is dropped
+    serialReadErrors.increment();
+    return;
+  }
+
+  serialDataReadError = false;
+  markTxFrameReady(txFrameFillIndex, payloadLength + REQUEST_HEADER_SIZE);
+  txFrameFillIndex = (txFrameFillIndex + 1) % TX_FRAME_BUFFER_COUNT;
+}
+
+//===================================================================//
+//Uses up a frame of credit. The frame answers the oldest grant still waiting,
+//and if it arrived, the time it took is recorded.
+
+void takeCredit(bool arrived) {
+  if (creditOutstanding > 0) {
+    creditOutstanding--;
+  }
+
+  if (creditRequestCount > 0) {
+    if (arrived) {
+      requestTime.record(millis() - creditRequestTimes[creditRequestFirst]);
+    }
+    creditRequestFirst = (creditRequestFirst + 1) % CREDIT_MAX_FRAMES;
+    creditRequestCount--;
+  }
+}
+
+//===================================================================//
+//Hands a frame buffer to the main task. A length of 0 is a frame that was given
+//up on, and is skipped.
+
+void markTxFrameReady(int index, uint16_t length) {
+  txFrameLength[index] = length;
+  txFrameEpoch[index] = serialControlEpoch;
+
+  portENTER_CRITICAL(&criticalMux);
+    txFrameReady[index] = true;  //reset by the main task after sending
+  portEXIT_CRITICAL(&criticalMux);
+}
+
+//===================================================================//
+
+bool isTxFrameFree(int index) {
+  return (!txFrameReady[index]) && (!txFrameMissing[index]);
+}
+
+//===================================================================//
+//Reads the bytes that have arrived until the sync word of a checked frame or of
+//a control message has gone by. The bytes before it are thrown away. Returns
+//SYNC_NONE if it's not there yet, and the part of it that was seen is remembered
+//for the next call.
+
+int findFrameSync() {
+  while (dataSerial.available() > 0) {
+    int value = dataSerial.read();
+
+    if (value < 0) {
+      break;
+    }
+
+    uint32_t skipped = 0;
+    int sync = scanSyncByte(uint8_t(value), &serialSyncMatched, &skipped);
+
+    if (skipped > 0) {
+      excessBytes.add(skipped);
+      serialBytesSkipped += skipped;
+      serialSkipTime = millis();
+    }
+    if (sync == SYNC_FRAME) {
+      serialBytesSkipped = 0;
+    }
+    if (sync != SYNC_NONE) {
+      return sync;
+    }
+  }
+  return SYNC_NONE;
+}
+
+//===================================================================//
+//Reads a checked frame in credit mode, from its sync word on. The frame is read
+//into the next free buffer, or if there's none, into the serial receive buffer,
+//as it may be one that was asked for again. A frame that's damaged is never
+//passed on, and the bytes after it are looked through for the next sync word.
+
+void readCheckedFrame() {
+  int sync = findFrameSync();
+
+  if (sync == SYNC_CONTROL) {
+    readControl();
+    return;
+  }
+  if (sync != SYNC_FRAME) {
+    return;
+  }
+
+  uint8_t* frameBuffer = isTxFrameFree(txFrameFillIndex) ? txFrameBuffer[txFrameFillIndex] : serialRxDataBuffer;
+  uint8_t sequence = 0;
+
+  if ((dataSerial.readBytes(&sequence, 1) != 1) ||
+      (dataSerial.readBytes(frameBuffer, REQUEST_HEADER_SIZE) != REQUEST_HEADER_SIZE)) {
+    checkedFrameDamaged();
+    return;
+  }
+
+  uint16_t frameSampleCount = uint16_t(frameBuffer[0] << 8);  //high byte
+  frameSampleCount |= frameBuffer[1];  //low byte
+  uint32_t payloadLength = getFramePayloadLength(frameBuffer[2], frameSampleCount);
+  uint32_t frameLength = REQUEST_HEADER_SIZE + payloadLength;
+
+  if ((frameSampleCount == 0) || (payloadLength == 0) || (payloadLength > (linkSettings.frameSize - REQUEST_HEADER_SIZE))) {
+    checkedFrameDamaged();
+    return;
+  }
+
+  uint8_t crcBytes[FRAME_CHECK_CRC_SIZE] = {0};
+  uint32_t readStartTime = millis();
+  uint16_t bytesRead = dataSerial.readBytes((frameBuffer + REQUEST_HEADER_SIZE), payloadLength);
+  bytesRead += dataSerial.readBytes(crcBytes, FRAME_CHECK_CRC_SIZE);
+  serialReadTime.record(millis() - readStartTime);
+  serialBytes.add(FRAME_CHECK_PREFIX_SIZE + REQUEST_HEADER_SIZE + bytesRead);
+
+  if (bytesRead != (payloadLength + FRAME_CHECK_CRC_SIZE)) {
+    checkedFrameDamaged();
+    return;
+  }
+
+  if (!checkFrameCrc(sequence, frameBuffer, frameLength, crcBytes)) {
+    crcErrors.increment();
+    checkedFrameDamaged();
+    return;
+  }
+
+  serialDataReadError = false;
+  storeCheckedFrame(sequence, frameBuffer, frameLength);
+}
+
+//===================================================================//
+//Puts a whole checked frame in its buffer. It's either one that was asked for
+//again, a new one, which may show that the ones before it went missing, or one
+//that had arrived after all and is thrown away.
+
+void storeCheckedFrame(uint8_t sequence, const uint8_t* frame, uint32_t length) {
+  for (int i=0; i < TX_FRAME_BUFFER_COUNT; i++) {
+    if (txFrameMissing[i] && (txFrameCheckSequence[i] == sequence)) {
+      memcpy(txFrameBuffer[i], frame, length);
+      txFrameMissing[i] = false;
+      txFramesMissing--;
+      framesRecovered.increment();
+      markTxFrameReady(i, length);
+      return;
+    }
+  }
+
+  int gap = getSequenceGap(serialExpectedSequence, sequence);
+
+  if (gap < 0) {
+    return;
+  }
+
+  //the missing frames and this one take a buffer each, in order. if they're
+  //not all free, the frame is dropped, and asked for once the next one shows
+  //the gap.
+  for (int i=0; i <= gap; i++) {
+    if ((i >= TX_FRAME_BUFFER_COUNT) || (!isTxFrameFree((txFrameFillIndex + i) % TX_FRAME_BUFFER_COUNT))) {
+      serialReadErrors.increment();
+      return;
+    }
+  }
+
+  for (int i=0; i < gap; i++) {
+    requestMissingFrame();
+  }
+
+  if (frame != txFrameBuffer[txFrameFillIndex]) {
+    memcpy(txFrameBuffer[txFrameFillIndex], frame, length);
+  }
+  serialExpectedSequence++;
+  takeCredit(true);
+  markTxFrameReady(txFrameFillIndex, length);
+  txFrameFillIndex = (txFrameFillIndex + 1) % TX_FRAME_BUFFER_COUNT;
+}
+
+//===================================================================//
+//A checked frame was seen but it's no use. If a new frame was due and nothing
+//else is missing, it was most likely that one, and it's asked for again right
+//away. Otherwise the gap shows once the next frame is there.
+
+void checkedFrameDamaged() {
+  serialDataReadError = true;
+  serialReadErrors.increment();
+
+  if ((creditOutstanding > 0) && (txFramesMissing == 0) && isTxFrameFree(txFrameFillIndex)) {
+    requestMissingFrame();
+  }
+}
+
+//===================================================================//
+//The next new frame is missing. Its buffer is kept and it's asked for again.
+
+void requestMissingFrame() {
+  int index = txFrameFillIndex;
+  txFrameMissing[index] = true;
+  txFrameCheckSequence[index] = serialExpectedSequence;
+  txFrameResendCount[index] = 0;
+  txFramesMissing++;
+  requestResend(index);
+
+  serialExpectedSequence++;
+  takeCredit(false);
+  txFrameFillIndex = (txFrameFillIndex + 1) % TX_FRAME_BUFFER_COUNT;
+}
+
+//===================================================================//
+
+void requestResend(int index) {
+  dataSerial.print("RS#");
+  dataSerial.print(txFrameCheckSequence[index]);
+  dataSerial.print("\n");
+  txFrameResendTime[index] = millis();
+  txFrameResendCount[index]++;
+  resendRequests.increment();
+}
+
+//===================================================================//
+//Asks again for the frames that didn't come in time, and gives up on those that
+//were asked for FRAME_RESEND_ATTEMPTS times. The main task skips those.
+
+void checkMissingFrames() {
+  //a frame whose sync word was missed only shows as bytes passed over, until a
+  //frame comes after it. if nothing does, it's asked for.
+  if ((creditOutstanding > 0) && (txFramesMissing == 0) && (serialBytesSkipped > 0) &&
+      ((millis() - serialSkipTime) >= FRAME_RESEND_TIMEOUT) && isTxFrameFree(txFrameFillIndex)) {
+    serialBytesSkipped = 0;
+    requestMissingFrame();
+  }
+
+  for (int i=0; (i < TX_FRAME_BUFFER_COUNT) && (txFramesMissing > 0); i++) {
+    if ((!txFrameMissing[i]) || ((millis() - txFrameResendTime[i]) < FRAME_RESEND_TIMEOUT)) {
+      continue;
+    }
+
+    if (txFrameResendCount[i] < FRAME_RESEND_ATTEMPTS) {
+      requestResend(i);
+    }
+    else {
+      txFrameMissing[i] = false;
+      txFramesMissing--;
+      framesLost.increment();
+      markTxFrameReady(i, 0);
+    }
+  }
+}
+
+//===================================================================//
+//Reads the checked frame the application sends after its ACK!, into the UDP
+//transmit buffer. If it's damaged it's asked for again with RS#. If it can't be
+//had, nothing is sent, and the client asks again once its request times out.
+
+void readLegacyCheckedFrame() {
+  bool frameRead = false;
+
+  for (int attempt=0; (attempt <= FRAME_RESEND_ATTEMPTS) && (!frameRead); attempt++) {
+    if (attempt > 0) {
+      dataSerial.print("RS#");
+      dataSerial.print(serialExpectedSequence);
+      dataSerial.print("\n");
+      resendRequests.increment();
+    }
+
+    //the control messages due are sent right after the ACK!, before the frame
+    uint32_t waitStartTime = millis();
+    int sync = SYNC_NONE;
+
+    while (((sync = findFrameSync()) != SYNC_FRAME) && ((millis() - waitStartTime) < DATA_SERIAL_TIMEOUT)) {
+      if (sync == SYNC_CONTROL) {
+        readControl();
+      }
+      else {
+        vTaskDelay(1);
+      }
+    }
+    if (sync != SYNC_FRAME) {
+      continue;
+    }
+
+    uint8_t sequence = 0;
+
+    if ((dataSerial.readBytes(&sequence, 1) != 1) ||
+        (dataSerial.readBytes(udpTxDataBuffer, REQUEST_HEADER_SIZE) != REQUEST_HEADER_SIZE)) {
+      continue;
+    }
+
+    uint16_t frameSampleCount = uint16_t(udpTxDataBuffer[0] << 8);  //high byte
+    frameSampleCount |= udpTxDataBuffer[1];  //low byte
+    uint32_t payloadLength = getFramePayloadLength(udpTxDataBuffer[2], frameSampleCount);
+
+    if ((frameSampleCount == 0) || (payloadLength == 0) || (payloadLength > (linkSettings.frameSize - REQUEST_HEADER_SIZE))) {
+      continue;
+    }
+
+    uint8_t crcBytes[FRAME_CHECK_CRC_SIZE] = {0};
+    uint32_t readStartTime = millis();
+    uint32_t bytesRead = dataSerial.readBytes((udpTxDataBuffer + REQUEST_HEADER_SIZE), payloadLength);
+    bytesRead += dataSerial.readBytes(crcBytes, FRAME_CHECK_CRC_SIZE);
+    serialReadTime.record(millis() - readStartTime);
+    serialBytes.add(FRAME_CHECK_PREFIX_SIZE + REQUEST_HEADER_SIZE + bytesRead);
+
+    if ((bytesRead == (payloadLength + FRAME_CHECK_CRC_SIZE)) && (sequence == serialExpectedSequence) &&
+        checkFrameCrc(sequence, udpTxDataBuffer, REQUEST_HEADER_SIZE + payloadLength, crcBytes)) {
+      frameDataLength = uint16_t(payloadLength);
+      udpTxDataEpoch = serialControlEpoch;
+      frameRead = true;
+
+      if (attempt > 0) {
+        framesRecovered.increment();
+      }
+    }
+    else if (bytesRead == (payloadLength + FRAME_CHECK_CRC_SIZE)) {
+      crcErrors.increment();
+    }
+  }
+
+  serialExpectedSequence++; //the application has moved on either way
+  serialDataReadError = !frameRead;
+
+  if (frameRead) {
+    requestTime.record(millis() - legacyRequestTime);
+  }
+  else {
+    serialReadErrors.increment();
+    framesLost.increment();
+  }
+
+  portENTER_CRITICAL(&criticalMux);
+    serialDataIncoming = false;
+    dataReady = frameRead; //this has to be reset at the main task, after reading the data
+    dataRequestReceived = false;
+    dataRequestAcknowledged = false;
+  portEXIT_CRITICAL(&criticalMux);
+}
+
+//===================================================================//
+//Reads a control message from the server, after its sync word, and answers it
+//with CA#. One that was sent again is only answered. A skip or a seek starts a
+//new epoch, and the frames asked for again are given up on, as they're from
+//the old place. If the main task has yet to take the messages before, this one
+//isn't answered, and the server sends it again.
+
+void readControl() {
+  uint8_t data[CONTROL_MESSAGE_SIZE + FRAME_CHECK_CRC_SIZE] = {0};
+  ControlMessage message;
+
+  if ((dataSerial.readBytes(data, sizeof(data)) != sizeof(data)) || (!readControlEnvelope(data, &message))) {
+    controlErrors.increment();
+    return;
+  }
+
+  if (controlHandOffCount == CONTROL_QUEUE_SIZE) {
+    return;
+  }
+
+  char line[PROTOCOL_LINE_MAX_LENGTH] = {0};
+  formatControlAck(line, sizeof(line), message.id);
+  dataSerial.print(line);
+  dataSerial.print("\n");
+
+  if (!serialControlFilter.accept(message.id)) {
+    return;
+  }
+  controlsReceived.increment();
+
+  if (isControlFlush(message.type)) {
+    for (int i=0; i < TX_FRAME_BUFFER_COUNT; i++) {
+      if (txFrameMissing[i]) {
+        txFrameMissing[i] = false;
+        markTxFrameReady(i, 0);
+      }
+    }
+    txFramesMissing = 0;
+  }
+
+  portENTER_CRITICAL(&criticalMux);
+    controlHandOff[controlHandOffCount] = message;
+    controlHandOffCount++;
+
+    if (isControlFlush(message.type)) {
+      serialControlEpoch++;
+    }
+  portEXIT_CRITICAL(&criticalMux);
+}
+
+//===================================================================//
+//Answers the application's READY? with our capabilities, and follows it through
+//the BAUD#, test pattern and LINK# steps in AUDIFI-Protocol.h. If a faster rate
+//doesn't work out, we go back to the rate the handshake started at on our own.
+//An older application sends nothing after the YES!, and the link stays as it is.
+
+void negotiateLink() {
+  char line[PROTOCOL_LINE_MAX_LENGTH] = {0};
+  uint8_t pattern[PROTOCOL_TEST_PATTERN_SIZE] = {0};
+  uint32_t startBaudRate = dataSerialBaudRate;
+  LinkCapabilities capabilities = {PROTOCOL_VERSION, DATA_SERIAL_BAUDRATES, REQUEST_SIZE,
+                                   PROTOCOL_CODEC_PCM_U8 | PROTOCOL_CODEC_IMA_ADPCM};
+
+  formatCapabilities(line, sizeof(line), capabilities);
+  dataSerial.print(line);
+  dataSerial.print("\n");
+  dataSerial.setTimeout(PROTOCOL_NEGOTIATE_TIMEOUT);
+
+  while (readLinkLine(line) > 0) {
+    LinkSettings settings;
+
+    if (strncmp(line, "BAUD#", 5) == 0) {
+      uint32_t baudRate = strtoul(&line[5], NULL, 10);
+
+      if ((DATA_SERIAL_BAUDRATES & getBaudRateBit(baudRate)) == 0) {
+        dataSerial.print("NO!\n");
+        continue;
+      }
+      dataSerial.print("OK!\n");
+      setDataSerialBaudRate(baudRate);
+      uint32_t switchTime = millis();
+      dataSerial.setTimeout(PROTOCOL_TEST_TIMEOUT);
+
+      //send the pattern back as it is, the application checks it
+      if (dataSerial.readBytes(pattern, PROTOCOL_TEST_PATTERN_SIZE) == PROTOCOL_TEST_PATTERN_SIZE) {
+        dataSerial.write(pattern, PROTOCOL_TEST_PATTERN_SIZE);
+        uint32_t elapsed = millis() - switchTime;
+
+        if (elapsed < PROTOCOL_TEST_TIMEOUT) {
+          dataSerial.setTimeout(PROTOCOL_TEST_TIMEOUT - elapsed);
+
+          if ((readLinkLine(line) > 0) && parseLinkSettings(line, &settings) && (settings.baudRate == baudRate)) {
+            linkSettings = settings;
+            dataSerial.print("YES!\n");
+            break;
+          }
+        }
+      }
+      setDataSerialBaudRate(startBaudRate); //the rate didn't work, go back
+      dataSerial.setTimeout(PROTOCOL_NEGOTIATE_TIMEOUT);
+    }
+    else if (parseLinkSettings(line, &settings) && (settings.baudRate == dataSerialBaudRate)) {
+      linkSettings = settings;
+      dataSerial.print("YES!\n");
+      break;
+    }
+    else if (strstr(line, "READY?") != NULL) {  //the application started over
+      formatCapabilities(line, sizeof(line), capabilities);
+      dataSerial.print(line);
+      dataSerial.print("\n");
+    }
+  }
+
+  linkSettings.baudRate = dataSerialBaudRate;
+  dataSerial.setTimeout(DATA_SERIAL_TIMEOUT);
+
+  //whatever was asked for before is not coming, and the sequence nos. of
+  //checked frames start over
+  creditOutstanding = 0;
+  creditRequestCount = 0;
+  serialExpectedSequence = 0;
+  serialSyncMatched = 0;
+  serialBytesSkipped = 0;
+  serialControlFilter.reset();
+
+  for (int i=0; i < TX_FRAME_BUFFER_COUNT; i++) {
+    if (txFrameMissing[i]) {
+      txFrameMissing[i] = false;
+      markTxFrameReady(i, 0);
+    }
+  }
+  txFramesMissing = 0;
+
+  debugSerial.print("Link: ");
+  debugSerial.print(linkSettings.baudRate);
+  debugSerial.print(" baud, ");
+  debugSerial.print(linkSettings.frameSize);
+  debugSerial.print(" byte frames, codec ");
+  debugSerial.print(linkSettings.codec);
+  debugSerial.print((linkSettings.options & PROTOCOL_OPTION_CHECKED_FRAMES) ? ", checked" : "");
+  debugSerial.print((linkSettings.options & PROTOCOL_OPTION_CONTROL) ? ", control" : "");
+  debugSerial.println((linkSettings.options & PROTOCOL_OPTION_STEREO) ? ", stereo" : "");
+}
+
+//===================================================================//
+//Reads a negotiation line into the buffer without the NL and CR. Returns its
+//length, or 0 if nothing came within the Stream timeout.
+
+size_t readLinkLine(char* line) {
+  size_t length = dataSerial.readBytesUntil('\n', line, PROTOCOL_LINE_MAX_LENGTH - 1);
+
+  if ((length > 0) && (line[length - 1] == '\r')) {
+    length--;
+  }
+  line[length] = 0;
+  return length;
+}
+
+//===================================================================//
+//Switches the data serial to another rate once the bytes before are sent. Bytes
+//received while switching are garbage and are thrown away.
+
+void setDataSerialBaudRate(uint32_t baudRate) {
+  dataSerial.flush();
+  dataSerial.updateBaudRate(baudRate);
+  dataSerialBaudRate = baudRate;
+
+  while (dataSerial.available() > 0) {
+    dataSerial.read();
+  }
+}
+
 //===================================================================//
 
 void WiFiStationDisconnected(WiFiEvent_t event, WiFiEventInfo_t info){
@@ -319,6 +1107,7 @@ void setup() {
    
   // Setup serial port
   dataSerial.begin(DATA_SERIAL_BAUDRATE);
+  dataSerial.setTimeout(DATA_SERIAL_TIMEOUT);
   dataSerial.setRxBufferSize(REQUEST_SIZE+50);
   debugSerial.begin(DEBUG_SERIAL_BAUDRATE, SERIAL_8N1, RXD2, TXD2);
   debugSerial.println();
@@ -357,10 +1146,13 @@ void setup() {
 //===================================================================//
  
 void loop() {
+#if FAN_OUT_MODE > 0
+  serveFanOut();
+#else
   waitForClient();
   authenticateClient();
   // udpCallResponse();  //this will not work after the client is reset and reconnected
-  // commandMode();
+  commandMode();
 
   if (clientConnected && clientReady) { //if ready to accept requests from client
     udpRxDataLength = 0;
@@ -384,10 +1176,64 @@ void loop() {
           dataRequestReceived = true;
           // debugSerial.println("Request received to send data");
         }
+        //or if the client is granting credit for a number of frames
+        else if (strncmp(udpRxDataBuffer, "RD#", 3) == 0) {
+          int creditGrant = atoi(&udpRxDataBuffer[3]);
+
+          //the client has counted the whole grant, so the excess is only clipped
+          if (creditGrant > 0) {
+            uint32_t creditClip = 0;
+
+            portENTER_CRITICAL(&criticalMux);
+              uint32_t creditTotal = uint32_t(creditGrantPending) + uint32_t(creditGrant);
+
+              if (creditTotal > CREDIT_MAX_FRAMES) {
+                creditClip = creditTotal - CREDIT_MAX_FRAMES;
+                creditTotal = CREDIT_MAX_FRAMES;
+              }
+              creditGrantPending = uint16_t(creditTotal);
+            portEXIT_CRITICAL(&criticalMux);
+
+            if (creditClip > 0) {
+              creditClipped.add(creditClip);
+            }
+          }
+        }
+        //or if some fragments of a frame were lost
+        else if (strncmp(udpRxDataBuffer, "NK#", 3) == 0) {
+          nacksReceived.increment();
+          retransmitFragments(client_IP, udpRxDataBuffer);
+        }
+        //or if the client told us its version
+        else if (parseReceiverVersion(udpRxDataBuffer, &clientVersion)) {
+          debugSerial.print("Client version ");
+          debugSerial.println(clientVersion);
+        }
+        //or if a control message arrived
+        else {
+          uint8_t controlId = 0;
+
+          if (parseControlAck(udpRxDataBuffer, &controlId)) {
+            airControls.acknowledge(controlId);
+          }
+        }
       }
     }
   }
 
+  //the control messages go ahead of the frames
+  takeControls(txFrameSequence);
+  sendControls(client_IP);
+
+  //a frame read before a skip or a seek is dropped
+  if (dataReady && (udpTxDataEpoch != serialControlEpoch)) {
+    framesFlushed.increment();
+
+    portENTER_CRITICAL(&criticalMux);
+      dataReady = false;
+    portEXIT_CRITICAL(&criticalMux);
+  }
+
   if (dataReady) {
     // //print the lenght of bytes received from application, after a request was made.
     // debugSerial.print("Data received. Length: ");
@@ -396,21 +1242,335 @@ void loop() {
     outgoingPacketCounter++;
     debugSerial.println(outgoingPacketCounter);
     
-    sendUDP(udpTxDataBuffer, (sampleDataLength + REQUEST_HEADER_SIZE)); //send the data to receiver
+    uint16_t frameLength = fitFrameToReceivers(udpTxDataBuffer, (frameDataLength + REQUEST_HEADER_SIZE), clientVersion);
+    sendFrame(client_IP, udpTxDataBuffer, frameLength, txFrameSequence++); //send the data to receiver
 
     portENTER_CRITICAL(&criticalMux);
       dataReady = false;
     portEXIT_CRITICAL(&criticalMux);
   }
 
+  //send the frames read in credit mode, in the order they were read. a frame
+  //that was given up on has no length and is skipped.
+  if (txFrameReady[txFrameSendIndex]) {
+    if ((txFrameLength[txFrameSendIndex] > 0) && (txFrameEpoch[txFrameSendIndex] != serialControlEpoch)) {
+      framesFlushed.increment();
+    }
+    else if (txFrameLength[txFrameSendIndex] > 0) {
+      outgoingPacketCounter++;
+      uint16_t frameLength = fitFrameToReceivers(txFrameBuffer[txFrameSendIndex], txFrameLength[txFrameSendIndex], clientVersion);
+      sendFrame(client_IP, txFrameBuffer[txFrameSendIndex], frameLength, txFrameSequence++);
+    }
+
+    portENTER_CRITICAL(&criticalMux);
+      txFrameReady[txFrameSendIndex] = false;
+    portEXIT_CRITICAL(&criticalMux);
+
+    txFrameSendIndex = (txFrameSendIndex + 1) % TX_FRAME_BUFFER_COUNT;
+  }
+#endif
+
+  if (metricsTask.call()) {
+    printMetrics();
+  }
+
   wdtFeed();
 }
 
+#if FAN_OUT_MODE > 0
+
+//===================================================================//
+//Serves all the registered receivers from one stream. Requests come from any
+//receiver and are told apart by their address. The frames read from serial are
+//moved to the fan-out ring, and the application is asked for as many frames as
+//the ring has room for. One frame is sent per call, so requests are picked up
+//in between.
+
+void serveFanOut() {
+  uint32_t now = millis();
+
+  //invite the stations that haven't registered yet
+  if ((WiFi.softAPgetStationNum() > fanOut.getClientCount()) && ((now - fanOutAnnounceTime) >= FAN_OUT_ANNOUNCE_INTERVAL)) {
+    uint8_t buffer[] = "READY?";
+    sendUDPTo(broadcast_IP, buffer, strlen((char*)buffer));
+    fanOutAnnounceTime = now;
+  }
+
+  udpRxPacketSize = UDP.parsePacket();
+
+  if (udpRxPacketSize) {
+    udpRxDataLength = UDP.read(udpRxDataBuffer, UDP_MTU_SIZE - 1);
+
+    if (udpRxDataLength > 0) {
+      udpRxDataBuffer[udpRxDataLength] = '\0';
+      uint32_t address = uint32_t(UDP.remoteIP());
+      int clientCount = fanOut.getClientCount();
+      uint8_t version = 0;
+
+      if (strcmp(udpRxDataBuffer, "YES!") == 0) {
+        fanOut.registerClient(address, now);
+      }
+      else if (strcmp(udpRxDataBuffer, "RD?") == 0) {
+        fanOut.grantCredit(address, 1, now);  //a legacy receiver asks for one frame at a time
+      }
+      else if (strncmp(udpRxDataBuffer, "RD#", 3) == 0) {
+        int creditGrant = atoi(&udpRxDataBuffer[3]);
+
+        if (creditGrant > 0) {
+          fanOut.grantCredit(address, uint16_t(creditGrant), now);
+        }
+      }
+      else if (strncmp(udpRxDataBuffer, "NK#", 3) == 0) {
+        nacksReceived.increment();
+        retransmitFragments(UDP.remoteIP(), udpRxDataBuffer);  //even in broadcast mode, only to the one that asked
+      }
+      else if (parseReceiverVersion(udpRxDataBuffer, &version)) {
+        fanOut.setClientVersion(address, version, now);
+      }
+
+      if (fanOut.getClientCount() > clientCount) {
+        debugSerial.print("Client registered. Clients: ");
+        debugSerial.println(fanOut.getClientCount());
+      }
+    }
+  }
+
+  if (fanOut.expireClients(now) > 0) {
+    debugSerial.print("Client dropped. Clients: ");
+    debugSerial.println(fanOut.getClientCount());
+  }
+
+  //the control messages are broadcast, and sent CONTROL_SEND_ATTEMPTS times as
+  //there's more than one receiver to answer. the frames already in the ring are
+  //thrown away by the receivers after a skip or a seek.
+  takeControls(uint16_t(fanOut.getNextSequence()));
+  sendControls(broadcast_IP);
+
+  //a frame read from serial goes to the ring once there's room. one that was
+  //given up on or read before a skip or a seek is only skipped.
+  if (txFrameReady[txFrameSendIndex]) {
+    uint16_t length = txFrameLength[txFrameSendIndex];
+
+    if ((length > 0) && (txFrameEpoch[txFrameSendIndex] != serialControlEpoch)) {
+      framesFlushed.increment();
+      length = 0;
+    }
+    uint8_t* slot = (length > 0) ? fanOut.beginWrite() : NULL;
+
+    if ((slot != NULL) || (length == 0)) {
+      //the frame goes to every receiver, so it's folded to mono if any of them is older
+      if (slot != NULL) {
+        memcpy(slot, txFrameBuffer[txFrameSendIndex], length);
+        fanOut.commitWrite(fitFrameToReceivers(slot, length, fanOut.getMinClientVersion()));
+      }
+
+      portENTER_CRITICAL(&criticalMux);
+        txFrameReady[txFrameSendIndex] = false;
+      portEXIT_CRITICAL(&criticalMux);
+
+      txFrameSendIndex = (txFrameSendIndex + 1) % TX_FRAME_BUFFER_COUNT;
+      fanOutRequestTime = now;
+
+      if (fanOutFramesRequested > 0) {
+        fanOutFramesRequested--;
+      }
+    }
+  }
+
+  //ask for the frames the ring can take, on top of those on the way
+  uint32_t framesFree = fanOut.getFreeFrames();
+
+  if (applicationReady && (framesFree > fanOutFramesRequested)) {
+    uint16_t creditGrant = uint16_t(framesFree - fanOutFramesRequested);
+
+    portENTER_CRITICAL(&criticalMux);
+      creditGrantPending += creditGrant;
+    portEXIT_CRITICAL(&criticalMux);
+
+    fanOutFramesRequested += creditGrant;
+    fanOutRequestTime = now;
+  }
+  else if ((fanOutFramesRequested > 0) && ((now - fanOutRequestTime) >= FAN_OUT_REQUEST_TIMEOUT)) {
+    fanOutFramesRequested = 0;  //the frames were lost on the way, ask again
+  }
+
+  FanOutSend send;
+
+  if (fanOut.nextSend(&send)) {
+    //the ring's sequence nos. are the same for every receiver
+    sendFrame(((send.client < 0) ? broadcast_IP : IPAddress(send.address)), send.frame, send.length, uint16_t(send.sequence));
+    fanOut.completeSend(send);
+    outgoingPacketCounter++;
+  }
+}
+
+#endif
+
+//===================================================================//
+//Takes the control messages the serial task read from the server, to be sent to
+//the receiver. nextSequence is the sequence no. of the next frame sent, which
+//after a skip or a seek is the first one from the new place.
+
+void takeControls(uint16_t nextSequence) {
+  if (controlHandOffCount == 0) {
+    return;
+  }
+
+  ControlMessage messages[CONTROL_QUEUE_SIZE];
+  uint8_t count = 0;
+
+  portENTER_CRITICAL(&criticalMux);
+    count = controlHandOffCount;
+    memcpy(messages, controlHandOff, sizeof(ControlMessage) * count);
+    controlHandOffCount = 0;
+  portEXIT_CRITICAL(&criticalMux);
+
+  for (int i=0; i < count; i++) {
+    messages[i].frameSequence = nextSequence;
+    addAirControl(messages[i]);
+  }
+}
+
+//===================================================================//
+
+void addAirControl(const ControlMessage& message) {
+  airControls.add(message);
+  controlsSent.increment();
+  debugSerial.print("Control: ");
+  debugSerial.println(getControlName(message.type));
+}
+
+//===================================================================//
+//Sends the control messages that are due to the receiver, the new ones and
+//those still without a CA#.
+
+void sendControls(IPAddress address) {
+  ControlMessage message;
+  uint8_t packet[CONTROL_PACKET_SIZE] = {0};
+  bool resent = false;
+
+  while (airControls.getDue(millis(), &message, &resent)) {
+    uint32_t length = writeControlPacket(packet, message);
+    sendUDPTo(address, packet, length);
+  }
+}
+
+//===================================================================//
+//Folds a stereo frame to mono in place if a receiver of receiverVersion can't
+//play it, see "Receiver version" in AUDIFI-Protocol.h. Returns the length of the
+//frame to send.
+
+uint16_t fitFrameToReceivers(uint8_t* frame, uint16_t length, uint8_t receiverVersion) {
+  if ((receiverVersion >= PROTOCOL_STEREO_VERSION) || ((frame[3] & FRAME_FLAG_STEREO) == 0)) {
+    return length;
+  }
+  framesDownmixed.increment();
+  return downmixStereoFrame(frame, length);
+}
+
+//===================================================================//
+//Sends a frame as fragments, followed by the parity fragment if FEC is on.
+//A copy is kept so that lost fragments can be sent again.
+
+void sendFrame(IPAddress address, const uint8_t* frame, uint16_t length, uint16_t sequence) {
+  retransmitCache.store(sequence, frame, length);
+
+  uint8_t fragmentCount = getFragmentCount(length);
+
+  for (uint8_t i=0; i < fragmentCount; i++) {
+    uint16_t packetLength = writeFragment(frame, length, sequence, i, 0, fragmentBuffer);
+    sendUDPTo(address, fragmentBuffer, packetLength);
+  }
+
+  if (FRAGMENT_FEC) {
+    uint16_t packetLength = writeParityFragment(frame, length, sequence, fragmentBuffer);
+    sendUDPTo(address, fragmentBuffer, packetLength);
+  }
+  framesSent.increment();
+  fragmentsSent.add(fragmentCount + (FRAGMENT_FEC ? 1 : 0));
+}
+
+//===================================================================//
+//Answers "NK#<sequence>#<mask>" from a receiver by sending the fragments in the
+//mask again. Nothing is sent if the frame is no longer kept.
+
+void retransmitFragments(IPAddress address, const char* request) {
+  char* end = NULL;
+  uint16_t sequence = uint16_t(strtoul(&request[3], &end, 10));
+
+  if ((end == &request[3]) || (*end != '#')) {
+    return;
+  }
+
+  uint32_t mask = strtoul(end + 1, NULL, 10);
+  uint16_t length = 0;
+  const uint8_t* frame = retransmitCache.find(sequence, &length);
+
+  if (frame == NULL) {
+    return;
+  }
+
+  uint8_t fragmentCount = getFragmentCount(length);
+
+  for (uint8_t i=0; i < fragmentCount; i++) {
+    if (mask & (uint32_t(1) << i)) {
+      uint16_t packetLength = writeFragment(frame, length, sequence, i, FRAGMENT_FLAG_RETRANSMIT, fragmentBuffer);
+      sendUDPTo(address, fragmentBuffer, packetLength);
+      fragmentsResent.increment();
+    }
+  }
+}
+
+//===================================================================//
+//Prints the link metrics to the debug serial. Counters only ever grow, so
+//rates are the difference between two reports.
+
+void printMetrics() {
+  MetricsLine line("metrics");
+  line.add("uptime_ms", millis());
+  line.add("frames_sent", framesSent.get());
+  line.add("fragments_sent", fragmentsSent.get());
+  line.add("fragments_resent", fragmentsResent.get());
+  line.add("nacks", nacksReceived.get());
+  line.add("legacy_requests", legacyRequests.get());
+  line.add("request_retries", requestRetries.get());
+  line.add("credit_forwarded", creditForwarded.get());
+  line.add("credit_clipped", creditClipped.get());
+  line.add("serial_bytes", serialBytes.get());
+  line.add("serial_read_errors", serialReadErrors.get());
+  line.add("excess_bytes", excessBytes.get());
+  line.add("crc_errors", crcErrors.get());
+  line.add("resend_requests", resendRequests.get());
+  line.add("frames_recovered", framesRecovered.get());
+  line.add("frames_lost", framesLost.get());
+  line.add("controls_received", controlsReceived.get());
+  line.add("control_errors", controlErrors.get());
+  line.add("controls_sent", controlsSent.get());
+  line.add("controls_given_up", airControls.getGivenUp());
+  line.add("frames_flushed", framesFlushed.get());
+  line.add("frames_downmixed", framesDownmixed.get());
+  debugSerial.println(line.getText());
+
+  MetricsLine requestLine("histogram");
+  requestLine.add("request_rtt_ms", requestTime);
+  debugSerial.println(requestLine.getText());
+
+  MetricsLine readLine("histogram");
+  readLine.add("serial_read_ms", serialReadTime);
+  debugSerial.println(readLine.getText());
+}
+
 //===================================================================//
 
 uint32_t sendUDP(uint8_t* data, uint32_t length) {
+  return sendUDPTo(client_IP, data, length);
+}
+
+//===================================================================//
+
+uint32_t sendUDPTo(IPAddress address, uint8_t* data, uint32_t length) {
   //send a UDP packet
-  UDP.beginPacket(client_IP, UDP_PORT);
+  UDP.beginPacket(address, UDP_PORT);
   uint32_t response = UDP.write((uint8_t*)data, length);
   UDP.endPacket();
   return response;
@@ -521,6 +1681,8 @@ void authenticateClient() {
 
           if (strcmp(udpRxDataBuffer, "YES!") == 0) {
             debugSerial.println("Client is authenticated");
+            airControls.reset();  //the receiver starts the ids over
+            clientVersion = 0;  //until its VER# arrives
             clientReady = true;
             return;
           }
@@ -543,58 +1705,55 @@ void authenticateClient() {
 }
 
 //===================================================================//
+//Reads the commands typed in at the debug serial, a line at a time without
+//waiting. "rq" asks the application for a frame, and the others are those of
+//parseControlCommand(). A pause, a resume or a gain goes straight to the
+//receiver. A skip or a seek goes to the server, which starts the stream over and
+//sends it back down the link with the frames from the new place.
 
 void commandMode() {
-  uint8_t response = 0;
-  String inputString = "";
-  String commandString = "";
-  String firstParam = "";
-  String secondParam = "";
-  String thirdParam = "";
-
-  //send commands and parameters for each operation
-  //items are separated by single whitespace
-  //you can send up to 3 parameters
-  if(debugSerial.available()) {  //monitor the serial interface
-    inputString = debugSerial.readString();  //read the contents of serial buffer as string
-    // Serial.print(F("Command : "));
-    // Serial.println(inputString);
-    // Serial.println();
-
-    //-------------------------------------------------------------------------//
-
-    uint8_t posCount = 0;
-    int indexOfSpace = 0;
-
-    while(inputString.indexOf(" ") != -1) { //loop until all whitespace chars are found
-      indexOfSpace = inputString.indexOf(" ");  //get the position of first whitespace
-      if(indexOfSpace != -1) {  //if a whitespace is found
-        if(posCount == 0) //the first one will be command string
-          commandString = inputString.substring(0, indexOfSpace); //end char is exclusive
-        if(posCount == 1) //second will be second param
-          firstParam = inputString.substring(0, indexOfSpace);
-        if(posCount == 2) //and so on
-          secondParam = inputString.substring(0, indexOfSpace);
-        else if(posCount == 3)
-          thirdParam = inputString.substring(0, indexOfSpace);
-        inputString = inputString.substring(indexOfSpace+1);  //trim the input string
-        posCount++;
+  while (debugSerial.available() > 0) {
+    int value = debugSerial.read();
+
+    if (value < 0) {
+      break;
+    }
+    if ((value != '\n') && (value != '\r')) {
+      if (commandLength < (CONTROL_COMMAND_MAX_LENGTH - 1)) {
+        commandLine[commandLength++] = char(value);
       }
+      continue;
     }
 
-    //saves the last part of the string is no more whitespace is found
-    if(posCount == 0) //if there's just the command
-      commandString = inputString;
-    if(posCount == 1)
-      firstParam = inputString;
-    if(posCount == 2)
-      secondParam = inputString;
-    if(posCount == 3)
-      thirdParam = inputString;
+    commandLine[commandLength] = 0;
 
-    if (commandString == "rq") {
-      dataRequestReceived = true;
+    if (commandLength > 0) {
+      runCommand(commandLine);
     }
+    commandLength = 0;
+  }
+}
+
+//===================================================================//
+
+void runCommand(const char* command) {
+  ControlMessage message;
+
+  if (strcmp(command, "rq") == 0) {
+    dataRequestReceived = true;
+  }
+  else if (!parseControlCommand(command, &message)) {
+    debugSerial.println("Unknown command. The commands are rq, pause, resume, next, prev, skip <tracks>, seek <m:ss> and gain <percent>.");
+  }
+  else if (!isControlFlush(message.type)) {
+    addAirControl(message);
+  }
+  else if (applicationReady && (linkSettings.options & PROTOCOL_OPTION_CONTROL) && (!controlLinePending)) {
+    formatControlLine(controlLine, sizeof(controlLine), message);
+    controlLinePending = true;
+  }
+  else {
+    debugSerial.println("The application does not take control messages.");
   }
 }
 
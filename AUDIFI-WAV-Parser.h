@@ -0,0 +1,154 @@
+//==============================================================================//
+//
+//  AUDIFI WAV Parser
+//  Version : v0.1
+//
+//  Reads the RIFF chunks of a WAV file to find the sample format and the position
+//  of the audio data. Chunks other than fmt and data (LIST, fact, cue etc.) are
+//  skipped, so the data is found no matter what comes before it.
+//
+//==============================================================================//
+
+#ifndef AUDIFI_WAV_PARSER_H
+#define AUDIFI_WAV_PARSER_H
+
+#include "AUDIFI-Audio-Source.h"
+#include <stdint.h>
+#include <string.h>
+
+#define WAV_FORMAT_PCM 0x0001
+#define WAV_FORMAT_FLOAT 0x0003
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+
+#define WAV_MAX_CHANNELS 8  //max no. of channels we can downmix
+
+//==============================================================================//
+
+struct WavFormat {
+  uint16_t formatTag;     //WAV_FORMAT_PCM or WAV_FORMAT_FLOAT
+  uint16_t channelCount;
+  uint32_t sampleRate;
+  uint16_t bitsPerSample;
+  uint16_t blockAlign;    //no. of bytes per frame, all channels
+  uint64_t dataOffset;    //file offset of the first sample
+  uint64_t dataLength;    //no. of bytes of audio data, whole frames only
+};
+
+//==============================================================================//
+
+inline uint16_t readLE16(const uint8_t* data) {
+  return uint16_t(data[0] | (data[1] << 8));
+}
+
+inline uint32_t readLE32(const uint8_t* data) {
+  return uint32_t(data[0]) | (uint32_t(data[1]) << 8) | (uint32_t(data[2]) << 16) | (uint32_t(data[3]) << 24);
+}
+
+//==============================================================================//
+//Checks if the sample format is one we can convert.
+
+inline bool isWavFormatSupported(const WavFormat& format) {
+  if ((format.channelCount == 0) || (format.channelCount > WAV_MAX_CHANNELS) || (format.sampleRate == 0)) {
+    return false;
+  }
+  if (format.blockAlign != (format.channelCount * (format.bitsPerSample / 8))) {
+    return false;
+  }
+  if (format.formatTag == WAV_FORMAT_PCM) {
+    return (format.bitsPerSample == 8) || (format.bitsPerSample == 16) ||
+           (format.bitsPerSample == 24) || (format.bitsPerSample == 32);
+  }
+  if (format.formatTag == WAV_FORMAT_FLOAT) {
+    return (format.bitsPerSample == 32);
+  }
+  return false;
+}
+
+//==============================================================================//
+//Reads the sample format from the body of a fmt chunk, which has to be at least
+//16 bytes long.
+
+inline void parseWavFormatChunk(const uint8_t* fmt, uint32_t fmtLength, WavFormat* format) {
+  format->formatTag = readLE16(fmt);
+  format->channelCount = readLE16(fmt + 2);
+  format->sampleRate = readLE32(fmt + 4);
+  format->blockAlign = readLE16(fmt + 12);
+  format->bitsPerSample = readLE16(fmt + 14);
+
+  //the actual format of an extensible file is in the first two bytes of the sub format
+  if ((format->formatTag == WAV_FORMAT_EXTENSIBLE) && (fmtLength >= 26)) {
+    format->formatTag = readLE16(fmt + 24);
+  }
+}
+
+//==============================================================================//
+//Parses the RIFF header and the chunks of a WAV file. On success the format is
+//filled in and the source is positioned at the first sample.
+//Returns false if the file is not a WAV file or the format is not supported.
+
+inline bool parseWav(AudioSource* source, WavFormat* format) {
+  uint8_t header[12];
+  bool formatFound = false;
+  uint64_t fileSize = source->getSize();
+
+  memset(format, 0, sizeof(WavFormat));
+  source->seek(0);
+
+  if (source->read(header, 12) != 12) {
+    return false;
+  }
+  if ((memcmp(header, "RIFF", 4) != 0) || (memcmp(header + 8, "WAVE", 4) != 0)) {
+    return false;
+  }
+
+  //go through the chunks until the data chunk is found
+  while (true) {
+    uint8_t chunkHeader[8];
+
+    if (source->read(chunkHeader, 8) != 8) {
+      return false; //ran out of chunks
+    }
+
+    uint32_t chunkSize = readLE32(chunkHeader + 4);
+    uint64_t chunkStart = source->getPosition();
+
+    if (memcmp(chunkHeader, "fmt ", 4) == 0) {
+      uint8_t fmt[40] = {0};
+      uint32_t fmtLength = (chunkSize < sizeof(fmt)) ? chunkSize : uint32_t(sizeof(fmt));
+
+      if ((fmtLength < 16) || (source->read(fmt, fmtLength) != fmtLength)) {
+        return false;
+      }
+
+      parseWavFormatChunk(fmt, fmtLength, format);
+      formatFound = true;
+    }
+    else if (memcmp(chunkHeader, "data", 4) == 0) {
+      if (!formatFound) {
+        return false; //fmt has to come before the data
+      }
+
+      format->dataOffset = chunkStart;
+      format->dataLength = chunkSize;
+
+      //files written while streaming can have a zero or oversized length
+      if ((chunkSize == 0) || (chunkSize == 0xFFFFFFFF) || ((chunkStart + chunkSize) > fileSize)) {
+        format->dataLength = fileSize - chunkStart;
+      }
+
+      if (!isWavFormatSupported(*format)) {
+        return false;
+      }
+
+      format->dataLength -= format->dataLength % format->blockAlign;
+      return true;
+    }
+
+    //chunks are padded to an even length
+    if (!source->seek(chunkStart + chunkSize + (chunkSize & 1))) {
+      return false;
+    }
+  }
+}
+
+#endif